@@ -0,0 +1,66 @@
+/*
+ * Kernel command line for SpikeOS.
+ *
+ * Copied out of the Multiboot info at boot, so drivers can look up
+ * their options (cmdline_uint("e1000.rxdesc", ...)) whenever they
+ * initialize.
+ */
+
+#include <kernel/cmdline.h>
+#include <string.h>
+
+static char cmdline[CMDLINE_MAX];
+
+void cmdline_init(const char *line) {
+    uint32_t n = 0;
+    if (line) {
+        while (line[n] && n < CMDLINE_MAX - 1) {
+            cmdline[n] = line[n];
+            n++;
+        }
+    }
+    cmdline[n] = '\0';
+}
+
+const char *cmdline_get(void) {
+    return cmdline;
+}
+
+int cmdline_value(const char *key, char *buf, uint32_t len) {
+    uint32_t klen = (uint32_t)strlen(key);
+    const char *found = (const char *)0;
+
+    for (const char *p = cmdline; *p; ) {
+        while (*p == ' ') p++;
+        const char *word = p;
+        while (*p && *p != ' ') p++;
+
+        if ((uint32_t)(p - word) > klen && word[klen] == '=' &&
+            memcmp(word, key, klen) == 0)
+            found = word + klen + 1;
+    }
+    if (!found) return -1;
+
+    uint32_t n = 0;
+    while (found[n] && found[n] != ' ' && n + 1 < len) {
+        buf[n] = found[n];
+        n++;
+    }
+    if (len) buf[n] = '\0';
+    return 0;
+}
+
+uint32_t cmdline_uint(const char *key, uint32_t def) {
+    char buf[12];
+    if (cmdline_value(key, buf, sizeof(buf)) != 0 || !buf[0])
+        return def;
+
+    uint32_t val = 0;
+    for (const char *p = buf; *p; p++) {
+        if (*p < '0' || *p > '9') return def;
+        uint32_t d = (uint32_t)(*p - '0');
+        if (val > (0xFFFFFFFFu - d) / 10) return def;
+        val = val * 10 + d;
+    }
+    return val;
+}
@@ -21,6 +21,7 @@
 #include <kernel/vfs.h>
 #include <kernel/ata.h>
 #include <kernel/spikefs.h>
+#include <kernel/blk.h>
 #include <kernel/boot_splash.h>
 #include <kernel/fd.h>
 #include <kernel/pipe.h>
@@ -32,9 +33,12 @@
 #include <kernel/pci.h>
 #include <kernel/e1000.h>
 #include <kernel/virtio_gpu.h>
+#include <kernel/virtio_net.h>
 #include <kernel/net.h>
+#include <kernel/skb.h>
 #include <kernel/dock.h>
 #include <kernel/settings.h>
+#include <kernel/cmdline.h>
 
 extern void kprint_howdy(void);
 extern void paging_enable(uint32_t);
@@ -222,11 +226,19 @@ void kernel_main(void) {
     printf("CR0 = %x\n", cr0);
 #endif
 
-    /* Save framebuffer info from multiboot before heap (just stores values) */
+    /* Direct map of RAM; must exist before the first page directory */
+    physmap_init();
+
+    /* Save framebuffer info and the command line from multiboot before
+       heap (just stores values) */
     {
         uint32_t mb_phys = multiboot_info_ptr;
-        if (mb_phys != 0)
-            fb_save_info((struct multiboot_info *)mb_phys);
+        if (mb_phys != 0) {
+            struct multiboot_info *mb = (struct multiboot_info *)mb_phys;
+            fb_save_info(mb);
+            if (mb->flags & MB_FLAG_CMDLINE)
+                cmdline_init((const char *)phys_to_virt(mb->cmdline));
+        }
     }
 
     heap_init();
@@ -309,6 +321,9 @@ void kernel_main(void) {
     printf("INIT Timer (100 Hz) + IRQ0 unmasked\n");
 #endif
 
+    /* Block queue worker — before this, waiters issue their own I/O */
+    blk_start_worker();
+
     keyboard_init();
     pic_clear_mask(1);
 #ifdef VERBOSE_BOOT
@@ -336,11 +351,14 @@ void kernel_main(void) {
     }
 #endif
 
-    e1000_init();
+    /* A paravirtual NIC if there is one, else the emulated e1000 */
+    skb_init();
+    if (virtio_net_init() != 0)
+        e1000_init();
 #ifdef VERBOSE_BOOT
     if (nic)
-        printf("INIT e1000 NIC (MAC=%02x:%02x:%02x:%02x:%02x:%02x, link=%s)\n",
-               nic->mac[0], nic->mac[1], nic->mac[2],
+        printf("INIT %s NIC (MAC=%02x:%02x:%02x:%02x:%02x:%02x, link=%s)\n",
+               nic->name, nic->mac[0], nic->mac[1], nic->mac[2],
                nic->mac[3], nic->mac[4], nic->mac[5],
                nic->link_up ? "UP" : "DOWN");
 #endif
@@ -361,7 +379,7 @@ void kernel_main(void) {
     printf("INIT Network stack\n");
 #endif
 
-    /* DHCP: auto-configure IP (needs interrupts for e1000 RX) */
+    /* DHCP: auto-configure IP (needs interrupts for NIC RX) */
     if (nic) {
         dhcp_discover();
         uint32_t dhcp_deadline = timer_ticks() + 500; /* 5 second timeout */
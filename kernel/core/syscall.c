@@ -4,8 +4,10 @@
 #include <kernel/paging.h>
 #include <kernel/hal.h>
 #include <kernel/fd.h>
+#include <kernel/heap.h>
 #include <kernel/vfs.h>
 #include <kernel/pipe.h>
+#include <kernel/poll.h>
 #include <kernel/wait.h>
 #include <kernel/timer.h>
 #include <kernel/tty.h>
@@ -366,19 +368,7 @@ static int32_t sys_pipe(trapframe *tf) {
 /* ------------------------------------------------------------------ */
 
 static int32_t sys_dup(trapframe *tf) {
-    int old_fd = (int)tf->ebx;
-    if (old_fd < 0 || old_fd >= MAX_FDS) return -1;
-
-    int ofi = current_process->fds[old_fd];
-    if (ofi < 0) return -1;
-
-    int new_fd = alloc_fd(current_process->fds);
-    if (new_fd < 0) return -1;
-
-    current_process->fds[new_fd] = ofi;
-    open_file_table[ofi].refcount++;
-
-    return new_fd;
+    return fd_dup((int)tf->ebx);
 }
 
 /* ------------------------------------------------------------------ */
@@ -394,12 +384,15 @@ static int32_t sys_kill(trapframe *tf) {
 }
 
 /* ------------------------------------------------------------------ */
-/*  SYS_SOCKET (19) — create a UDP socket                            */
-/*  EBX = type (SOCK_UDP = 1)                                        */
+/*  SYS_SOCKET (19) — create a socket                                */
+/*  EBX = type (SOCK_UDP = 1, SOCK_TCP = 2 [| SOCK_NONBLOCK])         */
+/*  TCP returns an fd; UDP sockets are created by SYS_BIND.           */
 /* ------------------------------------------------------------------ */
 
 static int32_t sys_socket(trapframe *tf) {
     uint32_t type = tf->ebx;
+    if ((type & ~SOCK_NONBLOCK) == SOCK_TCP)
+        return tcp_open(type & SOCK_NONBLOCK);
     if (type != SOCK_UDP) return -1;
 
     /* udp_bind(0) allocates a socket without binding a port yet.
@@ -409,7 +402,7 @@ static int32_t sys_socket(trapframe *tf) {
 
 /* ------------------------------------------------------------------ */
 /*  SYS_BIND (20) — bind a socket to a local port                   */
-/*  EBX = type (SOCK_UDP), ECX = port                                */
+/*  EBX = type (SOCK_UDP [| SOCK_NONBLOCK]), ECX = port               */
 /*  Returns socket index, or -1 on failure.                          */
 /* ------------------------------------------------------------------ */
 
@@ -417,8 +410,11 @@ static int32_t sys_bind(trapframe *tf) {
     uint32_t type = tf->ebx;
     uint16_t port = (uint16_t)tf->ecx;
 
-    if (type != SOCK_UDP) return -1;
-    return (int32_t)udp_bind(port);
+    if ((type & ~SOCK_NONBLOCK) != SOCK_UDP) return -1;
+    int sock = udp_bind(port);
+    if (sock >= 0 && (type & SOCK_NONBLOCK))
+        udp_fcntl(sock, F_SETFL, O_NONBLOCK);
+    return (int32_t)sock;
 }
 
 /* ------------------------------------------------------------------ */
@@ -474,14 +470,48 @@ static int32_t sys_closesock(trapframe *tf) {
 }
 
 /* ------------------------------------------------------------------ */
-/*  SYS_MMAP (24) — map anonymous memory into process address space   */
+/*  SYS_MMAP (24) — map anonymous memory or a file into the process   */
 /*  EBX = pointer to struct mmap_args                                 */
 /*  Returns mapped address, or (uint32_t)-1 on failure.               */
+/*                                                                    */
+/*  File mappings map the file's page-cache frames directly. Writes  */
+/*  through MAP_SHARED land in the cache (and reach disk at the next  */
+/*  sync); MAP_PRIVATE pages are mapped read-only and copied on the   */
+/*  first write (see cow_fault in paging.c).                          */
 /* ------------------------------------------------------------------ */
 
-/* mmap region base — anonymous mappings start here and grow up */
+/* mmap region base — mappings start here and grow up */
 #define MMAP_BASE 0x40000000u
 
+static int vma_shared_write(const vma_t *vma) {
+    return !(vma->flags & MAP_ANONYMOUS) && (vma->flags & MAP_SHARED)
+           && (vma->prot & PROT_WRITE);
+}
+
+/* Resolve a file mapping's fd to its inode and check the range.
+   Returns the inode number, or -1. */
+static int32_t mmap_file_inode(int32_t fd, uint32_t offset, uint32_t length,
+                               uint32_t prot, uint32_t flags) {
+    /* Exactly one of MAP_SHARED / MAP_PRIVATE */
+    if (!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE)) return -1;
+    if (offset & (PAGE_SIZE - 1)) return -1;
+
+    open_file_t *of = fd_file(fd);
+    if (!of || of->type != FD_TYPE_VFS) return -1;
+    if ((flags & MAP_SHARED) && (prot & PROT_WRITE)
+        && !(of->flags & (O_WRONLY | O_RDWR)))
+        return -1;
+
+    vfs_inode_t *node = vfs_get_inode(of->ino);
+    if (!node || node->type != VFS_TYPE_FILE) return -1;
+
+    /* Only pages the file reaches (the last one partially) */
+    uint32_t end = (node->size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (offset >= end || length > end - offset) return -1;
+
+    return (int32_t)of->ino;
+}
+
 static int32_t sys_mmap(trapframe *tf) {
     struct mmap_args *args = (struct mmap_args *)tf->ebx;
 
@@ -494,9 +524,7 @@ static int32_t sys_mmap(trapframe *tf) {
     uint32_t flags  = args->flags;
     uint32_t prot   = args->prot;
     uint32_t addr   = args->addr;
-
-    /* Must be anonymous for now (no file-backed mappings) */
-    if (!(flags & MAP_ANONYMOUS)) return -1;
+    uint32_t offset = args->offset;
 
     /* Length must be nonzero */
     if (length == 0) return -1;
@@ -504,6 +532,13 @@ static int32_t sys_mmap(trapframe *tf) {
     /* Page-align length upward */
     length = (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 
+    int file = !(flags & MAP_ANONYMOUS);
+    int32_t ino = -1;
+    if (file) {
+        ino = mmap_file_inode(args->fd, offset, length, prot, flags);
+        if (ino < 0) return -1;
+    }
+
     /* Check VMA table capacity */
     if (current_process->vma_count >= MAX_VMAS) return -1;
 
@@ -551,9 +586,27 @@ static int32_t sys_mmap(trapframe *tf) {
     if (prot & PROT_WRITE)
         page_flags |= PAGE_WRITABLE;
 
+    /* Private file pages start read-only and are copied on first write */
+    if (file && (flags & MAP_PRIVATE))
+        page_flags &= ~PAGE_WRITABLE;
+
     for (uint32_t off = 0; off < length; off += PAGE_SIZE) {
-        uint32_t frame = alloc_frame();
-        if (frame == FRAME_ALLOC_FAIL) goto fail_unmap;
+        uint32_t frame;
+
+        if (file) {
+            /* Share the page-cache frame; the mapping holds a reference */
+            frame = vfs_get_page((uint32_t)ino, (offset + off) / PAGE_SIZE);
+            if (frame == 0) goto fail_unmap;
+            frame_get(frame);
+        } else {
+            frame = alloc_frame();
+            if (frame == FRAME_ALLOC_FAIL) goto fail_unmap;
+
+            /* Zero the page */
+            uint8_t *p = (uint8_t *)temp_map(frame);
+            memset(p, 0, PAGE_SIZE);
+            temp_unmap();
+        }
 
         if (pgdir_map_user_page(current_process->cr3, addr + off, frame,
                                 page_flags) != 0) {
@@ -561,11 +614,6 @@ static int32_t sys_mmap(trapframe *tf) {
             goto fail_unmap;
         }
 
-        /* Zero the page */
-        uint8_t *p = (uint8_t *)temp_map(frame);
-        memset(p, 0, PAGE_SIZE);
-        temp_unmap();
-
         pages_mapped++;
     }
 
@@ -575,6 +623,11 @@ static int32_t sys_mmap(trapframe *tf) {
     vma->length = length;
     vma->prot   = prot;
     vma->flags  = flags;
+    vma->ino    = file ? (uint32_t)ino : 0;
+    vma->offset = file ? offset : 0;
+
+    if (file)
+        vfs_map_file((uint32_t)ino, vma_shared_write(vma));
 
     return (int32_t)addr;
 
@@ -582,12 +635,12 @@ fail_unmap:
     /* Roll back: unmap and free already-mapped pages */
     for (uint32_t i = 0; i < pages_mapped; i++) {
         uint32_t va = addr + i * PAGE_SIZE;
-        uint32_t phys = virt_to_phys(va);
-        if (phys != 0 && phys != FRAME_ALLOC_FAIL) {
-            free_frame(phys);
-        }
+        uint32_t pte = pgdir_get_pte(current_process->cr3, va);
+        if (pte & PAGE_PRESENT)
+            free_frame(pte & 0xFFFFF000);
         /* Clear the PTE (map to 0 with no flags effectively unmaps) */
         pgdir_map_user_page(current_process->cr3, va, 0, 0);
+        hal_tlb_invalidate(va);
     }
     return -1;
 }
@@ -623,17 +676,20 @@ static int32_t sys_munmap(trapframe *tf) {
     }
     if (vma_idx < 0) return -1;  /* no matching VMA */
 
-    /* Unmap pages and free frames */
+    /* Unmap pages and drop their frames (page-cache frames stay cached) */
     for (uint32_t off = 0; off < length; off += PAGE_SIZE) {
         uint32_t va = addr + off;
-        uint32_t phys = virt_to_phys(va);
-        if (phys != 0 && phys != FRAME_ALLOC_FAIL) {
-            free_frame(phys);
-        }
+        uint32_t pte = pgdir_get_pte(current_process->cr3, va);
+        if (pte & PAGE_PRESENT)
+            free_frame(pte & 0xFFFFF000);
         pgdir_map_user_page(current_process->cr3, va, 0, 0);
         hal_tlb_invalidate(va);
     }
 
+    vma_t *vma = &current_process->vmas[vma_idx];
+    if (!(vma->flags & MAP_ANONYMOUS))
+        vfs_unmap_file(vma->ino, vma_shared_write(vma));
+
     /* Remove VMA entry by shifting the rest down */
     for (uint32_t i = (uint32_t)vma_idx; i + 1 < current_process->vma_count; i++) {
         current_process->vmas[i] = current_process->vmas[i + 1];
@@ -699,6 +755,303 @@ static int32_t sys_gpu_destroy_ctx(trapframe *tf) {
     return (int32_t)virtio_gpu_ctx_destroy(ctx_id);
 }
 
+/* ------------------------------------------------------------------ */
+/*  Vectored and positional I/O                                       */
+/* ------------------------------------------------------------------ */
+
+/* Copy a user iovec array into 'out' (IOV_MAX entries), checking every
+   buffer. Returns 0, or -1 if anything points into the kernel. */
+static int copy_user_iov(struct iovec *out, const struct iovec *iov,
+                         uint32_t iovcnt) {
+    if (iovcnt > IOV_MAX) return -1;
+    if (iovcnt == 0) return 0;
+    if (bad_user_ptr(iov, iovcnt * sizeof(struct iovec))) return -1;
+
+    memcpy(out, iov, iovcnt * sizeof(struct iovec));
+    for (uint32_t i = 0; i < iovcnt; i++) {
+        if (out[i].iov_len && bad_user_ptr(out[i].iov_base, out[i].iov_len))
+            return -1;
+    }
+    return 0;
+}
+
+/* SYS_READV (29) / SYS_WRITEV (30) — EBX = fd, ECX = iov, EDX = iovcnt */
+static int32_t sys_readv(trapframe *tf) {
+    struct iovec iov[IOV_MAX];
+    uint32_t iovcnt = tf->edx;
+
+    if (copy_user_iov(iov, (const struct iovec *)tf->ecx, iovcnt) != 0)
+        return -1;
+    return fd_readv((int)tf->ebx, iov, (int)iovcnt);
+}
+
+static int32_t sys_writev(trapframe *tf) {
+    struct iovec iov[IOV_MAX];
+    uint32_t iovcnt = tf->edx;
+
+    if (copy_user_iov(iov, (const struct iovec *)tf->ecx, iovcnt) != 0)
+        return -1;
+    return fd_writev((int)tf->ebx, iov, (int)iovcnt);
+}
+
+/* SYS_PREAD (31) / SYS_PWRITE (32) — EBX = pointer to struct prw_args */
+/* Copy the args in once, so the buffer checked is the one used */
+static int copy_user_prw(struct prw_args *out, const struct prw_args *args) {
+    if (bad_user_ptr(args, sizeof(struct prw_args))) return -1;
+    memcpy(out, args, sizeof(struct prw_args));
+    return bad_user_ptr(out->buf, out->len) ? -1 : 0;
+}
+
+static int32_t sys_pread(trapframe *tf) {
+    struct prw_args args;
+
+    if (copy_user_prw(&args, (const struct prw_args *)tf->ebx) != 0)
+        return -1;
+    return fd_pread(args.fd, args.buf, args.len, args.offset);
+}
+
+static int32_t sys_pwrite(trapframe *tf) {
+    struct prw_args args;
+
+    if (copy_user_prw(&args, (const struct prw_args *)tf->ebx) != 0)
+        return -1;
+    return fd_pwrite(args.fd, args.buf, args.len, args.offset);
+}
+
+/* SYS_SENDMSG (33) / SYS_RECVMSG (34) — EBX = sock, ECX = args */
+static int32_t sys_sendmsg(trapframe *tf) {
+    struct sendmsg_args *args = (struct sendmsg_args *)tf->ecx;
+    struct iovec iov[IOV_MAX];
+
+    if (bad_user_ptr(args, sizeof(struct sendmsg_args))) return -1;
+    if (copy_user_iov(iov, args->iov, args->iovcnt) != 0) return -1;
+    return (int32_t)udp_sendv((int)tf->ebx, args->dst_ip, args->dst_port,
+                              iov, (int)args->iovcnt);
+}
+
+static int32_t sys_recvmsg(trapframe *tf) {
+    struct recvmsg_args *args = (struct recvmsg_args *)tf->ecx;
+    struct iovec iov[IOV_MAX];
+
+    if (bad_user_ptr(args, sizeof(struct recvmsg_args))) return -1;
+    if (copy_user_iov(iov, args->iov, args->iovcnt) != 0) return -1;
+
+    uint32_t from_ip = 0;
+    uint16_t from_port = 0;
+    int ret = udp_recvv((int)tf->ebx, iov, (int)args->iovcnt,
+                        &from_ip, &from_port);
+    if (ret >= 0) {
+        args->from_ip   = from_ip;
+        args->from_port = from_port;
+        args->received  = (uint16_t)ret;
+    }
+    return (int32_t)ret;
+}
+
+/* SYS_RECVMMSG (44) — EBX = sock, ECX = recvmsg_args[], EDX = vlen */
+static int32_t sys_recvmmsg(trapframe *tf) {
+    struct recvmsg_args *args = (struct recvmsg_args *)tf->ecx;
+    uint32_t vlen = tf->edx;
+
+    if (vlen == 0 || vlen > UDP_MMSG_MAX) return -1;
+    if (bad_user_ptr(args, vlen * sizeof(struct recvmsg_args))) return -1;
+
+    struct udp_msg *msgs = (struct udp_msg *)kcalloc(vlen,
+                                                     sizeof(struct udp_msg));
+    struct iovec *iov = (struct iovec *)kmalloc(vlen * IOV_MAX *
+                                                sizeof(struct iovec));
+    int32_t ret = -1;
+    if (!msgs || !iov) goto out;
+
+    for (uint32_t i = 0; i < vlen; i++) {
+        if (copy_user_iov(&iov[i * IOV_MAX], args[i].iov, args[i].iovcnt))
+            goto out;
+        msgs[i].iov    = &iov[i * IOV_MAX];
+        msgs[i].iovcnt = (int)args[i].iovcnt;
+    }
+
+    ret = udp_recvmmsg((int)tf->ebx, msgs, (int)vlen);
+    for (int32_t i = 0; i < ret; i++) {
+        args[i].from_ip   = msgs[i].ip;
+        args[i].from_port = msgs[i].port;
+        args[i].received  = msgs[i].len;
+    }
+
+out:
+    kfree(msgs);
+    kfree(iov);
+    return ret;
+}
+
+/* SYS_SENDMMSG (48) — EBX = sock, ECX = sendmsg_args[], EDX = vlen */
+static int32_t sys_sendmmsg(trapframe *tf) {
+    const struct sendmsg_args *args = (const struct sendmsg_args *)tf->ecx;
+    uint32_t vlen = tf->edx;
+
+    if (vlen == 0 || vlen > UDP_MMSG_MAX) return -1;
+    if (bad_user_ptr(args, vlen * sizeof(struct sendmsg_args))) return -1;
+
+    struct udp_msg *msgs = (struct udp_msg *)kcalloc(vlen,
+                                                     sizeof(struct udp_msg));
+    struct iovec *iov = (struct iovec *)kmalloc(vlen * IOV_MAX *
+                                                sizeof(struct iovec));
+    int32_t ret = -1;
+    if (!msgs || !iov) goto out;
+
+    for (uint32_t i = 0; i < vlen; i++) {
+        if (copy_user_iov(&iov[i * IOV_MAX], args[i].iov, args[i].iovcnt))
+            goto out;
+        msgs[i].iov    = &iov[i * IOV_MAX];
+        msgs[i].iovcnt = (int)args[i].iovcnt;
+        msgs[i].ip     = args[i].dst_ip;
+        msgs[i].port   = args[i].dst_port;
+    }
+
+    ret = udp_sendmmsg((int)tf->ebx, msgs, (int)vlen);
+
+out:
+    kfree(msgs);
+    kfree(iov);
+    return ret;
+}
+
+/* SYS_SETSOCKOPT (42) — EBX = sock (TCP: fd), ECX = opt, EDX = value */
+static int32_t sys_setsockopt(trapframe *tf) {
+    int opt = (int)tf->ecx;
+    if (opt >= TCP_NODELAY)
+        return tcp_setsockopt((int)tf->ebx, opt, tf->edx);
+    return udp_setsockopt((int)tf->ebx, opt, tf->edx);
+}
+
+/* SYS_GETSOCKOPT (43) — EBX = sock (TCP: fd), ECX = opt; returns the value */
+static int32_t sys_getsockopt(trapframe *tf) {
+    int opt = (int)tf->ecx;
+    if (opt >= TCP_NODELAY)
+        return tcp_getsockopt((int)tf->ebx, opt);
+    return udp_getsockopt((int)tf->ebx, opt);
+}
+
+/* ------------------------------------------------------------------ */
+/*  TCP                                                               */
+/* ------------------------------------------------------------------ */
+
+/* SYS_LISTEN (45) — EBX = fd, ECX = port, EDX = backlog */
+static int32_t sys_listen(trapframe *tf) {
+    return tcp_listen((int)tf->ebx, (uint16_t)tf->ecx, (int)tf->edx);
+}
+
+/* SYS_ACCEPT (46) — EBX = fd, ECX = struct accept_args * or 0.
+   Returns the new connection's fd. */
+static int32_t sys_accept(trapframe *tf) {
+    struct accept_args *args = (struct accept_args *)tf->ecx;
+    if (args && bad_user_ptr(args, sizeof(struct accept_args))) return -1;
+
+    uint32_t ip;
+    uint16_t port;
+    int fd = tcp_accept((int)tf->ebx, &ip, &port);
+    if (fd >= 0 && args) {
+        args->ip   = ip;
+        args->port = port;
+    }
+    return fd;
+}
+
+/* SYS_CONNECT (47) — EBX = fd, ECX = ip (network order), EDX = port */
+static int32_t sys_connect(trapframe *tf) {
+    return tcp_connect((int)tf->ebx, tf->ecx, (uint16_t)tf->edx);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Kernel-side copy (sendfile)                                       */
+/* ------------------------------------------------------------------ */
+
+/* Validate a sendfile_args block; its offset pointer is optional */
+static struct sendfile_args *sendfile_user_args(uint32_t uaddr) {
+    struct sendfile_args *args = (struct sendfile_args *)uaddr;
+    if (bad_user_ptr(args, sizeof(struct sendfile_args))) return NULL;
+    if (args->offset && bad_user_ptr(args->offset, sizeof(uint32_t)))
+        return NULL;
+    return args;
+}
+
+/* SYS_SENDFILE (35) — EBX = out_fd, ECX = args */
+static int32_t sys_sendfile(trapframe *tf) {
+    struct sendfile_args *args = sendfile_user_args(tf->ecx);
+    if (!args) return -1;
+    return fd_sendfile((int)tf->ebx, args->in_fd, args->offset, args->count);
+}
+
+/* SYS_SENDFILE_UDP (36) — EBX = sock, ECX = args */
+static int32_t sys_sendfile_udp(trapframe *tf) {
+    struct sendfile_args *args = sendfile_user_args(tf->ecx);
+    if (!args) return -1;
+    return udp_sendfile((int)tf->ebx, args->dst_ip, args->dst_port,
+                        args->in_fd, args->offset, args->count);
+}
+
+/* SYS_FCNTL (37) — EBX = fd (or socket), ECX = cmd [| F_SOCK], EDX = arg */
+static int32_t sys_fcntl(trapframe *tf) {
+    int cmd = (int)tf->ecx;
+    if (cmd & F_SOCK)
+        return udp_fcntl((int)tf->ebx, cmd & ~F_SOCK, tf->edx);
+    return fd_fcntl((int)tf->ebx, cmd, tf->edx);
+}
+
+/* ------------------------------------------------------------------ */
+/*  poll / epoll                                                      */
+/* ------------------------------------------------------------------ */
+
+/* SYS_POLL (38) — EBX = struct pollfd[], ECX = nfds, EDX = timeout_ms */
+static int32_t sys_poll(trapframe *tf) {
+    struct pollfd fds[POLL_MAX_FDS];
+    struct pollfd *ufds = (struct pollfd *)tf->ebx;
+    uint32_t nfds = tf->ecx;
+
+    if (nfds > POLL_MAX_FDS) return -1;
+    if (nfds && bad_user_ptr(ufds, nfds * sizeof(struct pollfd))) return -1;
+
+    memcpy(fds, ufds, nfds * sizeof(struct pollfd));
+    int32_t ret = poll_fds(fds, nfds, (int32_t)tf->edx);
+    if (ret >= 0) {
+        for (uint32_t i = 0; i < nfds; i++)
+            ufds[i].revents = fds[i].revents;
+    }
+    return ret;
+}
+
+/* SYS_EPOLL_CREATE (39) — returns an fd */
+static int32_t sys_epoll_create(trapframe *tf) {
+    (void)tf;
+    return epoll_create();
+}
+
+/* SYS_EPOLL_CTL (40) — EBX = pointer to struct epoll_ctl_args */
+static int32_t sys_epoll_ctl(trapframe *tf) {
+    struct epoll_ctl_args *args = (struct epoll_ctl_args *)tf->ebx;
+    if (bad_user_ptr(args, sizeof(struct epoll_ctl_args))) return -1;
+
+    struct epoll_event ev = { args->events, args->data };
+    return epoll_ctl(args->epfd, args->op, args->fd, &ev);
+}
+
+/* SYS_EPOLL_WAIT (41) — EBX = pointer to struct epoll_wait_args */
+static int32_t sys_epoll_wait(trapframe *tf) {
+    struct epoll_wait_args *args = (struct epoll_wait_args *)tf->ebx;
+    struct epoll_event events[EPOLL_MAX_WATCH];
+
+    if (bad_user_ptr(args, sizeof(struct epoll_wait_args))) return -1;
+    int32_t max = args->maxevents;
+    if (max <= 0) return -1;
+    if (max > EPOLL_MAX_WATCH) max = EPOLL_MAX_WATCH;
+    if (bad_user_ptr(args->events, (uint32_t)max * sizeof(struct epoll_event)))
+        return -1;
+
+    int32_t n = epoll_wait(args->epfd, events, max, args->timeout_ms);
+    if (n > 0)
+        memcpy(args->events, events, (uint32_t)n * sizeof(struct epoll_event));
+    return n;
+}
+
 /* ------------------------------------------------------------------ */
 /*  Dispatch table                                                    */
 /* ------------------------------------------------------------------ */
@@ -735,6 +1088,26 @@ static syscall_fn syscall_table[NUM_SYSCALLS] = {
     [SYS_GPU_CREATE_CTX]  = sys_gpu_create_ctx,
     [SYS_GPU_SUBMIT]      = sys_gpu_submit,
     [SYS_GPU_DESTROY_CTX] = sys_gpu_destroy_ctx,
+    [SYS_READV]     = sys_readv,
+    [SYS_WRITEV]    = sys_writev,
+    [SYS_PREAD]     = sys_pread,
+    [SYS_PWRITE]    = sys_pwrite,
+    [SYS_SENDMSG]   = sys_sendmsg,
+    [SYS_RECVMSG]   = sys_recvmsg,
+    [SYS_SENDFILE]  = sys_sendfile,
+    [SYS_SENDFILE_UDP] = sys_sendfile_udp,
+    [SYS_FCNTL]     = sys_fcntl,
+    [SYS_POLL]      = sys_poll,
+    [SYS_EPOLL_CREATE] = sys_epoll_create,
+    [SYS_EPOLL_CTL]    = sys_epoll_ctl,
+    [SYS_EPOLL_WAIT]   = sys_epoll_wait,
+    [SYS_SETSOCKOPT]   = sys_setsockopt,
+    [SYS_GETSOCKOPT]   = sys_getsockopt,
+    [SYS_RECVMMSG]     = sys_recvmmsg,
+    [SYS_LISTEN]       = sys_listen,
+    [SYS_ACCEPT]       = sys_accept,
+    [SYS_CONNECT]      = sys_connect,
+    [SYS_SENDMMSG]     = sys_sendmmsg,
 };
 
 void syscall_dispatch(trapframe *tf) {
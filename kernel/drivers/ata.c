@@ -1,6 +1,7 @@
 #include <kernel/ata.h>
 #include <kernel/io.h>
 #include <kernel/hal.h>
+#include <kernel/blk.h>
 #include <stdio.h>
 
 static int disk_present = 0;
@@ -49,6 +50,115 @@ static void ata_delay(void) {
     inb(ATA_PRIMARY_CTRL);
 }
 
+/* ------------------------------------------------------------------ */
+/*  PIO transfer core                                                 */
+/* ------------------------------------------------------------------ */
+
+/*
+ * One READ/WRITE SECTORS command of 1..256 sectors, with the data
+ * phase fed from a scatter-gather list. Each segment supplies
+ * segs[i].sectors consecutive sectors. Does not flush the write cache.
+ */
+static int ata_pio(int write, uint32_t lba, uint32_t count,
+                   const blk_seg_t *segs, uint32_t nsegs) {
+    if (!disk_present) return -1;
+    if (count == 0 || count > ATA_MAX_PIO_SECTORS) return -1;
+
+    /* Disable interrupts during transfer, restore caller's state on exit */
+    uint32_t irqflags = hal_irq_save();
+
+    /* Wait for drive ready */
+    if (ata_poll_bsy() != 0) {
+        hal_irq_restore(irqflags);
+        return -1;
+    }
+
+    /* Select drive + LBA bits 24-27 */
+    outb(ATA_PRIMARY_IO + ATA_REG_DRIVE,
+         0xE0 | ((lba >> 24) & 0x0F));
+
+    /* Set sector count (0 means 256) and LBA */
+    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, (uint8_t)count);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_LO, (uint8_t)(lba));
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_MID, (uint8_t)(lba >> 8));
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA_HI, (uint8_t)(lba >> 16));
+
+    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND,
+         write ? ATA_CMD_WRITE_PIO : ATA_CMD_READ_PIO);
+
+    /* Move each sector through the segment list */
+    uint32_t seg = 0, in_seg = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        while (seg < nsegs && in_seg == segs[seg].sectors) {
+            seg++;
+            in_seg = 0;
+        }
+        if (seg == nsegs || ata_poll_drq() != 0) {
+            hal_irq_restore(irqflags);
+            return -1;
+        }
+
+        uint16_t *ptr = (uint16_t *)segs[seg].buf + in_seg * 256;
+        if (write)
+            outsw(ATA_PRIMARY_IO + ATA_REG_DATA, ptr, 256);
+        else
+            insw(ATA_PRIMARY_IO + ATA_REG_DATA, ptr, 256);
+        in_seg++;
+    }
+
+    /* Let the final write drain before the next command */
+    if (write && ata_poll_bsy() != 0) {
+        hal_irq_restore(irqflags);
+        return -1;
+    }
+
+    hal_irq_restore(irqflags);
+    return 0;
+}
+
+/* Block-layer hook: split long requests into PIO-sized commands. */
+static int ata_blk_transfer(blk_device_t *dev, int dir, uint32_t lba,
+                            uint32_t count, const blk_seg_t *segs,
+                            uint32_t nsegs) {
+    (void)dev;
+    blk_seg_t part[BLK_MAX_SEGS];
+    uint32_t seg = 0, seg_off = 0;
+
+    while (count > 0) {
+        uint32_t n = count > ATA_MAX_PIO_SECTORS ? ATA_MAX_PIO_SECTORS : count;
+
+        /* Carve the next n sectors out of the segment list */
+        uint32_t np = 0, need = n;
+        while (need > 0 && seg < nsegs && np < BLK_MAX_SEGS) {
+            uint32_t avail = segs[seg].sectors - seg_off;
+            uint32_t take = avail < need ? avail : need;
+            part[np].buf = (uint8_t *)segs[seg].buf + seg_off * 512;
+            part[np].sectors = take;
+            np++;
+            need -= take;
+            seg_off += take;
+            if (seg_off == segs[seg].sectors) {
+                seg++;
+                seg_off = 0;
+            }
+        }
+        if (need > 0)
+            return -1;
+
+        if (ata_pio(dir == BLK_WRITE, lba, n, part, np) != 0)
+            return -1;
+
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+static blk_device_t ata_blk = {
+    .name     = "ata0",
+    .transfer = ata_blk_transfer,
+};
+
 /* ------------------------------------------------------------------ */
 /*  Public API                                                        */
 /* ------------------------------------------------------------------ */
@@ -107,88 +217,25 @@ int ata_init(void) {
     printf("[ata] primary master: %d sectors (%d KB)\n",
            total_sectors, total_sectors / 2);
 
+    ata_blk.total_sectors = total_sectors;
+    blk_register(&ata_blk);
+
     return 0;
 }
 
 int ata_read_sectors(uint32_t lba, uint8_t count, void *buf) {
-    if (!disk_present) return -1;
     if (count == 0) return -1;
 
-    /* Disable interrupts during transfer, restore caller's state on exit */
-    uint32_t irqflags = hal_irq_save();
-
-    /* Wait for drive ready */
-    if (ata_poll_bsy() != 0) {
-        hal_irq_restore(irqflags);
-        return -1;
-    }
-
-    /* Select drive + LBA bits 24-27 */
-    outb(ATA_PRIMARY_IO + ATA_REG_DRIVE,
-         0xE0 | ((lba >> 24) & 0x0F));
-
-    /* Set sector count and LBA */
-    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, count);
-    outb(ATA_PRIMARY_IO + ATA_REG_LBA_LO, (uint8_t)(lba));
-    outb(ATA_PRIMARY_IO + ATA_REG_LBA_MID, (uint8_t)(lba >> 8));
-    outb(ATA_PRIMARY_IO + ATA_REG_LBA_HI, (uint8_t)(lba >> 16));
-
-    /* Send READ SECTORS command */
-    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, ATA_CMD_READ_PIO);
-
-    /* Read each sector */
-    uint16_t *ptr = (uint16_t *)buf;
-    for (uint8_t i = 0; i < count; i++) {
-        if (ata_poll_drq() != 0) {
-            hal_irq_restore(irqflags);
-            return -1;
-        }
-        insw(ATA_PRIMARY_IO + ATA_REG_DATA, ptr, 256);
-        ptr += 256;
-    }
-
-    hal_irq_restore(irqflags);
-    return 0;
+    blk_seg_t seg = { buf, count };
+    return ata_pio(0, lba, count, &seg, 1);
 }
 
 int ata_write_sectors(uint32_t lba, uint8_t count, const void *buf) {
-    if (!disk_present) return -1;
     if (count == 0) return -1;
 
-    /* Disable interrupts during transfer, restore caller's state on exit */
-    uint32_t irqflags = hal_irq_save();
-
-    /* Wait for drive ready */
-    if (ata_poll_bsy() != 0) {
-        hal_irq_restore(irqflags);
+    blk_seg_t seg = { (void *)buf, count };
+    if (ata_pio(1, lba, count, &seg, 1) != 0)
         return -1;
-    }
-
-    /* Select drive + LBA bits 24-27 */
-    outb(ATA_PRIMARY_IO + ATA_REG_DRIVE,
-         0xE0 | ((lba >> 24) & 0x0F));
-
-    /* Set sector count and LBA */
-    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, count);
-    outb(ATA_PRIMARY_IO + ATA_REG_LBA_LO, (uint8_t)(lba));
-    outb(ATA_PRIMARY_IO + ATA_REG_LBA_MID, (uint8_t)(lba >> 8));
-    outb(ATA_PRIMARY_IO + ATA_REG_LBA_HI, (uint8_t)(lba >> 16));
-
-    /* Send WRITE SECTORS command */
-    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, ATA_CMD_WRITE_PIO);
-
-    /* Write each sector */
-    const uint16_t *ptr = (const uint16_t *)buf;
-    for (uint8_t i = 0; i < count; i++) {
-        if (ata_poll_drq() != 0) {
-            hal_irq_restore(irqflags);
-            return -1;
-        }
-        outsw(ATA_PRIMARY_IO + ATA_REG_DATA, ptr, 256);
-        ptr += 256;
-    }
-
-    hal_irq_restore(irqflags);
 
     /* Flush write cache */
     return ata_flush();
@@ -0,0 +1,444 @@
+#include <kernel/blk.h>
+#include <kernel/process.h>
+#include <kernel/timer.h>
+#include <kernel/heap.h>
+#include <kernel/hal.h>
+#include <string.h>
+#include <stdio.h>
+
+static blk_device_t *devices[BLK_MAX_DEVICES];
+static uint32_t num_devices = 0;
+
+static struct process *worker = NULL;
+static wait_queue_t worker_wq = WAIT_QUEUE_INIT;
+
+/* ------------------------------------------------------------------ */
+/*  Registration                                                      */
+/* ------------------------------------------------------------------ */
+
+int blk_register(blk_device_t *dev) {
+    if (!dev || !dev->transfer || num_devices >= BLK_MAX_DEVICES)
+        return -1;
+
+    dev->queue = NULL;
+    dev->depth = 0;
+    dev->head_pos = 0;
+    dev->busy = 0;
+    dev->fault_budget = BLK_FAULT_OFF;
+    memset(&dev->stats, 0, sizeof(dev->stats));
+
+    devices[num_devices++] = dev;
+    return 0;
+}
+
+blk_device_t *blk_lookup(const char *name) {
+    for (uint32_t i = 0; i < num_devices; i++) {
+        if (strcmp(devices[i]->name, name) == 0)
+            return devices[i];
+    }
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Queue ownership                                                   */
+/* ------------------------------------------------------------------ */
+
+/* Only one context dispatches from a queue at a time. */
+static int queue_claim(blk_device_t *dev) {
+    uint32_t flags = hal_irq_save();
+    int ok = !dev->busy;
+    if (ok) dev->busy = 1;
+    hal_irq_restore(flags);
+    return ok;
+}
+
+static void queue_release(blk_device_t *dev) {
+    uint32_t flags = hal_irq_save();
+    dev->busy = 0;
+    int leftover = dev->queue != NULL;
+    hal_irq_restore(flags);
+
+    /* Hand anything we didn't issue to the worker */
+    if (leftover && worker)
+        wake_up_one(&worker_wq);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Submission                                                        */
+/* ------------------------------------------------------------------ */
+
+void submit_bio(bio_t *bio) {
+    blk_device_t *dev = bio->dev;
+
+    bio->status = 0;
+    bio->next = NULL;
+    bio->start_us = timer_usecs();
+
+    uint32_t flags = hal_irq_save();
+
+    /* Sorted insert by LBA; equal LBAs stay in submission order */
+    bio_t **pp = &dev->queue;
+    while (*pp && (*pp)->lba <= bio->lba)
+        pp = &(*pp)->next;
+    bio->next = *pp;
+    *pp = bio;
+
+    dev->depth++;
+    dev->stats.submitted++;
+    if (dev->depth > dev->stats.max_depth)
+        dev->stats.max_depth = dev->depth;
+
+    int idle = !dev->busy;
+    hal_irq_restore(flags);
+
+    if (idle && worker)
+        wake_up_one(&worker_wq);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Dispatch (C-LOOK + merge)                                         */
+/* ------------------------------------------------------------------ */
+
+static uint32_t lat_bucket(uint32_t us) {
+    uint32_t b = 0;
+    us >>= 7;                   /* bucket 0 = under 128us */
+    while (us && b < BLK_LAT_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/* Cut a segment list down to its first 'sectors' sectors.
+   Returns the number of segments left. */
+static uint32_t trim_segs(blk_seg_t *segs, uint32_t nsegs, uint32_t sectors) {
+    uint32_t i = 0;
+    while (i < nsegs && sectors > 0) {
+        if (segs[i].sectors > sectors)
+            segs[i].sectors = sectors;
+        sectors -= segs[i].sectors;
+        i++;
+    }
+    return i;
+}
+
+/* Issue one (possibly merged) command. Caller owns the queue.
+   Returns 1 if something was dispatched, 0 if the queue was empty. */
+static int dispatch_one(blk_device_t *dev) {
+    blk_seg_t segs[BLK_MAX_SEGS];
+
+    uint32_t flags = hal_irq_save();
+
+    if (!dev->queue) {
+        hal_irq_restore(flags);
+        return 0;
+    }
+
+    /* C-LOOK: first request at or past the head, else wrap to lowest */
+    bio_t **pp = &dev->queue;
+    while (*pp && (*pp)->lba < dev->head_pos)
+        pp = &(*pp)->next;
+    if (!*pp)
+        pp = &dev->queue;
+
+    /* Extend the run over contiguous same-direction neighbours */
+    bio_t *first = *pp;
+    bio_t *last = first;
+    uint32_t count = first->count;
+    uint32_t nsegs = 1;
+
+    while (last->next && nsegs < BLK_MAX_SEGS) {
+        bio_t *n = last->next;
+        if (n->dir != first->dir) break;
+        if (n->lba != last->lba + last->count) break;
+        if (count + n->count > BLK_MAX_SECTORS) break;
+        count += n->count;
+        nsegs++;
+        last = n;
+    }
+
+    /* Detach [first..last] from the queue */
+    *pp = last->next;
+    last->next = NULL;
+
+    dev->stats.depth_sum += dev->depth;
+    dev->stats.dispatches++;
+    dev->stats.merges += nsegs - 1;
+    dev->depth -= nsegs;
+    dev->head_pos = first->lba + count;
+
+    /* An armed fault lets the command through only up to its budget */
+    uint32_t issue = count;
+    if (first->dir == BLK_WRITE && dev->fault_budget != BLK_FAULT_OFF) {
+        if (issue > dev->fault_budget)
+            issue = dev->fault_budget;
+        dev->fault_budget -= issue;
+    }
+
+    hal_irq_restore(flags);
+
+    uint32_t i = 0;
+    for (bio_t *b = first; b; b = b->next, i++) {
+        segs[i].buf = b->buf;
+        segs[i].sectors = b->count;
+    }
+
+    int rc = 0;
+    if (issue < count)
+        nsegs = trim_segs(segs, nsegs, issue);
+    if (issue > 0)
+        rc = dev->transfer(dev, first->dir, first->lba, issue, segs, nsegs);
+
+    if (rc != 0) {
+        printf("[blk] %s: %s error at lba %d (%d sectors)\n", dev->name,
+               first->dir == BLK_WRITE ? "write" : "read", first->lba, count);
+    }
+    if (first->dir == BLK_WRITE)
+        dev->stats.sectors_written += issue;
+    else
+        dev->stats.sectors_read += count;
+
+    if (issue < count) {
+        dev->stats.sectors_dropped += count - issue;
+        rc = -1;
+    }
+
+    /* Complete in LBA order. end_io may free the bio. */
+    uint32_t now = timer_usecs();
+    bio_t *b = first;
+    while (b) {
+        bio_t *next = b->next;
+        b->status = rc;
+        b->next = NULL;
+        if (rc != 0)
+            dev->stats.errors++;
+        dev->stats.lat_hist[lat_bucket(now - b->start_us)]++;
+        dev->stats.completed++;
+        if (b->end_io)
+            b->end_io(b);
+        b = next;
+    }
+
+    return 1;
+}
+
+void blk_unplug(blk_device_t *dev) {
+    if (!queue_claim(dev))
+        return;     /* current owner drains, or hands off to the worker */
+    while (dispatch_one(dev))
+        ;
+    queue_release(dev);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Worker                                                            */
+/* ------------------------------------------------------------------ */
+
+static int work_available(void) {
+    for (uint32_t i = 0; i < num_devices; i++) {
+        if (devices[i]->queue && !devices[i]->busy)
+            return 1;
+    }
+    return 0;
+}
+
+static void blk_worker(void) {
+    for (;;) {
+        for (uint32_t i = 0; i < num_devices; i++)
+            blk_unplug(devices[i]);
+
+        uint32_t flags = hal_irq_save();
+        if (!work_available())
+            sleep_on(&worker_wq);
+        hal_irq_restore(flags);
+    }
+}
+
+void blk_start_worker(void) {
+    if (worker || num_devices == 0)
+        return;
+
+    worker = proc_create_kernel_thread(blk_worker);
+    if (!worker)
+        printf("[blk] failed to start queue worker\n");
+}
+
+/* ------------------------------------------------------------------ */
+/*  Batches and synchronous helpers                                   */
+/* ------------------------------------------------------------------ */
+
+static void batch_end_io(bio_t *bio) {
+    blk_batch_t *b = (blk_batch_t *)bio->private;
+
+    int status = bio->status;
+    kfree(bio);
+
+    /* The waiter may return (and its batch go out of scope) as soon as
+       pending reaches zero, so finish touching b before it can run. */
+    uint32_t flags = hal_irq_save();
+    if (status != 0)
+        b->error = -1;
+    if (--b->pending == 0)
+        wake_up_all(&b->wq);
+    hal_irq_restore(flags);
+}
+
+void blk_batch_init(blk_batch_t *b, blk_device_t *dev) {
+    b->dev = dev;
+    b->pending = 0;
+    b->error = 0;
+    b->wq.head = NULL;
+}
+
+int blk_batch_add(blk_batch_t *b, int dir, uint32_t lba, uint32_t count,
+                  void *buf) {
+    if (!b->dev || count == 0) {
+        b->error = -1;
+        return -1;
+    }
+
+    uint8_t *p = (uint8_t *)buf;
+
+    /* Split oversized requests so each can merge with its neighbours */
+    while (count > 0) {
+        uint32_t n = count > BLK_MAX_SECTORS ? BLK_MAX_SECTORS : count;
+
+        bio_t *bio = (bio_t *)kmalloc(sizeof(bio_t));
+        if (!bio) {
+            printf("[blk] out of memory for bio\n");
+            b->error = -1;
+            return -1;
+        }
+
+        bio->dev = b->dev;
+        bio->lba = lba;
+        bio->count = n;
+        bio->buf = p;
+        bio->dir = (uint8_t)dir;
+        bio->end_io = batch_end_io;
+        bio->private = b;
+
+        uint32_t flags = hal_irq_save();
+        b->pending++;
+        hal_irq_restore(flags);
+
+        submit_bio(bio);
+
+        lba += n;
+        p += n * BLK_SECTOR_SIZE;
+        count -= n;
+    }
+    return 0;
+}
+
+int blk_batch_wait(blk_batch_t *b) {
+    while (b->pending) {
+        /* Issue our own requests if nobody else is dispatching */
+        if (queue_claim(b->dev)) {
+            dispatch_one(b->dev);
+            queue_release(b->dev);
+            continue;
+        }
+
+        /* Someone else owns the queue. Without a worker (early boot)
+           there is nobody to wake us, so just retry. */
+        if (!worker || !current_process)
+            continue;
+
+        uint32_t flags = hal_irq_save();
+        if (b->pending)
+            sleep_on(&b->wq);
+        hal_irq_restore(flags);
+    }
+    return b->error;
+}
+
+int blk_read(blk_device_t *dev, uint32_t lba, uint32_t count, void *buf) {
+    blk_batch_t b;
+    blk_batch_init(&b, dev);
+    blk_batch_add(&b, BLK_READ, lba, count, buf);
+    return blk_batch_wait(&b);
+}
+
+int blk_write(blk_device_t *dev, uint32_t lba, uint32_t count,
+              const void *buf) {
+    blk_batch_t b;
+    blk_batch_init(&b, dev);
+    blk_batch_add(&b, BLK_WRITE, lba, count, (void *)buf);
+    return blk_batch_wait(&b);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Fault injection                                                   */
+/* ------------------------------------------------------------------ */
+
+void blk_set_fault(blk_device_t *dev, uint32_t sectors) {
+    uint32_t flags = hal_irq_save();
+    dev->fault_budget = sectors;
+    hal_irq_restore(flags);
+
+    if (sectors == BLK_FAULT_OFF)
+        printf("[blk] %s: fault injection off\n", dev->name);
+    else
+        printf("[blk] %s: power cut after %u more sectors written\n",
+               dev->name, sectors);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Statistics                                                        */
+/* ------------------------------------------------------------------ */
+
+static void print_lat_label(uint32_t bucket) {
+    uint32_t limit = 128u << bucket;
+    const char *op = "<";
+
+    if (bucket == BLK_LAT_BUCKETS - 1) {
+        limit >>= 1;
+        op = ">=";
+    }
+    if (limit < 1000)
+        printf("%s%uus", op, limit);
+    else
+        printf("%s%ums", op, limit / 1000);
+}
+
+void blk_print_stats(void) {
+    if (num_devices == 0) {
+        printf("No block devices\n");
+        return;
+    }
+
+    for (uint32_t i = 0; i < num_devices; i++) {
+        blk_device_t *dev = devices[i];
+        blk_stats_t *s = &dev->stats;
+
+        printf("%s: %u sectors, worker %s\n", dev->name, dev->total_sectors,
+               worker ? "running" : "not started");
+        printf("  queue depth: %u now, %u peak", dev->depth, s->max_depth);
+        if (s->dispatches)
+            printf(", %u.%u avg at dispatch",
+                   s->depth_sum / s->dispatches,
+                   (s->depth_sum * 10 / s->dispatches) % 10);
+        printf("\n");
+        printf("  bios: %u submitted, %u completed, %u errors\n",
+               s->submitted, s->completed, s->errors);
+        printf("  commands: %u issued, %u merges\n",
+               s->dispatches, s->merges);
+        printf("  sectors: %u read, %u written\n",
+               s->sectors_read, s->sectors_written);
+        if (s->sectors_dropped || dev->fault_budget != BLK_FAULT_OFF) {
+            printf("  fault: %u sectors dropped", s->sectors_dropped);
+            if (dev->fault_budget != BLK_FAULT_OFF)
+                printf(", armed with %u left", dev->fault_budget);
+            printf("\n");
+        }
+
+        printf("  latency:\n");
+        for (uint32_t b = 0; b < BLK_LAT_BUCKETS; b++) {
+            if (s->lat_hist[b] == 0) continue;
+            printf("    ");
+            print_lat_label(b);
+            printf(": %u\n", s->lat_hist[b]);
+        }
+    }
+}
@@ -7,8 +7,25 @@
  * MMIO registers are mapped at 0xC0C00000 (PDE[771]), following the
  * same pattern as the framebuffer (PDE[770]).
  *
- * TX/RX use legacy descriptors with DMA.  RX is IRQ-driven;
- * TX is synchronous (waits for DD).
+ * TX/RX use legacy descriptors with DMA straight to and from packet
+ * buffers (skb.h). RX is NAPI-style: the IRQ handler masks RX
+ * interrupts and schedules the net RX thread, whose e1000_poll() swaps
+ * each filled buffer for a fresh one from the pool and passes it up
+ * the stack without copying, then unmasks once the ring is empty.
+ * TX points a descriptor at the frame's buffer and frees it once the
+ * hardware has set DD on it.
+ *
+ * Ring sizes are set on the command line (up to 4096 descriptors
+ * each); the rings live in contiguous frames, and the packet pool is
+ * grown by the RX ring's size so the stack keeps its own buffers.
+ * Interrupt moderation (ITR/RDTR/RADV) favours throughput unless
+ * e1000.itr=latency.
+ *
+ * Checksums are offloaded both ways: a frame marked in skb->csum goes
+ * out on an extended data descriptor, behind a context descriptor
+ * whenever its offsets differ from the last one loaded, and RXCSUM has
+ * the hardware check received ones. During a net_tx_hold() burst the
+ * TDT doorbell is written once for many frames rather than per frame.
  */
 
 #include <kernel/e1000.h>
@@ -19,19 +36,12 @@
 #include <kernel/isr.h>
 #include <kernel/pic.h>
 #include <kernel/timer.h>
+#include <kernel/skb.h>
+#include <kernel/net.h>
+#include <kernel/cmdline.h>
 #include <stdio.h>
 #include <string.h>
 
-/* Forward declaration — called by net layer when a packet arrives */
-extern void net_rx_callback(const void *data, uint16_t len);
-
-/* Weak stub so the driver compiles before the net layer exists.
-   net.c will provide the real implementation. */
-__attribute__((weak))
-void net_rx_callback(const void *data, uint16_t len) {
-    (void)data; (void)len;
-}
-
 /* ------------------------------------------------------------------ */
 /*  MMIO mapping                                                      */
 /* ------------------------------------------------------------------ */
@@ -55,16 +65,32 @@ static inline void e1000_write(uint32_t reg, uint32_t val) {
 
 static e1000_tx_desc_t *tx_descs;
 static e1000_rx_desc_t *rx_descs;
+static uint32_t tx_ndesc, rx_ndesc;
+
+/* Packet buffers owned by the rings: a TX slot keeps its frame until
+   the hardware has sent it, an RX slot the buffer it will fill */
+static sk_buff_t **tx_skbs;
+static sk_buff_t **rx_skbs;
 
-/* Static TX buffers — avoids kmalloc in the send path */
-static uint8_t tx_buffers[E1000_NUM_TX_DESC][E1000_RX_BUF_SIZE]
-    __attribute__((aligned(16)));
+static uint32_t tx_tail;
+static uint32_t tx_clean;         /* oldest descriptor not yet reclaimed */
+static uint32_t rx_tail;
 
-/* RX buffers — one 2KB buffer per descriptor */
-static uint8_t *rx_buffers[E1000_NUM_RX_DESC];
+/* Descriptors queued since TDT was last written. A burst rings the
+   doorbell early once this reaches tx_batch: E1000_TX_BATCH, or half
+   a smaller ring. */
+#define E1000_TX_BATCH  32
+static uint32_t tx_pending;
+static uint32_t tx_batch;
 
-static uint16_t tx_tail;
-static uint16_t rx_tail;
+/* Checksum context the hardware last loaded (tucss 0: none yet) */
+static uint8_t tx_ctx_tucss, tx_ctx_tucso;
+
+#define E1000_RX_INTS  (E1000_ICR_RXT0 | E1000_ICR_RXDMT0 | E1000_ICR_RXO)
+
+static volatile int rx_polling;   /* RX interrupts masked, poll owns the ring */
+
+static void tx_reclaim(void);
 
 /* ------------------------------------------------------------------ */
 /*  NIC abstraction                                                   */
@@ -125,27 +151,52 @@ static void read_mac_address(void) {
 }
 
 /* ------------------------------------------------------------------ */
-/*  TX ring initialization                                            */
+/*  Ring allocation                                                   */
 /* ------------------------------------------------------------------ */
 
-static void tx_init(void) {
-    tx_descs = (e1000_tx_desc_t *)kcalloc(E1000_NUM_TX_DESC,
-                                           sizeof(e1000_tx_desc_t));
+/* Ring size from the command line: a multiple of 8 (the hardware wants
+   the ring length in 128-byte units), within MIN..MAX */
+static uint32_t ring_size(const char *key, uint32_t def) {
+    uint32_t n = cmdline_uint(key, def);
+    if (n < E1000_DESC_MIN) n = E1000_DESC_MIN;
+    if (n > E1000_DESC_MAX) n = E1000_DESC_MAX;
+    return n & ~7u;
+}
 
-    /* Point each descriptor at its static buffer and mark DD
-       so the first send() sees them as "done" */
-    for (int i = 0; i < E1000_NUM_TX_DESC; i++) {
-        tx_descs[i].addr   = (uint64_t)virt_to_phys((uint32_t)tx_buffers[i]);
-        tx_descs[i].status = E1000_TXD_STAT_DD;
-    }
+/* Descriptors in zeroed, physically contiguous frames (the NIC reads
+   the whole ring from one base address), reached through the physmap */
+static void *ring_alloc(uint32_t ndesc, uint32_t *phys_out) {
+    uint32_t pages = (ndesc * 16 + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t phys = alloc_frames_contiguous(pages, 1);
+    if (phys == FRAME_ALLOC_FAIL) return (void *)0;
+
+    void *ring = phys_to_virt(phys);
+    memset(ring, 0, pages * PAGE_SIZE);
+    *phys_out = phys;
+    return ring;
+}
+
+/* ------------------------------------------------------------------ */
+/*  TX ring initialization                                            */
+/* ------------------------------------------------------------------ */
+
+static int tx_init(void) {
+    uint32_t phys = 0;
+    tx_descs = (e1000_tx_desc_t *)ring_alloc(tx_ndesc, &phys);
+    tx_skbs = (sk_buff_t **)kcalloc(tx_ndesc, sizeof(sk_buff_t *));
+    if (!tx_descs || !tx_skbs) return -1;
 
-    uint32_t phys = virt_to_phys((uint32_t)tx_descs);
+    /* Descriptors from tx_clean up to tx_tail belong to the hardware;
+       each gets its buffer address at send time */
     e1000_write(E1000_TDBAL, phys);
     e1000_write(E1000_TDBAH, 0);
-    e1000_write(E1000_TDLEN, E1000_NUM_TX_DESC * sizeof(e1000_tx_desc_t));
+    e1000_write(E1000_TDLEN, tx_ndesc * sizeof(e1000_tx_desc_t));
     e1000_write(E1000_TDH, 0);
     e1000_write(E1000_TDT, 0);
-    tx_tail = 0;
+    tx_tail = tx_clean = 0;
+    tx_pending = 0;
+    tx_batch = tx_ndesc / 2 < E1000_TX_BATCH ? tx_ndesc / 2 : E1000_TX_BATCH;
+    tx_ctx_tucss = tx_ctx_tucso = 0;
 
     /* Enable transmitter: pad short packets, collision threshold, distance */
     e1000_write(E1000_TCTL,
@@ -155,34 +206,66 @@ static void tx_init(void) {
 
     /* Inter-packet gap: 10 | (8 << 10) | (6 << 20) — IEEE 802.3 */
     e1000_write(E1000_TIPG, 10u | (8u << 10) | (6u << 20));
+    return 0;
 }
 
 /* ------------------------------------------------------------------ */
 /*  RX ring initialization                                            */
 /* ------------------------------------------------------------------ */
 
-static void rx_init(void) {
-    rx_descs = (e1000_rx_desc_t *)kcalloc(E1000_NUM_RX_DESC,
-                                           sizeof(e1000_rx_desc_t));
-
-    for (int i = 0; i < E1000_NUM_RX_DESC; i++) {
-        rx_buffers[i] = (uint8_t *)kmalloc(E1000_RX_BUF_SIZE);
-        rx_descs[i].addr = (uint64_t)virt_to_phys((uint32_t)rx_buffers[i]);
+static int rx_init(void) {
+    uint32_t phys = 0;
+    rx_descs = (e1000_rx_desc_t *)ring_alloc(rx_ndesc, &phys);
+    rx_skbs = (sk_buff_t **)kcalloc(rx_ndesc, sizeof(sk_buff_t *));
+    if (!rx_descs || !rx_skbs) return -1;
+
+    /* The ring's buffers come on top of the pool's own, so a big ring
+       doesn't leave the stack short */
+    if (skb_grow(rx_ndesc) != 0) return -1;
+
+    /* The whole buffer (no headroom) is the 2 KB DMA target */
+    for (uint32_t i = 0; i < rx_ndesc; i++) {
+        rx_skbs[i] = skb_alloc(0);
+        if (!rx_skbs[i]) return -1;
+        rx_descs[i].addr = (uint64_t)rx_skbs[i]->phys;
         rx_descs[i].status = 0;
     }
 
-    uint32_t phys = virt_to_phys((uint32_t)rx_descs);
     e1000_write(E1000_RDBAL, phys);
     e1000_write(E1000_RDBAH, 0);
-    e1000_write(E1000_RDLEN, E1000_NUM_RX_DESC * sizeof(e1000_rx_desc_t));
+    e1000_write(E1000_RDLEN, rx_ndesc * sizeof(e1000_rx_desc_t));
     e1000_write(E1000_RDH, 0);
-    e1000_write(E1000_RDT, E1000_NUM_RX_DESC - 1);
-    rx_tail = E1000_NUM_RX_DESC - 1;
+    e1000_write(E1000_RDT, rx_ndesc - 1);
+    rx_tail = rx_ndesc - 1;
+
+    /* Check IP and TCP/UDP checksums on receive */
+    e1000_write(E1000_RXCSUM, E1000_RXCSUM_IPOFLD | E1000_RXCSUM_TUOFLD);
 
     /* Enable receiver: accept broadcast, strip CRC, 2KB buffers */
     e1000_write(E1000_RCTL,
                 E1000_RCTL_EN | E1000_RCTL_BAM |
                 E1000_RCTL_BSIZE_2K | E1000_RCTL_SECRC);
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Interrupt moderation and statistics                               */
+/* ------------------------------------------------------------------ */
+
+void e1000_set_moderation(int mode) {
+    int tput = mode == NIC_MOD_THROUGHPUT;
+    e1000_write(E1000_ITR,  tput ? E1000_ITR_THROUGHPUT : 0);
+    e1000_write(E1000_RDTR, tput ? E1000_RDTR_THROUGHPUT : 0);
+    e1000_write(E1000_RADV, tput ? E1000_RADV_THROUGHPUT : 0);
+    e1000_nic.moderation = tput ? NIC_MOD_THROUGHPUT : NIC_MOD_LATENCY;
+}
+
+void e1000_update_stats(void) {
+    uint32_t flags = hal_irq_save();
+    net_stats.rx_missed     += e1000_read(E1000_MPC);
+    net_stats.rx_no_desc    += e1000_read(E1000_RNBC);
+    net_stats.rx_crc_errors += e1000_read(E1000_CRCERRS);
+    hal_irq_restore(flags);
 }
 
 /* ------------------------------------------------------------------ */
@@ -200,59 +283,239 @@ static void e1000_irq_handler(trapframe *tf) {
         e1000_nic.link_up = (status & 0x2) ? 1 : 0;
     }
 
-    /* Receive: process all descriptors with DD set */
-    if (icr & (E1000_ICR_RXT0 | E1000_ICR_RXDMT0 | E1000_ICR_RXO)) {
-        while (1) {
-            uint16_t next = (rx_tail + 1) % E1000_NUM_RX_DESC;
-            if (!(rx_descs[next].status & E1000_RXD_STAT_DD))
-                break;
+    if (icr & E1000_ICR_RXO)
+        net_stats.rx_overruns++;
+
+    /* Receive: mask further RX interrupts and leave the ring to
+       e1000_poll() on the RX thread */
+    if ((icr & E1000_RX_INTS) && !rx_polling) {
+        rx_polling = 1;
+        e1000_write(E1000_IMC, E1000_RX_INTS);
+        net_rx_schedule();
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  RX poll                                                           */
+/* ------------------------------------------------------------------ */
+
+static int rx_ready(void) {
+    uint32_t next = (rx_tail + 1) % rx_ndesc;
+    return rx_descs[next].status & E1000_RXD_STAT_DD;
+}
+
+int e1000_poll(int budget) {
+    int done = 0;
+
+    /* Return the buffers of frames sent meanwhile to the pool */
+    uint32_t flags = hal_irq_save();
+    tx_reclaim();
+    hal_irq_restore(flags);
 
-            uint16_t len = rx_descs[next].length;
-            if ((rx_descs[next].status & E1000_RXD_STAT_EOP) && len > 0) {
-                net_rx_callback(rx_buffers[next], len);
+    while (done < budget && rx_ready()) {
+        uint32_t next = (rx_tail + 1) % rx_ndesc;
+        uint16_t len = rx_descs[next].length;
+        uint8_t status = rx_descs[next].status;
+        uint8_t csum = 0;
+
+        /* Checksums the hardware checked: drop the frame on a bad one,
+           otherwise the stack needn't check it again */
+        if (!(status & E1000_RXD_STAT_IXSM)) {
+            if (rx_descs[next].errors &
+                (E1000_RXD_ERR_IPE | E1000_RXD_ERR_TCPE)) {
+                net_stats.rx_csum_errors++;
+                status = 0;
             }
+            if (status & E1000_RXD_STAT_IPCS)  csum |= SKB_CSUM_IP;
+            if (status & E1000_RXD_STAT_TCPCS) csum |= SKB_CSUM_L4;
+        }
 
-            /* Reset descriptor and advance tail */
-            rx_descs[next].status = 0;
-            rx_tail = next;
-            e1000_write(E1000_RDT, rx_tail);
+        if ((status & E1000_RXD_STAT_EOP) && len > 0 &&
+            len <= E1000_RX_BUF_SIZE) {
+            /* Swap in a fresh buffer and pass the full one up. With
+               the pool empty the frame is dropped and its buffer
+               reused, so the ring never runs dry. */
+            sk_buff_t *fresh = skb_alloc(0);
+            if (fresh) {
+                sk_buff_t *skb = rx_skbs[next];
+                rx_skbs[next] = fresh;
+                rx_descs[next].addr = (uint64_t)fresh->phys;
+                skb->len = len;
+                skb->csum = csum;
+                net_rx(skb);
+            } else {
+                net_stats.rx_nobuf++;
+            }
         }
+
+        /* Reset descriptor and advance tail */
+        rx_descs[next].status = 0;
+        rx_tail = next;
+        done++;
     }
+
+    /* Hand the round's descriptors back to the hardware in one write */
+    if (done)
+        e1000_write(E1000_RDT, rx_tail);
+
+    if (done < budget) {
+        /* Ring empty: interrupts back on. A frame that landed after the
+           last check would raise no interrupt, so look once more. */
+        rx_polling = 0;
+        e1000_write(E1000_IMS, E1000_RX_INTS);
+        if (rx_ready()) {
+            rx_polling = 1;
+            e1000_write(E1000_IMC, E1000_RX_INTS);
+            return budget;
+        }
+    }
+    return done;
 }
 
 /* ------------------------------------------------------------------ */
 /*  Public API: send                                                  */
 /* ------------------------------------------------------------------ */
 
-int e1000_send(const void *data, uint16_t len) {
-    if (len == 0 || len > E1000_RX_BUF_SIZE) return -1;
+/* Free the frames the hardware has finished with, oldest first
+   (interrupts off). Every descriptor asks for status (RS), so DD
+   comes back in order. */
+static void tx_reclaim(void) {
+    while (tx_clean != tx_tail &&
+           (tx_descs[tx_clean].status & E1000_TXD_STAT_DD)) {
+        skb_free(tx_skbs[tx_clean]);
+        tx_skbs[tx_clean] = (sk_buff_t *)0;
+        tx_clean = (tx_clean + 1) % tx_ndesc;
+    }
+}
+
+static void tx_doorbell(void) {
+    if (!tx_pending) return;
+    e1000_write(E1000_TDT, tx_tail);
+    tx_pending = 0;
+    net_stats.tx_doorbells++;
+}
+
+/* Take the slot at tx_tail for skb (NULL for a context descriptor)
+   and advance. The caller checked there is room. */
+static uint32_t tx_take_slot(sk_buff_t *skb) {
+    uint32_t slot = tx_tail;
+    tx_skbs[slot] = skb;
+    tx_tail = (tx_tail + 1) % tx_ndesc;
+    tx_pending++;
+    return slot;
+}
+
+static uint32_t tx_free_slots(void) {
+    return tx_ndesc - 1 - (tx_tail + tx_ndesc - tx_clean) % tx_ndesc;
+}
+
+/* Point the hardware at skb's checksum fields. Offsets are from the
+   start of the frame; the IP header follows the Ethernet one. */
+static void tx_load_context(uint8_t tucss, uint8_t tucso) {
+    e1000_tx_ctx_desc_t *ctx =
+        (e1000_tx_ctx_desc_t *)&tx_descs[tx_take_slot((sk_buff_t *)0)];
+
+    ctx->ipcss   = ETH_HDR_LEN;
+    ctx->ipcso   = ETH_HDR_LEN + 10;
+    ctx->ipcse   = ETH_HDR_LEN + 20 - 1;
+    ctx->tucss   = tucss;
+    ctx->tucso   = tucso;
+    ctx->tucse   = 0;
+    ctx->cmd_len = E1000_TXD_DTYP_C | E1000_TXD_DCMD_DEXT |
+                   E1000_TXD_DCMD_RS | E1000_TXD_TUCMD_IP |
+                   (tucso - tucss == 16 ? E1000_TXD_TUCMD_TCP : 0);
+    ctx->status  = 0;
+    ctx->hdrlen  = 0;
+    ctx->mss     = 0;
+
+    tx_ctx_tucss = tucss;
+    tx_ctx_tucso = tucso;
+}
+
+int e1000_send_skb(sk_buff_t *skb) {
+    if (skb->len == 0 || skb->len > E1000_RX_BUF_SIZE) {
+        skb_free(skb);
+        return -1;
+    }
+
+    /* Checksum offsets within the frame; a new context costs a slot */
+    uint8_t tucss = 0, tucso = 0;
+    int new_ctx = 0;
+    if (skb->csum & SKB_CSUM_L4) {
+        tucss = (uint8_t)(skb->csum_start - (skb->data - skb->head));
+        tucso = (uint8_t)(tucss + skb->csum_offset);
+        new_ctx = tucss != tx_ctx_tucss || tucso != tx_ctx_tucso;
+    } else if (skb->csum) {
+        /* IP header only: any context will do */
+        tucss = tucso = ETH_HDR_LEN + 20;
+        new_ctx = !tx_ctx_tucss;
+    }
 
     uint32_t flags = hal_irq_save();
 
-    /* Wait for previous descriptor at this slot to finish */
-    if (!(tx_descs[tx_tail].status & E1000_TXD_STAT_DD)) {
+    /* Need a slot for the frame, and one for a new context */
+    tx_reclaim();
+    if (tx_free_slots() < 1u + new_ctx) {
+        tx_doorbell();          /* let the hardware drain what's queued */
+        net_stats.tx_ring_full++;
         hal_irq_restore(flags);
+        skb_free(skb);
         return -1;  /* ring full */
     }
 
-    /* Copy data into the static TX buffer */
-    memcpy(tx_buffers[tx_tail], data, len);
-
-    /* Set up the descriptor */
-    tx_descs[tx_tail].addr   = (uint64_t)virt_to_phys((uint32_t)tx_buffers[tx_tail]);
-    tx_descs[tx_tail].length = len;
-    tx_descs[tx_tail].cmd    = E1000_TXD_CMD_EOP | E1000_TXD_CMD_IFCS |
-                               E1000_TXD_CMD_RS;
-    tx_descs[tx_tail].status = 0;
+    if (skb->csum) {
+        if (new_ctx)
+            tx_load_context(tucss, tucso);
+
+        /* Extended descriptor: DMA straight from the packet buffer,
+           the hardware filling in the checksums */
+        e1000_tx_data_desc_t *d =
+            (e1000_tx_data_desc_t *)&tx_descs[tx_take_slot(skb)];
+        d->addr    = (uint64_t)skb_data_phys(skb);
+        d->cmd_len = skb->len | E1000_TXD_DTYP_D | E1000_TXD_DCMD_DEXT |
+                     E1000_TXD_DCMD_EOP | E1000_TXD_DCMD_IFCS |
+                     E1000_TXD_DCMD_RS;
+        d->status  = 0;
+        d->popts   = ((skb->csum & SKB_CSUM_IP) ? E1000_TXD_POPTS_IXSM : 0) |
+                     ((skb->csum & SKB_CSUM_L4) ? E1000_TXD_POPTS_TXSM : 0);
+        d->special = 0;
+    } else {
+        /* Legacy descriptor: DMA straight from the packet buffer */
+        e1000_tx_desc_t *d = &tx_descs[tx_take_slot(skb)];
+        d->addr   = (uint64_t)skb_data_phys(skb);
+        d->length = skb->len;
+        d->cmd    = E1000_TXD_CMD_EOP | E1000_TXD_CMD_IFCS |
+                    E1000_TXD_CMD_RS;
+        d->status = 0;
+    }
+    net_stats.tx_packets++;
+    net_stats.tx_bytes += skb->len;
 
-    /* Advance tail — tells hardware there's a new packet */
-    tx_tail = (tx_tail + 1) % E1000_NUM_TX_DESC;
-    e1000_write(E1000_TDT, tx_tail);
+    /* Advance TDT — tells hardware there's a new packet. A burst
+       leaves that to e1000_tx_flush(), unless it has queued a batch. */
+    if (!net_tx_held() || tx_pending >= tx_batch)
+        tx_doorbell();
 
     hal_irq_restore(flags);
     return 0;
 }
 
+void e1000_tx_flush(void) {
+    uint32_t flags = hal_irq_save();
+    tx_doorbell();
+    hal_irq_restore(flags);
+}
+
+int e1000_send(const void *data, uint16_t len) {
+    if (len == 0 || len > E1000_RX_BUF_SIZE) return -1;
+
+    sk_buff_t *skb = skb_alloc(0);
+    if (!skb) return -1;
+    memcpy(skb_put(skb, len), data, len);
+    net_stats.tx_copies++;
+    return e1000_send_skb(skb);
+}
+
 void e1000_get_mac(uint8_t *out) {
     memcpy(out, mac_addr, 6);
 }
@@ -326,16 +589,31 @@ int e1000_init(void) {
     read_mac_address();
 
     /* Initialize TX and RX descriptor rings */
-    tx_init();
-    rx_init();
+    tx_ndesc = ring_size("e1000.txdesc", E1000_TX_DESC_DEFAULT);
+    rx_ndesc = ring_size("e1000.rxdesc", E1000_RX_DESC_DEFAULT);
+    if (tx_init() != 0 || rx_init() != 0) {
+        printf("[e1000] out of memory for %u/%u descriptor rings\n",
+               rx_ndesc, tx_ndesc);
+        return -1;
+    }
+
+    /* Interrupt moderation: throughput unless asked otherwise */
+    char itr[16];
+    if (cmdline_value("e1000.itr", itr, sizeof(itr)) == 0 &&
+        strcmp(itr, "latency") == 0)
+        e1000_set_moderation(NIC_MOD_LATENCY);
+    else
+        e1000_set_moderation(NIC_MOD_THROUGHPUT);
 
-    /* Clear any pending interrupts */
+    /* Clear any pending interrupts, and the statistics counters */
     e1000_read(E1000_ICR);
+    e1000_read(E1000_MPC);
+    e1000_read(E1000_RNBC);
+    e1000_read(E1000_CRCERRS);
 
     /* Enable interrupts we care about */
-    e1000_write(E1000_IMS,
-                E1000_ICR_RXT0 | E1000_ICR_LSC |
-                E1000_ICR_RXDMT0 | E1000_ICR_RXO);
+    rx_polling = 0;
+    e1000_write(E1000_IMS, E1000_RX_INTS | E1000_ICR_LSC);
 
     /* Install IRQ handler — the e1000 in QEMU typically uses IRQ 11,
        but we read it from PCI config to be safe */
@@ -347,8 +625,16 @@ int e1000_init(void) {
     e1000_nic.link_up = (status & 0x2) ? 1 : 0;
 
     /* Populate NIC abstraction */
+    e1000_nic.name = "e1000";
     memcpy(e1000_nic.mac, mac_addr, 6);
     e1000_nic.send = e1000_send;
+    e1000_nic.send_skb = e1000_send_skb;
+    e1000_nic.tx_flush = e1000_tx_flush;
+    e1000_nic.update_stats = e1000_update_stats;
+    e1000_nic.rx_ring = rx_ndesc;
+    e1000_nic.tx_ring = tx_ndesc;
+    e1000_nic.features = NIC_F_TX_CSUM | NIC_F_TX_IP_CSUM | NIC_F_RX_CSUM;
+    e1000_nic.poll = e1000_poll;
     nic = &e1000_nic;
 
 #ifdef VERBOSE_BOOT
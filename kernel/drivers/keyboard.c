@@ -65,6 +65,14 @@ key_event_t keyboard_get_event_blocking(void) {
     }
 }
 
+int keyboard_has_event(void) {
+    return kbd_head != kbd_tail;
+}
+
+wait_queue_t *keyboard_wait_queue(void) {
+    return &keyboard_wq;
+}
+
 int keyboard_shift_held(void) {
     return shift_held;
 }
@@ -1,9 +1,14 @@
 #include <kernel/timer.h>
 #include <kernel/scheduler.h>
 #include <kernel/tty.h>
+#include <kernel/hal.h>
 
+#define PIT_FREQ      1193182u
+#define PIT_NS_PER_CLK 838u     /* 1e9 / 1193182, rounded */
 
 static volatile uint32_t g_ticks = 0;
+static uint32_t pit_divisor = 0;
+static uint32_t usecs_per_tick = 0;
 
 static void timer_irq(trapframe* r) {
     (void)r;
@@ -21,13 +26,89 @@ uint32_t timer_ticks(void) {
 
 }
 
+uint32_t timer_usecs(void) {
+    static uint32_t last_us = 0;
+
+    if (!pit_divisor) return 0;
+
+    uint32_t flags = hal_irq_save();
+
+    /* Latch channel 0 and read the live down-counter */
+    outb(0x43, 0x00);
+    uint32_t count = inb(0x40);
+    count |= (uint32_t)inb(0x40) << 8;
+
+    /* If the counter reloaded but IRQ0 is still pending in the PIC,
+       g_ticks is one period behind the counter. */
+    uint32_t ticks = g_ticks;
+    outb(0x20, 0x0A);               /* OCW3: read IRR */
+    if ((inb(0x20) & 0x01) && count > pit_divisor / 2)
+        ticks++;
+
+    uint32_t elapsed = pit_divisor - count;
+    uint32_t us = ticks * usecs_per_tick + elapsed * PIT_NS_PER_CLK / 1000;
+
+    /* Never run backwards, even if the pending-IRQ guess was wrong */
+    if ((int32_t)(us - last_us) < 0)
+        us = last_us;
+    last_us = us;
+
+    hal_irq_restore(flags);
+    return us;
+}
+
+/* ------------------------------------------------------------------ */
+/*  TSC (usable before timer_init, e.g. to time early boot work)      */
+/* ------------------------------------------------------------------ */
+
+static uint32_t tsc_per_us = 0;
+
+uint64_t timer_cycles(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Count TSC cycles across a 10 ms one-shot on PIT channel 2. Channel 2
+   is gated through port 0x61 and leaves channel 0 (IRQ0) alone. */
+static void tsc_calibrate(void) {
+    uint8_t gate = inb(0x61);
+    outb(0x61, (gate & ~0x02) | 0x01);   /* gate on, speaker off */
+
+    uint32_t count = PIT_FREQ / 100;
+    outb(0x43, 0xB0);                    /* ch2, lobyte/hibyte, mode 0 */
+    outb(0x42, (uint8_t)(count & 0xFF));
+    outb(0x42, (uint8_t)((count >> 8) & 0xFF));
+
+    uint64_t start = timer_cycles();
+    while (!(inb(0x61) & 0x20))          /* OUT2 goes high at terminal count */
+        ;
+    uint64_t cycles = timer_cycles() - start;
+
+    outb(0x61, gate);
+
+    tsc_per_us = (uint32_t)(cycles / 10000);
+    if (tsc_per_us == 0)
+        tsc_per_us = 1;
+}
+
+uint32_t timer_cycles_to_us(uint64_t cycles) {
+    if (!tsc_per_us)
+        tsc_calibrate();
+    return (uint32_t)(cycles / tsc_per_us);
+}
+
 void timer_init(uint32_t hz) {
     irq_install_handler(0, timer_irq);
 
-    // PIT: channel 0, lobyte/hibyte, mode 3 (square wave), binary
-    uint32_t divisor = 1193182u / hz;
+    // PIT: channel 0, lobyte/hibyte, mode 2 (rate generator), binary.
+    // Mode 2 counts down by one per clock, so timer_usecs() can read
+    // sub-tick time straight off the counter.
+    uint32_t divisor = PIT_FREQ / hz;
+    pit_divisor = divisor;
+    usecs_per_tick = 1000000u / hz;
 
-    outb(0x43, 0x36);
+    outb(0x43, 0x34);
     outb(0x40, (uint8_t)(divisor & 0xFF));
     outb(0x40, (uint8_t)((divisor >> 8) & 0xFF));
-}
\ No newline at end of file
+}
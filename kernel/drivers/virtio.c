@@ -1,12 +1,14 @@
 /*
  * VirtIO transport layer for SpikeOS.
  *
- * Implements virtqueue allocation, descriptor management, and
- * the available/used ring protocol. Used by device-specific drivers
- * (virtio_gpu.c, etc.).
+ * Implements virtqueue allocation, descriptor management, the
+ * available/used ring protocol, and mapping of the modern PCI
+ * transport's capabilities. Used by device-specific drivers
+ * (virtio_gpu.c, virtio_net.c).
  */
 
 #include <kernel/virtio.h>
+#include <kernel/pci.h>
 #include <kernel/paging.h>
 #include <kernel/heap.h>
 #include <string.h>
@@ -20,7 +22,8 @@
  *   [used ring]         6 + size * 8 bytes  (flags, idx, ring[size])
  *
  * All three structures must be in guest-physical memory accessible by
- * the device via DMA.
+ * the device via DMA. The device's DMA is cache-coherent, so the rings
+ * are reached through the physmap like any other RAM.
  */
 
 int virtq_init(virtq_t *vq, uint16_t size) {
@@ -42,12 +45,7 @@ int virtq_init(virtq_t *vq, uint16_t size) {
     uint32_t phys = alloc_frames_contiguous(num_pages, 1);
     if (phys == FRAME_ALLOC_FAIL) return -1;
 
-    /* Map into kernel VA so we can access it */
-    uint32_t virt;
-    if (map_mmio_region(phys, total, &virt) != 0) {
-        free_frames_contiguous(phys, num_pages);
-        return -1;
-    }
+    uint32_t virt = (uint32_t)phys_to_virt(phys);
 
     /* Zero everything */
     memset((void *)virt, 0, total);
@@ -128,3 +126,50 @@ uint16_t virtq_pop_used(virtq_t *vq, uint32_t *len_out) {
     vq->last_used++;
     return (uint16_t)id;
 }
+
+/* ------------------------------------------------------------------ */
+/*  Modern PCI transport                                              */
+/* ------------------------------------------------------------------ */
+
+int virtio_pci_map_caps(pci_device_t *dev, virtio_pci_t *vp) {
+    memset(vp, 0, sizeof(*vp));
+
+    for (int i = 0; i < dev->cap_count; i++) {
+        if (dev->caps[i].id != PCI_CAP_ID_VENDOR) continue;
+
+        uint8_t off = dev->caps[i].offset;
+        uint8_t cfg_type = pci_config_read8(dev->bus, dev->slot, dev->func, off + 3);
+        uint8_t bar_idx  = pci_config_read8(dev->bus, dev->slot, dev->func, off + 4);
+        uint32_t bar_off = pci_config_read32(dev->bus, dev->slot, dev->func, off + 8);
+        uint32_t bar_len = pci_config_read32(dev->bus, dev->slot, dev->func, off + 12);
+
+        /* Only the first structure of each type is used */
+        volatile uint8_t **slot;
+        switch (cfg_type) {
+        case VIRTIO_PCI_CAP_COMMON_CFG: slot = &vp->common; break;
+        case VIRTIO_PCI_CAP_NOTIFY_CFG: slot = &vp->notify; break;
+        case VIRTIO_PCI_CAP_ISR_CFG:    slot = &vp->isr;    break;
+        case VIRTIO_PCI_CAP_DEVICE_CFG: slot = &vp->device; break;
+        default: continue;
+        }
+        if (*slot) continue;
+
+        uint32_t bar_phys = pci_bar_addr(dev, bar_idx);
+        uint32_t virt;
+        if (bar_phys == 0 || bar_len == 0 ||
+            map_mmio_region(bar_phys + bar_off, bar_len, &virt) != 0)
+            continue;
+
+        *slot = (volatile uint8_t *)virt;
+        if (cfg_type == VIRTIO_PCI_CAP_NOTIFY_CFG)
+            vp->notify_off_multiplier =
+                pci_config_read32(dev->bus, dev->slot, dev->func, off + 16);
+    }
+
+    return (vp->common && vp->notify && vp->isr) ? 0 : -1;
+}
+
+void virtio_pci_notify(virtio_pci_t *vp, virtq_t *vq, uint16_t index) {
+    uint32_t off = (uint32_t)vq->notify_off * vp->notify_off_multiplier;
+    *(volatile uint16_t *)(vp->notify + off) = index;
+}
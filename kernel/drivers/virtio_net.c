@@ -0,0 +1,532 @@
+/*
+ * VirtIO network driver for SpikeOS.
+ *
+ * Drives QEMU's `-device virtio-net-pci` through the modern PCI
+ * transport (virtio.c), behind the same nic_t as the e1000. A
+ * paravirtual NIC costs one notification per batch of frames instead
+ * of the e1000's register traps per frame.
+ *
+ * Queue 0 receives, queue 1 transmits. Every RX descriptor is a whole
+ * 2 KB packet buffer (skb.h) the device writes the virtio-net header
+ * and frame into (VIRTIO_NET_F_MRG_RXBUF, so the header needn't have
+ * a descriptor of its own); TX pushes the header into the frame's
+ * headroom and hands the buffer over as one descriptor. Both ways the
+ * buffers go up and down the stack without copying.
+ *
+ * With VIRTIO_F_RING_EVENT_IDX the driver is only interrupted when it
+ * asks to be (RX, once a poll round has emptied the queue; never for
+ * TX, whose buffers are reclaimed on the next send or poll), and only
+ * notifies the device when the device asks to be told. RX is
+ * NAPI-style like the e1000's: the IRQ handler turns RX interrupts off
+ * and schedules the net RX thread, which calls virtio_net_poll().
+ *
+ * TCP/UDP checksums are offloaded both ways (VIRTIO_NET_F_CSUM and
+ * VIRTIO_NET_F_GUEST_CSUM); the IPv4 header checksum stays in software.
+ */
+
+#include <kernel/virtio.h>
+#include <kernel/virtio_net.h>
+#include <kernel/e1000.h>
+#include <kernel/pci.h>
+#include <kernel/paging.h>
+#include <kernel/heap.h>
+#include <kernel/hal.h>
+#include <kernel/isr.h>
+#include <kernel/pic.h>
+#include <kernel/skb.h>
+#include <kernel/net.h>
+#include <stdio.h>
+#include <string.h>
+
+/* ------------------------------------------------------------------ */
+/*  Internal state                                                    */
+/* ------------------------------------------------------------------ */
+
+static virtio_pci_t vp;
+static virtq_t rxq, txq;
+
+/* Packet buffers the device holds, by descriptor index */
+static sk_buff_t **rx_skbs;
+static sk_buff_t **tx_skbs;
+
+/* Available index each queue's device was last told about */
+static uint16_t rx_kicked, tx_kicked;
+
+/* Frames queued since the TX queue was last kicked. A burst kicks
+   early once this reaches tx_batch, as the e1000 rings its doorbell. */
+#define VIRTIO_NET_TX_BATCH  32
+static uint32_t tx_pending;
+static uint32_t tx_batch;
+
+static uint32_t features;       /* negotiated, word 0 */
+static int event_idx;           /* VIRTIO_F_RING_EVENT_IDX negotiated */
+
+static volatile int rx_polling; /* RX interrupts off, poll owns the queue */
+
+static nic_t vnet_nic;
+
+#define HAS(f)  (features & (1u << (f)))
+
+/* ------------------------------------------------------------------ */
+/*  Helpers                                                           */
+/* ------------------------------------------------------------------ */
+
+static inline void cfg_write8(uint32_t off, uint8_t val) {
+    vp.common[off] = val;
+}
+static inline void cfg_write16(uint32_t off, uint16_t val) {
+    *(volatile uint16_t *)(vp.common + off) = val;
+}
+static inline void cfg_write32(uint32_t off, uint32_t val) {
+    *(volatile uint32_t *)(vp.common + off) = val;
+}
+static inline uint8_t cfg_read8(uint32_t off) {
+    return vp.common[off];
+}
+static inline uint16_t cfg_read16(uint32_t off) {
+    return *(volatile uint16_t *)(vp.common + off);
+}
+static inline uint32_t cfg_read32(uint32_t off) {
+    return *(volatile uint32_t *)(vp.common + off);
+}
+
+/* Full barrier: our ring index store must be visible before we read
+   the event index the device wrote (and the other way round) */
+static inline void mb(void) {
+    __asm__ volatile("lock; addl $0, (%%esp)" ::: "memory", "cc");
+}
+
+/* Notify the device of a queue's new buffers, unless it said it
+   doesn't need telling. Returns 1 if it was notified. */
+static int queue_kick(virtq_t *vq, uint16_t index, uint16_t *kicked) {
+    uint16_t new_idx = vq->avail->idx;
+    if (new_idx == *kicked) return 0;
+
+    mb();
+    int need = event_idx ?
+        virtq_need_event(*virtq_avail_event(vq), new_idx, *kicked) :
+        !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    *kicked = new_idx;
+
+    if (need)
+        virtio_pci_notify(&vp, vq, index);
+    return need;
+}
+
+static void link_update(void) {
+    vnet_nic.link_up = 1;
+    if (HAS(VIRTIO_NET_F_STATUS) && vp.device)
+        vnet_nic.link_up = (*(volatile uint16_t *)
+                            (vp.device + VIRTIO_NET_CFG_STATUS) &
+                            VIRTIO_NET_S_LINK_UP) ? 1 : 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  RX interrupts                                                     */
+/* ------------------------------------------------------------------ */
+
+/* An event index behind last_used is never crossed again (until the
+   16-bit index wraps), so it keeps the device quiet */
+static void rx_irq_off(void) {
+    if (event_idx)
+        *virtq_used_event(&rxq) = (uint16_t)(rxq.last_used - 1);
+    else
+        rxq.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+}
+
+static void rx_irq_on(void) {
+    if (event_idx)
+        *virtq_used_event(&rxq) = rxq.last_used;
+    else
+        rxq.avail->flags = 0;
+    mb();
+}
+
+static void virtio_net_irq_handler(trapframe *tf) {
+    (void)tf;
+
+    uint8_t isr = *vp.isr;      /* reading acknowledges the interrupt */
+
+    if (isr & VIRTIO_ISR_CONFIG)
+        link_update();
+
+    /* Turn RX interrupts off and leave the queue to virtio_net_poll()
+       on the RX thread */
+    if ((isr & VIRTIO_ISR_QUEUE) && !rx_polling && virtq_has_used(&rxq)) {
+        rx_polling = 1;
+        rx_irq_off();
+        net_rx_schedule();
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  RX                                                                */
+/* ------------------------------------------------------------------ */
+
+/* Give the device an empty buffer to receive into */
+static void rx_post(sk_buff_t *skb) {
+    uint16_t d = virtq_alloc_desc(&rxq);
+    rxq.desc[d].addr  = (uint64_t)skb->phys;
+    rxq.desc[d].len   = SKB_BUF_SIZE;
+    rxq.desc[d].flags = VIRTQ_DESC_F_WRITE;
+    rx_skbs[d] = skb;
+    virtq_submit(&rxq, d);
+}
+
+static void tx_reclaim(void);
+
+/* Buffers still to skip of a frame too long for one */
+static uint16_t rx_skip;
+
+int virtio_net_poll(int budget) {
+    int done = 0;
+
+    /* Return the buffers of frames sent meanwhile to the pool */
+    uint32_t flags = hal_irq_save();
+    tx_reclaim();
+    hal_irq_restore(flags);
+
+    while (done < budget && virtq_has_used(&rxq)) {
+        uint32_t len;
+        uint16_t d = virtq_pop_used(&rxq, &len);
+        sk_buff_t *skb = rx_skbs[d];
+        rx_skbs[d] = (sk_buff_t *)0;
+        virtq_free_desc(&rxq, d);
+        done++;
+
+        virtio_net_hdr_t *hdr = (virtio_net_hdr_t *)skb->head;
+        int pass = 1;
+        if (rx_skip) {
+            /* The tail of a frame we dropped */
+            rx_skip--;
+            pass = 0;
+        } else if (HAS(VIRTIO_NET_F_MRG_RXBUF) && hdr->num_buffers > 1) {
+            /* Only a frame bigger than a packet buffer spans several,
+               which at our MTU the device never sends; drop it */
+            rx_skip = hdr->num_buffers - 1;
+            pass = 0;
+        } else if (len < sizeof(*hdr) + ETH_HDR_LEN || len > SKB_BUF_SIZE) {
+            pass = 0;
+        }
+
+        /* Swap in a fresh buffer and pass the full one up. With the
+           pool empty the frame is dropped and its buffer reused. */
+        sk_buff_t *fresh = pass ? skb_alloc(0) : (sk_buff_t *)0;
+        if (fresh) {
+            /* A partial checksum came from the host itself, and the
+               device has checked any it marked valid */
+            uint8_t csum = 0;
+            if (hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM |
+                              VIRTIO_NET_HDR_F_DATA_VALID))
+                csum = SKB_CSUM_L4;
+
+            skb->data = skb->head + sizeof(*hdr);
+            skb->len  = (uint16_t)(len - sizeof(*hdr));
+            skb->csum = csum;
+            rx_post(fresh);
+            net_rx(skb);
+        } else {
+            if (pass)
+                net_stats.rx_nobuf++;
+            rx_post(skb);
+        }
+    }
+
+    /* Hand the round's buffers back with at most one notification */
+    if (done)
+        queue_kick(&rxq, VIRTIO_NET_RXQ, &rx_kicked);
+
+    if (done < budget) {
+        /* Queue empty: interrupts back on. A frame that landed after
+           the last check would raise no interrupt, so look once more. */
+        rx_polling = 0;
+        rx_irq_on();
+        if (virtq_has_used(&rxq)) {
+            rx_polling = 1;
+            rx_irq_off();
+            return budget;
+        }
+    }
+    return done;
+}
+
+/* ------------------------------------------------------------------ */
+/*  TX                                                                */
+/* ------------------------------------------------------------------ */
+
+/* Free the frames the device has finished with (interrupts off) */
+static void tx_reclaim(void) {
+    while (virtq_has_used(&txq)) {
+        uint16_t d = virtq_pop_used(&txq, (uint32_t *)0);
+        skb_free(tx_skbs[d]);
+        tx_skbs[d] = (sk_buff_t *)0;
+        virtq_free_desc(&txq, d);
+    }
+
+    /* Keep TX completions from interrupting */
+    if (event_idx)
+        *virtq_used_event(&txq) = (uint16_t)(txq.last_used - 1);
+}
+
+static void tx_kick(void) {
+    if (!tx_pending) return;
+    tx_pending = 0;
+    if (queue_kick(&txq, VIRTIO_NET_TXQ, &tx_kicked))
+        net_stats.tx_doorbells++;
+}
+
+int virtio_net_send_skb(sk_buff_t *skb) {
+    if (skb->len == 0 || skb->len > ETH_FRAME_MAX) {
+        skb_free(skb);
+        return -1;
+    }
+
+    /* The header goes in the headroom, which every frame the stack
+       builds has plenty of */
+    uint16_t frame_len = skb->len;
+    virtio_net_hdr_t *hdr = (virtio_net_hdr_t *)skb_push(skb, sizeof(*hdr));
+    if (!hdr) {
+        skb_free(skb);
+        return -1;
+    }
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+
+    /* The checksum field holds the pseudo-header sum, which is what
+       the device wants to add the rest to */
+    if (skb->csum & SKB_CSUM_L4) {
+        hdr->flags       = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start  = (uint16_t)(skb->csum_start -
+                                      (skb->data - skb->head) - sizeof(*hdr));
+        hdr->csum_offset = skb->csum_offset;
+    }
+
+    uint32_t flags = hal_irq_save();
+
+    tx_reclaim();
+    if (txq.num_free == 0) {
+        tx_kick();              /* let the device drain what's queued */
+        net_stats.tx_ring_full++;
+        hal_irq_restore(flags);
+        skb_free(skb);
+        return -1;  /* queue full */
+    }
+
+    uint16_t d = virtq_alloc_desc(&txq);
+    txq.desc[d].addr  = (uint64_t)skb_data_phys(skb);
+    txq.desc[d].len   = skb->len;
+    txq.desc[d].flags = 0;
+    tx_skbs[d] = skb;
+    virtq_submit(&txq, d);
+    tx_pending++;
+
+    net_stats.tx_packets++;
+    net_stats.tx_bytes += frame_len;
+
+    /* A burst leaves the kick to virtio_net_tx_flush(), unless it has
+       queued a batch */
+    if (!net_tx_held() || tx_pending >= tx_batch)
+        tx_kick();
+
+    hal_irq_restore(flags);
+    return 0;
+}
+
+void virtio_net_tx_flush(void) {
+    uint32_t flags = hal_irq_save();
+    tx_kick();
+    hal_irq_restore(flags);
+}
+
+int virtio_net_send(const void *data, uint16_t len) {
+    if (len == 0 || len > ETH_FRAME_MAX) return -1;
+
+    sk_buff_t *skb = skb_alloc(sizeof(virtio_net_hdr_t));
+    if (!skb) return -1;
+    memcpy(skb_put(skb, len), data, len);
+    net_stats.tx_copies++;
+    return virtio_net_send_skb(skb);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Device initialization (VirtIO 1.1 section 3.1)                    */
+/* ------------------------------------------------------------------ */
+
+static int queue_init(uint16_t index, virtq_t *vq) {
+    cfg_write16(VIRTIO_COMMON_Q_SELECT, index);
+    uint16_t qsize = cfg_read16(VIRTIO_COMMON_Q_SIZE);
+    if (qsize == 0) return -1;
+    if (qsize > VIRTIO_NET_QUEUE_MAX) {
+        qsize = VIRTIO_NET_QUEUE_MAX;
+        cfg_write16(VIRTIO_COMMON_Q_SIZE, qsize);
+    }
+
+    if (virtq_init(vq, qsize) != 0) return -1;
+    vq->notify_off = cfg_read16(VIRTIO_COMMON_Q_NOTIFY_OFF);
+
+    cfg_write32(VIRTIO_COMMON_Q_DESC_LO,  vq->desc_phys);
+    cfg_write32(VIRTIO_COMMON_Q_DESC_HI,  0);
+    cfg_write32(VIRTIO_COMMON_Q_AVAIL_LO, vq->avail_phys);
+    cfg_write32(VIRTIO_COMMON_Q_AVAIL_HI, 0);
+    cfg_write32(VIRTIO_COMMON_Q_USED_LO,  vq->used_phys);
+    cfg_write32(VIRTIO_COMMON_Q_USED_HI,  0);
+
+    /* Legacy INTx, not MSI-X */
+    cfg_write16(VIRTIO_COMMON_Q_MSIX_VEC, VIRTIO_MSI_NO_VECTOR);
+    cfg_write16(VIRTIO_COMMON_Q_ENABLE, 1);
+    return 0;
+}
+
+static int device_init(void) {
+    /* 1. Reset and wait for it to take */
+    cfg_write8(VIRTIO_COMMON_STATUS, 0);
+    for (int i = 0; i < 100000 && cfg_read8(VIRTIO_COMMON_STATUS); i++)
+        ;
+
+    /* 2-3. ACKNOWLEDGE, DRIVER */
+    cfg_write8(VIRTIO_COMMON_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    cfg_write8(VIRTIO_COMMON_STATUS,
+               VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    /* 4. Features: everything we use that the device offers. A
+       modern device (VERSION_1) is required for the 12-byte header. */
+    cfg_write32(VIRTIO_COMMON_DFSELECT, 0);
+    uint32_t dev_lo = cfg_read32(VIRTIO_COMMON_DF);
+    cfg_write32(VIRTIO_COMMON_DFSELECT, 1);
+    uint32_t dev_hi = cfg_read32(VIRTIO_COMMON_DF);
+    if (!(dev_hi & (1u << (VIRTIO_F_VERSION_1 - 32)))) {
+        printf("[virtio-net] legacy-only device, not supported\n");
+        cfg_write8(VIRTIO_COMMON_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+
+    features = dev_lo & ((1u << VIRTIO_NET_F_CSUM) |
+                         (1u << VIRTIO_NET_F_GUEST_CSUM) |
+                         (1u << VIRTIO_NET_F_MAC) |
+                         (1u << VIRTIO_NET_F_MRG_RXBUF) |
+                         (1u << VIRTIO_NET_F_STATUS) |
+                         (1u << VIRTIO_F_RING_EVENT_IDX));
+    event_idx = HAS(VIRTIO_F_RING_EVENT_IDX) ? 1 : 0;
+    cfg_write32(VIRTIO_COMMON_GFSELECT, 0);
+    cfg_write32(VIRTIO_COMMON_GF, features);
+    cfg_write32(VIRTIO_COMMON_GFSELECT, 1);
+    cfg_write32(VIRTIO_COMMON_GF, 1u << (VIRTIO_F_VERSION_1 - 32));
+
+    /* 5-6. FEATURES_OK, and check the device kept it */
+    uint8_t status = cfg_read8(VIRTIO_COMMON_STATUS);
+    cfg_write8(VIRTIO_COMMON_STATUS, status | VIRTIO_STATUS_FEATURES_OK);
+    if (!(cfg_read8(VIRTIO_COMMON_STATUS) & VIRTIO_STATUS_FEATURES_OK)) {
+        printf("[virtio-net] features negotiation failed\n");
+        cfg_write8(VIRTIO_COMMON_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+
+    /* 7. Queues */
+    cfg_write16(VIRTIO_COMMON_MSIX_CFG, VIRTIO_MSI_NO_VECTOR);
+    if (queue_init(VIRTIO_NET_RXQ, &rxq) != 0 ||
+        queue_init(VIRTIO_NET_TXQ, &txq) != 0) {
+        printf("[virtio-net] failed to set up virtqueues\n");
+        cfg_write8(VIRTIO_COMMON_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Public API                                                        */
+/* ------------------------------------------------------------------ */
+
+int virtio_net_init(void) {
+    pci_device_t *dev = pci_find_device(VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEV_NET);
+    if (!dev)
+        dev = pci_find_device(VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEV_NET_MODERN);
+    if (!dev) {
+#ifdef VERBOSE_BOOT
+        printf("[virtio-net] no device found\n");
+#endif
+        return -1;
+    }
+
+#ifdef VERBOSE_BOOT
+    printf("[virtio-net] found %04x:%04x at %02x:%02x.%x IRQ=%d\n",
+           dev->vendor_id, dev->device_id,
+           dev->bus, dev->slot, dev->func, dev->irq_line);
+#endif
+
+    pci_enable_bus_master(dev);
+
+    if (virtio_pci_map_caps(dev, &vp) != 0) {
+        printf("[virtio-net] no modern PCI capabilities\n");
+        return -1;
+    }
+    if (device_init() != 0)
+        return -1;
+
+    rx_skbs = (sk_buff_t **)kcalloc(rxq.size, sizeof(sk_buff_t *));
+    tx_skbs = (sk_buff_t **)kcalloc(txq.size, sizeof(sk_buff_t *));
+    if (!rx_skbs || !tx_skbs || skb_grow(rxq.size) != 0) {
+        printf("[virtio-net] out of memory for %u/%u buffers\n",
+               rxq.size, txq.size);
+        cfg_write8(VIRTIO_COMMON_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+
+    /* Fill the RX queue; the pool was grown by as many buffers */
+    for (uint16_t i = 0; i < rxq.size; i++) {
+        sk_buff_t *skb = skb_alloc(0);
+        if (!skb) break;
+        rx_post(skb);
+    }
+    rx_kicked = tx_kicked = 0;
+    tx_pending = 0;
+    tx_batch = txq.size / 2 < VIRTIO_NET_TX_BATCH ?
+               txq.size / 2 : VIRTIO_NET_TX_BATCH;
+
+    /* Interrupts for received frames only */
+    rx_polling = 0;
+    rx_irq_on();
+    if (event_idx)
+        *virtq_used_event(&txq) = (uint16_t)(txq.last_used - 1);
+    else
+        txq.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+
+    /* MAC from the device, or a fixed locally administered one */
+    static const uint8_t fallback_mac[6] = {0x02, 0x53, 0x50, 0x4B, 0x00, 0x01};
+    for (int i = 0; i < 6; i++)
+        vnet_nic.mac[i] = (HAS(VIRTIO_NET_F_MAC) && vp.device) ?
+                          vp.device[VIRTIO_NET_CFG_MAC + i] : fallback_mac[i];
+    link_update();
+
+    /* 8. DRIVER_OK — device is live, then tell it about the buffers */
+    uint8_t status = cfg_read8(VIRTIO_COMMON_STATUS);
+    cfg_write8(VIRTIO_COMMON_STATUS, status | VIRTIO_STATUS_DRIVER_OK);
+    queue_kick(&rxq, VIRTIO_NET_RXQ, &rx_kicked);
+
+    (void)*vp.isr;              /* clear anything pending */
+    irq_install_handler(dev->irq_line, virtio_net_irq_handler);
+    pic_clear_mask(dev->irq_line);
+
+    /* Populate NIC abstraction */
+    vnet_nic.name = "virtio-net";
+    vnet_nic.send = virtio_net_send;
+    vnet_nic.send_skb = virtio_net_send_skb;
+    vnet_nic.tx_flush = virtio_net_tx_flush;
+    vnet_nic.update_stats = (void (*)(void))0;
+    vnet_nic.rx_ring = rxq.size;
+    vnet_nic.tx_ring = txq.size;
+    vnet_nic.moderation = NIC_MOD_LATENCY;
+    vnet_nic.features = (HAS(VIRTIO_NET_F_CSUM) ? NIC_F_TX_CSUM : 0) |
+                        (HAS(VIRTIO_NET_F_GUEST_CSUM) ? NIC_F_RX_CSUM : 0);
+    vnet_nic.poll = virtio_net_poll;
+    nic = &vnet_nic;
+
+#ifdef VERBOSE_BOOT
+    printf("[virtio-net] MAC=%02x:%02x:%02x:%02x:%02x:%02x link=%s "
+           "queues=%u/%u features=%x\n",
+           vnet_nic.mac[0], vnet_nic.mac[1], vnet_nic.mac[2],
+           vnet_nic.mac[3], vnet_nic.mac[4], vnet_nic.mac[5],
+           vnet_nic.link_up ? "UP" : "DOWN", rxq.size, txq.size, features);
+#endif
+
+    return 0;
+}
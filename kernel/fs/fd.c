@@ -2,9 +2,13 @@
 #include <kernel/vfs.h>
 #include <kernel/process.h>
 #include <kernel/pipe.h>
+#include <kernel/poll.h>
+#include <kernel/paging.h>
 #include <kernel/tty.h>
 #include <kernel/keyboard.h>
 #include <kernel/hal.h>
+#include <kernel/heap.h>
+#include <kernel/net.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -12,34 +16,101 @@
 /*  System-wide open file table                                       */
 /* ------------------------------------------------------------------ */
 
-open_file_t open_file_table[MAX_OPEN_FILES];
+#define OPEN_FILE_CHUNKS (MAX_OPEN_FILES / OPEN_FILE_CHUNK)
+
+static open_file_t *of_chunks[OPEN_FILE_CHUNKS];
+static uint32_t     of_nchunks;
+static int          of_free = -1;      /* free list head */
+static int          console_ofi = -1;  /* shared stdin/stdout/stderr */
+
+#define OPEN_FILE(idx) (&of_chunks[(idx) / OPEN_FILE_CHUNK] \
+                                  [(idx) % OPEN_FILE_CHUNK])
+
+/* Add one chunk of free slots. Returns 0, or -1 at the limit / OOM. */
+static int grow_open_files(void) {
+    open_file_t *chunk = (open_file_t *)kcalloc(OPEN_FILE_CHUNK,
+                                                sizeof(open_file_t));
+    if (!chunk) return -1;
+
+    uint32_t flags = hal_irq_save();
+    uint32_t c = of_nchunks;
+    if (c >= OPEN_FILE_CHUNKS) {
+        hal_irq_restore(flags);
+        kfree(chunk);
+        return -1;
+    }
+    of_chunks[c] = chunk;
+    for (int i = OPEN_FILE_CHUNK - 1; i >= 0; i--) {
+        chunk[i].next_free = of_free;
+        of_free = (int)(c * OPEN_FILE_CHUNK) + i;
+    }
+    of_nchunks = c + 1;
+    hal_irq_restore(flags);
+    return 0;
+}
 
 void fd_init(void) {
-    memset(open_file_table, 0, sizeof(open_file_table));
+    memset(of_chunks, 0, sizeof(of_chunks));
+    of_nchunks = 0;
+    of_free = -1;
+
+    /* The console open file is never released: fd.c keeps a reference */
+    console_ofi = alloc_open_file();
+    if (console_ofi >= 0) {
+        OPEN_FILE(console_ofi)->type  = FD_TYPE_CONSOLE;
+        OPEN_FILE(console_ofi)->flags = O_RDWR;
+    }
+}
+
+open_file_t *open_file_get(int idx) {
+    if (idx < 0 || (uint32_t)idx >= of_nchunks * OPEN_FILE_CHUNK)
+        return (open_file_t *)0;
+    return OPEN_FILE(idx);
 }
 
 int alloc_open_file(void) {
-    uint32_t flags = hal_irq_save();
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (open_file_table[i].type == FD_TYPE_NONE) {
-            memset(&open_file_table[i], 0, sizeof(open_file_t));
-            open_file_table[i].refcount = 1;
+    for (;;) {
+        uint32_t flags = hal_irq_save();
+        if (of_free >= 0) {
+            int idx = of_free;
+            open_file_t *of = OPEN_FILE(idx);
+            of_free = of->next_free;
+            memset(of, 0, sizeof(open_file_t));
+            of->refcount = 1;
             hal_irq_restore(flags);
-            return i;
+            return idx;
         }
+        hal_irq_restore(flags);
+
+        if (grow_open_files() != 0) return -1;
     }
+}
+
+void hold_open_file(int idx) {
+    open_file_t *of = open_file_get(idx);
+    if (!of) return;
+
+    uint32_t flags = hal_irq_save();
+    of->refcount++;
     hal_irq_restore(flags);
-    return -1;
 }
 
 void release_open_file(int idx) {
-    if (idx < 0 || idx >= MAX_OPEN_FILES) return;
+    open_file_t *of = open_file_get(idx);
+    if (!of) return;
 
     uint32_t flags = hal_irq_save();
-    open_file_t *of = &open_file_table[idx];
+    if (of->refcount <= 0) {        /* already free */
+        hal_irq_restore(flags);
+        return;
+    }
 
     of->refcount--;
     if (of->refcount <= 0) {
+        /* Drop epoll watches before the queues they hang on go away */
+        if (of->watchers)
+            epoll_forget_file(of);
+
         /* Close pipe endpoints */
         if (of->type == FD_TYPE_PIPE && of->pipe) {
             if (of->flags & O_WRONLY)
@@ -47,62 +118,116 @@ void release_open_file(int idx) {
             else
                 pipe_close_reader(of->pipe);
         }
+        if (of->type == FD_TYPE_EPOLL)
+            epoll_release(of->epoll);
+        if (of->type == FD_TYPE_TCP)
+            tcp_release(of->tcp);
         memset(of, 0, sizeof(open_file_t));
+        of->next_free = of_free;
+        of_free = idx;
     }
     hal_irq_restore(flags);
 }
 
-int alloc_fd(int *fd_table) {
-    for (int i = 0; i < MAX_FDS; i++) {
-        if (fd_table[i] == -1) {
-            return i;
-        }
+/* ------------------------------------------------------------------ */
+/*  Per-process fd table                                              */
+/* ------------------------------------------------------------------ */
+
+static int *fd_slots(fd_table_t *t) {
+    return t->ext ? t->ext : t->inline_fd;
+}
+
+void fd_table_init(fd_table_t *t) {
+    t->ext  = (int *)0;
+    t->size = FD_INLINE;
+    t->hint = 0;
+    for (int i = 0; i < FD_INLINE; i++)
+        t->inline_fd[i] = -1;
+}
+
+/* Double the table (moving it to the heap). Returns 0 or -1. */
+static int fd_table_grow(fd_table_t *t) {
+    if (t->size >= MAX_FDS) return -1;
+
+    uint32_t size = t->size * 2;
+    int *slots = (int *)kmalloc(size * sizeof(int));
+    if (!slots) return -1;
+
+    memcpy(slots, fd_slots(t), t->size * sizeof(int));
+    for (uint32_t i = t->size; i < size; i++)
+        slots[i] = -1;
+
+    kfree(t->ext);
+    t->ext  = slots;
+    t->size = size;
+    return 0;
+}
+
+int fd_install(fd_table_t *t, int ofi) {
+    int *slots = fd_slots(t);
+    uint32_t fd = t->hint;
+    while (fd < t->size && slots[fd] != -1)
+        fd++;
+
+    if (fd == t->size) {
+        if (fd_table_grow(t) != 0) return -1;
+        slots = fd_slots(t);
     }
-    return -1;
+
+    slots[fd] = ofi;
+    t->hint = fd + 1;
+    return (int)fd;
+}
+
+int fd_lookup(fd_table_t *t, int fd) {
+    if (fd < 0 || (uint32_t)fd >= t->size) return -1;
+    return fd_slots(t)[fd];
+}
+
+/* Free fd (the caller drops the open file reference) */
+static void fd_clear(fd_table_t *t, int fd) {
+    fd_slots(t)[fd] = -1;
+    if ((uint32_t)fd < t->hint)
+        t->hint = (uint32_t)fd;
+}
+
+open_file_t *fd_file(int fd) {
+    return open_file_get(fd_lookup(&current_process->fds, fd));
+}
+
+int fd_dup(int fd) {
+    int ofi = fd_lookup(&current_process->fds, fd);
+    if (ofi < 0) return -1;
+
+    int new_fd = fd_install(&current_process->fds, ofi);
+    if (new_fd < 0) return -1;
+    hold_open_file(ofi);
+    return new_fd;
 }
 
 /* ------------------------------------------------------------------ */
 /*  Per-process fd init                                                */
 /* ------------------------------------------------------------------ */
 
-void fd_init_process(int *fd_table) {
-    /* Mark all fds as free */
-    for (int i = 0; i < MAX_FDS; i++) {
-        fd_table[i] = -1;
-    }
-
-    /* Allocate stdin (fd 0) — console, read-only */
-    int of_in = alloc_open_file();
-    if (of_in >= 0) {
-        open_file_table[of_in].type = FD_TYPE_CONSOLE;
-        open_file_table[of_in].flags = O_RDONLY;
-        fd_table[0] = of_in;
-    }
-
-    /* Allocate stdout (fd 1) — console, write-only */
-    int of_out = alloc_open_file();
-    if (of_out >= 0) {
-        open_file_table[of_out].type = FD_TYPE_CONSOLE;
-        open_file_table[of_out].flags = O_WRONLY;
-        fd_table[1] = of_out;
-    }
+void fd_init_process(fd_table_t *t) {
+    fd_close_all(t);
 
-    /* Allocate stderr (fd 2) — console, write-only */
-    int of_err = alloc_open_file();
-    if (of_err >= 0) {
-        open_file_table[of_err].type = FD_TYPE_CONSOLE;
-        open_file_table[of_err].flags = O_WRONLY;
-        fd_table[2] = of_err;
+    /* stdin, stdout, stderr (fds 0-2) all share the console */
+    if (console_ofi < 0) return;
+    for (int i = 0; i < 3; i++) {
+        if (fd_install(t, console_ofi) >= 0)
+            hold_open_file(console_ofi);
     }
 }
 
-void fd_close_all(int *fd_table) {
-    for (int i = 0; i < MAX_FDS; i++) {
-        if (fd_table[i] != -1) {
-            release_open_file(fd_table[i]);
-            fd_table[i] = -1;
-        }
+void fd_close_all(fd_table_t *t) {
+    int *slots = fd_slots(t);
+    for (uint32_t i = 0; i < t->size; i++) {
+        if (slots[i] != -1)
+            release_open_file(slots[i]);
     }
+    kfree(t->ext);
+    fd_table_init(t);
 }
 
 /* ------------------------------------------------------------------ */
@@ -133,54 +258,54 @@ int fd_open(const char *path, uint32_t flags) {
     int ofi = alloc_open_file();
     if (ofi < 0) return -1;
 
-    open_file_table[ofi].type = FD_TYPE_VFS;
-    open_file_table[ofi].flags = flags;
-    open_file_table[ofi].ino = (uint32_t)ino;
-    open_file_table[ofi].offset = 0;
+    open_file_t *of = open_file_get(ofi);
+    of->type = FD_TYPE_VFS;
+    of->flags = flags;
+    of->ino = (uint32_t)ino;
+    of->offset = 0;
 
     /* Truncate if requested */
     if (flags & O_TRUNC) {
-        vfs_inode_t *n = vfs_get_inode((uint32_t)ino);
-        if (n) {
-            n->size = 0;
-        }
+        vfs_truncate((uint32_t)ino, 0);
     }
 
     /* Allocate fd in current process */
-    int fd = alloc_fd(current_process->fds);
+    int fd = fd_install(&current_process->fds, ofi);
     if (fd < 0) {
         release_open_file(ofi);
         return -1;
     }
-
-    current_process->fds[fd] = ofi;
     return fd;
 }
 
 int fd_close(int fd) {
-    if (fd < 0 || fd >= MAX_FDS) return -1;
-    if (current_process->fds[fd] == -1) return -1;
+    int ofi = fd_lookup(&current_process->fds, fd);
+    if (ofi < 0) return -1;
 
-    release_open_file(current_process->fds[fd]);
-    current_process->fds[fd] = -1;
+    fd_clear(&current_process->fds, fd);
+    release_open_file(ofi);
     return 0;
 }
 
-int32_t fd_read(int fd, void *buf, uint32_t count) {
-    if (fd < 0 || fd >= MAX_FDS) return -1;
-    int ofi = current_process->fds[fd];
-    if (ofi < 0) return -1;
-
-    open_file_t *of = &open_file_table[ofi];
-
+/* Read from an open file, failing with -EAGAIN rather than blocking
+   if nonblock is set */
+static int32_t file_read(open_file_t *of, void *buf, uint32_t count,
+                         int nonblock) {
     switch (of->type) {
     case FD_TYPE_CONSOLE: {
-        /* Blocking character-at-a-time read from keyboard */
+        /* Character-at-a-time read from keyboard; blocks unless
+           nonblock */
         uint8_t *out = (uint8_t *)buf;
         uint32_t total = 0;
 
         while (total < count) {
-            key_event_t e = keyboard_get_event_blocking();
+            key_event_t e;
+            if (nonblock) {
+                e = keyboard_get_event();
+                if (e.type == KEY_NONE) return -EAGAIN;
+            } else {
+                e = keyboard_get_event_blocking();
+            }
 
             switch (e.type) {
             case KEY_CHAR:
@@ -210,19 +335,25 @@ int32_t fd_read(int fd, void *buf, uint32_t count) {
 
     case FD_TYPE_PIPE:
         if (!of->pipe) return -1;
-        return pipe_read(of->pipe, buf, count);
+        return pipe_read(of->pipe, buf, count, nonblock);
+
+    case FD_TYPE_TCP:
+        return tcp_read(of->tcp, buf, count, nonblock);
 
     default:
         return -1;
     }
 }
 
-int32_t fd_write(int fd, const void *buf, uint32_t count) {
-    if (fd < 0 || fd >= MAX_FDS) return -1;
-    int ofi = current_process->fds[fd];
-    if (ofi < 0) return -1;
+int32_t fd_read(int fd, void *buf, uint32_t count) {
+    open_file_t *of = fd_file(fd);
+    if (!of) return -1;
+    return file_read(of, buf, count, of->flags & O_NONBLOCK);
+}
 
-    open_file_t *of = &open_file_table[ofi];
+int32_t fd_write(int fd, const void *buf, uint32_t count) {
+    open_file_t *of = fd_file(fd);
+    if (!of) return -1;
 
     switch (of->type) {
     case FD_TYPE_CONSOLE:
@@ -241,7 +372,10 @@ int32_t fd_write(int fd, const void *buf, uint32_t count) {
 
     case FD_TYPE_PIPE:
         if (!of->pipe) return -1;
-        return pipe_write(of->pipe, buf, count);
+        return pipe_write(of->pipe, buf, count, of->flags & O_NONBLOCK);
+
+    case FD_TYPE_TCP:
+        return tcp_write(of->tcp, buf, count, of->flags & O_NONBLOCK);
 
     default:
         return -1;
@@ -249,12 +383,8 @@ int32_t fd_write(int fd, const void *buf, uint32_t count) {
 }
 
 int32_t fd_seek(int fd, int32_t offset, int whence) {
-    if (fd < 0 || fd >= MAX_FDS) return -1;
-    int ofi = current_process->fds[fd];
-    if (ofi < 0) return -1;
-
-    open_file_t *of = &open_file_table[ofi];
-    if (of->type != FD_TYPE_VFS) return -1;
+    open_file_t *of = fd_file(fd);
+    if (!of || of->type != FD_TYPE_VFS) return -1;
 
     vfs_inode_t *node = vfs_get_inode(of->ino);
     if (!node) return -1;
@@ -278,3 +408,158 @@ int32_t fd_seek(int fd, int32_t offset, int whence) {
     of->offset = (uint32_t)new_offset;
     return new_offset;
 }
+
+int32_t fd_fcntl(int fd, int cmd, uint32_t arg) {
+    open_file_t *of = fd_file(fd);
+    if (!of) return -1;
+
+    switch (cmd) {
+    case F_GETFL:
+        return (int32_t)of->flags;
+
+    case F_SETFL:
+        of->flags = (of->flags & ~FD_SETFL_MASK) | (arg & FD_SETFL_MASK);
+        return 0;
+
+    case F_GETPIPE_SZ:
+        if (of->type != FD_TYPE_PIPE || !of->pipe) return -1;
+        return (int32_t)of->pipe->size;
+
+    case F_SETPIPE_SZ:
+        if (of->type != FD_TYPE_PIPE || !of->pipe) return -1;
+        return pipe_set_size(of->pipe, arg);
+
+    default:
+        return -1;
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Vectored and positional I/O                                       */
+/* ------------------------------------------------------------------ */
+
+int32_t fd_readv(int fd, const struct iovec *iov, int iovcnt) {
+    open_file_t *of = fd_file(fd);
+    if (iovcnt < 0 || iovcnt > IOV_MAX || !of) return -1;
+
+    /* Only the first segment may wait: once data has arrived, a later
+       one that would block ends the read instead of holding it back */
+    int32_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) continue;
+        int32_t n = file_read(of, iov[i].iov_base, iov[i].iov_len,
+                              total > 0 || (of->flags & O_NONBLOCK));
+        if (n < 0) return total > 0 ? total : n;
+        total += n;
+        if ((uint32_t)n < iov[i].iov_len) break;
+    }
+    return total;
+}
+
+int32_t fd_writev(int fd, const struct iovec *iov, int iovcnt) {
+    if (iovcnt < 0 || iovcnt > IOV_MAX || !fd_file(fd)) return -1;
+
+    int32_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) continue;
+        int32_t n = fd_write(fd, iov[i].iov_base, iov[i].iov_len);
+        if (n < 0) return total > 0 ? total : n;
+        total += n;
+        if ((uint32_t)n < iov[i].iov_len) break;
+    }
+    return total;
+}
+
+int32_t fd_pread(int fd, void *buf, uint32_t count, uint32_t offset) {
+    open_file_t *of = fd_file(fd);
+    if (!of || of->type != FD_TYPE_VFS) return -1;
+    return vfs_read(of->ino, buf, offset, count);
+}
+
+int32_t fd_pwrite(int fd, const void *buf, uint32_t count, uint32_t offset) {
+    open_file_t *of = fd_file(fd);
+    if (!of || of->type != FD_TYPE_VFS) return -1;
+    return vfs_write(of->ino, buf, offset, count);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Kernel-side copy (sendfile)                                       */
+/* ------------------------------------------------------------------ */
+
+/* Holes in a sparse file are handed to the sink from here */
+static const uint8_t zero_page[VFS_PAGE_SIZE];
+
+int32_t fd_splice_from(int in_fd, uint32_t *offset, uint32_t count,
+                       uint32_t chunk, fd_splice_sink sink, void *ctx) {
+    open_file_t *of = fd_file(in_fd);
+    if (!of || of->type != FD_TYPE_VFS || !sink) return -1;
+
+    uint32_t ino = of->ino;
+    uint32_t pos = offset ? *offset : of->offset;
+    uint32_t total = 0;
+
+    while (total < count) {
+        /* Re-check the size every round: the sink may have slept */
+        vfs_inode_t *node = vfs_get_inode(ino);
+        if (!node || node->type != VFS_TYPE_FILE) break;
+        if (pos >= node->size) break;
+
+        uint32_t want = count - total;
+        if (chunk && want > chunk) want = chunk;
+        if (want > node->size - pos) want = node->size - pos;
+
+        /* (Re)load data dropped by eviction, then pin this chunk's
+           pages; pinning never allocates, so nothing is evicted in
+           between */
+        if (vfs_load_data(ino) != 0) break;
+
+        struct iovec iov[IOV_MAX];
+        uint32_t frames[IOV_MAX];
+        uint32_t len = 0;
+        int n = 0;
+        while (len < want && n < IOV_MAX) {
+            uint32_t at = pos + len;
+            uint32_t pgoff = at % VFS_PAGE_SIZE;
+            uint32_t seg = VFS_PAGE_SIZE - pgoff;
+            if (seg > want - len) seg = want - len;
+
+            frames[n] = vfs_pin_page(ino, at / VFS_PAGE_SIZE);
+            iov[n].iov_base = frames[n]
+                ? (uint8_t *)phys_to_virt(frames[n]) + pgoff
+                : (void *)(zero_page + pgoff);
+            iov[n].iov_len = seg;
+            len += seg;
+            n++;
+        }
+
+        int32_t moved = sink(ctx, iov, n);
+
+        for (int i = 0; i < n; i++) {
+            if (frames[i])
+                free_frame(frames[i]);
+        }
+
+        if (moved < 0) {
+            if (total == 0) return moved;   /* -1 or -EAGAIN */
+            break;
+        }
+        pos += (uint32_t)moved;
+        total += (uint32_t)moved;
+        if ((uint32_t)moved < len) break;
+    }
+
+    if (offset)
+        *offset = pos;
+    else
+        of->offset = pos;
+    return (int32_t)total;
+}
+
+static int32_t fd_sink(void *ctx, const struct iovec *iov, int iovcnt) {
+    return fd_writev(*(int *)ctx, iov, iovcnt);
+}
+
+int32_t fd_sendfile(int out_fd, int in_fd, uint32_t *offset, uint32_t count) {
+    if (!fd_file(out_fd)) return -1;
+    return fd_splice_from(in_fd, offset, count, 0, fd_sink, &out_fd);
+}
@@ -3,6 +3,7 @@
 #include <kernel/process.h>
 #include <kernel/signal.h>
 #include <kernel/hal.h>
+#include <kernel/paging.h>
 #include <string.h>
 
 /* ------------------------------------------------------------------ */
@@ -15,18 +16,78 @@ void pipe_init(void) {
     memset(pipe_pool, 0, sizeof(pipe_pool));
 }
 
+/* Bytes -> pages, rounded up to a power of two (at least one page) */
+static uint32_t ring_pages(uint32_t size) {
+    uint32_t pages = 1;
+    while (pages * PAGE_SIZE < size)
+        pages <<= 1;
+    return pages;
+}
+
 static pipe_t *alloc_pipe(void) {
+    pipe_t *p = (pipe_t *)0;
+
     uint32_t flags = hal_irq_save();
     for (int i = 0; i < MAX_PIPES; i++) {
         if (!pipe_pool[i].active) {
-            memset(&pipe_pool[i], 0, sizeof(pipe_t));
-            pipe_pool[i].active = 1;
-            hal_irq_restore(flags);
-            return &pipe_pool[i];
+            p = &pipe_pool[i];
+            memset(p, 0, sizeof(pipe_t));
+            p->active = 1;
+            break;
         }
     }
     hal_irq_restore(flags);
-    return (pipe_t *)0;
+    if (!p) return (pipe_t *)0;
+
+    uint32_t phys = alloc_frames_contiguous(ring_pages(PIPE_DEFAULT_SIZE), 1);
+    if (phys == FRAME_ALLOC_FAIL) {
+        p->active = 0;
+        return (pipe_t *)0;
+    }
+    p->phys = phys;
+    p->buf  = (uint8_t *)phys_to_virt(phys);
+    p->size = PIPE_DEFAULT_SIZE;
+    return p;
+}
+
+/* Give the ring back and free the slot (both ends are gone) */
+static void free_pipe(pipe_t *p) {
+    if (p->buf)
+        free_frames_contiguous(p->phys, p->size / PAGE_SIZE);
+    p->buf = (uint8_t *)0;
+    p->active = 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Ring copies (interrupts off)                                      */
+/* ------------------------------------------------------------------ */
+
+/* Copy up to n bytes in; at most two memcpy calls around the wrap */
+static uint32_t ring_put(pipe_t *p, const uint8_t *in, uint32_t n) {
+    uint32_t space = p->size - p->count;
+    if (n > space) n = space;
+
+    uint32_t first = p->size - p->write_pos;
+    if (first > n) first = n;
+    memcpy(p->buf + p->write_pos, in, first);
+    memcpy(p->buf, in + first, n - first);
+
+    p->write_pos = (p->write_pos + n) & (p->size - 1);
+    p->count += n;
+    return n;
+}
+
+static uint32_t ring_take(pipe_t *p, uint8_t *out, uint32_t n) {
+    if (n > p->count) n = p->count;
+
+    uint32_t first = p->size - p->read_pos;
+    if (first > n) first = n;
+    memcpy(out, p->buf + p->read_pos, first);
+    memcpy(out + first, p->buf, n - first);
+
+    p->read_pos = (p->read_pos + n) & (p->size - 1);
+    p->count -= n;
+    return n;
 }
 
 /* ------------------------------------------------------------------ */
@@ -42,37 +103,35 @@ int pipe_create(int *read_fd, int *write_fd) {
 
     /* Allocate read-end open file */
     int ofi_r = alloc_open_file();
-    if (ofi_r < 0) { p->active = 0; return -1; }
-    open_file_table[ofi_r].type = FD_TYPE_PIPE;
-    open_file_table[ofi_r].flags = O_RDONLY;
-    open_file_table[ofi_r].pipe = p;
+    if (ofi_r < 0) { free_pipe(p); return -1; }
+    open_file_t *of_r = open_file_get(ofi_r);
+    of_r->type = FD_TYPE_PIPE;
+    of_r->flags = O_RDONLY;
+    of_r->pipe = p;
 
     /* Allocate write-end open file */
     int ofi_w = alloc_open_file();
-    if (ofi_w < 0) { release_open_file(ofi_r); p->active = 0; return -1; }
-    open_file_table[ofi_w].type = FD_TYPE_PIPE;
-    open_file_table[ofi_w].flags = O_WRONLY;
-    open_file_table[ofi_w].pipe = p;
+    if (ofi_w < 0) { release_open_file(ofi_r); free_pipe(p); return -1; }
+    open_file_t *of_w = open_file_get(ofi_w);
+    of_w->type = FD_TYPE_PIPE;
+    of_w->flags = O_WRONLY;
+    of_w->pipe = p;
 
     /* Allocate fds in current process */
-    int rfd = alloc_fd(current_process->fds);
+    fd_table_t *t = &current_process->fds;
+    int rfd = fd_install(t, ofi_r);
     if (rfd < 0) {
         release_open_file(ofi_r);
-        release_open_file(ofi_w);
-        p->active = 0;
+        release_open_file(ofi_w);   /* last end closed: frees the pipe */
         return -1;
     }
-    current_process->fds[rfd] = ofi_r;
 
-    int wfd = alloc_fd(current_process->fds);
+    int wfd = fd_install(t, ofi_w);
     if (wfd < 0) {
-        current_process->fds[rfd] = -1;
-        release_open_file(ofi_r);
-        release_open_file(ofi_w);
-        p->active = 0;
+        fd_close(rfd);
+        release_open_file(ofi_w);   /* last end closed: frees the pipe */
         return -1;
     }
-    current_process->fds[wfd] = ofi_w;
 
     *read_fd = rfd;
     *write_fd = wfd;
@@ -83,34 +142,37 @@ int pipe_create(int *read_fd, int *write_fd) {
 /*  pipe_read                                                         */
 /* ------------------------------------------------------------------ */
 
-int32_t pipe_read(pipe_t *p, void *buf, uint32_t count) {
+int32_t pipe_read(pipe_t *p, void *buf, uint32_t count, int nonblock) {
     uint8_t *out = (uint8_t *)buf;
     uint32_t total = 0;
 
     while (total < count) {
-        /* Wait while buffer is empty and writers exist */
+        /* Test and sleep with interrupts off, so a writer can't fill
+           the pipe (and skip its wakeup) in between */
+        uint32_t irq = hal_irq_save();
+        if (nonblock && p->count == 0 && p->writers > 0) {
+            hal_irq_restore(irq);
+            if (total == 0) return -EAGAIN;
+            break;
+        }
         while (p->count == 0 && p->writers > 0) {
             sleep_on(&p->read_wq);
+            hal_irq_disable();
         }
 
         /* If empty and no writers left, return what we have (EOF) */
-        if (p->count == 0 && p->writers <= 0) {
+        if (p->count == 0) {
+            hal_irq_restore(irq);
             break;
         }
 
-        /* Copy available bytes (interrupts off to protect buffer state) */
-        {
-            uint32_t irq = hal_irq_save();
-            while (total < count && p->count > 0) {
-                out[total++] = p->buf[p->read_pos];
-                p->read_pos = (p->read_pos + 1) % PIPE_BUF_SIZE;
-                p->count--;
-            }
-            hal_irq_restore(irq);
-        }
+        int was_full = (p->count == p->size);
+        total += ring_take(p, out + total, count - total);
+        hal_irq_restore(irq);
 
-        /* Wake any blocked writers */
-        wake_up_all(&p->write_wq);
+        /* Writers only sleep on a full pipe */
+        if (was_full)
+            wake_up_all(&p->write_wq);
     }
 
     return (int32_t)total;
@@ -120,47 +182,84 @@ int32_t pipe_read(pipe_t *p, void *buf, uint32_t count) {
 /*  pipe_write                                                        */
 /* ------------------------------------------------------------------ */
 
-int32_t pipe_write(pipe_t *p, const void *buf, uint32_t count) {
+int32_t pipe_write(pipe_t *p, const void *buf, uint32_t count, int nonblock) {
     const uint8_t *in = (const uint8_t *)buf;
     uint32_t total = 0;
 
     while (total < count) {
-        /* No readers left → broken pipe */
-        if (p->readers <= 0) {
-            if (current_process)
-                proc_signal(current_process->pid, SIGPIPE);
-            return total > 0 ? (int32_t)total : -1;
+        uint32_t irq = hal_irq_save();
+        if (nonblock && p->count == p->size && p->readers > 0) {
+            hal_irq_restore(irq);
+            if (total == 0) return -EAGAIN;
+            break;
         }
-
-        /* Wait while buffer is full */
-        while (p->count >= PIPE_BUF_SIZE && p->readers > 0) {
+        while (p->count == p->size && p->readers > 0) {
             sleep_on(&p->write_wq);
+            hal_irq_disable();
         }
 
+        /* No readers left → broken pipe */
         if (p->readers <= 0) {
+            hal_irq_restore(irq);
             if (current_process)
                 proc_signal(current_process->pid, SIGPIPE);
             return total > 0 ? (int32_t)total : -1;
         }
 
-        /* Copy bytes into buffer (interrupts off to protect buffer state) */
-        {
-            uint32_t irq = hal_irq_save();
-            while (total < count && p->count < PIPE_BUF_SIZE) {
-                p->buf[p->write_pos] = in[total++];
-                p->write_pos = (p->write_pos + 1) % PIPE_BUF_SIZE;
-                p->count++;
-            }
-            hal_irq_restore(irq);
-        }
+        int was_empty = (p->count == 0);
+        total += ring_put(p, in + total, count - total);
+        hal_irq_restore(irq);
 
-        /* Wake any blocked readers */
-        wake_up_all(&p->read_wq);
+        /* Readers only sleep on an empty pipe */
+        if (was_empty)
+            wake_up_all(&p->read_wq);
     }
 
     return (int32_t)total;
 }
 
+/* ------------------------------------------------------------------ */
+/*  Resize (F_SETPIPE_SZ)                                             */
+/* ------------------------------------------------------------------ */
+
+int32_t pipe_set_size(pipe_t *p, uint32_t size) {
+    if (!p || size > PIPE_MAX_SIZE) return -1;
+
+    uint32_t pages = ring_pages(size);
+    size = pages * PAGE_SIZE;
+    if (size == p->size) return (int32_t)size;
+
+    uint32_t phys = alloc_frames_contiguous(pages, 1);
+    if (phys == FRAME_ALLOC_FAIL) return -1;
+    uint8_t *buf = (uint8_t *)phys_to_virt(phys);
+
+    uint32_t irq = hal_irq_save();
+    if (p->count > size) {
+        hal_irq_restore(irq);
+        free_frames_contiguous(phys, pages);
+        return -1;
+    }
+
+    /* Unwrap the buffered data to the start of the new ring */
+    uint32_t old_phys = p->phys, old_pages = p->size / PAGE_SIZE;
+    uint32_t n = p->count;
+    ring_take(p, buf, n);
+
+    p->buf       = buf;
+    p->phys      = phys;
+    p->size      = size;
+    p->read_pos  = 0;
+    p->write_pos = n & (size - 1);
+    p->count     = n;
+    hal_irq_restore(irq);
+
+    free_frames_contiguous(old_phys, old_pages);
+
+    /* A writer blocked on the old, full ring may have room now */
+    wake_up_all(&p->write_wq);
+    return (int32_t)size;
+}
+
 /* ------------------------------------------------------------------ */
 /*  Close endpoints                                                   */
 /* ------------------------------------------------------------------ */
@@ -170,7 +269,7 @@ void pipe_close_reader(pipe_t *p) {
     p->readers--;
     int no_readers = (p->readers <= 0);
     int deactivate = (p->readers <= 0 && p->writers <= 0);
-    if (deactivate) p->active = 0;
+    if (deactivate) free_pipe(p);
     hal_irq_restore(flags);
 
     if (no_readers) {
@@ -184,7 +283,7 @@ void pipe_close_writer(pipe_t *p) {
     p->writers--;
     int no_writers = (p->writers <= 0);
     int deactivate = (p->readers <= 0 && p->writers <= 0);
-    if (deactivate) p->active = 0;
+    if (deactivate) free_pipe(p);
     hal_irq_restore(flags);
 
     if (no_writers) {
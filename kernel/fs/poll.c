@@ -0,0 +1,404 @@
+#include <kernel/poll.h>
+#include <kernel/fd.h>
+#include <kernel/pipe.h>
+#include <kernel/process.h>
+#include <kernel/keyboard.h>
+#include <kernel/net.h>
+#include <kernel/timer.h>
+#include <kernel/heap.h>
+#include <kernel/hal.h>
+#include <string.h>
+
+/* ------------------------------------------------------------------ */
+/*  Readiness probes                                                  */
+/* ------------------------------------------------------------------ */
+
+/* Ready bits of an open file for 'events', interrupts off. The queues
+   woken when that may change go into wq[] (up to two). */
+static uint16_t probe_file(open_file_t *of, uint16_t events,
+                           wait_queue_t *wq[2]) {
+    wq[0] = wq[1] = NULL;
+    uint16_t ready = 0;
+
+    if (!of) return POLLNVAL;
+
+    switch (of->type) {
+    case FD_TYPE_VFS:
+        ready = POLLIN | POLLOUT;     /* never blocks */
+        break;
+
+    case FD_TYPE_CONSOLE:
+        /* One shared O_RDWR console: always writable, readable once
+           the keyboard has input */
+        ready = POLLOUT;
+        wq[0] = keyboard_wait_queue();
+        if (keyboard_has_event()) ready |= POLLIN;
+        break;
+
+    case FD_TYPE_PIPE: {
+        pipe_t *p = of->pipe;
+        if (!p) return POLLNVAL;
+        if (of->flags & O_WRONLY) {
+            wq[0] = &p->write_wq;
+            if (p->readers <= 0)       ready = POLLERR;
+            else if (p->count < p->size) ready = POLLOUT;
+        } else {
+            wq[0] = &p->read_wq;
+            if (p->count)        ready |= POLLIN;
+            if (p->writers <= 0) ready |= POLLHUP;
+        }
+        break;
+    }
+
+    case FD_TYPE_TCP:
+        ready = tcp_poll(of->tcp, wq);
+        break;
+
+    default:
+        return POLLNVAL;
+    }
+
+    /* Errors and hangups are reported whether asked for or not */
+    return ready & (events | POLLERR | POLLHUP);
+}
+
+/* Same for an fd of the current process, or a socket with POLLSOCK */
+static uint16_t poll_probe(int32_t fd, uint16_t events, wait_queue_t *wq[2]) {
+    if (events & POLLSOCK) {
+        wq[0] = wq[1] = NULL;
+        int r = udp_poll(fd, &wq[0]);
+        if (r < 0) return POLLNVAL;
+        uint16_t ready = POLLOUT | (r ? POLLIN : 0);
+        return ready & events;
+    }
+    return probe_file(fd_file(fd), events, wq);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Sleeping                                                          */
+/* ------------------------------------------------------------------ */
+
+static uint32_t ms_to_ticks(int32_t ms) {
+    return ((uint32_t)ms + POLL_TICK_MS - 1) / POLL_TICK_MS;
+}
+
+/*
+ * Wait until *flag is set or the deadline passes. Called with
+ * interrupts off (saved in irq) after the caller has checked for
+ * ready fds, so a hook that fires after that check still sets the flag
+ * before we look at it. Without a timeout we block properly and the
+ * hook wakes us; with one we idle on HLT like sys_sleep, since there
+ * are no timer-driven wakeups.
+ */
+static void poll_sleep(volatile int *flag, int32_t timeout_ms,
+                       uint32_t deadline, uint32_t irq) {
+    if (*flag) {
+        hal_irq_restore(irq);
+        return;
+    }
+
+    if (timeout_ms < 0) {
+        current_process->state = PROC_BLOCKED;
+        hal_irq_restore(irq);
+        while (current_process->state == PROC_BLOCKED) {
+            hal_irq_enable();
+            hal_halt();
+        }
+    } else {
+        hal_irq_restore(irq);
+        while (!*flag && (int32_t)(timer_ticks() - deadline) < 0) {
+            hal_irq_enable();
+            hal_halt();
+        }
+    }
+}
+
+static int timed_out(int32_t timeout_ms, uint32_t deadline) {
+    if (timeout_ms == 0) return 1;
+    return timeout_ms > 0 && (int32_t)(timer_ticks() - deadline) >= 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  poll                                                              */
+/* ------------------------------------------------------------------ */
+
+typedef struct poll_waiter {
+    struct process *proc;
+    volatile int    triggered;
+} poll_waiter_t;
+
+static void poll_hook(wait_queue_entry_t *entry) {
+    poll_waiter_t *w = (poll_waiter_t *)entry->data;
+    w->triggered = 1;
+    if (w->proc->state == PROC_BLOCKED)
+        w->proc->state = PROC_READY;
+}
+
+int32_t poll_fds(struct pollfd *fds, uint32_t nfds, int32_t timeout_ms) {
+    if (nfds > POLL_MAX_FDS) return -1;
+
+    wait_queue_entry_t *entries = NULL;
+    wait_queue_t **queues = NULL;
+    if (nfds && timeout_ms != 0) {
+        entries = (wait_queue_entry_t *)kcalloc(nfds * 2,
+                                                sizeof(wait_queue_entry_t));
+        queues  = (wait_queue_t **)kcalloc(nfds * 2, sizeof(wait_queue_t *));
+        if (!entries || !queues) {
+            kfree(entries);
+            kfree(queues);
+            return -1;
+        }
+    }
+
+    poll_waiter_t w = { current_process, 0 };
+    uint32_t deadline = timer_ticks() + ms_to_ticks(timeout_ms);
+    uint32_t nwait = 0;
+    int registered = 0;
+    int32_t ready;
+
+    for (;;) {
+        /* Probe and hook up with interrupts off, so nothing can change
+           between a probe and the decision to sleep */
+        uint32_t irq = hal_irq_save();
+        w.triggered = 0;
+        ready = 0;
+        for (uint32_t i = 0; i < nfds; i++) {
+            wait_queue_t *wq[2];
+            fds[i].revents = poll_probe(fds[i].fd, fds[i].events, wq);
+            if (fds[i].revents) ready++;
+
+            for (int j = 0; j < 2 && entries && !registered; j++) {
+                if (!wq[j]) continue;
+                wait_queue_entry_t *e = &entries[nwait];
+                e->proc = current_process;
+                e->func = poll_hook;
+                e->data = &w;
+                queues[nwait++] = wq[j];
+                wait_queue_add(wq[j], e);
+            }
+        }
+        registered = 1;
+
+        if (ready || timed_out(timeout_ms, deadline)) {
+            hal_irq_restore(irq);
+            break;
+        }
+        poll_sleep(&w.triggered, timeout_ms, deadline, irq);
+    }
+
+    for (uint32_t i = 0; i < nwait; i++)
+        wait_queue_remove(queues[i], &entries[i]);
+    kfree(entries);
+    kfree(queues);
+    return ready;
+}
+
+/* ------------------------------------------------------------------ */
+/*  epoll                                                             */
+/* ------------------------------------------------------------------ */
+
+/* A watched fd is probed through its open file, which keeps the item
+   on its watcher list until the item is deleted or the file's last fd
+   closes. Sockets have no open file and are probed by index. */
+typedef struct epoll_item {
+    int                in_use;
+    int32_t            fd;
+    open_file_t       *of;          /* NULL for a socket */
+    struct epoll_item *next_watch;  /* of->watchers chain */
+    struct epoll_event ev;
+    wait_queue_t      *wq[2];
+    wait_queue_entry_t entry[2];
+} epoll_item_t;
+
+typedef struct epoll {
+    epoll_item_t items[EPOLL_MAX_WATCH];
+    volatile int pending;      /* a watched queue was woken */
+    wait_queue_t wq;           /* epoll_wait sleeps here */
+} epoll_t;
+
+/* A watched fd's queue was woken: rescan on the next epoll_wait round */
+static void epoll_hook(wait_queue_entry_t *entry) {
+    epoll_t *ep = (epoll_t *)entry->data;
+    ep->pending = 1;
+    wake_up_all(&ep->wq);
+}
+
+static epoll_t *epoll_from_fd(int epfd) {
+    open_file_t *of = fd_file(epfd);
+    if (!of || of->type != FD_TYPE_EPOLL) return NULL;
+    return of->epoll;
+}
+
+/* Unhook an item from its queues and its file, and free the slot.
+   Interrupts off. */
+static void epoll_drop(epoll_item_t *it) {
+    for (int j = 0; j < 2; j++) {
+        if (it->wq[j])
+            wait_queue_remove(it->wq[j], &it->entry[j]);
+        it->wq[j] = NULL;
+    }
+    if (it->of) {
+        epoll_item_t **pp = &it->of->watchers;
+        while (*pp && *pp != it)
+            pp = &(*pp)->next_watch;
+        if (*pp) *pp = it->next_watch;
+        it->of = NULL;
+    }
+    it->in_use = 0;
+}
+
+int epoll_create(void) {
+    epoll_t *ep = (epoll_t *)kcalloc(1, sizeof(epoll_t));
+    if (!ep) return -1;
+
+    int ofi = alloc_open_file();
+    if (ofi < 0) { kfree(ep); return -1; }
+    open_file_t *of = open_file_get(ofi);
+    of->type  = FD_TYPE_EPOLL;
+    of->flags = O_RDONLY;
+    of->epoll = ep;
+
+    int fd = fd_install(&current_process->fds, ofi);
+    if (fd < 0) {
+        release_open_file(ofi);     /* frees ep */
+        return -1;
+    }
+    return fd;
+}
+
+int epoll_ctl(int epfd, int op, int fd, const struct epoll_event *ev) {
+    epoll_t *ep = epoll_from_fd(epfd);
+    if (!ep || !ev) return -1;
+
+    uint32_t sock = ev->events & POLLSOCK;
+    if (!sock && fd == epfd) return -1;
+    open_file_t *of = sock ? NULL : fd_file(fd);
+
+    /* An item is the fd number together with the file behind it */
+    epoll_item_t *it = NULL, *slot = NULL;
+    for (int i = 0; i < EPOLL_MAX_WATCH; i++) {
+        epoll_item_t *cand = &ep->items[i];
+        if (!cand->in_use) {
+            if (!slot) slot = cand;
+        } else if (cand->fd == fd && (cand->ev.events & POLLSOCK) == sock
+                   && cand->of == of) {
+            it = cand;
+        }
+    }
+
+    uint32_t irq = hal_irq_save();
+    int ret = 0;
+
+    switch (op) {
+    case EPOLL_CTL_ADD: {
+        wait_queue_t *wq[2];
+        if (it || !slot ||
+            poll_probe(fd, (uint16_t)ev->events, wq) & POLLNVAL) {
+            ret = -1;
+            break;
+        }
+        memset(slot, 0, sizeof(*slot));
+        slot->in_use = 1;
+        slot->fd     = fd;
+        slot->ev     = *ev;
+        if (of) {
+            slot->of = of;
+            slot->next_watch = of->watchers;
+            of->watchers = slot;
+        }
+        for (int j = 0; j < 2; j++) {
+            if (!wq[j]) continue;
+            slot->wq[j] = wq[j];
+            slot->entry[j].proc = current_process;
+            slot->entry[j].func = epoll_hook;
+            slot->entry[j].data = ep;
+            wait_queue_add(wq[j], &slot->entry[j]);
+        }
+        /* It may be ready already */
+        ep->pending = 1;
+        wake_up_all(&ep->wq);
+        break;
+    }
+
+    case EPOLL_CTL_MOD:
+        if (!it) { ret = -1; break; }
+        it->ev = *ev;
+        ep->pending = 1;
+        wake_up_all(&ep->wq);
+        break;
+
+    case EPOLL_CTL_DEL:
+        if (!it) { ret = -1; break; }
+        epoll_drop(it);
+        break;
+
+    default:
+        ret = -1;
+        break;
+    }
+
+    hal_irq_restore(irq);
+    return ret;
+}
+
+int32_t epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+                   int32_t timeout_ms) {
+    epoll_t *ep = epoll_from_fd(epfd);
+    if (!ep || !events || maxevents <= 0) return -1;
+
+    uint32_t deadline = timer_ticks() + ms_to_ticks(timeout_ms);
+    int32_t n;
+
+    for (;;) {
+        uint32_t irq = hal_irq_save();
+        ep->pending = 0;
+        n = 0;
+        for (int i = 0; i < EPOLL_MAX_WATCH && n < maxevents; i++) {
+            epoll_item_t *it = &ep->items[i];
+            if (!it->in_use) continue;
+
+            wait_queue_t *wq[2];
+            uint16_t r = it->of
+                         ? probe_file(it->of, (uint16_t)it->ev.events, wq)
+                         : poll_probe(it->fd, (uint16_t)it->ev.events, wq);
+            if (!r) continue;
+            events[n].events = r;
+            events[n].data   = it->ev.data;
+            n++;
+        }
+
+        if (n || timed_out(timeout_ms, deadline)) {
+            hal_irq_restore(irq);
+            break;
+        }
+
+        if (timeout_ms < 0) {
+            /* sleep_on queues us before interrupts come back on */
+            if (!ep->pending)
+                sleep_on(&ep->wq);
+            hal_irq_restore(irq);
+        } else {
+            poll_sleep(&ep->pending, timeout_ms, deadline, irq);
+        }
+    }
+    return n;
+}
+
+void epoll_release(struct epoll *ep) {
+    if (!ep) return;
+
+    uint32_t irq = hal_irq_save();
+    for (int i = 0; i < EPOLL_MAX_WATCH; i++) {
+        if (ep->items[i].in_use)
+            epoll_drop(&ep->items[i]);
+    }
+    hal_irq_restore(irq);
+    kfree(ep);
+}
+
+void epoll_forget_file(struct open_file *of) {
+    uint32_t irq = hal_irq_save();
+    while (of->watchers)
+        epoll_drop(of->watchers);
+    hal_irq_restore(irq);
+}
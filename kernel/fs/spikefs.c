@@ -1,7 +1,9 @@
 #include <kernel/spikefs.h>
 #include <kernel/ata.h>
+#include <kernel/blk.h>
 #include <kernel/vfs.h>
 #include <kernel/heap.h>
+#include <kernel/timer.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -9,21 +11,29 @@
 /*  Cached disk layout (populated from superblock or format)          */
 /* ------------------------------------------------------------------ */
 
-static struct {
+typedef struct {
     uint32_t num_blocks;
     uint32_t bitmap_start;
     uint32_t data_start;
     uint32_t bitmap_sectors;
     uint32_t imap_block;      /* block# of first inode map block */
     uint32_t num_ichunks;     /* active inode chunks */
-} layout;
+    uint32_t journal_block;   /* first journal block (0 = no journal) */
+    uint32_t journal_blocks;
+} spikefs_layout_t;
+
+static spikefs_layout_t layout;
 
 /* ------------------------------------------------------------------ */
 /*  Block bitmap (heap-allocated, sized from layout)                  */
 /* ------------------------------------------------------------------ */
 
+/* Format of the mounted disk's inodes (v3 until an upgrade rewrites it) */
+static uint32_t mounted_version = SPIKEFS_VERSION;
+
 static uint8_t *block_bitmap = NULL;
 static uint32_t bitmap_bytes = 0;
+static uint8_t *bitmap_dirty = NULL;   /* per bitmap sector: needs writing */
 
 static void bitmap_clear_all(void) {
     if (block_bitmap)
@@ -31,8 +41,17 @@ static void bitmap_clear_all(void) {
 }
 
 static void bitmap_set(uint32_t blk) {
-    if (blk / 8 < bitmap_bytes)
+    if (blk / 8 < bitmap_bytes) {
         block_bitmap[blk / 8] |= (1 << (blk % 8));
+        bitmap_dirty[blk / 4096] = 1;
+    }
+}
+
+static void bitmap_clear(uint32_t blk) {
+    if (blk / 8 < bitmap_bytes) {
+        block_bitmap[blk / 8] &= ~(1 << (blk % 8));
+        bitmap_dirty[blk / 4096] = 1;
+    }
 }
 
 static int bitmap_test(uint32_t blk) {
@@ -61,6 +80,24 @@ static int32_t bitmap_alloc(uint32_t count) {
     return -1;
 }
 
+/* Find the first free run of up to 'want' blocks and claim it.
+   Returns the start block (length in *got), or -1 if the disk is full. */
+static int32_t bitmap_alloc_run(uint32_t want, uint32_t *got) {
+    for (uint32_t i = 0; i < layout.num_blocks; i++) {
+        if (bitmap_test(i)) continue;
+
+        uint32_t len = 0;
+        while (len < want && i + len < layout.num_blocks
+               && !bitmap_test(i + len))
+            len++;
+        for (uint32_t j = i; j < i + len; j++)
+            bitmap_set(j);
+        *got = len;
+        return (int32_t)i;
+    }
+    return -1;
+}
+
 /* Allocate or resize the block bitmap */
 static int bitmap_init(uint32_t sectors) {
     uint32_t bytes = sectors * 512;
@@ -69,10 +106,17 @@ static int bitmap_init(uint32_t sectors) {
     }
     if (block_bitmap)
         kfree(block_bitmap);
+    if (bitmap_dirty)
+        kfree(bitmap_dirty);
 
     block_bitmap = (uint8_t *)kmalloc(bytes);
-    if (!block_bitmap) {
+    bitmap_dirty = (uint8_t *)kcalloc(sectors, 1);
+    if (!block_bitmap || !bitmap_dirty) {
         printf("[spikefs] out of memory for bitmap (%d bytes)\n", bytes);
+        kfree(block_bitmap);
+        kfree(bitmap_dirty);
+        block_bitmap = NULL;
+        bitmap_dirty = NULL;
         bitmap_bytes = 0;
         return -1;
     }
@@ -82,39 +126,161 @@ static int bitmap_init(uint32_t sectors) {
 }
 
 /* ------------------------------------------------------------------ */
-/*  Sector I/O helpers                                                */
+/*  Sector I/O helpers (through the block layer)                      */
 /* ------------------------------------------------------------------ */
 
-static uint8_t sector_buf[512] __attribute__((aligned(4)));
+static blk_device_t *disk = NULL;
 
 static int read_sector(uint32_t lba, void *buf) {
-    return ata_read_sectors(lba, 1, buf);
+    return blk_read(disk, lba, 1, buf);
 }
 
 static int write_sector(uint32_t lba, const void *buf) {
-    return ata_write_sectors(lba, 1, buf);
+    return blk_write(disk, lba, 1, buf);
 }
 
 static int read_sectors(uint32_t lba, uint32_t count, void *buf) {
-    uint8_t *p = (uint8_t *)buf;
-    for (uint32_t i = 0; i < count; i++) {
-        if (read_sector(lba + i, p + i * 512) != 0)
-            return -1;
-    }
-    return 0;
+    return blk_read(disk, lba, count, buf);
 }
 
 static int write_sectors(uint32_t lba, uint32_t count, const void *buf) {
-    const uint8_t *p = (const uint8_t *)buf;
-    for (uint32_t i = 0; i < count; i++) {
-        if (write_sector(lba + i, p + i * 512) != 0)
-            return -1;
+    return blk_write(disk, lba, count, buf);
+}
+
+/*
+ * Scratch buffers that must outlive a batch (inode chunks, padded tail
+ * sectors, indirect blocks). Freed together once the batch completes.
+ */
+typedef struct scratch {
+    struct scratch *next;
+    uint8_t data[];
+} scratch_t;
+
+static scratch_t *scratch_list = NULL;
+
+static uint8_t *scratch_alloc(uint32_t bytes) {
+    scratch_t *sc = (scratch_t *)kmalloc(sizeof(scratch_t) + bytes);
+    if (!sc) return NULL;
+    memset(sc->data, 0, bytes);
+    sc->next = scratch_list;
+    scratch_list = sc;
+    return sc->data;
+}
+
+static uint8_t *scratch_sector(void) {
+    return scratch_alloc(512);
+}
+
+static void scratch_free_all(void) {
+    while (scratch_list) {
+        scratch_t *next = scratch_list->next;
+        kfree(scratch_list);
+        scratch_list = next;
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Page vectors                                                      */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Inode data is addressed as an array of VFS_PAGE_SIZE pages: file
+ * data is scattered over page-cache frames, directory data is one
+ * kmalloc buffer cut into page-sized pieces. Requests are split at page
+ * boundaries; the block layer merges the pieces back into large
+ * commands when they are adjacent on disk.
+ */
+#define PAGE_SECTORS (VFS_PAGE_SIZE / 512)
+
+/* Holes in a file are written from here */
+static uint8_t zero_page[VFS_PAGE_SIZE];
+
+/* View a contiguous buffer as pages. Caller frees the vector. */
+static uint8_t **page_vector(uint8_t *buf, uint32_t bytes) {
+    uint32_t npages = (bytes + VFS_PAGE_SIZE - 1) / VFS_PAGE_SIZE;
+    uint8_t **pages = (uint8_t **)kmalloc((npages ? npages : 1)
+                                          * sizeof(uint8_t *));
+    if (!pages) return NULL;
+    for (uint32_t i = 0; i < npages; i++)
+        pages[i] = buf + i * VFS_PAGE_SIZE;
+    return pages;
+}
+
+/* Page vector over a file's cached pages; holes map to zero_page. */
+static uint8_t **file_page_vector(uint32_t ino, uint32_t bytes) {
+    uint32_t npages = (bytes + VFS_PAGE_SIZE - 1) / VFS_PAGE_SIZE;
+    uint8_t **pages = (uint8_t **)kmalloc((npages ? npages : 1)
+                                          * sizeof(uint8_t *));
+    if (!pages) return NULL;
+    for (uint32_t i = 0; i < npages; i++) {
+        pages[i] = (uint8_t *)vfs_page_addr(ino, i);
+        if (!pages[i])
+            pages[i] = zero_page;
+    }
+    return pages;
+}
+
+/* Queue 'count' sectors at 'lba' against the data starting at sector
+   'sector' of a page vector, one bio per page touched. */
+static void queue_pages(blk_batch_t *batch, int dir, uint32_t lba,
+                        uint8_t *const *pages, uint32_t sector,
+                        uint32_t count) {
+    while (count > 0) {
+        uint32_t in_page = sector % PAGE_SECTORS;
+        uint32_t n = PAGE_SECTORS - in_page;
+        if (n > count) n = count;
+
+        blk_batch_add(batch, dir, lba, n,
+                      pages[sector / PAGE_SECTORS] + in_page * 512);
+        lba += n;
+        sector += n;
+        count -= n;
     }
-    return 0;
+}
+
+/* Page vector over two buffers back to back (a directory's entries,
+   then its name index). The page straddling the seam is a scratch
+   copy, so it must be for writing only. */
+static uint8_t **split_page_vector(uint8_t *a, uint32_t a_bytes,
+                                   uint8_t *b, uint32_t b_bytes) {
+    if (b_bytes == 0)
+        return page_vector(a, a_bytes);
+
+    uint32_t total = a_bytes + b_bytes;
+    uint32_t n = (total + VFS_PAGE_SIZE - 1) / VFS_PAGE_SIZE;
+    uint8_t **pages = (uint8_t **)kmalloc(n * sizeof(uint8_t *));
+    if (!pages) return NULL;
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t start = i * VFS_PAGE_SIZE;
+        if (start + VFS_PAGE_SIZE <= a_bytes) {
+            pages[i] = a + start;
+        } else if (start >= a_bytes) {
+            pages[i] = b + (start - a_bytes);
+        } else {
+            uint8_t *copy = scratch_alloc(VFS_PAGE_SIZE);
+            if (!copy) {
+                kfree(pages);
+                return NULL;
+            }
+            uint32_t head = a_bytes - start;
+            uint32_t tail = VFS_PAGE_SIZE - head;
+            if (tail > b_bytes) tail = b_bytes;
+            memcpy(copy, a + start, head);
+            memcpy(copy + head, b, tail);
+            pages[i] = copy;
+        }
+    }
+    return pages;
+}
+
+/* Address of data sector 'sector' in a page vector */
+static uint8_t *page_sector(uint8_t *const *pages, uint32_t sector) {
+    return pages[sector / PAGE_SECTORS] + (sector % PAGE_SECTORS) * 512;
 }
 
 /* ------------------------------------------------------------------ */
-/*  Layout calculation (v3: no inode region, just bitmap + data pool) */
+/*  Layout calculation (v3+: no inode region, just bitmap + data pool) */
 /* ------------------------------------------------------------------ */
 
 static void calculate_layout(uint32_t total_sectors) {
@@ -133,22 +299,799 @@ static void populate_layout_from_super(spikefs_super_t *super) {
     layout.data_start     = super->data_start;
     layout.imap_block     = super->imap_block;
     layout.num_ichunks    = super->num_ichunks;
+    layout.journal_block  = super->journal_block;
+    layout.journal_blocks = super->journal_blocks;
     layout.bitmap_sectors = layout.data_start - layout.bitmap_start;
 }
 
+static void fill_super(spikefs_super_t *super) {
+    memset(super, 0, sizeof(*super));
+    super->magic          = SPIKEFS_MAGIC;
+    super->version        = SPIKEFS_VERSION;
+    super->num_blocks     = layout.num_blocks;
+    super->bitmap_start   = layout.bitmap_start;
+    super->data_start     = layout.data_start;
+    super->imap_block     = layout.imap_block;
+    super->num_ichunks    = layout.num_ichunks;
+    super->journal_block  = layout.journal_block;
+    super->journal_blocks = layout.journal_blocks;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Inode map (kept in memory for lazy loads and incremental sync)    */
 /* ------------------------------------------------------------------ */
-/*  Format (v3: inode chunks in data pool)                            */
+
+static uint32_t *chunk_blocks = NULL;   /* block of each inode chunk (0=none) */
+static uint32_t  chunk_cap    = 0;
+static uint32_t *imap_blocks  = NULL;   /* the imap chain, in order */
+static uint32_t  imap_count   = 0;
+
+/* Make room for 'n' chunk entries; new entries are 0 (unallocated). */
+static int chunks_reserve(uint32_t n) {
+    if (n <= chunk_cap) return 0;
+
+    uint32_t new_cap = chunk_cap ? chunk_cap : 16;
+    while (new_cap < n) new_cap *= 2;
+
+    uint32_t *grown = (uint32_t *)krealloc(chunk_blocks,
+                                           new_cap * sizeof(uint32_t));
+    if (!grown) return -1;
+    memset(grown + chunk_cap, 0, (new_cap - chunk_cap) * sizeof(uint32_t));
+    chunk_blocks = grown;
+    chunk_cap = new_cap;
+    return 0;
+}
+
+static int imap_push(uint32_t blk) {
+    uint32_t *grown = (uint32_t *)krealloc(imap_blocks,
+                                           (imap_count + 1) * sizeof(uint32_t));
+    if (!grown) return -1;
+    imap_blocks = grown;
+    imap_blocks[imap_count++] = blk;
+    return 0;
+}
+
+static void imap_reset(void) {
+    kfree(chunk_blocks);
+    kfree(imap_blocks);
+    chunk_blocks = NULL;
+    imap_blocks = NULL;
+    chunk_cap = 0;
+    imap_count = 0;
+}
+
+/* Whether chunk 'c' has a block. v3 put chunk 0 at block 0, so there
+   0 is a real block; v4 reserves it to mean "none". */
+static int chunk_on_disk(uint32_t c) {
+    return chunk_blocks[c] != 0 || mounted_version == SPIKEFS_VERSION_V3;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Metadata journal                                                  */
+/* ------------------------------------------------------------------ */
+
+/* Metadata sectors logged by the sync in progress */
+static uint32_t  *tx_targets = NULL;    /* home LBA of each */
+static uint8_t  **tx_bufs    = NULL;
+static uint32_t   tx_count   = 0;
+static uint32_t   tx_cap     = 0;
+
+static uint32_t journal_seq = 0;        /* sequence of the next transaction */
+static int      replay_needed = 0;      /* a committed transaction wasn't
+                                           fully checkpointed */
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32(uint32_t crc, const uint8_t *buf, uint32_t len) {
+    if (crc_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            crc_table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++)
+        crc = crc_table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t journal_lba(uint32_t i) {
+    return layout.data_start + layout.journal_block + i;
+}
+
+/* Journal length for a data pool of 'blocks' (0 = too small for one) */
+static uint32_t journal_size(uint32_t blocks) {
+    uint32_t n = blocks / 32;
+    if (n < SPIKEFS_JOURNAL_MIN) return 0;
+    if (n > SPIKEFS_JOURNAL_MAX) n = SPIKEFS_JOURNAL_MAX;
+    return n;
+}
+
+/* Write a fresh header and clear the first log block, so nothing left
+   over from an earlier life of these blocks can look committed. */
+static int journal_reset(uint32_t seq) {
+    uint8_t buf[512];
+
+    memset(buf, 0, sizeof(buf));
+    if (write_sector(journal_lba(1), buf) != 0)
+        return -1;
+
+    spikefs_jheader_t *hdr = (spikefs_jheader_t *)buf;
+    hdr->magic = SPIKEFS_JOURNAL_MAGIC;
+    hdr->seq = seq;
+    if (write_sector(journal_lba(0), buf) != 0)
+        return -1;
+
+    journal_seq = seq;
+    return 0;
+}
+
+/* Allocate and initialise a journal for the current layout. Leaves the
+   filesystem unjournaled if the disk is too small or too full. */
+static int journal_create(void) {
+    uint32_t want = journal_size(layout.num_blocks);
+
+    layout.journal_block = 0;
+    layout.journal_blocks = 0;
+    if (want == 0)
+        return 0;
+
+    int32_t blk = bitmap_alloc(want);
+    if (blk < 0) {
+        printf("[spikefs] no room for a %d-block journal, running without\n",
+               want);
+        return 0;
+    }
+
+    layout.journal_block = (uint32_t)blk;
+    layout.journal_blocks = want;
+    if (journal_reset(1) != 0) {
+        printf("[spikefs] failed to initialise journal\n");
+        for (uint32_t b = 0; b < want; b++)
+            bitmap_clear((uint32_t)blk + b);
+        layout.journal_block = 0;
+        layout.journal_blocks = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static void tx_reset(void) {
+    tx_count = 0;
+}
+
+/* Add a metadata sector to the current transaction. 'buf' must stay
+   valid until tx_commit returns. */
+static int tx_log(uint32_t lba, uint8_t *buf) {
+    if (tx_count == tx_cap) {
+        uint32_t new_cap = tx_cap ? tx_cap * 2 : 32;
+        uint32_t *t = (uint32_t *)krealloc(tx_targets,
+                                           new_cap * sizeof(uint32_t));
+        if (!t) return -1;
+        tx_targets = t;
+        uint8_t **b = (uint8_t **)krealloc(tx_bufs,
+                                           new_cap * sizeof(uint8_t *));
+        if (!b) return -1;
+        tx_bufs = b;
+        tx_cap = new_cap;
+    }
+    tx_targets[tx_count] = lba;
+    tx_bufs[tx_count] = buf;
+    tx_count++;
+    return 0;
+}
+
+/*
+ * Commit the logged metadata. 'batch' holds the transaction's data
+ * writes, which must be on disk before the commit record.
+ *
+ *   1. log blocks + data, flush
+ *   2. commit record, flush       <- the transaction is durable here
+ *   3. checkpoint to home locations, flush
+ *   4. bump the header sequence
+ *
+ * A transaction too big for the journal is written in place, as before
+ * the journal existed.
+ */
+static int tx_commit(blk_batch_t *batch) {
+    uint32_t ndesc = (tx_count + SPIKEFS_JDESC_ENTRIES - 1)
+                     / SPIKEFS_JDESC_ENTRIES;
+
+    if (layout.journal_blocks == 0
+        || 2 + ndesc + tx_count > layout.journal_blocks) {
+        if (layout.journal_blocks)
+            printf("[spikefs] journal: %d sectors won't fit, writing in place\n",
+                   tx_count);
+        /* The superblock goes last, so what it points at is there */
+        for (uint32_t i = 0; i < tx_count; i++) {
+            if (tx_targets[i] != 0)
+                blk_batch_add(batch, BLK_WRITE, tx_targets[i], 1, tx_bufs[i]);
+        }
+        if (blk_batch_wait(batch) != 0)
+            return -1;
+        ata_flush();
+        for (uint32_t i = 0; i < tx_count; i++) {
+            if (tx_targets[i] == 0 && write_sector(0, tx_bufs[i]) != 0)
+                return -1;
+        }
+        ata_flush();
+        return 0;
+    }
+
+    /* 1. Descriptors and log copies, queued alongside the data */
+    uint32_t crc = 0;
+    uint32_t jb = 1;
+    for (uint32_t i = 0; i < tx_count; ) {
+        spikefs_jdesc_t *desc = (spikefs_jdesc_t *)scratch_sector();
+        if (!desc) {
+            blk_batch_wait(batch);
+            return -1;
+        }
+
+        uint32_t n = tx_count - i;
+        if (n > SPIKEFS_JDESC_ENTRIES) n = SPIKEFS_JDESC_ENTRIES;
+
+        desc->magic = SPIKEFS_JDESC_MAGIC;
+        desc->seq = journal_seq;
+        desc->count = n;
+        for (uint32_t e = 0; e < n; e++)
+            desc->targets[e] = tx_targets[i + e];
+
+        crc = crc32(crc, (uint8_t *)desc, 512);
+        blk_batch_add(batch, BLK_WRITE, journal_lba(jb++), 1, desc);
+
+        for (uint32_t e = 0; e < n; e++, i++) {
+            crc = crc32(crc, tx_bufs[i], 512);
+            blk_batch_add(batch, BLK_WRITE, journal_lba(jb++), 1, tx_bufs[i]);
+        }
+    }
+    if (blk_batch_wait(batch) != 0)
+        return -1;
+    ata_flush();
+
+    /* 2. Commit record */
+    spikefs_jcommit_t commit;
+    memset(&commit, 0, sizeof(commit));
+    commit.magic = SPIKEFS_JCOMMIT_MAGIC;
+    commit.seq = journal_seq;
+    commit.blocks = jb - 1;
+    commit.crc = crc;
+    if (write_sector(journal_lba(jb), &commit) != 0)
+        return -1;
+    ata_flush();
+
+    /* 3. Checkpoint. From here on a failure is repaired by replay. */
+    blk_batch_t cp;
+    blk_batch_init(&cp, disk);
+    for (uint32_t i = 0; i < tx_count; i++)
+        blk_batch_add(&cp, BLK_WRITE, tx_targets[i], 1, tx_bufs[i]);
+    if (blk_batch_wait(&cp) != 0) {
+        replay_needed = 1;
+        return -1;
+    }
+    ata_flush();
+
+    /* 4. Retire the transaction */
+    spikefs_jheader_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SPIKEFS_JOURNAL_MAGIC;
+    hdr.seq = journal_seq + 1;
+    if (write_sector(journal_lba(0), &hdr) != 0) {
+        replay_needed = 1;
+        return -1;
+    }
+    journal_seq++;
+    return 0;
+}
+
+/*
+ * Replay a committed but unretired transaction, if the journal holds
+ * one. Returns 0 when the home locations are now current (whether or
+ * not anything was replayed), -1 on an I/O error.
+ */
+static int journal_replay(void) {
+    if (layout.journal_blocks == 0)
+        return 0;
+
+    uint8_t buf[512];
+    if (read_sector(journal_lba(0), buf) != 0) {
+        printf("[spikefs] journal: failed to read header\n");
+        return -1;
+    }
+
+    spikefs_jheader_t *hdr = (spikefs_jheader_t *)buf;
+    if (hdr->magic != SPIKEFS_JOURNAL_MAGIC) {
+        printf("[spikefs] journal: bad header, reinitialising\n");
+        return journal_reset(1);
+    }
+    uint32_t seq = hdr->seq;
+    journal_seq = seq;
+
+    /* Pass 1: walk descriptors, collect targets, check the commit */
+    uint32_t *targets = NULL, *sources = NULL;
+    uint32_t count = 0, cap = 0;
+    uint32_t crc = 0;
+    uint32_t jb = 1;
+    int committed = 0, rc = 0;
+
+    while (jb < layout.journal_blocks) {
+        if (read_sector(journal_lba(jb), buf) != 0) {
+            rc = -1;
+            break;
+        }
+
+        spikefs_jcommit_t *commit = (spikefs_jcommit_t *)buf;
+        if (commit->magic == SPIKEFS_JCOMMIT_MAGIC && commit->seq == seq) {
+            committed = count > 0 && commit->blocks == jb - 1
+                        && commit->crc == crc;
+            break;
+        }
+
+        spikefs_jdesc_t *desc = (spikefs_jdesc_t *)buf;
+        if (desc->magic != SPIKEFS_JDESC_MAGIC || desc->seq != seq
+            || desc->count == 0 || desc->count > SPIKEFS_JDESC_ENTRIES
+            || jb + desc->count >= layout.journal_blocks)
+            break;
+
+        crc = crc32(crc, buf, 512);
+        if (count + desc->count > cap) {
+            cap = (count + desc->count) * 2;
+            uint32_t *t = (uint32_t *)krealloc(targets, cap * sizeof(uint32_t));
+            uint32_t *s = t ? (uint32_t *)krealloc(sources,
+                                                    cap * sizeof(uint32_t))
+                            : NULL;
+            if (t) targets = t;
+            if (s) sources = s;
+            if (!t || !s) {
+                printf("[spikefs] journal: out of memory\n");
+                rc = -1;
+                break;
+            }
+        }
+
+        uint32_t n = desc->count;
+        for (uint32_t e = 0; e < n; e++) {
+            targets[count] = desc->targets[e];
+            sources[count] = jb + 1 + e;
+            count++;
+        }
+        jb++;
+
+        for (uint32_t e = 0; e < n; e++, jb++) {
+            if (read_sector(journal_lba(jb), buf) != 0) {
+                rc = -1;
+                break;
+            }
+            crc = crc32(crc, buf, 512);
+        }
+        if (rc != 0) break;
+    }
+
+    if (rc == 0 && !committed) {
+        if (count > 0)
+            printf("[spikefs] journal: discarded incomplete transaction %u\n",
+                   seq);
+        kfree(targets);
+        kfree(sources);
+        replay_needed = 0;
+        return 0;
+    }
+
+    /* Pass 2: copy each logged sector home */
+    for (uint32_t i = 0; i < count && rc == 0; i++) {
+        if (targets[i] >= disk->total_sectors
+            || (targets[i] >= journal_lba(0)
+                && targets[i] < journal_lba(layout.journal_blocks))) {
+            printf("[spikefs] journal: bad target %d, not replaying\n",
+                   targets[i]);
+            rc = -1;
+            break;
+        }
+        if (read_sector(journal_lba(sources[i]), buf) != 0
+            || write_sector(targets[i], buf) != 0)
+            rc = -1;
+    }
+    kfree(targets);
+    kfree(sources);
+
+    if (rc != 0) {
+        printf("[spikefs] journal: replay failed\n");
+        return -1;
+    }
+    ata_flush();
+
+    memset(buf, 0, sizeof(buf));
+    hdr->magic = SPIKEFS_JOURNAL_MAGIC;
+    hdr->seq = seq + 1;
+    if (write_sector(journal_lba(0), buf) != 0)
+        return -1;
+    journal_seq = seq + 1;
+    replay_needed = 0;
+
+    printf("[spikefs] journal: replayed transaction %u (%u sectors)\n",
+           seq, count);
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Extents                                                           */
+/* ------------------------------------------------------------------ */
+
+/* Append one extent to a growable array. Returns 0 on success. */
+static int extent_push(spikefs_extent_t **arr, uint32_t *n, uint32_t *cap,
+                       uint32_t start, uint32_t length) {
+    /* Coalesce with the previous run when physically contiguous */
+    if (*n > 0) {
+        spikefs_extent_t *last = &(*arr)[*n - 1];
+        if (last->start + last->length == start) {
+            last->length += length;
+            return 0;
+        }
+    }
+
+    if (*n == *cap) {
+        uint32_t new_cap = *cap ? *cap * 2 : SPIKEFS_INLINE_EXTENTS;
+        spikefs_extent_t *grown = (spikefs_extent_t *)krealloc(
+            *arr, new_cap * sizeof(spikefs_extent_t));
+        if (!grown) return -1;
+        *arr = grown;
+        *cap = new_cap;
+    }
+    (*arr)[*n].start = start;
+    (*arr)[*n].length = length;
+    (*n)++;
+    return 0;
+}
+
+/* Longest run alloc_extents hands out, for testing (0 = no limit) */
+static uint32_t frag_run = 0;
+
+void spikefs_set_frag(uint32_t blocks) {
+    frag_run = blocks;
+}
+
+/* Allocate 'blocks' data blocks: one contiguous run if the disk has
+   one, otherwise the first free runs in order. Returns 0 on success. */
+static int alloc_extents(uint32_t blocks, spikefs_extent_t **out,
+                         uint32_t *n_out) {
+    spikefs_extent_t *arr = NULL, *gaps = NULL;
+    uint32_t n = 0, cap = 0, ngaps = 0, gaps_cap = 0;
+    int rc = 0;
+
+    int32_t whole = frag_run ? -1 : bitmap_alloc(blocks);
+    if (whole >= 0) {
+        if (extent_push(&arr, &n, &cap, (uint32_t)whole, blocks) != 0)
+            return -1;
+    } else {
+        while (blocks > 0 && rc == 0) {
+            uint32_t got;
+            uint32_t want = frag_run && frag_run < blocks ? frag_run : blocks;
+            int32_t start = bitmap_alloc_run(want, &got);
+            if (start < 0 || extent_push(&arr, &n, &cap,
+                                         (uint32_t)start, got) != 0) {
+                rc = -1;
+                break;
+            }
+            blocks -= got;
+
+            /* Under a limit, hold the next block back so runs can't
+               merge into one extent */
+            uint32_t next = (uint32_t)start + got;
+            if (frag_run && next < layout.num_blocks && !bitmap_test(next)) {
+                bitmap_set(next);
+                rc = extent_push(&gaps, &ngaps, &gaps_cap, next, 1);
+            }
+        }
+        for (uint32_t i = 0; i < ngaps; i++) {
+            for (uint32_t b = 0; b < gaps[i].length; b++)
+                bitmap_clear(gaps[i].start + b);
+        }
+        kfree(gaps);
+        if (rc != 0) {
+            kfree(arr);
+            return -1;
+        }
+    }
+
+    *out = arr;
+    *n_out = n;
+    return 0;
+}
+
+/*
+ * Bulk-load an extent tree bottom-up: pack leaves 42 entries at a time,
+ * then index nodes over them until a single root remains. Node writes
+ * are queued on 'batch'. Returns the root block, or 0 on failure.
+ */
+static uint32_t xtree_build(const spikefs_extent_t *ext, uint32_t n,
+                            blk_batch_t *batch) {
+    spikefs_xentry_t *level = (spikefs_xentry_t *)kmalloc(
+        n * sizeof(spikefs_xentry_t));
+    if (!level) return 0;
+
+    uint32_t logical = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        level[i].logical = logical;
+        level[i].start = ext[i].start;
+        level[i].length = ext[i].length;
+        logical += ext[i].length;
+    }
+
+    uint32_t count = n;
+    for (uint16_t depth = 0; depth < SPIKEFS_XT_MAX_DEPTH; depth++) {
+        uint32_t nodes = (count + SPIKEFS_XT_ENTRIES - 1) / SPIKEFS_XT_ENTRIES;
+        spikefs_xentry_t *up = (spikefs_xentry_t *)kmalloc(
+            nodes * sizeof(spikefs_xentry_t));
+        if (!up) break;
+
+        for (uint32_t k = 0; k < nodes; k++) {
+            spikefs_xnode_t *node = (spikefs_xnode_t *)scratch_sector();
+            int32_t blk = bitmap_alloc(1);
+            if (!node || blk < 0) {
+                kfree(up);
+                kfree(level);
+                return 0;
+            }
+
+            uint32_t first = k * SPIKEFS_XT_ENTRIES;
+            uint32_t cnt = count - first;
+            if (cnt > SPIKEFS_XT_ENTRIES) cnt = SPIKEFS_XT_ENTRIES;
+
+            node->magic = SPIKEFS_XT_MAGIC;
+            node->depth = depth;
+            node->count = (uint16_t)cnt;
+
+            uint32_t covered = 0;
+            for (uint32_t e = 0; e < cnt; e++) {
+                node->entries[e] = level[first + e];
+                covered += level[first + e].length;
+            }
+
+            up[k].logical = level[first].logical;
+            up[k].start = (uint32_t)blk;
+            up[k].length = covered;
+
+            blk_batch_add(batch, BLK_WRITE,
+                          layout.data_start + (uint32_t)blk, 1, node);
+        }
+
+        kfree(level);
+        level = up;
+        count = nodes;
+
+        if (nodes == 1) {
+            uint32_t root = up[0].start;
+            kfree(up);
+            return root;
+        }
+    }
+
+    kfree(level);
+    return 0;
+}
+
+/* Walk an extent tree in order, appending leaf extents. If 'nodes' is
+   set, the tree's own blocks are appended there too. */
+static int xtree_collect(uint32_t blk, int depth_left,
+                         spikefs_extent_t **arr, uint32_t *n,
+                         uint32_t *cap, spikefs_extent_t **nodes,
+                         uint32_t *nn, uint32_t *ncap) {
+    if (depth_left < 0 || blk == 0 || blk >= layout.num_blocks)
+        return -1;
+
+    spikefs_xnode_t *node = (spikefs_xnode_t *)kmalloc(sizeof(*node));
+    if (!node) return -1;
+
+    int rc = read_sector(layout.data_start + blk, node);
+    if (rc == 0 && (node->magic != SPIKEFS_XT_MAGIC
+                    || node->count > SPIKEFS_XT_ENTRIES))
+        rc = -1;
+    if (rc == 0 && nodes)
+        rc = extent_push(nodes, nn, ncap, blk, 1);
+
+    for (uint32_t e = 0; rc == 0 && e < node->count; e++) {
+        spikefs_xentry_t *x = &node->entries[e];
+        if (node->depth == 0)
+            rc = extent_push(arr, n, cap, x->start, x->length);
+        else
+            rc = xtree_collect(x->start, depth_left - 1, arr, n, cap,
+                               nodes, nn, ncap);
+    }
+
+    kfree(node);
+    return rc;
+}
+
+/* Extent list of a v4 inode, in logical order. Caller frees *out. */
+static int inode_extents(const spikefs_inode_t *di,
+                         spikefs_extent_t **out, uint32_t *n_out) {
+    spikefs_extent_t *arr = NULL;
+    uint32_t n = 0, cap = 0;
+    int rc = 0;
+
+    if (di->xtree) {
+        rc = xtree_collect(di->xtree, SPIKEFS_XT_MAX_DEPTH, &arr, &n, &cap,
+                           NULL, NULL, NULL);
+    } else {
+        for (uint32_t i = 0; i < SPIKEFS_INLINE_EXTENTS && rc == 0; i++) {
+            if (di->extents[i].start == 0) break;
+            rc = extent_push(&arr, &n, &cap, di->extents[i].start,
+                             di->extents[i].length);
+        }
+    }
+
+    if (rc != 0) {
+        kfree(arr);
+        return -1;
+    }
+    *out = arr;
+    *n_out = n;
+    return 0;
+}
+
+/* Extent list of a v3 inode (direct + single indirect blocks). */
+static int inode_extents_v3(const spikefs_inode_v3_t *di,
+                            spikefs_extent_t **out, uint32_t *n_out) {
+    spikefs_extent_t *arr = NULL;
+    uint32_t n = 0, cap = 0;
+    uint32_t blocks = (di->size + 511) / 512;
+    int rc = 0;
+
+    for (uint32_t d = 0; d < SPIKEFS_DIRECT_BLOCKS && d < blocks && rc == 0; d++)
+        rc = extent_push(&arr, &n, &cap, di->direct[d], 1);
+
+    if (rc == 0 && blocks > SPIKEFS_DIRECT_BLOCKS && di->indirect != 0) {
+        uint32_t *entries = (uint32_t *)kmalloc(512);
+        if (!entries || read_sector(layout.data_start + di->indirect,
+                                    entries) != 0) {
+            rc = -1;
+        } else {
+            for (uint32_t k = 0;
+                 k < 128 && k + SPIKEFS_DIRECT_BLOCKS < blocks && rc == 0;
+                 k++) {
+                if (entries[k] == 0) break;
+                rc = extent_push(&arr, &n, &cap, entries[k], 1);
+            }
+        }
+        kfree(entries);
+    }
+
+    if (rc != 0) {
+        kfree(arr);
+        return -1;
+    }
+    *out = arr;
+    *n_out = n;
+    return 0;
+}
+
+/* Blocks the next committed sync frees along with its own replaced
+   ones: a v3 disk's, once the v4 copy of everything is written */
+static spikefs_extent_t *pending_free = NULL;
+static uint32_t pending_count = 0, pending_cap = 0;
+
+static void pending_reset(void) {
+    kfree(pending_free);
+    pending_free = NULL;
+    pending_count = 0;
+    pending_cap = 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Reading inode data                                                */
+/* ------------------------------------------------------------------ */
+
+/* Queue reads of an inode's data into a page vector covering di->size
+   rounded up to whole sectors. Blocks the map doesn't cover are zeroed. */
+static int queue_inode_read(const spikefs_inode_t *di, uint32_t version,
+                            uint32_t ino, uint8_t *const *pages,
+                            blk_batch_t *batch) {
+    spikefs_extent_t *ext;
+    uint32_t n;
+    int rc = version == SPIKEFS_VERSION_V3
+             ? inode_extents_v3((const spikefs_inode_v3_t *)di, &ext, &n)
+             : inode_extents(di, &ext, &n);
+    if (rc != 0) {
+        printf("[spikefs] bad block map for inode %d\n", ino);
+        return -1;
+    }
+
+    /* Directories may carry their name index after the entries */
+    uint32_t bytes = di->size;
+    if (version != SPIKEFS_VERSION_V3 && di->type == VFS_TYPE_DIR)
+        bytes += di->dir_index;
+
+    uint32_t blocks_needed = (bytes + 511) / 512;
+    uint32_t logical = 0;
+    for (uint32_t i = 0; i < n && logical < blocks_needed; i++) {
+        uint32_t len = ext[i].length;
+        if (len > blocks_needed - logical)
+            len = blocks_needed - logical;
+        queue_pages(batch, BLK_READ, layout.data_start + ext[i].start,
+                    pages, logical, len);
+        logical += len;
+    }
+    kfree(ext);
+
+    if (logical < blocks_needed) {
+        printf("[spikefs] inode %d maps %d of %d blocks\n",
+               ino, logical, blocks_needed);
+        for (uint32_t s = logical; s < blocks_needed; s++)
+            memset(page_sector(pages, s), 0, 512);
+    }
+    return 0;
+}
+
+/* VFS backing store: fetch one file's data into its page-cache pages
+   on first access. */
+static int spikefs_fill(uint32_t ino, uint32_t size, uint8_t *const *pages) {
+    uint32_t c = ino / SPIKEFS_ICHUNK_INODES;
+    if (!disk || c >= layout.num_ichunks || !chunk_on_disk(c))
+        return -1;
+
+    spikefs_inode_t *chunk = (spikefs_inode_t *)kmalloc(512);
+    if (!chunk) return -1;
+
+    int rc = read_sector(layout.data_start + chunk_blocks[c], chunk);
+    spikefs_inode_t *di = &chunk[ino % SPIKEFS_ICHUNK_INODES];
+    if (rc == 0 && (di->type != VFS_TYPE_FILE || di->size != size))
+        rc = -1;    /* disk and memory disagree; don't guess */
+
+    if (rc == 0) {
+        blk_batch_t batch;
+        blk_batch_init(&batch, disk);
+        rc = queue_inode_read(di, mounted_version, ino, pages, &batch);
+        if (blk_batch_wait(&batch) != 0)
+            rc = -1;
+    }
+
+    kfree(chunk);
+    return rc;
+}
+
+static const vfs_backing_ops_t spikefs_backing = {
+    .fill = spikefs_fill,
+};
+
+/* Bring every lazily loaded file into memory and keep it dirty, so
+   nothing in the VFS depends on the current disk contents any more. */
+static int load_all_files(void) {
+    for (int32_t i = vfs_next_inode(0); i >= 0; i = vfs_next_inode(i + 1)) {
+        vfs_inode_t *vnode = vfs_get_inode(i);
+        if (vnode->type != VFS_TYPE_FILE
+            || !(vnode->flags & VFS_INODE_UNLOADED))
+            continue;
+        if (vfs_load_data(i) != 0)
+            return -1;
+        vnode->flags |= VFS_INODE_DIRTY;    /* pin against eviction */
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Format (v4: inode chunks in data pool, block 0 reserved)          */
 /* ------------------------------------------------------------------ */
 
 int spikefs_format(void) {
-    if (!ata_present()) return -1;
+    if (!disk) return -1;
 
-    uint32_t total = ata_total_sectors();
+    uint32_t total = disk->total_sectors;
     if (total < 64) {
         printf("[spikefs] disk too small (%d sectors)\n", total);
         return -1;
     }
 
+    /* Files not read since mount would be lost with the old disk */
+    if (load_all_files() != 0) {
+        printf("[spikefs] format: cannot load all file data, aborting\n");
+        return -1;
+    }
+    vfs_set_backing(NULL);
+    pending_reset();
+
     calculate_layout(total);
 
     /* Allocate bitmap */
@@ -156,14 +1099,28 @@ int spikefs_format(void) {
         return -1;
     bitmap_clear_all();
 
-    /* Block 0: inode chunk 0 (holds root inode + 7 free slots) */
+    /* Block 0: reserved so that block number 0 means "none" */
     bitmap_set(0);
-    /* Block 1: inode map block */
+    /* Block 1: inode chunk 0 (holds root inode + 7 free slots) */
     bitmap_set(1);
+    /* Block 2: inode map block */
+    bitmap_set(2);
 
-    layout.imap_block = 1;
+    layout.imap_block = 2;
     layout.num_ichunks = 1;
 
+    /* Blocks 3..: the journal */
+    if (journal_create() != 0)
+        return -1;
+    replay_needed = 0;
+
+    imap_reset();
+    if (chunks_reserve(1) != 0 || imap_push(2) != 0) {
+        printf("[spikefs] format: out of memory\n");
+        return -1;
+    }
+    chunk_blocks[0] = 1;
+
     /* Build inode chunk 0: root directory inode at slot 0 */
     uint8_t chunk_buf[512];
     memset(chunk_buf, 0, 512);
@@ -172,269 +1129,451 @@ int spikefs_format(void) {
     root_inode->link_count = 2;  /* "." and ".." */
     root_inode->size = 0;        /* empty dir, data written by first sync */
 
-    if (write_sector(layout.data_start + 0, chunk_buf) != 0) return -1;
+    if (write_sector(layout.data_start + 1, chunk_buf) != 0) return -1;
 
-    /* Build inode map block: entry[0]=0 (chunk 0 at block 0) */
+    /* Build inode map block: entry[0]=1 (chunk 0 at block 1) */
     uint32_t imap_buf[128];
     memset(imap_buf, 0, sizeof(imap_buf));
-    imap_buf[0] = 0;  /* chunk 0 is at block 0 */
+    imap_buf[0] = 1;
     /* entry[127] = 0 (no next imap block) */
 
-    if (write_sector(layout.data_start + 1, imap_buf) != 0) return -1;
+    if (write_sector(layout.data_start + 2, imap_buf) != 0) return -1;
 
-    /* Write zeroed bitmap sectors */
-    /* First, write the actual bitmap with blocks 0,1 marked */
+    /* Write the bitmap with blocks 0-2 marked */
     if (write_sectors(layout.bitmap_start, layout.bitmap_sectors,
                       block_bitmap) != 0)
         return -1;
+    memset(bitmap_dirty, 0, layout.bitmap_sectors);
 
     /* Write superblock */
     spikefs_super_t super;
-    memset(&super, 0, sizeof(super));
-    super.magic        = SPIKEFS_MAGIC;
-    super.version      = SPIKEFS_VERSION;
-    super.num_blocks   = layout.num_blocks;
-    super.bitmap_start = layout.bitmap_start;
-    super.data_start   = layout.data_start;
-    super.imap_block   = layout.imap_block;
-    super.num_ichunks  = layout.num_ichunks;
+    fill_super(&super);
 
     if (write_sector(0, &super) != 0) return -1;
 
     ata_flush();
 
-    printf("[spikefs] formatted: %d data blocks, 1 inode chunk\n",
-           layout.num_blocks);
+    /* Everything in memory is now newer than the disk */
+    mounted_version = SPIKEFS_VERSION;
+    vfs_mark_all_dirty();
+    vfs_set_backing(&spikefs_backing);
+
+    printf("[spikefs] formatted: %d data blocks, 1 inode chunk, "
+           "%d-block journal\n", layout.num_blocks, layout.journal_blocks);
     return 0;
 }
 
 /* ------------------------------------------------------------------ */
-/*  Sync (VFS -> disk) — v3 chunk-based write-back                    */
+/*  Sync (VFS -> disk) — incremental, dirty inodes only               */
 /* ------------------------------------------------------------------ */
 
-int spikefs_sync(void) {
-    if (!ata_present()) return -1;
+/* Allocate blocks for one inode's data (a page vector) and queue the
+   writes. */
+static int sync_inode_data(spikefs_inode_t *di, uint8_t *const *pages,
+                           uint32_t data_bytes, blk_batch_t *batch) {
+    uint32_t blocks = (data_bytes + 511) / 512;
+    spikefs_extent_t *ext;
+    uint32_t n;
 
-    uint32_t vfs_count = vfs_get_max_inodes();
+    if (alloc_extents(blocks, &ext, &n) != 0)
+        return -1;
 
-    /* 1. Find highest used inode to determine chunks needed */
-    uint32_t highest = 0;
-    for (uint32_t i = 0; i < vfs_count; i++) {
-        vfs_inode_t *vnode = vfs_get_inode(i);
-        if (vnode && vnode->type != VFS_TYPE_FREE)
-            highest = i;
+    if (n <= SPIKEFS_INLINE_EXTENTS) {
+        for (uint32_t i = 0; i < n; i++)
+            di->extents[i] = ext[i];
+    } else {
+        di->xtree = xtree_build(ext, n, batch);
+        if (di->xtree == 0) {
+            kfree(ext);
+            return -1;
+        }
     }
-    uint32_t num_ichunks = (highest / SPIKEFS_ICHUNK_INODES) + 1;
 
-    /* 2. Calculate imap blocks needed */
-    uint32_t num_imap_blocks = (num_ichunks + SPIKEFS_IMAP_ENTRIES - 1)
-                               / SPIKEFS_IMAP_ENTRIES;
+    /* Write straight from the pages. A partial tail sector is padded
+       through a scratch sector. */
+    uint32_t logical = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t off = logical * 512;
+        uint32_t bytes = data_bytes - off;
+        if (bytes > ext[i].length * 512)
+            bytes = ext[i].length * 512;
+
+        uint32_t full = bytes / 512;
+        uint32_t tail = bytes % 512;
+
+        if (full > 0)
+            queue_pages(batch, BLK_WRITE, layout.data_start + ext[i].start,
+                        pages, logical, full);
+        if (tail > 0) {
+            uint8_t *pad = scratch_sector();
+            if (!pad) {
+                kfree(ext);
+                return -1;
+            }
+            memcpy(pad, page_sector(pages, logical + full), tail);
+            blk_batch_add(batch, BLK_WRITE,
+                          layout.data_start + ext[i].start + full, 1, pad);
+        }
+        logical += ext[i].length;
+    }
 
-    /* 3. Clear bitmap and allocate chunk blocks + imap blocks */
-    bitmap_clear_all();
+    kfree(ext);
+    return 0;
+}
+
+/* Append every block an on-disk inode owns (data and tree nodes). */
+static int collect_blocks(const spikefs_inode_t *di, spikefs_extent_t **arr,
+                          uint32_t *n, uint32_t *cap) {
+    if (di->type == VFS_TYPE_FREE)
+        return 0;
+    if (di->xtree)
+        return xtree_collect(di->xtree, SPIKEFS_XT_MAX_DEPTH, arr, n, cap,
+                             arr, n, cap);
+
+    for (uint32_t i = 0; i < SPIKEFS_INLINE_EXTENTS; i++) {
+        if (di->extents[i].start == 0) break;
+        if (extent_push(arr, n, cap, di->extents[i].start,
+                        di->extents[i].length) != 0)
+            return -1;
+    }
+    return 0;
+}
 
-    /* Allocate inode chunks (consecutive) */
-    int32_t chunk_start = bitmap_alloc(num_ichunks);
-    if (chunk_start < 0) {
-        printf("[spikefs] sync: out of space for %d inode chunks\n",
-               num_ichunks);
+/* The in-memory metadata a sync starts from, put back if it fails, so
+   the blocks it allocated or released and the chunks it added don't
+   outlive it */
+typedef struct {
+    uint8_t          *bitmap;
+    uint32_t         *chunks;
+    uint32_t          nchunks;
+    uint32_t          imap_count;
+    spikefs_layout_t  layout;
+} sync_undo_t;
+
+static int sync_save(sync_undo_t *u, uint32_t nchunks) {
+    u->bitmap = (uint8_t *)kmalloc(bitmap_bytes);
+    u->chunks = (uint32_t *)kmalloc(nchunks * sizeof(uint32_t));
+    if (!u->bitmap || !u->chunks) {
+        kfree(u->bitmap);
+        kfree(u->chunks);
         return -1;
     }
+    memcpy(u->bitmap, block_bitmap, bitmap_bytes);
+    memcpy(u->chunks, chunk_blocks, nchunks * sizeof(uint32_t));
+    u->nchunks = nchunks;
+    u->imap_count = imap_count;
+    u->layout = layout;
+    return 0;
+}
+
+/* Bitmap sectors stay marked dirty; rewriting one unchanged is harmless */
+static void sync_restore(const sync_undo_t *u) {
+    memcpy(block_bitmap, u->bitmap, bitmap_bytes);
+    memcpy(chunk_blocks, u->chunks, u->nchunks * sizeof(uint32_t));
+    imap_count = u->imap_count;
+    layout = u->layout;
+}
+
+static void sync_undo_free(sync_undo_t *u) {
+    kfree(u->bitmap);
+    kfree(u->chunks);
+}
+
+/* An inode written by the sync in progress, and its dirty_seq when it
+   was read: the sync may sleep, and a change made meanwhile must keep
+   the inode dirty */
+typedef struct {
+    uint32_t ino;
+    uint32_t seq;
+} sync_seen_t;
 
-    /* Allocate imap blocks (consecutive) */
-    int32_t imap_start = bitmap_alloc(num_imap_blocks);
-    if (imap_start < 0) {
-        printf("[spikefs] sync: out of space for imap\n");
+int spikefs_sync(void) {
+    if (!disk || !block_bitmap) return -1;
+
+    /* Finish a checkpoint an earlier sync couldn't */
+    if (replay_needed && journal_replay() != 0)
         return -1;
+    tx_reset();
+
+    uint32_t vfs_count = vfs_get_max_inodes();
+
+    /* 1. Chunks needed to cover the highest used inode (never shrinks;
+          chunks left empty are released below instead) */
+    uint32_t highest = 0;
+    for (int32_t i = vfs_next_inode(0); i >= 0; i = vfs_next_inode(i + 1)) {
+        if (vfs_get_inode(i)->type != VFS_TYPE_FREE)
+            highest = (uint32_t)i;
     }
+    uint32_t num_ichunks = (highest / SPIKEFS_ICHUNK_INODES) + 1;
+    if (num_ichunks < layout.num_ichunks)
+        num_ichunks = layout.num_ichunks;
+    int imap_changed = num_ichunks != layout.num_ichunks;
 
-    layout.imap_block = (uint32_t)imap_start;
-    layout.num_ichunks = num_ichunks;
+    if (chunks_reserve(num_ichunks) != 0) {
+        printf("[spikefs] sync: out of memory\n");
+        return -1;
+    }
+    uint8_t **bufs = (uint8_t **)kcalloc(num_ichunks, sizeof(uint8_t *));
+    sync_undo_t undo;
+    if (!bufs || sync_save(&undo, num_ichunks) != 0) {
+        kfree(bufs);
+        printf("[spikefs] sync: out of memory\n");
+        return -1;
+    }
 
-    /* 4. Build and write inode chunks, allocating data blocks per inode */
+    spikefs_extent_t *stale = NULL;
+    uint32_t nstale = 0, stale_cap = 0;
+    uint32_t chunks_written = 0, inodes_written = 0;
+    sync_seen_t *seen = NULL;
+    uint32_t nread = 0, nseen = 0;
+
+    /* 2. Read back every chunk holding a dirty inode; the old block
+          maps come from there. Clean chunks are never touched. */
+    blk_batch_t batch;
+    blk_batch_init(&batch, disk);
+    for (int32_t i = vfs_next_inode(0); i >= 0; i = vfs_next_inode(i + 1)) {
+        uint32_t c = (uint32_t)i / SPIKEFS_ICHUNK_INODES;
+        if (c >= num_ichunks || bufs[c]
+            || !(vfs_get_inode(i)->flags & VFS_INODE_DIRTY))
+            continue;
+        bufs[c] = scratch_sector();
+        if (!bufs[c]) goto oom;
+        nread++;
+        if (chunk_blocks[c])
+            blk_batch_add(&batch, BLK_READ,
+                          layout.data_start + chunk_blocks[c], 1, bufs[c]);
+    }
+    if (blk_batch_wait(&batch) != 0) {
+        printf("[spikefs] sync: failed to read inode chunks\n");
+        goto fail;
+    }
+    seen = (sync_seen_t *)kmalloc((nread ? nread : 1) * SPIKEFS_ICHUNK_INODES
+                                  * sizeof(sync_seen_t));
+    if (!seen) goto oom;
+
+    /* 3. Rewrite dirty inodes. New blocks are allocated before any old
+          ones are released, so this sync never overwrites data the
+          on-disk metadata still points at. */
+    blk_batch_init(&batch, disk);
     for (uint32_t c = 0; c < num_ichunks; c++) {
-        uint8_t chunk_buf_local[512];
-        memset(chunk_buf_local, 0, 512);
-        spikefs_inode_t *disk_inodes = (spikefs_inode_t *)chunk_buf_local;
+        if (!bufs[c]) continue;
+
+        if (chunk_blocks[c] == 0) {
+            int32_t blk = bitmap_alloc(1);
+            if (blk < 0) {
+                printf("[spikefs] sync: out of space for inode chunk %d\n", c);
+                goto fail;
+            }
+            chunk_blocks[c] = (uint32_t)blk;
+            imap_changed = 1;
+        }
+
+        spikefs_inode_t *disk_inodes = (spikefs_inode_t *)bufs[c];
 
         for (uint32_t j = 0; j < SPIKEFS_ICHUNK_INODES; j++) {
             uint32_t ino = c * SPIKEFS_ICHUNK_INODES + j;
             if (ino >= vfs_count) break;
 
             vfs_inode_t *vnode = vfs_get_inode(ino);
-            if (!vnode || vnode->type == VFS_TYPE_FREE) {
-                memset(&disk_inodes[j], 0, sizeof(spikefs_inode_t));
+            if (!vnode || !(vnode->flags & VFS_INODE_DIRTY))
+                continue;
+
+            spikefs_inode_t *di = &disk_inodes[j];
+            inodes_written++;
+            seen[nseen].ino = ino;
+            seen[nseen].seq = vnode->dirty_seq;
+            nseen++;
+
+            /* Only metadata changed: the disk copy of the data stands */
+            if (vnode->type == VFS_TYPE_FILE
+                && (vnode->flags & VFS_INODE_UNLOADED)) {
+                di->type = vnode->type;
+                di->link_count = vnode->link_count;
                 continue;
             }
 
-            disk_inodes[j].type = vnode->type;
-            disk_inodes[j].link_count = vnode->link_count;
-            disk_inodes[j].indirect = 0;
-            disk_inodes[j].reserved = 0;
+            if (collect_blocks(di, &stale, &nstale, &stale_cap) != 0)
+                printf("[spikefs] sync: cannot release blocks of inode %d\n",
+                       ino);
+            memset(di, 0, sizeof(*di));
+
+            if (vnode->type == VFS_TYPE_FREE)
+                continue;
 
-            /* Determine data bytes */
-            uint32_t data_bytes;
+            di->type = vnode->type;
+            di->link_count = vnode->link_count;
+
+            /* Determine data bytes (a directory's name index rides
+               along after its entries) */
+            uint32_t data_bytes, index_bytes = 0;
             if (vnode->type == VFS_TYPE_FILE) {
                 data_bytes = vnode->size;
             } else {
                 data_bytes = vnode->size * sizeof(vfs_dirent_t);
+                if (vnode->index)
+                    index_bytes = vnode->index_cap * sizeof(uint32_t);
             }
-            disk_inodes[j].size = data_bytes;
+            di->size = data_bytes;
+            di->dir_index = index_bytes;
 
-            if (data_bytes == 0) {
-                memset(disk_inodes[j].direct, 0,
-                       sizeof(disk_inodes[j].direct));
+            if (data_bytes == 0)
                 continue;
-            }
 
-            /* Allocate data blocks */
-            uint32_t blocks_needed = (data_bytes + 511) / 512;
-            uint32_t direct_count = blocks_needed;
-            uint32_t indirect_count = 0;
-
-            if (blocks_needed > SPIKEFS_DIRECT_BLOCKS) {
-                direct_count = SPIKEFS_DIRECT_BLOCKS;
-                indirect_count = blocks_needed - SPIKEFS_DIRECT_BLOCKS;
-            }
-
-            uint32_t total_alloc = blocks_needed
-                                   + (indirect_count > 0 ? 1 : 0);
-            int32_t first_block = bitmap_alloc(total_alloc);
-            if (first_block < 0) {
+            uint8_t **pages = vnode->type == VFS_TYPE_FILE
+                              ? file_page_vector(ino, data_bytes)
+                              : split_page_vector((uint8_t *)vnode->data,
+                                                  data_bytes,
+                                                  (uint8_t *)vnode->index,
+                                                  index_bytes);
+            if (!pages) goto oom;
+
+            int rc = sync_inode_data(di, pages, data_bytes + index_bytes,
+                                     &batch);
+            kfree(pages);
+            if (rc != 0) {
                 printf("[spikefs] sync: out of space for inode %d\n", ino);
-                return -1;
+                goto fail;
             }
+        }
 
-            /* Fill direct block pointers */
-            for (uint32_t d = 0; d < SPIKEFS_DIRECT_BLOCKS; d++) {
-                if (d < direct_count)
-                    disk_inodes[j].direct[d] =
-                        (uint32_t)first_block + d;
-                else
-                    disk_inodes[j].direct[d] = 0;
-            }
-
-            /* Write data to direct blocks */
-            uint8_t *data_ptr = (uint8_t *)vnode->data;
-            uint32_t remaining = data_bytes;
-
-            for (uint32_t d = 0; d < direct_count && remaining > 0; d++) {
-                uint32_t sector = layout.data_start
-                                  + (uint32_t)first_block + d;
-                uint32_t chunk = remaining > 512 ? 512 : remaining;
+        /* A chunk whose inodes are all free gives its block back; load
+           and check skip chunks with no block */
+        uint32_t j = 0;
+        while (j < SPIKEFS_ICHUNK_INODES && disk_inodes[j].type == VFS_TYPE_FREE)
+            j++;
+        if (c != 0 && j == SPIKEFS_ICHUNK_INODES) {
+            if (extent_push(&stale, &nstale, &stale_cap, chunk_blocks[c], 1) != 0)
+                goto oom;
+            chunk_blocks[c] = 0;
+            imap_changed = 1;
+            continue;
+        }
 
-                memset(sector_buf, 0, 512);
-                memcpy(sector_buf, data_ptr, chunk);
-                if (write_sector(sector, sector_buf) != 0)
-                    return -1;
+        if (tx_log(layout.data_start + chunk_blocks[c], bufs[c]) != 0)
+            goto oom;
+        chunks_written++;
+    }
 
-                data_ptr += chunk;
-                remaining -= chunk;
+    /* 4. Rewrite the inode map chain if chunks were added */
+    if (imap_changed) {
+        uint32_t need = (num_ichunks + SPIKEFS_IMAP_ENTRIES - 1)
+                        / SPIKEFS_IMAP_ENTRIES;
+        while (imap_count < need) {
+            int32_t blk = bitmap_alloc(1);
+            if (blk < 0 || imap_push((uint32_t)blk) != 0) {
+                printf("[spikefs] sync: out of space for imap\n");
+                goto fail;
             }
+        }
 
-            /* Handle indirect blocks if needed */
-            if (indirect_count > 0) {
-                uint32_t indirect_blk =
-                    (uint32_t)first_block + direct_count;
-                disk_inodes[j].indirect = indirect_blk;
-
-                uint32_t indirect_entries[128];
-                memset(indirect_entries, 0, sizeof(indirect_entries));
-
-                for (uint32_t k = 0;
-                     k < indirect_count && k < 128;
-                     k++) {
-                    uint32_t data_blk = indirect_blk + 1 + k;
-                    indirect_entries[k] = data_blk;
-
-                    uint32_t sector = layout.data_start + data_blk;
-                    uint32_t chunk = remaining > 512 ? 512 : remaining;
+        for (uint32_t m = 0; m < imap_count; m++) {
+            uint32_t *imap_buf = (uint32_t *)scratch_sector();
+            if (!imap_buf) goto oom;
 
-                    memset(sector_buf, 0, 512);
-                    memcpy(sector_buf, data_ptr, chunk);
-                    if (write_sector(sector, sector_buf) != 0)
-                        return -1;
+            for (uint32_t e = 0; e < SPIKEFS_IMAP_ENTRIES; e++) {
+                uint32_t c = m * SPIKEFS_IMAP_ENTRIES + e;
+                if (c >= num_ichunks) break;
+                imap_buf[e] = chunk_blocks[c];
+            }
 
-                    data_ptr += chunk;
-                    remaining -= chunk;
-                }
+            /* Entry 127 = next imap block (0 if last) */
+            if (m + 1 < imap_count)
+                imap_buf[127] = imap_blocks[m + 1];
 
-                uint32_t sector = layout.data_start + indirect_blk;
-                if (write_sector(sector, indirect_entries) != 0)
-                    return -1;
-            }
+            if (tx_log(layout.data_start + imap_blocks[m],
+                       (uint8_t *)imap_buf) != 0)
+                goto oom;
         }
-
-        /* Write this inode chunk to disk */
-        uint32_t chunk_sector = layout.data_start
-                                + (uint32_t)chunk_start + c;
-        if (write_sector(chunk_sector, chunk_buf_local) != 0)
-            return -1;
+        layout.imap_block = imap_blocks[0];
     }
+    layout.num_ichunks = num_ichunks;
 
-    /* 5. Build and write inode map blocks */
-    uint32_t chunks_written = 0;
-    for (uint32_t m = 0; m < num_imap_blocks; m++) {
-        uint32_t imap_buf[128];
-        memset(imap_buf, 0, sizeof(imap_buf));
-
-        uint32_t entries_this = num_ichunks - chunks_written;
-        if (entries_this > SPIKEFS_IMAP_ENTRIES)
-            entries_this = SPIKEFS_IMAP_ENTRIES;
-
-        for (uint32_t e = 0; e < entries_this; e++) {
-            /* Chunk block number = chunk_start + chunk_index */
-            imap_buf[e] = (uint32_t)chunk_start + chunks_written + e;
+    /* 5. Release replaced blocks, then log the bitmap sectors that
+          changed and the superblock */
+    for (uint32_t i = 0; i < nstale; i++) {
+        for (uint32_t b = 0; b < stale[i].length; b++) {
+            if (stale[i].start + b != 0)
+                bitmap_clear(stale[i].start + b);
         }
-
-        /* Entry 127 = next imap block (0 if last) */
-        if (m + 1 < num_imap_blocks) {
-            imap_buf[127] = (uint32_t)imap_start + m + 1;
-        } else {
-            imap_buf[127] = 0;
+    }
+    for (uint32_t i = 0; i < pending_count; i++) {
+        for (uint32_t b = 0; b < pending_free[i].length; b++) {
+            if (pending_free[i].start + b != 0)
+                bitmap_clear(pending_free[i].start + b);
         }
-
-        uint32_t imap_sector = layout.data_start
-                               + (uint32_t)imap_start + m;
-        if (write_sector(imap_sector, imap_buf) != 0)
-            return -1;
-
-        chunks_written += entries_this;
+    }
+    kfree(stale);
+    stale = NULL;
+
+    for (uint32_t sec = 0; sec < layout.bitmap_sectors; sec++) {
+        if (bitmap_dirty[sec]
+            && tx_log(layout.bitmap_start + sec,
+                      block_bitmap + sec * 512) != 0)
+            goto oom;
     }
 
-    /* 6. Write bitmap */
-    if (write_sectors(layout.bitmap_start, layout.bitmap_sectors,
-                      block_bitmap) != 0)
-        return -1;
-
-    /* 7. Write superblock */
-    spikefs_super_t super;
-    memset(&super, 0, sizeof(super));
-    super.magic        = SPIKEFS_MAGIC;
-    super.version      = SPIKEFS_VERSION;
-    super.num_blocks   = layout.num_blocks;
-    super.bitmap_start = layout.bitmap_start;
-    super.data_start   = layout.data_start;
-    super.imap_block   = layout.imap_block;
-    super.num_ichunks  = layout.num_ichunks;
-
-    if (write_sector(0, &super) != 0)
+    spikefs_super_t *super = (spikefs_super_t *)scratch_sector();
+    if (!super || tx_log(0, (uint8_t *)super) != 0)
+        goto oom;
+    fill_super(super);
+
+    /* 6. Data first, then the metadata through the journal */
+    if (tx_commit(&batch) != 0) {
+        /* Past the commit record the new metadata is what replay puts
+           on disk, so memory keeps it; before that the disk still
+           holds the old one */
+        if (replay_needed)
+            pending_reset();
+        else
+            sync_restore(&undo);
+        scratch_free_all();
+        kfree(bufs);
+        kfree(seen);
+        sync_undo_free(&undo);
+        printf("[spikefs] sync: write failed\n");
         return -1;
-
-    /* 8. Flush and clear dirty */
-    ata_flush();
-    vfs_mark_clean();
-
-    printf("[spikefs] synced to disk (%d inode chunks)\n", num_ichunks);
+    }
+    scratch_free_all();
+    kfree(bufs);
+    sync_undo_free(&undo);
+    pending_reset();
+    memset(bitmap_dirty, 0, layout.bitmap_sectors);
+
+    /* 7. Clear dirty on what was written, unless it changed since */
+    for (uint32_t i = 0; i < nseen; i++)
+        vfs_clear_dirty(seen[i].ino, seen[i].seq);
+    kfree(seen);
+    vfs_mark_synced();
+
+    printf("[spikefs] synced to disk (%d inodes in %d chunks)\n",
+           inodes_written, chunks_written);
     return 0;
+
+oom:
+    printf("[spikefs] sync: out of memory\n");
+fail:
+    /* Drain whatever was queued before the scratch buffers go away */
+    blk_batch_wait(&batch);
+    scratch_free_all();
+    kfree(bufs);
+    kfree(stale);
+    kfree(seen);
+    sync_restore(&undo);
+    sync_undo_free(&undo);
+    return -1;
 }
 
 /* ------------------------------------------------------------------ */
-/*  Load (disk -> VFS) — v3 chunk-based                               */
+/*  Load (disk -> VFS) — metadata and directories only               */
 /* ------------------------------------------------------------------ */
 
-int spikefs_load(void) {
-    if (!ata_present()) return -1;
+static int load_disk(uint32_t version) {
+    if (!disk) return -1;
+
+    uint64_t t0 = timer_cycles();
+    vfs_set_backing(NULL);
+    pending_reset();
+    mounted_version = version;
 
     /* Allocate bitmap */
     if (bitmap_init(layout.bitmap_sectors) != 0)
@@ -446,6 +1585,7 @@ int spikefs_load(void) {
         printf("[spikefs] load: failed to read bitmap\n");
         return -1;
     }
+    memset(bitmap_dirty, 0, layout.bitmap_sectors);
 
     /* Read inode map chain to get chunk block numbers */
     uint32_t total_inodes = layout.num_ichunks * SPIKEFS_ICHUNK_INODES;
@@ -457,10 +1597,10 @@ int spikefs_load(void) {
         return -1;
     }
 
-    /* Collect all chunk block numbers by walking the imap chain */
-    uint32_t *chunk_blocks = (uint32_t *)kmalloc(
-        layout.num_ichunks * sizeof(uint32_t));
-    if (!chunk_blocks) {
+    /* Collect all chunk block numbers by walking the imap chain. Both
+       lists stay in memory for lazy loads and incremental syncs. */
+    imap_reset();
+    if (chunks_reserve(layout.num_ichunks) != 0) {
         printf("[spikefs] load: out of memory for chunk list\n");
         return -1;
     }
@@ -468,12 +1608,12 @@ int spikefs_load(void) {
     uint32_t chunks_read = 0;
     uint32_t imap_blk = layout.imap_block;
 
-    while (imap_blk != 0 && chunks_read < layout.num_ichunks) {
+    while (chunks_read < layout.num_ichunks) {
         uint32_t imap_buf[128];
         uint32_t imap_sector = layout.data_start + imap_blk;
 
-        if (read_sector(imap_sector, imap_buf) != 0) {
-            kfree(chunk_blocks);
+        if (read_sector(imap_sector, imap_buf) != 0
+            || imap_push(imap_blk) != 0) {
             printf("[spikefs] load: failed to read imap block\n");
             return -1;
         }
@@ -488,148 +1628,380 @@ int spikefs_load(void) {
 
         chunks_read += entries;
         imap_blk = imap_buf[127];  /* next imap block (0 = end) */
+        if (imap_blk == 0) break;
     }
+    layout.num_ichunks = chunks_read;
 
-    /* Reset in-memory VFS */
-    vfs_reset();
+    /* Read every inode chunk in one batch. Chunks with no block hold
+       no inodes and get no buffer. */
+    uint32_t present = 0;
+    for (uint32_t c = 0; c < layout.num_ichunks; c++) {
+        if (chunk_on_disk(c)) present++;
+    }
+    uint8_t *chunks = (uint8_t *)kmalloc(present * 512);
+    uint8_t **cbuf = (uint8_t **)kcalloc(layout.num_ichunks, sizeof(uint8_t *));
+    if (!chunks || !cbuf) {
+        kfree(chunks);
+        kfree(cbuf);
+        printf("[spikefs] load: out of memory for inode chunks\n");
+        return -1;
+    }
 
-    /* Read each inode chunk and populate VFS */
+    blk_batch_t batch;
+    blk_batch_init(&batch, disk);
+    present = 0;
     for (uint32_t c = 0; c < layout.num_ichunks; c++) {
-        uint8_t chunk_buf_local[512];
-        uint32_t chunk_sector = layout.data_start + chunk_blocks[c];
+        if (!chunk_on_disk(c)) continue;
+        cbuf[c] = chunks + present++ * 512;
+        blk_batch_add(&batch, BLK_READ,
+                      layout.data_start + chunk_blocks[c], 1, cbuf[c]);
+    }
+    if (blk_batch_wait(&batch) != 0) {
+        kfree(chunks);
+        kfree(cbuf);
+        printf("[spikefs] load: failed to read inode chunks\n");
+        return -1;
+    }
 
-        if (read_sector(chunk_sector, chunk_buf_local) != 0) {
-            kfree(chunk_blocks);
-            printf("[spikefs] load: failed to read chunk %d\n", c);
-            return -1;
-        }
+    /* Reset in-memory VFS */
+    vfs_reset();
 
-        spikefs_inode_t *disk_inodes =
-            (spikefs_inode_t *)chunk_buf_local;
+    /*
+     * Populate VFS inodes. Directories are read now, since every path
+     * lookup needs them; file data stays on disk until first use and is
+     * then read straight into page-cache pages. (A v3 disk being
+     * upgraded has all of it pulled in by spikefs_upgrade.)
+     */
+    uint32_t total = layout.num_ichunks * SPIKEFS_ICHUNK_INODES;
+    uint32_t dirs = 0, deferred = 0;
+    int failed = 0;
+
+    blk_batch_init(&batch, disk);
+    for (uint32_t ino = 0; ino < total && !failed; ino++) {
+        uint8_t *chunk = cbuf[ino / SPIKEFS_ICHUNK_INODES];
+        if (!chunk) {
+            ino |= SPIKEFS_ICHUNK_INODES - 1;   /* skip the whole chunk */
+            continue;
+        }
 
-        for (uint32_t j = 0; j < SPIKEFS_ICHUNK_INODES; j++) {
-            uint32_t ino = c * SPIKEFS_ICHUNK_INODES + j;
+        /* v3 and v4 inodes share the leading type/link/size fields */
+        spikefs_inode_t *di = (spikefs_inode_t *)
+            (chunk + (ino % SPIKEFS_ICHUNK_INODES) * 64);
 
-            if (disk_inodes[j].type == VFS_TYPE_FREE)
-                continue;
+        if (di->type == VFS_TYPE_FREE)
+            continue;
 
-            vfs_inode_t *vnode = vfs_get_inode(ino);
-            if (!vnode) continue;
+        vfs_inode_t *vnode = vfs_install_inode(ino, di->type);
+        if (!vnode) continue;
 
-            vnode->type = disk_inodes[j].type;
-            vnode->link_count = disk_inodes[j].link_count;
+        vnode->link_count = di->link_count;
 
-            uint32_t data_bytes = disk_inodes[j].size;
+        uint32_t data_bytes = di->size;
 
-            if (data_bytes == 0) {
-                if (vnode->type == VFS_TYPE_DIR) {
-                    vnode->size = 0;
-                    vnode->capacity = 0;
-                    vnode->data = NULL;
-                }
-                continue;
-            }
+        if (vnode->type == VFS_TYPE_DIR) {
+            /* Drop the fresh root vfs_reset() built; the disk has one */
+            kfree(vnode->data);
+            kfree(vnode->index);
+            vnode->data = NULL;
+            vnode->index = NULL;
+            vnode->index_cap = 0;
+            vnode->size = 0;
+            vnode->capacity = 0;
+            dirs++;
+        }
 
-            /* Allocate memory for data */
-            void *data = kmalloc(data_bytes);
-            if (!data) {
-                printf("[spikefs] load: out of memory for inode %d\n",
-                       ino);
-                kfree(chunk_blocks);
-                return -1;
-            }
+        if (data_bytes == 0)
+            continue;
 
-            /* Read data from disk blocks */
-            uint8_t *dst = (uint8_t *)data;
-            uint32_t remaining = data_bytes;
-
-            uint32_t blocks_needed = (data_bytes + 511) / 512;
-            uint32_t direct_count = blocks_needed;
-            if (direct_count > SPIKEFS_DIRECT_BLOCKS)
-                direct_count = SPIKEFS_DIRECT_BLOCKS;
-
-            for (uint32_t d = 0;
-                 d < direct_count && remaining > 0;
-                 d++) {
-                uint32_t blk = disk_inodes[j].direct[d];
-                uint32_t sector = layout.data_start + blk;
-
-                if (read_sector(sector, sector_buf) != 0) {
-                    kfree(data);
-                    kfree(chunk_blocks);
-                    return -1;
-                }
-
-                uint32_t chunk = remaining > 512 ? 512 : remaining;
-                memcpy(dst, sector_buf, chunk);
-                dst += chunk;
-                remaining -= chunk;
-            }
+        if (vnode->type == VFS_TYPE_FILE) {
+            vnode->size = data_bytes;
+            vnode->flags |= VFS_INODE_UNLOADED;
+            deferred++;
+            continue;
+        }
 
-            /* Read from indirect blocks if needed */
-            if (remaining > 0 && disk_inodes[j].indirect != 0) {
-                uint32_t indirect_entries[128];
-                uint32_t sector = layout.data_start
-                                  + disk_inodes[j].indirect;
-
-                if (read_sector(sector, indirect_entries) != 0) {
-                    kfree(data);
-                    kfree(chunk_blocks);
-                    return -1;
-                }
-
-                for (uint32_t k = 0;
-                     k < 128 && remaining > 0;
-                     k++) {
-                    if (indirect_entries[k] == 0) break;
-
-                    sector = layout.data_start + indirect_entries[k];
-                    if (read_sector(sector, sector_buf) != 0) {
-                        kfree(data);
-                        kfree(chunk_blocks);
-                        return -1;
-                    }
-
-                    uint32_t chunk = remaining > 512
-                                     ? 512 : remaining;
-                    memcpy(dst, sector_buf, chunk);
-                    dst += chunk;
-                    remaining -= chunk;
-                }
-            }
+        if (version != SPIKEFS_VERSION_V3)
+            data_bytes += di->dir_index;
+        uint32_t blocks_needed = (data_bytes + 511) / 512;
+        uint8_t *data = (uint8_t *)kmalloc(blocks_needed * 512);
+        uint8_t **pages = data ? page_vector(data, blocks_needed * 512) : NULL;
+        if (!pages) {
+            printf("[spikefs] load: out of memory for inode %d\n", ino);
+            kfree(data);
+            failed = 1;
+            break;
+        }
+        int rc = queue_inode_read(di, version, ino, pages, &batch);
+        kfree(pages);
+        if (rc != 0) {
+            kfree(data);
+            failed = 1;
+            break;
+        }
 
-            /* Set the VFS inode fields */
-            if (vnode->type == VFS_TYPE_FILE) {
-                vnode->size = data_bytes;
-                vnode->capacity = data_bytes;
-                vnode->data = data;
-            } else {
-                uint32_t num_entries =
-                    data_bytes / sizeof(spikefs_dirent_t);
-                vnode->size = num_entries;
-                vnode->capacity = num_entries;
-                vnode->data = data;
-            }
+        uint32_t num_entries = di->size / sizeof(spikefs_dirent_t);
+        vnode->size = num_entries;
+        vnode->capacity = num_entries;
+        vnode->data = data;
+    }
+    if (blk_batch_wait(&batch) != 0)
+        failed = 1;
+
+    /* Hand stored name indexes to the VFS and trim them off the
+       entry arrays */
+    for (uint32_t ino = 0; ino < total && !failed
+                           && version != SPIKEFS_VERSION_V3; ino++) {
+        uint8_t *chunk = cbuf[ino / SPIKEFS_ICHUNK_INODES];
+        if (!chunk) {
+            ino |= SPIKEFS_ICHUNK_INODES - 1;
+            continue;
         }
+        spikefs_inode_t *di = (spikefs_inode_t *)
+            (chunk + (ino % SPIKEFS_ICHUNK_INODES) * 64);
+        if (di->type != VFS_TYPE_DIR || di->dir_index == 0)
+            continue;
+
+        vfs_inode_t *vnode = vfs_get_inode(ino);
+        if (!vnode || !vnode->data) continue;
+
+        uint32_t *index = (uint32_t *)kmalloc(di->dir_index);
+        if (index)
+            memcpy(index, (uint8_t *)vnode->data + di->size, di->dir_index);
+        vnode->data = krealloc(vnode->data, di->size);
+        vfs_dir_set_index(ino, index, di->dir_index / sizeof(uint32_t));
+    }
+
+    kfree(chunks);
+    kfree(cbuf);
+
+    if (failed) {
+        printf("[spikefs] load: failed to read filesystem data\n");
+        return -1;
     }
 
-    kfree(chunk_blocks);
     vfs_mark_clean();
-    printf("[spikefs] loaded from disk (%d inode chunks, %d inodes)\n",
-           layout.num_ichunks,
-           layout.num_ichunks * SPIKEFS_ICHUNK_INODES);
+    vfs_set_backing(&spikefs_backing);
+
+    uint32_t us = timer_cycles_to_us(timer_cycles() - t0);
+    printf("[spikefs] mounted in %u ms (%d inode chunks, %u dirs read, "
+           "%u files deferred)\n",
+           us / 1000, layout.num_ichunks, dirs, deferred);
     return 0;
 }
 
+int spikefs_load(void) {
+    return load_disk(SPIKEFS_VERSION);
+}
+
+/* ------------------------------------------------------------------ */
+/*  v3 upgrade                                                        */
+/* ------------------------------------------------------------------ */
+
+/* Every block the mounted v3 filesystem uses: its inode map chain,
+   inode chunks, indirect blocks and data */
+static int v3_blocks(spikefs_extent_t **arr, uint32_t *n, uint32_t *cap) {
+    spikefs_inode_v3_t *chunk = (spikefs_inode_v3_t *)kmalloc(512);
+    if (!chunk) return -1;
+
+    int rc = 0;
+    for (uint32_t m = 0; m < imap_count && rc == 0; m++)
+        rc = extent_push(arr, n, cap, imap_blocks[m], 1);
+
+    for (uint32_t c = 0; c < layout.num_ichunks && rc == 0; c++) {
+        rc = extent_push(arr, n, cap, chunk_blocks[c], 1);
+        if (rc == 0)
+            rc = read_sector(layout.data_start + chunk_blocks[c], chunk);
+
+        for (uint32_t j = 0; j < SPIKEFS_ICHUNK_INODES && rc == 0; j++) {
+            spikefs_inode_v3_t *di = &chunk[j];
+            if (di->type == VFS_TYPE_FREE) continue;
+
+            spikefs_extent_t *ext = NULL;
+            uint32_t next = 0;
+            rc = inode_extents_v3(di, &ext, &next);
+            for (uint32_t i = 0; i < next && rc == 0; i++)
+                rc = extent_push(arr, n, cap, ext[i].start, ext[i].length);
+            if (rc == 0 && di->indirect)
+                rc = extent_push(arr, n, cap, di->indirect, 1);
+            kfree(ext);
+        }
+    }
+
+    kfree(chunk);
+    return rc;
+}
+
+/*
+ * Rewrite the mounted v3 filesystem as v4 without touching anything it
+ * uses. The bitmap is rebuilt from what the v3 metadata references
+ * (which also drops blocks an interrupted upgrade took), every inode
+ * goes to fresh blocks, and the v3 blocks are only freed by the sync
+ * that switches the superblock to v4. That sync is one transaction:
+ * until it commits, the disk is the v3 filesystem as it was, and the
+ * next mount simply upgrades again.
+ */
+static int spikefs_upgrade(void) {
+    if (load_all_files() != 0) {
+        printf("[spikefs] upgrade: cannot load all file data, aborting\n");
+        return -1;
+    }
+
+    spikefs_extent_t *old = NULL;
+    uint32_t nold = 0, cap = 0;
+    if (v3_blocks(&old, &nold, &cap) != 0) {
+        printf("[spikefs] upgrade: cannot read the v3 block maps\n");
+        kfree(old);
+        return -1;
+    }
+
+    bitmap_clear_all();
+    memset(bitmap_dirty, 1, layout.bitmap_sectors);
+    bitmap_set(0);
+    for (uint32_t i = 0; i < nold; i++) {
+        for (uint32_t b = 0; b < old[i].length; b++)
+            bitmap_set(old[i].start + b);
+    }
+
+    /* Nothing of v4 exists yet; the sync allocates it all */
+    imap_reset();
+    layout.imap_block = 0;
+    layout.num_ichunks = 0;
+    if (journal_create() != 0) {
+        kfree(old);
+        return -1;
+    }
+    replay_needed = 0;
+
+    pending_reset();
+    pending_free = old;
+    pending_count = nold;
+    pending_cap = cap;
+
+    mounted_version = SPIKEFS_VERSION;
+    vfs_mark_all_dirty();
+    vfs_set_backing(&spikefs_backing);
+    return spikefs_sync();
+}
+
+/* ------------------------------------------------------------------ */
+/*  Consistency check                                                 */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    uint8_t  *seen;             /* blocks claimed so far */
+    uint8_t  *bitmap;           /* on-disk allocation bitmap */
+    uint32_t  bad, twice, unmarked;
+} check_state_t;
+
+static void check_claim(check_state_t *st, uint32_t blk) {
+    if (blk >= layout.num_blocks) {
+        st->bad++;
+        return;
+    }
+    if (st->seen[blk / 8] & (1 << (blk % 8)))
+        st->twice++;
+    if (!(st->bitmap[blk / 8] & (1 << (blk % 8))))
+        st->unmarked++;
+    st->seen[blk / 8] |= (1 << (blk % 8));
+}
+
+int spikefs_check(void) {
+    if (!disk || !block_bitmap || mounted_version != SPIKEFS_VERSION)
+        return -1;
+
+    check_state_t st;
+    memset(&st, 0, sizeof(st));
+    st.seen = (uint8_t *)kcalloc(bitmap_bytes, 1);
+    st.bitmap = (uint8_t *)kmalloc(bitmap_bytes);
+    uint8_t *chunks = (uint8_t *)kcalloc(layout.num_ichunks, 512);
+    spikefs_extent_t *ext = NULL;
+    uint32_t next = 0, ext_cap = 0;
+    int problems = -1;
+
+    if (!st.seen || !st.bitmap || !chunks) {
+        printf("[spikefs] check: out of memory\n");
+        goto out;
+    }
+
+    blk_batch_t batch;
+    blk_batch_init(&batch, disk);
+    blk_batch_add(&batch, BLK_READ, layout.bitmap_start,
+                  layout.bitmap_sectors, st.bitmap);
+    for (uint32_t c = 0; c < layout.num_ichunks; c++) {
+        if (chunk_blocks[c])
+            blk_batch_add(&batch, BLK_READ,
+                          layout.data_start + chunk_blocks[c], 1,
+                          chunks + c * 512);
+    }
+    if (blk_batch_wait(&batch) != 0) {
+        printf("[spikefs] check: read failed\n");
+        goto out;
+    }
+
+    /* Fixed metadata */
+    check_claim(&st, 0);
+    for (uint32_t b = 0; b < layout.journal_blocks; b++)
+        check_claim(&st, layout.journal_block + b);
+    for (uint32_t m = 0; m < imap_count; m++)
+        check_claim(&st, imap_blocks[m]);
+    for (uint32_t c = 0; c < layout.num_ichunks; c++) {
+        if (chunk_blocks[c])
+            check_claim(&st, chunk_blocks[c]);
+    }
+
+    /* Every inode's data and extent tree blocks */
+    uint32_t total = layout.num_ichunks * SPIKEFS_ICHUNK_INODES;
+    for (uint32_t ino = 0; ino < total; ino++) {
+        spikefs_inode_t *di = (spikefs_inode_t *)(chunks + ino * 64);
+        next = 0;
+        if (collect_blocks(di, &ext, &next, &ext_cap) != 0) {
+            printf("[spikefs] check: inode %d has an unreadable extent tree\n",
+                   ino);
+            st.bad++;
+            continue;
+        }
+        for (uint32_t i = 0; i < next; i++) {
+            for (uint32_t b = 0; b < ext[i].length; b++)
+                check_claim(&st, ext[i].start + b);
+        }
+    }
+
+    uint32_t used = 0, leaked = 0;
+    for (uint32_t blk = 0; blk < layout.num_blocks; blk++) {
+        int marked = (st.bitmap[blk / 8] >> (blk % 8)) & 1;
+        int claimed = (st.seen[blk / 8] >> (blk % 8)) & 1;
+        if (marked) used++;
+        if (marked && !claimed) leaked++;
+    }
+
+    printf("[spikefs] check: %u blocks in use, %u leaked, %u claimed twice, "
+           "%u not in bitmap, %u out of range\n",
+           used, leaked, st.twice, st.unmarked, st.bad);
+    problems = (int)(leaked + st.twice + st.unmarked + st.bad);
+
+out:
+    kfree(st.seen);
+    kfree(st.bitmap);
+    kfree(chunks);
+    kfree(ext);
+    return problems;
+}
+
 /* ------------------------------------------------------------------ */
 /*  Init (called at boot)                                             */
 /* ------------------------------------------------------------------ */
 
 int spikefs_init(void) {
-    if (!ata_present()) {
+    blk_device_t *dev = blk_lookup("ata0");
+    if (!dev) {
         printf("[spikefs] no disk, skipping\n");
         return -1;
     }
+    return spikefs_mount(dev);
+}
+
+int spikefs_mount(blk_device_t *dev) {
+    disk = dev;
 
     /* Read superblock */
     spikefs_super_t super;
@@ -639,15 +2011,46 @@ int spikefs_init(void) {
     }
 
     if (super.magic == SPIKEFS_MAGIC && super.version == SPIKEFS_VERSION) {
-        /* Valid v3 filesystem — populate layout and load */
+        /* Valid v4 filesystem — finish any interrupted sync, then
+           populate layout (replay may have rewritten the superblock)
+           and mount */
+        populate_layout_from_super(&super);
+        replay_needed = 0;
+        if (journal_replay() != 0)
+            return -1;
+        if (read_sector(0, &super) != 0) {
+            printf("[spikefs] failed to read superblock\n");
+            return -1;
+        }
+        populate_layout_from_super(&super);
+
+        printf("[spikefs] found v4 filesystem (%d inode chunks), mounting...\n",
+               layout.num_ichunks);
+        if (spikefs_load() != 0)
+            return -1;
+
+        /* Disks from before the journal get one; the next sync records
+           it in the superblock and bitmap */
+        if (layout.journal_blocks == 0 && journal_create() == 0
+            && layout.journal_blocks)
+            printf("[spikefs] added a %d-block journal\n",
+                   layout.journal_blocks);
+        return 0;
+    }
+
+    if (super.magic == SPIKEFS_MAGIC && super.version == SPIKEFS_VERSION_V3) {
+        /* v3 shares the v4 layout; only inode block maps differ. Load
+           it with the old decoder and write it back out as v4. */
         populate_layout_from_super(&super);
-        printf("[spikefs] found v3 filesystem (%d inode chunks), loading...\n",
+        printf("[spikefs] found v3 filesystem (%d inode chunks), upgrading to v4...\n",
                layout.num_ichunks);
-        return spikefs_load();
+        if (load_disk(SPIKEFS_VERSION_V3) != 0)
+            return -1;
+        return spikefs_upgrade();
     }
 
     /* Blank or incompatible disk — format and sync current VFS */
-    printf("[spikefs] no valid v3 filesystem, formatting...\n");
+    printf("[spikefs] no valid filesystem, formatting...\n");
     if (spikefs_format() != 0)
         return -1;
 
@@ -3,6 +3,7 @@
 #include <kernel/initrd.h>
 #include <kernel/paging.h>
 #include <kernel/process.h>
+#include <kernel/timer.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -10,10 +11,34 @@
 /*  Globals                                                           */
 /* ------------------------------------------------------------------ */
 
-static vfs_inode_t *inode_table = NULL;  /* heap-allocated, sized at init */
-static uint32_t     num_inodes  = 0;     /* runtime capacity */
+/* Inode table: a two-level sparse directory of VFS_ICHUNK_INODES-inode
+   chunks (see vfs.h). Chunks come and go; inodes never move. */
+typedef struct inode_chunk {
+    uint32_t    used[2];            /* bit per inode, set = allocated */
+    vfs_inode_t inodes[VFS_ICHUNK_INODES];
+} inode_chunk_t;
+
+#define ICHUNK_SHIFT 6              /* log2(VFS_ICHUNK_INODES) */
+#define IDIR_SHIFT   6              /* chunk pointers per second-level block */
+#define IDIR_SLOTS   (1u << IDIR_SHIFT)
+#define MAX_CHUNKS   (VFS_MAX_INODES_CAP / VFS_ICHUNK_INODES)
+
+static inode_chunk_t **inode_dir[MAX_CHUNKS / IDIR_SLOTS];
+static uint32_t chunk_present[MAX_CHUNKS / 32];
+static uint32_t chunk_partial[MAX_CHUNKS / 32];  /* present, has a free slot */
+static uint32_t alloc_hint  = 0;    /* chunk_partial word to search first */
+static uint32_t inode_limit = 0;    /* inode numbers below the last chunk */
+static uint32_t live_inodes = 0;
+static uint32_t live_chunks = 0;
 static uint32_t     cwd_inode   = 0;
 static int          dirty       = 0;     /* set on any VFS mutation */
+static uint32_t     dirty_seq   = 0;     /* mutations so far */
+
+/* Lazy file data */
+static const vfs_backing_ops_t *backing = NULL;
+static uint32_t stat_loads     = 0;
+static uint32_t stat_evictions = 0;
+static uint32_t stat_evicted_bytes = 0;
 
 #define VFS_PATH_MAX   256
 static char cwd_path_buf[VFS_PATH_MAX];
@@ -27,66 +52,436 @@ static uint32_t effective_cwd(void) {
 
 #define DIR_INIT_CAP   8   /* initial dirent slots per directory */
 
+/* Chunk c / inode ino, for numbers known to be in a present chunk */
+#define CHUNK(c)   (inode_dir[(c) >> IDIR_SHIFT][(c) & (IDIR_SLOTS - 1)])
+#define INODE(ino) (&CHUNK((ino) >> ICHUNK_SHIFT) \
+                        ->inodes[(ino) & (VFS_ICHUNK_INODES - 1)])
+
+static void mark_dirty(uint32_t ino) {
+    INODE(ino)->flags |= VFS_INODE_DIRTY;
+    INODE(ino)->dirty_seq = ++dirty_seq;
+    dirty = 1;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Dentry cache                                                      */
+/* ------------------------------------------------------------------ */
+
+/* Links (hash chains, LRU list) hold entry index + 1, 0 = none, so the
+   zeroed cache is a valid empty one. */
+#define DCACHE_BUCKETS 128
+
+typedef struct dentry {
+    uint32_t parent;
+    int32_t  child;             /* -1 = negative entry */
+    uint32_t hash;
+    uint16_t next;              /* hash chain */
+    uint16_t prev_lru, next_lru;
+    uint8_t  used;
+    char     name[VFS_MAX_NAME + 1];
+} dentry_t;
+
+static dentry_t dcache[VFS_DCACHE_SIZE];
+static uint16_t dcache_buckets[DCACHE_BUCKETS];
+static uint16_t lru_head, lru_tail;     /* most / least recently used */
+static uint32_t dcache_count;           /* entries handed out so far */
+static uint32_t dcache_hits, dcache_misses;
+
+static uint32_t dcache_hash(uint32_t parent, const char *name) {
+    return vfs_name_hash(name) ^ (parent * 0x9E3779B1u);
+}
+
+static void lru_unlink(uint16_t link) {
+    dentry_t *d = &dcache[link - 1];
+    if (d->prev_lru) dcache[d->prev_lru - 1].next_lru = d->next_lru;
+    else lru_head = d->next_lru;
+    if (d->next_lru) dcache[d->next_lru - 1].prev_lru = d->prev_lru;
+    else lru_tail = d->prev_lru;
+    d->prev_lru = d->next_lru = 0;
+}
+
+static void lru_push_head(uint16_t link) {
+    dentry_t *d = &dcache[link - 1];
+    d->next_lru = lru_head;
+    if (lru_head) dcache[lru_head - 1].prev_lru = link;
+    lru_head = link;
+    if (!lru_tail) lru_tail = link;
+}
+
+static void lru_push_tail(uint16_t link) {
+    dentry_t *d = &dcache[link - 1];
+    d->prev_lru = lru_tail;
+    if (lru_tail) dcache[lru_tail - 1].next_lru = link;
+    lru_tail = link;
+    if (!lru_head) lru_head = link;
+}
+
+/* Take an entry off its hash chain and queue it for reuse first */
+static void dcache_drop(uint16_t link) {
+    dentry_t *d = &dcache[link - 1];
+    uint16_t *pp = &dcache_buckets[d->hash & (DCACHE_BUCKETS - 1)];
+    while (*pp != link) pp = &dcache[*pp - 1].next;
+    *pp = d->next;
+    d->used = 0;
+    lru_unlink(link);
+    lru_push_tail(link);
+}
+
+static uint16_t dcache_find(uint32_t parent, const char *name, uint32_t hash) {
+    uint16_t link = dcache_buckets[hash & (DCACHE_BUCKETS - 1)];
+    while (link) {
+        dentry_t *d = &dcache[link - 1];
+        if (d->hash == hash && d->parent == parent && strcmp(d->name, name) == 0)
+            return link;
+        link = d->next;
+    }
+    return 0;
+}
+
+/* 1 and *child set on a hit (*child = -1 for a cached miss) */
+static int dcache_lookup(uint32_t parent, const char *name, int32_t *child) {
+    uint16_t link = dcache_find(parent, name, dcache_hash(parent, name));
+    if (!link) {
+        dcache_misses++;
+        return 0;
+    }
+    lru_unlink(link);
+    lru_push_head(link);
+    *child = dcache[link - 1].child;
+    dcache_hits++;
+    return 1;
+}
+
+static void dcache_add(uint32_t parent, const char *name, int32_t child) {
+    uint16_t link;
+    if (dcache_count < VFS_DCACHE_SIZE) {
+        link = (uint16_t)++dcache_count;
+    } else {
+        link = lru_tail;                /* recycle the least recently used */
+        if (dcache[link - 1].used)
+            dcache_drop(link);
+        lru_unlink(link);
+    }
+
+    dentry_t *d = &dcache[link - 1];
+    uint32_t hash = dcache_hash(parent, name);
+    d->parent = parent;
+    d->child = child;
+    d->hash = hash;
+    d->used = 1;
+    strcpy(d->name, name);
+    d->next = dcache_buckets[hash & (DCACHE_BUCKETS - 1)];
+    dcache_buckets[hash & (DCACHE_BUCKETS - 1)] = link;
+    lru_push_head(link);
+}
+
+/* Forget (parent, name) — the entry was added, removed or repointed */
+static void dcache_forget(uint32_t parent, const char *name) {
+    uint16_t link = dcache_find(parent, name, dcache_hash(parent, name));
+    if (link) dcache_drop(link);
+}
+
+/* Forget everything naming ino, as parent or child, before the slot
+   is reused */
+static void dcache_forget_inode(uint32_t ino) {
+    for (uint32_t i = 0; i < dcache_count; i++) {
+        dentry_t *d = &dcache[i];
+        if (d->used && (d->parent == ino || d->child == (int32_t)ino))
+            dcache_drop((uint16_t)(i + 1));
+    }
+}
+
+static void dcache_flush(void) {
+    memset(dcache, 0, sizeof(dcache));
+    memset(dcache_buckets, 0, sizeof(dcache_buckets));
+    lru_head = lru_tail = 0;
+    dcache_count = 0;
+}
+
+void vfs_dcache_stats(uint32_t *hits, uint32_t *misses) {
+    *hits = dcache_hits;
+    *misses = dcache_misses;
+}
+
 /* ------------------------------------------------------------------ */
 /*  Inode allocation / free                                           */
 /* ------------------------------------------------------------------ */
 
-static int32_t inode_alloc(uint8_t type) {
-    for (uint32_t i = 1; i < num_inodes; i++) {  /* 0 = root */
-        if (inode_table[i].type == VFS_TYPE_FREE) {
-            memset(&inode_table[i], 0, sizeof(vfs_inode_t));
-            inode_table[i].type = type;
-            dirty = 1;
-            return (int32_t)i;
-        }
+static int bit_test(const uint32_t *map, uint32_t n) {
+    return (map[n / 32] >> (n % 32)) & 1;
+}
+
+static void bit_set(uint32_t *map, uint32_t n)   { map[n / 32] |= 1u << (n % 32); }
+static void bit_clear(uint32_t *map, uint32_t n) { map[n / 32] &= ~(1u << (n % 32)); }
+
+/* Inode ino, or NULL if its chunk isn't allocated */
+static vfs_inode_t *inode_lookup(uint32_t ino) {
+    if (ino >= VFS_MAX_INODES_CAP || !bit_test(chunk_present, ino >> ICHUNK_SHIFT))
+        return NULL;
+    return INODE(ino);
+}
+
+static inode_chunk_t *chunk_create(uint32_t c) {
+    inode_chunk_t **l2 = inode_dir[c >> IDIR_SHIFT];
+    if (!l2) {
+        l2 = (inode_chunk_t **)kcalloc(IDIR_SLOTS, sizeof(inode_chunk_t *));
+        if (!l2) return NULL;
+        inode_dir[c >> IDIR_SHIFT] = l2;
     }
 
-    /* Table full — try to grow (btrfs/XFS-style dynamic allocation) */
-    uint32_t old_cap = num_inodes;
-    uint32_t new_cap = old_cap * 2;
-    if (new_cap > VFS_MAX_INODES_CAP) new_cap = VFS_MAX_INODES_CAP;
-    if (new_cap <= old_cap) {
-        printf("[vfs] inode table at max (%d inodes)\n", num_inodes);
-        return -1;
+    inode_chunk_t *chunk = (inode_chunk_t *)kcalloc(1, sizeof(inode_chunk_t));
+    if (!chunk) return NULL;
+    l2[c & (IDIR_SLOTS - 1)] = chunk;
+    bit_set(chunk_present, c);
+    bit_set(chunk_partial, c);
+    live_chunks++;
+    if ((c + 1) * VFS_ICHUNK_INODES > inode_limit)
+        inode_limit = (c + 1) * VFS_ICHUNK_INODES;
+    return chunk;
+}
+
+/* Free an empty chunk, and its second-level block once that's empty */
+static void chunk_release(uint32_t c) {
+    inode_chunk_t **l2 = inode_dir[c >> IDIR_SHIFT];
+    kfree(l2[c & (IDIR_SLOTS - 1)]);
+    l2[c & (IDIR_SLOTS - 1)] = NULL;
+    bit_clear(chunk_present, c);
+    bit_clear(chunk_partial, c);
+    live_chunks--;
+
+    for (uint32_t i = 0; i < IDIR_SLOTS; i++)
+        if (l2[i]) return;
+    kfree(l2);
+    inode_dir[c >> IDIR_SHIFT] = NULL;
+}
+
+static void inode_mark_used(uint32_t ino) {
+    inode_chunk_t *chunk = CHUNK(ino >> ICHUNK_SHIFT);
+    uint32_t slot = ino & (VFS_ICHUNK_INODES - 1);
+    if (chunk->used[slot / 32] & (1u << (slot % 32))) return;
+
+    chunk->used[slot / 32] |= 1u << (slot % 32);
+    if ((chunk->used[0] & chunk->used[1]) == 0xFFFFFFFF)
+        bit_clear(chunk_partial, ino >> ICHUNK_SHIFT);
+    live_inodes++;
+}
+
+static void inode_mark_free(uint32_t ino) {
+    inode_chunk_t *chunk = CHUNK(ino >> ICHUNK_SHIFT);
+    uint32_t slot = ino & (VFS_ICHUNK_INODES - 1);
+    chunk->used[slot / 32] &= ~(1u << (slot % 32));
+    bit_set(chunk_partial, ino >> ICHUNK_SHIFT);
+    live_inodes--;
+}
+
+/* A chunk with a free slot: a partly used one, searching from the
+   hint, else the lowest-numbered chunk not yet allocated. -1 if none. */
+static int32_t chunk_with_space(void) {
+    uint32_t words = MAX_CHUNKS / 32;
+    for (uint32_t n = 0; n < words; n++) {
+        uint32_t w = (alloc_hint + n) % words;
+        if (chunk_partial[w]) {
+            alloc_hint = w;
+            return (int32_t)(w * 32 + __builtin_ctz(chunk_partial[w]));
+        }
     }
-    if (vfs_ensure_capacity(new_cap) != 0) {
-        printf("[vfs] failed to grow inode table\n");
-        return -1;
+
+    for (uint32_t w = 0; w < words; w++) {
+        if (chunk_present[w] == 0xFFFFFFFF) continue;
+        uint32_t c = w * 32 + __builtin_ctz(~chunk_present[w]);
+        if (!chunk_create(c)) {
+            printf("[vfs] out of memory for inode chunk\n");
+            return -1;
+        }
+        alloc_hint = w;
+        return (int32_t)c;
     }
-    printf("[vfs] grew inode table: %d -> %d\n", old_cap, num_inodes);
-    /* Use first slot of the newly added region (guaranteed free) */
-    memset(&inode_table[old_cap], 0, sizeof(vfs_inode_t));
-    inode_table[old_cap].type = type;
-    dirty = 1;
-    return (int32_t)old_cap;
+
+    printf("[vfs] inode table at max (%d inodes)\n", VFS_MAX_INODES_CAP);
+    return -1;
+}
+
+static int32_t inode_alloc(uint8_t type) {
+    int32_t c = chunk_with_space();
+    if (c < 0) return -1;
+
+    inode_chunk_t *chunk = CHUNK((uint32_t)c);
+    uint32_t half = chunk->used[0] != 0xFFFFFFFF ? 0 : 1;
+    uint32_t ino = ((uint32_t)c << ICHUNK_SHIFT)
+                 + half * 32 + __builtin_ctz(~chunk->used[half]);
+
+    memset(INODE(ino), 0, sizeof(vfs_inode_t));
+    INODE(ino)->type = type;
+    inode_mark_used(ino);
+    mark_dirty(ino);
+    return (int32_t)ino;
 }
 
 static void inode_free(uint32_t ino) {
-    if (ino >= num_inodes) return;
-    if (inode_table[ino].data)
-        kfree(inode_table[ino].data);
-    memset(&inode_table[ino], 0, sizeof(vfs_inode_t));
-    dirty = 1;
+    if (!inode_lookup(ino)) return;
+    if (INODE(ino)->data)
+        kfree(INODE(ino)->data);
+    kfree(INODE(ino)->index);
+    pcache_truncate(&INODE(ino)->pages, 0);
+    memset(INODE(ino), 0, sizeof(vfs_inode_t));
+    inode_mark_free(ino);
+    dcache_forget_inode(ino);
+    mark_dirty(ino);    /* so the next sync releases its blocks */
 }
 
 /* ------------------------------------------------------------------ */
-/*  Directory helpers                                                 */
+/*  Directory name index                                              */
 /* ------------------------------------------------------------------ */
 
-static int32_t dir_lookup(uint32_t dir_ino, const char *name) {
-    vfs_inode_t *dir = &inode_table[dir_ino];
-    if (dir->type != VFS_TYPE_DIR) return -1;
+static int index_enabled = 1;
+
+/* FNV-1a */
+uint32_t vfs_name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void index_insert(vfs_inode_t *dir, uint32_t pos) {
+    vfs_dirent_t *entries = (vfs_dirent_t *)dir->data;
+    uint32_t mask = dir->index_cap - 1;
+    uint32_t i = vfs_name_hash(entries[pos].name) & mask;
+    while (dir->index[i])
+        i = (i + 1) & mask;
+    dir->index[i] = pos + 1;
+}
+
+/* (Re)build the index with room for 'want' entries at half load.
+   On allocation failure the directory just stays unindexed. */
+static int index_build(vfs_inode_t *dir, uint32_t want) {
+    uint32_t cap = 32;
+    while (cap < want * 2) cap *= 2;
+
+    uint32_t *table = (uint32_t *)kcalloc(cap, sizeof(uint32_t));
+    if (!table) {
+        kfree(dir->index);
+        dir->index = NULL;
+        dir->index_cap = 0;
+        return -1;
+    }
+    kfree(dir->index);
+    dir->index = table;
+    dir->index_cap = cap;
+
+    for (uint32_t pos = 0; pos < dir->size; pos++)
+        index_insert(dir, pos);
+    return 0;
+}
+
+/* Slot holding 'name', or -1 */
+static int32_t index_find(vfs_inode_t *dir, const char *name) {
+    vfs_dirent_t *entries = (vfs_dirent_t *)dir->data;
+    uint32_t mask = dir->index_cap - 1;
+    uint32_t i = vfs_name_hash(name) & mask;
+    while (dir->index[i]) {
+        if (strcmp(entries[dir->index[i] - 1].name, name) == 0)
+            return (int32_t)i;
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+/* Empty slot 'i', pulling later members of its probe run back so no
+   lookup stops early at the hole (no tombstones needed). */
+static void index_delete_slot(vfs_inode_t *dir, uint32_t i) {
+    vfs_dirent_t *entries = (vfs_dirent_t *)dir->data;
+    uint32_t mask = dir->index_cap - 1;
+    uint32_t j = i;
+
+    dir->index[i] = 0;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!dir->index[j]) break;
+
+        uint32_t home = vfs_name_hash(entries[dir->index[j] - 1].name) & mask;
+        /* Move j into the hole unless its home lies cyclically in (i, j] */
+        int stays = i <= j ? (home > i && home <= j)
+                           : (home > i || home <= j);
+        if (!stays) {
+            dir->index[i] = dir->index[j];
+            dir->index[j] = 0;
+            i = j;
+        }
+    }
+}
+
+/* Position of 'name' in the dirent array, or -1 */
+static int32_t dir_find(vfs_inode_t *dir, const char *name) {
+    if (!dir->index && dir->size >= VFS_DIR_INDEX_MIN)
+        index_build(dir, dir->size);
+
+    if (dir->index && index_enabled) {
+        int32_t slot = index_find(dir, name);
+        return slot < 0 ? -1 : (int32_t)dir->index[slot] - 1;
+    }
 
     vfs_dirent_t *entries = (vfs_dirent_t *)dir->data;
     for (uint32_t i = 0; i < dir->size; i++) {
         if (strcmp(entries[i].name, name) == 0)
-            return (int32_t)entries[i].inode;
+            return (int32_t)i;
     }
     return -1;
 }
 
+void vfs_dir_set_index(uint32_t dir_ino, uint32_t *index, uint32_t cap) {
+    if (!inode_lookup(dir_ino)) {
+        kfree(index);
+        return;
+    }
+    vfs_inode_t *dir = INODE(dir_ino);
+    kfree(dir->index);
+    dir->index = NULL;
+    dir->index_cap = 0;
+
+    /* Cheap sanity check: right size, every slot in range, one slot
+       per entry. A bad index is left to be rebuilt on first use. */
+    int ok = index && cap >= 32 && (cap & (cap - 1)) == 0
+             && cap >= dir->size * 2;
+    uint32_t used = 0;
+    for (uint32_t i = 0; ok && i < cap; i++) {
+        if (index[i] > dir->size) ok = 0;
+        else if (index[i]) used++;
+    }
+    if (!ok || used != dir->size) {
+        kfree(index);
+        return;
+    }
+    dir->index = index;
+    dir->index_cap = cap;
+}
+
+void vfs_dir_index_enable(int on) {
+    index_enabled = on;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Directory helpers                                                 */
+/* ------------------------------------------------------------------ */
+
+static int32_t dir_lookup(uint32_t dir_ino, const char *name) {
+    vfs_inode_t *dir = INODE(dir_ino);
+    if (dir->type != VFS_TYPE_DIR) return -1;
+
+    int32_t child;
+    if (dcache_lookup(dir_ino, name, &child))
+        return child;
+
+    int32_t pos = dir_find(dir, name);
+    child = pos < 0 ? -1 : (int32_t)((vfs_dirent_t *)dir->data)[pos].inode;
+    dcache_add(dir_ino, name, child);
+    return child;
+}
+
 static int dir_add_entry(uint32_t dir_ino, const char *name, uint32_t child_ino) {
-    vfs_inode_t *dir = &inode_table[dir_ino];
+    vfs_inode_t *dir = INODE(dir_ino);
     if (dir->type != VFS_TYPE_DIR) return -1;
 
     /* Grow array if needed */
@@ -107,47 +502,67 @@ static int dir_add_entry(uint32_t dir_ino, const char *name, uint32_t child_ino)
     entries[dir->size].name[VFS_MAX_NAME] = '\0';
     entries[dir->size].inode = child_ino;
     dir->size++;
+    dcache_forget(dir_ino, name);
 
-    inode_table[child_ino].link_count++;
-    dirty = 1;
+    /* Keep the index at most half full */
+    if (dir->index && dir->size * 2 <= dir->index_cap)
+        index_insert(dir, dir->size - 1);
+    else if (dir->index || dir->size >= VFS_DIR_INDEX_MIN)
+        index_build(dir, dir->size);
+
+    INODE(child_ino)->link_count++;
+    mark_dirty(dir_ino);
+    mark_dirty(child_ino);
     return 0;
 }
 
 static int dir_remove_entry(uint32_t dir_ino, const char *name) {
-    vfs_inode_t *dir = &inode_table[dir_ino];
+    vfs_inode_t *dir = INODE(dir_ino);
     if (dir->type != VFS_TYPE_DIR) return -1;
 
+    int32_t pos = dir_find(dir, name);
+    if (pos < 0) return -1;
+
     vfs_dirent_t *entries = (vfs_dirent_t *)dir->data;
-    for (uint32_t i = 0; i < dir->size; i++) {
-        if (strcmp(entries[i].name, name) == 0) {
-            uint32_t child = entries[i].inode;
-            inode_table[child].link_count--;
-
-            /* Swap with last entry (O(1) removal) */
-            if (i < dir->size - 1)
-                entries[i] = entries[dir->size - 1];
-            dir->size--;
-            dirty = 1;
-            return 0;
+    uint32_t i = (uint32_t)pos;
+    uint32_t last = dir->size - 1;
+    uint32_t child = entries[i].inode;
+    INODE(child)->link_count--;
+    dcache_forget(dir_ino, name);
+
+    if (dir->index) {
+        index_delete_slot(dir, (uint32_t)index_find(dir, name));
+        /* The last entry moves into the gap; repoint its slot */
+        if (i < last) {
+            int32_t moved = index_find(dir, entries[last].name);
+            dir->index[moved] = i + 1;
         }
     }
-    return -1;
+
+    /* Swap with last entry (O(1) removal) */
+    if (i < last)
+        entries[i] = entries[last];
+    dir->size--;
+    mark_dirty(dir_ino);
+    mark_dirty(child);
+    return 0;
 }
 
 /* Update an existing ".." entry to point to a new parent */
 static void dir_update_dotdot(uint32_t dir_ino, uint32_t new_parent) {
-    vfs_inode_t *dir = &inode_table[dir_ino];
+    vfs_inode_t *dir = INODE(dir_ino);
+    int32_t i = dir_find(dir, "..");
+    if (i < 0) return;
+
+    /* Adjust link counts */
     vfs_dirent_t *entries = (vfs_dirent_t *)dir->data;
-    for (uint32_t i = 0; i < dir->size; i++) {
-        if (strcmp(entries[i].name, "..") == 0) {
-            /* Adjust link counts */
-            inode_table[entries[i].inode].link_count--;
-            entries[i].inode = new_parent;
-            inode_table[new_parent].link_count++;
-            dirty = 1;
-            return;
-        }
-    }
+    mark_dirty(entries[i].inode);
+    INODE(entries[i].inode)->link_count--;
+    entries[i].inode = new_parent;
+    INODE(new_parent)->link_count++;
+    dcache_forget(dir_ino, "..");
+    mark_dirty(new_parent);
+    mark_dirty(dir_ino);
 }
 
 /* ------------------------------------------------------------------ */
@@ -239,7 +654,7 @@ int32_t vfs_resolve(const char *path, uint32_t *parent_out, char *leaf_out) {
         /* comp is not the last component — must resolve it as a directory */
         int32_t ino = dir_lookup(cur, comp);
         if (ino < 0) return -1;
-        if (inode_table[ino].type != VFS_TYPE_DIR) return -1;
+        if (INODE(ino)->type != VFS_TYPE_DIR) return -1;
 
         cur = (uint32_t)ino;
         strcpy(comp, next_comp);
@@ -250,25 +665,25 @@ int32_t vfs_resolve(const char *path, uint32_t *parent_out, char *leaf_out) {
 /*  Initialization                                                    */
 /* ------------------------------------------------------------------ */
 
-void vfs_init(uint32_t max_inodes) {
-    if (max_inodes > VFS_MAX_INODES_CAP)
-        max_inodes = VFS_MAX_INODES_CAP;
-    if (max_inodes < 256)
-        max_inodes = 256;
+void vfs_init(uint32_t initial_capacity) {
+    if (initial_capacity > VFS_MAX_INODES_CAP)
+        initial_capacity = VFS_MAX_INODES_CAP;
 
-    num_inodes = max_inodes;
-    inode_table = (vfs_inode_t *)kcalloc(num_inodes, sizeof(vfs_inode_t));
-    if (!inode_table) {
-        printf("[vfs] FATAL: cannot allocate inode table (%d inodes)\n", num_inodes);
-        return;
+    /* Chunk 0 holds the root; later chunks come on demand */
+    for (uint32_t c = 0; c == 0 || c * VFS_ICHUNK_INODES < initial_capacity; c++) {
+        if (!chunk_create(c)) {
+            printf("[vfs] FATAL: cannot allocate inode table\n");
+            return;
+        }
     }
 
     /* Set up root directory (inode 0) */
-    inode_table[0].type = VFS_TYPE_DIR;
-    inode_table[0].link_count = 0;
-    inode_table[0].size = 0;
-    inode_table[0].capacity = 0;
-    inode_table[0].data = NULL;
+    inode_mark_used(0);
+    INODE(0)->type = VFS_TYPE_DIR;
+    INODE(0)->link_count = 0;
+    INODE(0)->size = 0;
+    INODE(0)->capacity = 0;
+    INODE(0)->data = NULL;
 
     dir_add_entry(0, ".", 0);
     dir_add_entry(0, "..", 0);
@@ -276,7 +691,12 @@ void vfs_init(uint32_t max_inodes) {
     cwd_inode = 0;
     dirty = 0;
 
-    printf("[vfs] initialized (%d inodes)\n", num_inodes);
+    /* Clean file pages can be dropped and re-read when memory runs out */
+    heap_set_reclaim(vfs_evict_clean);
+    pcache_set_reclaim(vfs_evict_clean);
+
+    printf("[vfs] initialized (%d inodes, up to %d)\n",
+           inode_limit, VFS_MAX_INODES_CAP);
 }
 
 void vfs_import_initrd(void) {
@@ -295,36 +715,12 @@ void vfs_import_initrd(void) {
         int32_t ino = inode_alloc(VFS_TYPE_FILE);
         if (ino < 0) break;
 
-        /* Copy file data from initrd physical pages into a heap buffer */
-        vfs_inode_t *node = &inode_table[ino];
-        if (size > 0) {
-            node->data = kmalloc(size);
-            if (!node->data) {
-                inode_free((uint32_t)ino);
-                continue;
-            }
-            node->size = size;
-            node->capacity = size;
-
-            /* Copy page-by-page using temp_map */
-            uint8_t *dst = (uint8_t *)node->data;
-            uint32_t remaining = size;
-            uint32_t src_phys = phys;
-
-            while (remaining > 0) {
-                uint32_t page_base = src_phys & ~0xFFFu;
-                uint32_t page_off  = src_phys & 0xFFFu;
-                uint32_t chunk = 0x1000 - page_off;
-                if (chunk > remaining) chunk = remaining;
-
-                uint8_t *mapped = (uint8_t *)temp_map(page_base);
-                memcpy(dst, mapped + page_off, chunk);
-                temp_unmap();
-
-                dst       += chunk;
-                src_phys  += chunk;
-                remaining -= chunk;
-            }
+        /* Copy file data from the initrd (via the physmap) into the
+           page cache */
+        if (size > 0 && vfs_write((uint32_t)ino, phys_to_virt(phys), 0,
+                                  size) != (int32_t)size) {
+            inode_free((uint32_t)ino);
+            continue;
         }
 
         /* Add to root directory */
@@ -354,7 +750,7 @@ int32_t vfs_create_file(const char *path) {
         printf("[vfs] create_file: empty name\n");
         return -1;
     }
-    if (inode_table[parent_ino].type != VFS_TYPE_DIR) {
+    if (INODE(parent_ino)->type != VFS_TYPE_DIR) {
         printf("[vfs] create_file: parent not a directory\n");
         return -1;
     }
@@ -384,7 +780,7 @@ int32_t vfs_mkdir(const char *path) {
         printf("[vfs] mkdir: empty name\n");
         return -1;
     }
-    if (inode_table[parent_ino].type != VFS_TYPE_DIR) {
+    if (INODE(parent_ino)->type != VFS_TYPE_DIR) {
         printf("[vfs] mkdir: parent not a directory\n");
         return -1;
     }
@@ -437,7 +833,7 @@ int vfs_remove(const char *path) {
         return -1;
     }
 
-    vfs_inode_t *node = &inode_table[ino];
+    vfs_inode_t *node = INODE(ino);
 
     if (node->type == VFS_TYPE_DIR) {
         /* Only remove empty directories (only "." and "..") */
@@ -446,7 +842,8 @@ int vfs_remove(const char *path) {
             return -1;
         }
         /* Decrement parent's link count for removed ".." */
-        inode_table[parent_ino].link_count--;
+        INODE(parent_ino)->link_count--;
+        mark_dirty(parent_ino);
     }
 
     /* Remove entry from parent */
@@ -484,7 +881,7 @@ int vfs_remove_recursive(const char *path) {
         return -1;
     }
 
-    vfs_inode_t *node = &inode_table[ino];
+    vfs_inode_t *node = INODE(ino);
 
     if (node->type == VFS_TYPE_DIR) {
         /* Recursively remove all children (skip . and ..) */
@@ -524,7 +921,8 @@ int vfs_remove_recursive(const char *path) {
 
     /* Now remove the (now-empty) node itself */
     if (node->type == VFS_TYPE_DIR) {
-        inode_table[parent_ino].link_count--;
+        INODE(parent_ino)->link_count--;
+        mark_dirty(parent_ino);
     }
 
     dir_remove_entry(parent_ino, leaf);
@@ -535,49 +933,114 @@ int vfs_remove_recursive(const char *path) {
     return 0;
 }
 
+/* Zero the cached page holding byte 'from', from there to the page's
+   end, so bytes past EOF read back as zeros if the file grows again. */
+static void zero_tail(vfs_inode_t *node, uint32_t from) {
+    uint32_t pgoff = from % VFS_PAGE_SIZE;
+    if (pgoff == 0) return;
+
+    uint32_t frame = pcache_lookup(&node->pages, from / VFS_PAGE_SIZE);
+    if (frame)
+        memset((uint8_t *)phys_to_virt(frame) + pgoff, 0,
+               VFS_PAGE_SIZE - pgoff);
+}
+
 int32_t vfs_read(uint32_t ino, void *buf, uint32_t offset, uint32_t count) {
-    if (ino >= num_inodes) return -1;
-    vfs_inode_t *node = &inode_table[ino];
+    if (!inode_lookup(ino)) return -1;
+    vfs_inode_t *node = INODE(ino);
     if (node->type != VFS_TYPE_FILE) return -1;
 
     if (offset >= node->size) return 0;
     if (offset + count > node->size)
         count = node->size - offset;
 
-    memcpy(buf, (uint8_t *)node->data + offset, count);
+    if (vfs_load_data(ino) != 0) return -1;
+    node = INODE(ino);
+
+    /* Page by page; holes read as zeros */
+    uint8_t *out = (uint8_t *)buf;
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t pos = offset + done;
+        uint32_t pgoff = pos % VFS_PAGE_SIZE;
+        uint32_t n = VFS_PAGE_SIZE - pgoff;
+        if (n > count - done) n = count - done;
+
+        uint32_t frame = pcache_lookup(&node->pages, pos / VFS_PAGE_SIZE);
+        if (frame)
+            memcpy(out + done, (uint8_t *)phys_to_virt(frame) + pgoff, n);
+        else
+            memset(out + done, 0, n);
+        done += n;
+    }
     return (int32_t)count;
 }
 
 int32_t vfs_write(uint32_t ino, const void *buf, uint32_t offset, uint32_t count) {
-    if (ino >= num_inodes) return -1;
-    vfs_inode_t *node = &inode_table[ino];
+    if (!inode_lookup(ino)) return -1;
+    vfs_inode_t *node = INODE(ino);
     if (node->type != VFS_TYPE_FILE) return -1;
+    if (offset + count < offset) return -1;
+
+    if (vfs_load_data(ino) != 0) return -1;
+    node = INODE(ino);
 
-    uint32_t end = offset + count;
+    /* Writing past EOF leaves a gap that must read as zeros */
+    if (offset > node->size)
+        zero_tail(node, node->size);
 
-    /* Grow buffer if needed */
-    if (end > node->capacity) {
-        uint32_t new_cap = node->capacity ? node->capacity : 64;
-        while (new_cap < end) new_cap *= 2;
+    const uint8_t *in = (const uint8_t *)buf;
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t pos = offset + done;
+        uint32_t pgoff = pos % VFS_PAGE_SIZE;
+        uint32_t n = VFS_PAGE_SIZE - pgoff;
+        if (n > count - done) n = count - done;
 
-        void *new_data = krealloc(node->data, new_cap);
-        if (!new_data) {
+        uint32_t frame = pcache_get_page(&node->pages, pos / VFS_PAGE_SIZE);
+        if (!frame) {
             printf("[vfs] write: out of memory\n");
-            return -1;
+            break;
         }
-        /* Zero new region between old size and offset */
-        if (offset > node->size)
-            memset((uint8_t *)new_data + node->size, 0, offset - node->size);
-        node->data = new_data;
-        node->capacity = new_cap;
+        memcpy((uint8_t *)phys_to_virt(frame) + pgoff, in + done, n);
+        done += n;
     }
 
-    memcpy((uint8_t *)node->data + offset, buf, count);
-    if (end > node->size)
-        node->size = end;
+    if (done == 0 && count > 0) return -1;
+    if (offset + done > node->size)
+        node->size = offset + done;
 
-    dirty = 1;
-    return (int32_t)count;
+    mark_dirty(ino);
+    return (int32_t)done;
+}
+
+int vfs_truncate(uint32_t ino, uint32_t size) {
+    if (!inode_lookup(ino)) return -1;
+    vfs_inode_t *node = INODE(ino);
+    if (node->type != VFS_TYPE_FILE) return -1;
+
+    if (size == 0) {
+        /* Nothing to keep, so nothing to load */
+        pcache_truncate(&node->pages, 0);
+        node->size = 0;
+        node->flags &= ~VFS_INODE_UNLOADED;
+    } else if (size != node->size) {
+        if (vfs_load_data(ino) != 0) return -1;
+        node = INODE(ino);
+
+        if (size < node->size) {
+            pcache_truncate(&node->pages,
+                            (size + VFS_PAGE_SIZE - 1) / VFS_PAGE_SIZE);
+            zero_tail(node, size);
+        } else {
+            /* Pages past the old end stay holes until written */
+            zero_tail(node, node->size);
+        }
+        node->size = size;
+    }
+
+    mark_dirty(ino);
+    return 0;
 }
 
 int vfs_rename(const char *old_path, const char *new_path) {
@@ -601,7 +1064,7 @@ int vfs_rename(const char *old_path, const char *new_path) {
         printf("[vfs] rename: invalid destination\n");
         return -1;
     }
-    if (inode_table[new_parent].type != VFS_TYPE_DIR) {
+    if (INODE(new_parent)->type != VFS_TYPE_DIR) {
         printf("[vfs] rename: destination parent not a directory\n");
         return -1;
     }
@@ -609,12 +1072,12 @@ int vfs_rename(const char *old_path, const char *new_path) {
     /* If destination exists, remove it first (files only) */
     int32_t existing = dir_lookup(new_parent, new_leaf);
     if (existing >= 0) {
-        if (inode_table[existing].type == VFS_TYPE_DIR) {
+        if (INODE(existing)->type == VFS_TYPE_DIR) {
             printf("[vfs] rename: cannot overwrite directory\n");
             return -1;
         }
         dir_remove_entry(new_parent, new_leaf);
-        if (inode_table[existing].link_count == 0)
+        if (INODE(existing)->link_count == 0)
             inode_free((uint32_t)existing);
     }
 
@@ -623,7 +1086,7 @@ int vfs_rename(const char *old_path, const char *new_path) {
     dir_add_entry(new_parent, new_leaf, (uint32_t)ino);
 
     /* Update ".." if moving a directory to a new parent */
-    if (inode_table[ino].type == VFS_TYPE_DIR && old_parent != new_parent)
+    if (INODE(ino)->type == VFS_TYPE_DIR && old_parent != new_parent)
         dir_update_dotdot((uint32_t)ino, new_parent);
 
     return 0;
@@ -635,7 +1098,7 @@ int32_t vfs_copy(const char *src_path, const char *dst_path) {
         printf("[vfs] copy: source not found\n");
         return -1;
     }
-    if (inode_table[src_ino].type != VFS_TYPE_FILE) {
+    if (INODE(src_ino)->type != VFS_TYPE_FILE) {
         printf("[vfs] copy: can only copy files\n");
         return -1;
     }
@@ -648,7 +1111,7 @@ int32_t vfs_copy(const char *src_path, const char *dst_path) {
         printf("[vfs] copy: invalid destination\n");
         return -1;
     }
-    if (inode_table[dst_parent].type != VFS_TYPE_DIR) {
+    if (INODE(dst_parent)->type != VFS_TYPE_DIR) {
         printf("[vfs] copy: destination parent not a directory\n");
         return -1;
     }
@@ -663,20 +1126,29 @@ int32_t vfs_copy(const char *src_path, const char *dst_path) {
     int32_t new_ino = inode_alloc(VFS_TYPE_FILE);
     if (new_ino < 0) return -1;
 
-    /* Copy data */
-    vfs_inode_t *src = &inode_table[src_ino];
-    vfs_inode_t *dst = &inode_table[new_ino];
+    if (vfs_load_data((uint32_t)src_ino) != 0) {
+        inode_free((uint32_t)new_ino);
+        return -1;
+    }
 
-    if (src->size > 0) {
-        dst->data = kmalloc(src->size);
-        if (!dst->data) {
+    /* Copy data page by page; holes stay holes */
+    vfs_inode_t *src = INODE(src_ino);
+    vfs_inode_t *dst = INODE(new_ino);
+    uint32_t npages = (src->size + VFS_PAGE_SIZE - 1) / VFS_PAGE_SIZE;
+
+    for (uint32_t i = 0; i < npages; i++) {
+        uint32_t from = pcache_lookup(&src->pages, i);
+        if (!from) continue;
+
+        uint32_t to = pcache_get_page(&dst->pages, i);
+        if (!to) {
+            printf("[vfs] copy: out of memory\n");
             inode_free((uint32_t)new_ino);
             return -1;
         }
-        memcpy(dst->data, src->data, src->size);
-        dst->size = src->size;
-        dst->capacity = src->size;
+        memcpy(phys_to_virt(to), phys_to_virt(from), VFS_PAGE_SIZE);
     }
+    dst->size = src->size;
 
     /* Add to destination directory */
     if (dir_add_entry(dst_parent, dst_leaf, (uint32_t)new_ino) != 0) {
@@ -692,8 +1164,8 @@ int32_t vfs_copy(const char *src_path, const char *dst_path) {
 /* ------------------------------------------------------------------ */
 
 int vfs_list(uint32_t dir_ino) {
-    if (dir_ino >= num_inodes) return -1;
-    vfs_inode_t *dir = &inode_table[dir_ino];
+    if (!inode_lookup(dir_ino)) return -1;
+    vfs_inode_t *dir = INODE(dir_ino);
     if (dir->type != VFS_TYPE_DIR) {
         printf("[vfs] ls: not a directory\n");
         return -1;
@@ -701,7 +1173,7 @@ int vfs_list(uint32_t dir_ino) {
 
     vfs_dirent_t *entries = (vfs_dirent_t *)dir->data;
     for (uint32_t i = 0; i < dir->size; i++) {
-        vfs_inode_t *child = &inode_table[entries[i].inode];
+        vfs_inode_t *child = INODE(entries[i].inode);
         if (child->type == VFS_TYPE_DIR) {
             printf("  %s/\n", entries[i].name);
         } else {
@@ -722,7 +1194,7 @@ uint32_t vfs_get_cwd(void) {
 int vfs_chdir(const char *path) {
     int32_t ino = vfs_resolve(path, NULL, NULL);
     if (ino < 0) return -1;
-    if (inode_table[ino].type != VFS_TYPE_DIR) return -1;
+    if (INODE(ino)->type != VFS_TYPE_DIR) return -1;
 
     if (current_process)
         current_process->cwd = (uint32_t)ino;
@@ -747,7 +1219,7 @@ const char *vfs_get_cwd_path(void) {
         if (parent < 0 || (uint32_t)parent == cur) break;  /* at root */
 
         /* Find our name in the parent directory */
-        vfs_inode_t *pdir = &inode_table[parent];
+        vfs_inode_t *pdir = INODE(parent);
         vfs_dirent_t *entries = (vfs_dirent_t *)pdir->data;
         const char *name = "?";
         for (uint32_t i = 0; i < pdir->size; i++) {
@@ -787,19 +1259,32 @@ const char *vfs_get_cwd_path(void) {
 /* ------------------------------------------------------------------ */
 
 void vfs_reset(void) {
-    /* Free all inode data */
-    for (uint32_t i = 0; i < num_inodes; i++) {
-        if (inode_table[i].data)
-            kfree(inode_table[i].data);
+    /* Free all inode data, and every chunk but the root's */
+    for (uint32_t c = 0; c < inode_limit / VFS_ICHUNK_INODES; c++) {
+        if (!bit_test(chunk_present, c)) continue;
+        inode_chunk_t *chunk = CHUNK(c);
+        for (uint32_t i = 0; i < VFS_ICHUNK_INODES; i++) {
+            kfree(chunk->inodes[i].data);
+            kfree(chunk->inodes[i].index);
+            pcache_truncate(&chunk->inodes[i].pages, 0);
+        }
+        if (c != 0)
+            chunk_release(c);
     }
-    memset(inode_table, 0, num_inodes * sizeof(vfs_inode_t));
+    memset(CHUNK(0), 0, sizeof(inode_chunk_t));
+    bit_set(chunk_partial, 0);
+    inode_limit = VFS_ICHUNK_INODES;
+    live_inodes = 0;
+    alloc_hint = 0;
+    dcache_flush();
 
     /* Re-create root directory with "." and ".." */
-    inode_table[0].type = VFS_TYPE_DIR;
-    inode_table[0].link_count = 0;
-    inode_table[0].size = 0;
-    inode_table[0].capacity = 0;
-    inode_table[0].data = NULL;
+    inode_mark_used(0);
+    INODE(0)->type = VFS_TYPE_DIR;
+    INODE(0)->link_count = 0;
+    INODE(0)->size = 0;
+    INODE(0)->capacity = 0;
+    INODE(0)->data = NULL;
 
     dir_add_entry(0, ".", 0);
     dir_add_entry(0, "..", 0);
@@ -815,34 +1300,59 @@ void vfs_reset(void) {
 /* ------------------------------------------------------------------ */
 
 vfs_inode_t *vfs_get_inode(uint32_t ino) {
-    if (ino >= num_inodes) return (vfs_inode_t *)0;
-    return &inode_table[ino];
+    return inode_lookup(ino);
 }
 
 uint32_t vfs_get_max_inodes(void) {
-    return num_inodes;
+    return inode_limit;
+}
+
+int32_t vfs_next_inode(uint32_t from) {
+    while (from < inode_limit) {
+        uint32_t c = from >> ICHUNK_SHIFT;
+        if (!bit_test(chunk_present, c)) {
+            /* Skip a whole bitmap word of absent chunks at once */
+            if (chunk_present[c / 32] >> (c % 32) == 0)
+                c = (c | 31);
+            from = (c + 1) << ICHUNK_SHIFT;
+            continue;
+        }
+
+        inode_chunk_t *chunk = CHUNK(c);
+        for (uint32_t i = from & (VFS_ICHUNK_INODES - 1); i < VFS_ICHUNK_INODES; i++) {
+            vfs_inode_t *n = &chunk->inodes[i];
+            if (n->type != VFS_TYPE_FREE || (n->flags & VFS_INODE_DIRTY))
+                return (int32_t)((c << ICHUNK_SHIFT) + i);
+        }
+        from = (c + 1) << ICHUNK_SHIFT;
+    }
+    return -1;
 }
 
 int vfs_ensure_capacity(uint32_t min_inodes) {
-    if (min_inodes <= num_inodes) return 0;
-    if (min_inodes > VFS_MAX_INODES_CAP) min_inodes = VFS_MAX_INODES_CAP;
-    if (num_inodes >= VFS_MAX_INODES_CAP) return -1;
-
-    vfs_inode_t *new_table = (vfs_inode_t *)krealloc(
-        inode_table, min_inodes * sizeof(vfs_inode_t));
-    if (!new_table) {
-        printf("[vfs] ensure_capacity: out of memory (%d -> %d)\n",
-               num_inodes, min_inodes);
-        return -1;
-    }
-    /* Zero the new region */
-    memset(&new_table[num_inodes], 0,
-           (min_inodes - num_inodes) * sizeof(vfs_inode_t));
-    inode_table = new_table;
-    num_inodes = min_inodes;
+    if (min_inodes > VFS_MAX_INODES_CAP) {
+        printf("[vfs] %d inodes exceeds the limit of %d\n",
+               min_inodes, VFS_MAX_INODES_CAP);
+        return -1;
+    }
     return 0;
 }
 
+vfs_inode_t *vfs_install_inode(uint32_t ino, uint8_t type) {
+    if (ino >= VFS_MAX_INODES_CAP) return (vfs_inode_t *)0;
+    if (!bit_test(chunk_present, ino >> ICHUNK_SHIFT)
+        && !chunk_create(ino >> ICHUNK_SHIFT))
+        return (vfs_inode_t *)0;
+    INODE(ino)->type = type;
+    inode_mark_used(ino);
+    return INODE(ino);
+}
+
+void vfs_inode_stats(uint32_t *live, uint32_t *chunks) {
+    *live = live_inodes;
+    *chunks = live_chunks;
+}
+
 /* ------------------------------------------------------------------ */
 /*  Dirty tracking                                                    */
 /* ------------------------------------------------------------------ */
@@ -852,5 +1362,223 @@ int vfs_is_dirty(void) {
 }
 
 void vfs_mark_clean(void) {
-    dirty = 0;
+    for (uint32_t c = 0; c < inode_limit / VFS_ICHUNK_INODES; c++) {
+        if (!bit_test(chunk_present, c)) continue;
+        inode_chunk_t *chunk = CHUNK(c);
+        for (uint32_t i = 0; i < VFS_ICHUNK_INODES; i++)
+            chunk->inodes[i].flags &= ~VFS_INODE_DIRTY;
+    }
+    vfs_mark_synced();
+}
+
+void vfs_clear_dirty(uint32_t ino, uint32_t seq) {
+    vfs_inode_t *n = inode_lookup(ino);
+    if (n && n->dirty_seq == seq)
+        n->flags &= ~VFS_INODE_DIRTY;
+}
+
+void vfs_mark_synced(void) {
+    /* Freed inodes that are clean have been written out; drop chunks
+       left empty. A freed inode still dirty keeps its chunk. */
+    uint32_t limit = VFS_ICHUNK_INODES;
+    int left = 0;
+    for (uint32_t c = 0; c < inode_limit / VFS_ICHUNK_INODES; c++) {
+        if (!bit_test(chunk_present, c)) continue;
+        inode_chunk_t *chunk = CHUNK(c);
+        int chunk_dirty = 0;
+        for (uint32_t i = 0; i < VFS_ICHUNK_INODES; i++) {
+            if (chunk->inodes[i].flags & VFS_INODE_DIRTY)
+                chunk_dirty = 1;
+        }
+        if (c != 0 && !chunk_dirty
+            && (chunk->used[0] | chunk->used[1]) == 0) {
+            chunk_release(c);
+            continue;
+        }
+        left |= chunk_dirty;
+        limit = (c + 1) * VFS_ICHUNK_INODES;
+    }
+    inode_limit = limit;
+    dirty = left;
+}
+
+void vfs_mark_all_dirty(void) {
+    for (int32_t i = vfs_next_inode(0); i >= 0; i = vfs_next_inode((uint32_t)i + 1))
+        INODE(i)->flags |= VFS_INODE_DIRTY;
+    dirty = 1;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Lazy file data                                                    */
+/* ------------------------------------------------------------------ */
+
+void vfs_set_backing(const vfs_backing_ops_t *ops) {
+    backing = ops;
+}
+
+int vfs_load_data(uint32_t ino) {
+    if (!inode_lookup(ino)) return -1;
+    vfs_inode_t *node = INODE(ino);
+
+    /* Touch first, so reclaim triggered by our own allocations skips us */
+    node->atime = timer_ticks();
+    if (!(node->flags & VFS_INODE_UNLOADED))
+        return 0;
+    if (!backing) return -1;
+
+    uint32_t size = node->size;
+    uint32_t npages = (size + VFS_PAGE_SIZE - 1) / VFS_PAGE_SIZE;
+
+    /* Fill a private tree, then install it if nobody beat us to it */
+    pcache_t pc;
+    memset(&pc, 0, sizeof(pc));
+
+    uint8_t **pages = (uint8_t **)kmalloc((npages ? npages : 1)
+                                          * sizeof(uint8_t *));
+    if (!pages) {
+        printf("[vfs] load: out of memory for inode %d\n", ino);
+        return -1;
+    }
+    for (uint32_t i = 0; i < npages; i++) {
+        uint32_t frame = pcache_get_page(&pc, i);
+        if (!frame) {
+            printf("[vfs] load: out of memory for inode %d\n", ino);
+            kfree(pages);
+            pcache_truncate(&pc, 0);
+            return -1;
+        }
+        pages[i] = (uint8_t *)phys_to_virt(frame);
+    }
+
+    int rc = backing->fill(ino, size, pages);
+    kfree(pages);
+    if (rc != 0) {
+        pcache_truncate(&pc, 0);
+        printf("[vfs] load: read failed for inode %d\n", ino);
+        return -1;
+    }
+
+    /* The fill may have slept; someone else may have loaded, truncated
+       or freed the inode meanwhile (or grown the inode table). Their
+       version wins. */
+    node = INODE(ino);
+    if (node->type != VFS_TYPE_FILE || !(node->flags & VFS_INODE_UNLOADED)
+        || node->size != size) {
+        pcache_truncate(&pc, 0);
+        return node->type == VFS_TYPE_FILE ? 0 : -1;
+    }
+
+    node->pages = pc;
+    node->flags &= ~VFS_INODE_UNLOADED;
+    stat_loads++;
+    return 0;
+}
+
+void *vfs_page_addr(uint32_t ino, uint32_t index) {
+    if (!inode_lookup(ino)) return NULL;
+    uint32_t frame = pcache_lookup(&INODE(ino)->pages, index);
+    return frame ? phys_to_virt(frame) : NULL;
+}
+
+uint32_t vfs_get_page(uint32_t ino, uint32_t index) {
+    if (!inode_lookup(ino) || INODE(ino)->type != VFS_TYPE_FILE)
+        return 0;
+    if (vfs_load_data(ino) != 0) return 0;
+    return pcache_get_page(&INODE(ino)->pages, index);
+}
+
+uint32_t vfs_pin_page(uint32_t ino, uint32_t index) {
+    if (!inode_lookup(ino)) return 0;
+    uint32_t frame = pcache_lookup(&INODE(ino)->pages, index);
+    if (frame)
+        frame_get(frame);
+    return frame;
+}
+
+void vfs_map_file(uint32_t ino, int shared_write) {
+    if (!inode_lookup(ino)) return;
+    INODE(ino)->mmap_count++;
+    if (shared_write)
+        mark_dirty(ino);
+}
+
+void vfs_unmap_file(uint32_t ino, int shared_write) {
+    if (!inode_lookup(ino)) return;
+    vfs_inode_t *node = INODE(ino);
+
+    /* The file may have been removed while mapped */
+    if (node->mmap_count)
+        node->mmap_count--;
+    if (shared_write && node->type == VFS_TYPE_FILE)
+        mark_dirty(ino);
+}
+
+uint32_t vfs_evict_clean(uint32_t bytes) {
+    if (!backing) return 0;
+
+    uint32_t now = timer_ticks();
+    uint32_t freed = 0;
+
+    while (freed < bytes) {
+        /* Least recently used clean, resident file that has sat idle */
+        int32_t victim = -1;
+        uint32_t victim_age = 0;
+
+        for (int32_t i = vfs_next_inode(0); i >= 0;
+             i = vfs_next_inode((uint32_t)i + 1)) {
+            vfs_inode_t *n = INODE(i);
+            if (n->type != VFS_TYPE_FILE || n->pages.nr_pages == 0) continue;
+            if (n->flags & (VFS_INODE_DIRTY | VFS_INODE_UNLOADED)) continue;
+            if (n->mmap_count) continue;
+
+            uint32_t age = now - n->atime;
+            if (age < VFS_EVICT_MIN_TICKS) continue;
+            if (victim < 0 || age > victim_age) {
+                victim = i;
+                victim_age = age;
+            }
+        }
+        if (victim < 0) break;
+
+        vfs_inode_t *n = INODE(victim);
+        uint32_t bytes_held = n->pages.nr_pages * VFS_PAGE_SIZE;
+        freed += bytes_held;
+        stat_evicted_bytes += bytes_held;
+        stat_evictions++;
+
+        pcache_truncate(&n->pages, 0);
+        n->flags |= VFS_INODE_UNLOADED;
+    }
+    return freed;
+}
+
+void vfs_print_stats(void) {
+    uint32_t files = 0, resident = 0, unloaded = 0, dirty_files = 0;
+    uint32_t mapped = 0;
+
+    for (int32_t i = vfs_next_inode(0); i >= 0; i = vfs_next_inode((uint32_t)i + 1)) {
+        vfs_inode_t *n = INODE(i);
+        if (n->type != VFS_TYPE_FILE) continue;
+        files++;
+        if (n->flags & VFS_INODE_UNLOADED)
+            unloaded++;
+        else if (n->pages.nr_pages)
+            resident++;
+        if (n->flags & VFS_INODE_DIRTY)
+            dirty_files++;
+        if (n->mmap_count)
+            mapped++;
+    }
+
+    printf("files: %u (%u resident, %u on disk only, %u dirty, %u mapped)\n",
+           files, resident, unloaded, dirty_files, mapped);
+    printf("inodes: %u live in %u chunks (%u KiB)\n", live_inodes, live_chunks,
+           live_chunks * (uint32_t)sizeof(inode_chunk_t) / 1024);
+    printf("page cache: %u pages (%u KiB)\n", pcache_total_pages(),
+           pcache_total_pages() * (VFS_PAGE_SIZE / 1024));
+    printf("loads: %u, evictions: %u (%u KiB)\n",
+           stat_loads, stat_evictions, stat_evicted_bytes / 1024);
+    printf("dcache: %u/%u entries, %u hits, %u misses\n",
+           dcache_count, VFS_DCACHE_SIZE, dcache_hits, dcache_misses);
+    printf("backing store: %s\n", backing ? "attached" : "none");
 }
@@ -32,7 +32,11 @@
 #define ATA_SR_DRQ          0x08
 #define ATA_SR_ERR          0x01
 
-/* Initialize ATA driver. Returns 0 if disk found, -1 if not. */
+/* LBA28 PIO: one command moves at most 256 sectors */
+#define ATA_MAX_PIO_SECTORS 256
+
+/* Initialize ATA driver. Returns 0 if disk found, -1 if not.
+   A found disk is registered with the block layer as "ata0". */
 int ata_init(void);
 
 /* Read 'count' sectors starting at LBA into buf. Returns 0 on success. */
@@ -0,0 +1,146 @@
+#ifndef _BLK_H
+#define _BLK_H
+
+#include <stdint.h>
+#include <kernel/wait.h>
+
+/*
+ * Block request layer.
+ *
+ * Callers describe I/O as bios (LBA, sector count, buffer, direction)
+ * and submit them to a device queue instead of calling the driver
+ * inline. The queue is kept sorted by LBA and dispatched in C-LOOK
+ * order: the head sweeps upward through pending requests, then jumps
+ * back to the lowest LBA. Adjacent same-direction bios are merged into
+ * one driver command.
+ *
+ * A kernel worker drains queues in the background. A caller waiting on
+ * its own bios dispatches inline when the worker is idle (or not yet
+ * started at early boot), so a wait never costs an extra context switch.
+ *
+ * Usage (submit many, wait once):
+ *   blk_batch_t b;
+ *   blk_batch_init(&b, dev);
+ *   blk_batch_add(&b, BLK_WRITE, lba, n, buf);   // repeat
+ *   if (blk_batch_wait(&b) != 0) ...error...
+ *
+ * Overlapping bios have no ordering guarantee while both are queued;
+ * wait for a write before reading the same sectors back.
+ */
+
+#define BLK_SECTOR_SIZE   512
+#define BLK_MAX_SECTORS   128   /* cap on one merged driver command */
+#define BLK_MAX_SEGS      32    /* bios merged into one command */
+#define BLK_MAX_DEVICES   4
+#define BLK_LAT_BUCKETS   14    /* log2 latency buckets, <128us .. >=512ms */
+
+#define BLK_READ   0
+#define BLK_WRITE  1
+
+#define BLK_FAULT_OFF 0xFFFFFFFFu   /* fault_budget when not armed */
+
+struct bio;
+struct blk_device;
+
+typedef void (*bio_end_io_t)(struct bio *bio);
+
+typedef struct bio {
+    struct blk_device *dev;
+    uint32_t      lba;
+    uint32_t      count;        /* sectors */
+    void         *buf;          /* count * 512 bytes */
+    uint8_t       dir;          /* BLK_READ / BLK_WRITE */
+    int           status;       /* 0 = ok, -1 = error (set before end_io) */
+    uint32_t      start_us;     /* submit timestamp, for latency stats */
+    bio_end_io_t  end_io;       /* completion callback (may be NULL) */
+    void         *private;      /* owner cookie for end_io */
+    struct bio   *next;         /* queue link (owned by the block layer) */
+} bio_t;
+
+/* One buffer of a merged command, handed to the driver */
+typedef struct blk_seg {
+    void     *buf;
+    uint32_t  sectors;
+} blk_seg_t;
+
+typedef struct blk_stats {
+    uint32_t submitted;
+    uint32_t completed;
+    uint32_t errors;
+    uint32_t merges;            /* bios folded into another's command */
+    uint32_t dispatches;        /* driver commands issued */
+    uint32_t depth_sum;         /* queue depth seen at each dispatch */
+    uint32_t max_depth;
+    uint32_t sectors_read;
+    uint32_t sectors_written;
+    uint32_t sectors_dropped;   /* writes lost to an injected fault */
+    uint32_t lat_hist[BLK_LAT_BUCKETS];
+} blk_stats_t;
+
+typedef struct blk_device {
+    const char   *name;
+    uint32_t      total_sectors;
+
+    /* Driver hook: move 'count' sectors at 'lba' through the segment
+       list in one command. Returns 0 on success, -1 on error. */
+    int (*transfer)(struct blk_device *dev, int dir, uint32_t lba,
+                    uint32_t count, const blk_seg_t *segs, uint32_t nsegs);
+
+    /* Queue state — managed by blk.c */
+    bio_t        *queue;        /* pending bios, sorted by LBA */
+    uint32_t      depth;
+    uint32_t      head_pos;     /* LBA just past the last dispatch */
+    int           busy;         /* a dispatcher currently owns the queue */
+    uint32_t      fault_budget; /* sectors writable before a simulated
+                                   power cut, or BLK_FAULT_OFF */
+    blk_stats_t   stats;
+} blk_device_t;
+
+/* Batch of bios owned by one waiter */
+typedef struct blk_batch {
+    blk_device_t *dev;
+    uint32_t      pending;
+    int           error;
+    wait_queue_t  wq;
+} blk_batch_t;
+
+/* Register a device with the block layer. Returns 0 on success. */
+int blk_register(blk_device_t *dev);
+
+/* Look up a registered device by name (e.g. "ata0"). NULL if absent. */
+blk_device_t *blk_lookup(const char *name);
+
+/* Start the background queue worker. Call once the scheduler is up. */
+void blk_start_worker(void);
+
+/* Queue a bio. bio->dev, lba, count, buf, dir and end_io must be set.
+   end_io runs from the dispatching context once the transfer finishes. */
+void submit_bio(bio_t *bio);
+
+/* Issue everything queued on dev. Dispatches inline if no one else is,
+   otherwise hands the queue to the worker. */
+void blk_unplug(blk_device_t *dev);
+
+/* Synchronous helpers built on submit_bio. Return 0 on success. */
+int blk_read(blk_device_t *dev, uint32_t lba, uint32_t count, void *buf);
+int blk_write(blk_device_t *dev, uint32_t lba, uint32_t count,
+              const void *buf);
+
+/* Batches: queue any number of bios, then wait for all of them once. */
+void blk_batch_init(blk_batch_t *b, blk_device_t *dev);
+int  blk_batch_add(blk_batch_t *b, int dir, uint32_t lba, uint32_t count,
+                   void *buf);
+int  blk_batch_wait(blk_batch_t *b);
+
+/*
+ * Fault injection: let 'sectors' more sectors be written, then drop
+ * every later write as if power had been cut mid-command. The command
+ * that crosses the limit is written only up to it. Dropped writes fail
+ * with status -1; reads keep working. BLK_FAULT_OFF disarms.
+ */
+void blk_set_fault(blk_device_t *dev, uint32_t sectors);
+
+/* Print queue depth, merge and latency statistics for every device. */
+void blk_print_stats(void);
+
+#endif
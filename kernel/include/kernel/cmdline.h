@@ -0,0 +1,29 @@
+#ifndef _CMDLINE_H
+#define _CMDLINE_H
+
+#include <stdint.h>
+
+/*
+ * Kernel command line, from the Multiboot info. Options are
+ * space-separated key=value words; GRUB puts the kernel's path first,
+ * and words without '=' are ignored. For example:
+ *
+ *     multiboot /boot/myos.kernel e1000.rxdesc=1024 e1000.itr=latency
+ */
+
+#define CMDLINE_MAX 256
+
+/* Keep a copy of the line (truncated to CMDLINE_MAX - 1 bytes) */
+void cmdline_init(const char *line);
+
+/* The whole line, "" if there was none */
+const char *cmdline_get(void);
+
+/* Copy key's value into buf (NUL-terminated, truncated to len - 1).
+   Returns 0, or -1 if key isn't on the line. The last one wins. */
+int cmdline_value(const char *key, char *buf, uint32_t len);
+
+/* key's value as a decimal number, or def if it's missing or isn't one */
+uint32_t cmdline_uint(const char *key, uint32_t def);
+
+#endif
@@ -12,6 +12,7 @@
 #define E1000_EERD       0x0014   /* EEPROM Read */
 #define E1000_ICR        0x00C0   /* Interrupt Cause Read */
 #define E1000_IMS        0x00D0   /* Interrupt Mask Set */
+#define E1000_ITR        0x00C4   /* Interrupt Throttling */
 #define E1000_IMC        0x00D8   /* Interrupt Mask Clear */
 #define E1000_RCTL       0x0100   /* Receive Control */
 #define E1000_TCTL       0x0400   /* Transmit Control */
@@ -23,6 +24,8 @@
 #define E1000_RDLEN      0x2808   /* RX Descriptor Length */
 #define E1000_RDH        0x2810   /* RX Descriptor Head */
 #define E1000_RDT        0x2818   /* RX Descriptor Tail */
+#define E1000_RDTR       0x2820   /* RX Delay Timer */
+#define E1000_RADV       0x282C   /* RX Absolute Delay Timer */
 
 /* Transmit descriptor ring */
 #define E1000_TDBAL      0x3800   /* TX Descriptor Base Low */
@@ -38,6 +41,14 @@
 /* Multicast table array (128 dwords) */
 #define E1000_MTA        0x5200
 
+/* Receive checksum control */
+#define E1000_RXCSUM     0x5000
+
+/* Statistics (clear on read) */
+#define E1000_CRCERRS    0x4000   /* CRC Error Count */
+#define E1000_MPC        0x4010   /* Missed Packets Count */
+#define E1000_RNBC       0x40A0   /* Receive No Buffers Count */
+
 /* ------------------------------------------------------------------ */
 /*  CTRL register bits                                                 */
 /* ------------------------------------------------------------------ */
@@ -77,6 +88,13 @@
 #define E1000_ICR_RXO     (1u << 6)    /* Receiver Overrun */
 #define E1000_ICR_RXT0    (1u << 7)    /* Receiver Timer Interrupt */
 
+/* ------------------------------------------------------------------ */
+/*  RXCSUM register bits                                               */
+/* ------------------------------------------------------------------ */
+
+#define E1000_RXCSUM_IPOFLD  (1u << 8)    /* IPv4 header checksum offload */
+#define E1000_RXCSUM_TUOFLD  (1u << 9)    /* TCP/UDP checksum offload */
+
 /* ------------------------------------------------------------------ */
 /*  EEPROM read bits                                                   */
 /* ------------------------------------------------------------------ */
@@ -94,20 +112,52 @@
 #define E1000_TXD_CMD_IFCS  (1u << 1)   /* Insert FCS/CRC */
 #define E1000_TXD_CMD_RS    (1u << 3)   /* Report Status */
 
+/* Context and extended data descriptors: type and command bits in
+   the cmd_len dword, option bits in popts */
+#define E1000_TXD_DTYP_C     (0u << 20)  /* Context descriptor */
+#define E1000_TXD_DTYP_D     (1u << 20)  /* Extended data descriptor */
+#define E1000_TXD_DCMD_EOP   (1u << 24)  /* End of Packet */
+#define E1000_TXD_DCMD_IFCS  (1u << 25)  /* Insert FCS/CRC */
+#define E1000_TXD_DCMD_RS    (1u << 27)  /* Report Status */
+#define E1000_TXD_DCMD_DEXT  (1u << 29)  /* Extended descriptor */
+#define E1000_TXD_TUCMD_TCP  (1u << 24)  /* Context: L4 is TCP, not UDP */
+#define E1000_TXD_TUCMD_IP   (1u << 25)  /* Context: IPv4 */
+#define E1000_TXD_POPTS_IXSM (1u << 0)   /* Insert IP checksum */
+#define E1000_TXD_POPTS_TXSM (1u << 1)   /* Insert TCP/UDP checksum */
+
 /* TX status bits */
 #define E1000_TXD_STAT_DD   (1u << 0)   /* Descriptor Done */
 
 /* RX status bits */
-#define E1000_RXD_STAT_DD   (1u << 0)   /* Descriptor Done */
-#define E1000_RXD_STAT_EOP  (1u << 1)   /* End of Packet */
+#define E1000_RXD_STAT_DD    (1u << 0)   /* Descriptor Done */
+#define E1000_RXD_STAT_EOP   (1u << 1)   /* End of Packet */
+#define E1000_RXD_STAT_IXSM  (1u << 2)   /* Ignore checksum indication */
+#define E1000_RXD_STAT_TCPCS (1u << 5)   /* TCP/UDP checksum calculated */
+#define E1000_RXD_STAT_IPCS  (1u << 6)   /* IP checksum calculated */
+
+/* RX error bits */
+#define E1000_RXD_ERR_TCPE   (1u << 5)   /* TCP/UDP checksum error */
+#define E1000_RXD_ERR_IPE    (1u << 6)   /* IP checksum error */
 
 /* ------------------------------------------------------------------ */
 /*  Descriptor counts and buffer size                                  */
 /* ------------------------------------------------------------------ */
 
-#define E1000_NUM_TX_DESC  16
-#define E1000_NUM_RX_DESC  32
-#define E1000_RX_BUF_SIZE  2048
+/* Ring sizes come from the command line (e1000.rxdesc=, e1000.txdesc=),
+   rounded down to a multiple of 8 and kept within MIN..MAX */
+#define E1000_RX_DESC_DEFAULT  256
+#define E1000_TX_DESC_DEFAULT  256
+#define E1000_DESC_MIN         32
+#define E1000_DESC_MAX         4096
+#define E1000_RX_BUF_SIZE      2048
+
+/* Interrupt moderation for NIC_MOD_THROUGHPUT (e1000.itr=throughput):
+   at most ~8000 interrupts a second (ITR counts 256 ns), and an RX
+   interrupt waits up to 32 us for more frames, 128 us at the most
+   (RDTR and RADV count 1.024 us) */
+#define E1000_ITR_THROUGHPUT   488
+#define E1000_RDTR_THROUGHPUT  32
+#define E1000_RADV_THROUGHPUT  128
 
 /* ------------------------------------------------------------------ */
 /*  Legacy TX descriptor (16 bytes, packed)                            */
@@ -123,6 +173,37 @@ typedef struct __attribute__((packed)) {
     uint16_t special;
 } e1000_tx_desc_t;
 
+/* ------------------------------------------------------------------ */
+/*  TX context descriptor (16 bytes, packed)                           */
+/* ------------------------------------------------------------------ */
+
+/* Loads the checksum offsets used by later extended data descriptors
+   that ask for IXSM/TXSM. Offsets are from the start of the frame. */
+typedef struct __attribute__((packed)) {
+    uint8_t  ipcss;       /* IP checksum start */
+    uint8_t  ipcso;       /* IP checksum field */
+    uint16_t ipcse;       /* IP checksum end (inclusive) */
+    uint8_t  tucss;       /* TCP/UDP checksum start */
+    uint8_t  tucso;       /* TCP/UDP checksum field */
+    uint16_t tucse;       /* TCP/UDP checksum end (0 = end of frame) */
+    uint32_t cmd_len;     /* DTYP_C | TUCMD | DCMD */
+    uint8_t  status;      /* Status (DD bit) */
+    uint8_t  hdrlen;      /* Segmentation only */
+    uint16_t mss;         /* Segmentation only */
+} e1000_tx_ctx_desc_t;
+
+/* ------------------------------------------------------------------ */
+/*  TX extended data descriptor (16 bytes, packed)                     */
+/* ------------------------------------------------------------------ */
+
+typedef struct __attribute__((packed)) {
+    uint64_t addr;        /* Buffer address (physical) */
+    uint32_t cmd_len;     /* Length | DTYP_D | DCMD */
+    uint8_t  status;      /* Status (DD bit) */
+    uint8_t  popts;       /* IXSM / TXSM */
+    uint16_t special;
+} e1000_tx_data_desc_t;
+
 /* ------------------------------------------------------------------ */
 /*  Legacy RX descriptor (16 bytes, packed)                            */
 /* ------------------------------------------------------------------ */
@@ -140,10 +221,39 @@ typedef struct __attribute__((packed)) {
 /*  NIC abstraction — allows swapping e1000 for another driver later   */
 /* ------------------------------------------------------------------ */
 
+struct sk_buff;
+
+/* nic_t.features */
+#define NIC_F_TX_CSUM     0x01   /* fills in TCP/UDP checksums marked in skb->csum */
+#define NIC_F_RX_CSUM     0x02   /* verifies received checksums */
+#define NIC_F_TX_IP_CSUM  0x04   /* fills in the IPv4 header checksum too */
+
+/* nic_t.moderation */
+#define NIC_MOD_LATENCY     0   /* interrupt as soon as a frame is in */
+#define NIC_MOD_THROUGHPUT  1   /* hold RX interrupts back to batch frames */
+
 typedef struct nic {
+    const char *name;    /* driver, for netinfo */
     uint8_t  mac[6];
     int      link_up;
+    uint32_t features;   /* NIC_F_* */
+    uint32_t rx_ring;    /* descriptors in each ring */
+    uint32_t tx_ring;
+    int      moderation; /* NIC_MOD_* */
     int      (*send)(const void *data, uint16_t len);
+    /* Transmit a whole frame straight from the packet buffer; the
+       driver keeps it until the hardware is done, then frees it.
+       Consumes skb either way. */
+    int      (*send_skb)(struct sk_buff *skb);
+    /* Tell the hardware about frames send_skb() queued during a
+       net_tx_hold() burst. May be NULL. */
+    void     (*tx_flush)(void);
+    /* Add the hardware's own counters into net_stats. May be NULL. */
+    void     (*update_stats)(void);
+    /* Pass up to 'budget' received frames to net_rx(). Returning less
+       than budget means the ring is empty and RX interrupts are
+       unmasked again. */
+    int      (*poll)(int budget);
 } nic_t;
 
 extern nic_t *nic;  /* Global NIC pointer (NULL if no NIC) */
@@ -157,6 +267,17 @@ int e1000_init(void);
 
 /* Send a raw Ethernet frame. Returns 0 on success, -1 on error. */
 int e1000_send(const void *data, uint16_t len);
+int e1000_send_skb(struct sk_buff *skb);
+void e1000_tx_flush(void);
+
+/* Drain up to 'budget' frames from the RX ring (nic->poll) */
+int e1000_poll(int budget);
+
+/* Fold MPC/RNBC/CRCERRS into net_stats (nic->update_stats) */
+void e1000_update_stats(void);
+
+/* Switch interrupt moderation (NIC_MOD_*) */
+void e1000_set_moderation(int mode);
 
 /* Get MAC address (copies 6 bytes to out) */
 void e1000_get_mac(uint8_t *out);
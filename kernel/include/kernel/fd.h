@@ -7,24 +7,37 @@
 /*
  * File descriptor subsystem.
  *
- * Each process gets its own fd table (MAX_FDS entries). An fd points to
- * a shared open_file struct which holds the inode, offset, and flags.
- * Multiple fds can point to the same open_file (e.g. after dup).
+ * Each process gets its own fd table. An fd points to a shared
+ * open_file struct which holds the inode, offset, and flags. Multiple
+ * fds can point to the same open_file (e.g. after dup).
+ *
+ * Both tables grow on demand. A process's first FD_INLINE fds live in
+ * the process itself; beyond that the table moves to the heap and
+ * doubles up to MAX_FDS. Open files come in fixed chunks that never
+ * move, so an open_file_t pointer stays valid while the file is open;
+ * free slots are kept on a free list. All processes share one
+ * refcounted console open file for stdin/stdout/stderr.
  *
  * Special file types:
  *   FD_TYPE_NONE    - slot is free
  *   FD_TYPE_VFS     - regular VFS file (inode-based)
  *   FD_TYPE_CONSOLE - stdin/stdout/stderr (terminal)
  *   FD_TYPE_PIPE    - pipe endpoint
+ *   FD_TYPE_EPOLL   - epoll instance (see poll.h)
+ *   FD_TYPE_TCP     - TCP socket (see net.h)
  */
 
-#define MAX_FDS         16     /* per-process fd limit */
-#define MAX_OPEN_FILES  64     /* system-wide open file limit */
+#define FD_INLINE       16     /* fds held in the process struct */
+#define MAX_FDS         1024   /* per-process fd limit */
+#define OPEN_FILE_CHUNK 64     /* open files added per growth step */
+#define MAX_OPEN_FILES  4096   /* system-wide open file limit */
 
 #define FD_TYPE_NONE    0
 #define FD_TYPE_VFS     1
 #define FD_TYPE_CONSOLE 2
 #define FD_TYPE_PIPE    3
+#define FD_TYPE_EPOLL   4
+#define FD_TYPE_TCP     5
 
 /* Flags for open_file */
 #define O_RDONLY  0x0
@@ -33,8 +46,27 @@
 #define O_CREAT  0x100
 #define O_TRUNC  0x200
 #define O_APPEND 0x400
+#define O_NONBLOCK 0x800   /* reads/writes that would block fail with -EAGAIN */
+
+/* Negated return value of an O_NONBLOCK read/write that would have
+   blocked (libc turns it into errno = EAGAIN) */
+#define EAGAIN   11
+
+/* Negated return of a non-blocking TCP connect that was started */
+#define EINPROGRESS 115
 
-struct pipe;  /* forward declaration */
+struct pipe;  /* forward declarations */
+struct epoll;
+struct epoll_item;
+struct tcp_sock;
+
+/* One buffer of a scatter/gather transfer (readv/writev) */
+struct iovec {
+    void     *iov_base;
+    uint32_t  iov_len;
+};
+
+#define IOV_MAX 16     /* most iovecs per readv/writev call */
 
 typedef struct open_file {
     uint8_t   type;       /* FD_TYPE_* */
@@ -43,22 +75,50 @@ typedef struct open_file {
     uint32_t  offset;     /* current read/write position */
     int       refcount;   /* number of fds pointing here */
     struct pipe *pipe;    /* pipe pointer (for FD_TYPE_PIPE) */
+    struct epoll *epoll;  /* instance (for FD_TYPE_EPOLL) */
+    struct tcp_sock *tcp; /* socket (for FD_TYPE_TCP) */
+    struct epoll_item *watchers; /* epoll items watching this file */
+    int       next_free;  /* free list link while the slot is unused */
 } open_file_t;
 
-/* System-wide open file table */
-extern open_file_t open_file_table[MAX_OPEN_FILES];
+/* Per-process fd table: fd -> open file index, -1 = free */
+typedef struct fd_table {
+    int      *ext;        /* heap slots once grown past FD_INLINE */
+    uint32_t  size;       /* slots in use (FD_INLINE or ext's length) */
+    uint32_t  hint;       /* no free fd below this one */
+    int       inline_fd[FD_INLINE];
+} fd_table_t;
 
 /* Initialize the open file table */
 void fd_init(void);
 
-/* Allocate an open_file slot. Returns index or -1. */
+/* Open file slot 'idx', or NULL if there is no such slot */
+open_file_t *open_file_get(int idx);
+
+/* Allocate an open_file slot (refcount 1). Returns index or -1. */
 int alloc_open_file(void);
 
+/* Take another reference on an open_file slot (dup) */
+void hold_open_file(int idx);
+
 /* Release an open_file slot (decrements refcount, frees if 0). */
 void release_open_file(int idx);
 
-/* Allocate the lowest free fd in the given fd table. Returns fd or -1. */
-int alloc_fd(int *fd_table);
+/* Empty fd table using only the inline slots */
+void fd_table_init(fd_table_t *t);
+
+/* Point the lowest free fd at open file 'ofi', growing the table if
+   needed. Returns the fd, or -1 at MAX_FDS / out of memory. */
+int fd_install(fd_table_t *t, int ofi);
+
+/* Open file index behind fd, or -1 */
+int fd_lookup(fd_table_t *t, int fd);
+
+/* Open file behind fd in the current process, or NULL */
+open_file_t *fd_file(int fd);
+
+/* Duplicate fd into the lowest free fd. Returns it or -1. */
+int fd_dup(int fd);
 
 /* Per-process fd operations (operate on current_process->fds) */
 int     fd_open(const char *path, uint32_t flags);
@@ -67,15 +127,63 @@ int32_t fd_read(int fd, void *buf, uint32_t count);
 int32_t fd_write(int fd, const void *buf, uint32_t count);
 int32_t fd_seek(int fd, int32_t offset, int whence);
 
+/* Scatter/gather I/O. Segments are transferred in order, as one
+   fd_read/fd_write each, stopping at the first short one. Once readv
+   has read anything, later segments don't block. Returns the total
+   bytes moved, or the first segment's error (-1 or -EAGAIN). */
+int32_t fd_readv(int fd, const struct iovec *iov, int iovcnt);
+int32_t fd_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/* Read/write a VFS file at an explicit offset, leaving the shared
+   file offset alone (O_APPEND is ignored). -1 for pipes/console. */
+int32_t fd_pread(int fd, void *buf, uint32_t count, uint32_t offset);
+int32_t fd_pwrite(int fd, const void *buf, uint32_t count, uint32_t offset);
+
+/*
+ * Kernel-side copy out of a VFS file (sendfile). The file's pages are
+ * handed to 'sink' as iovecs pointing straight into the page cache, at
+ * most 'chunk' bytes per call (0 = as many pages as IOV_MAX covers).
+ * Each page is pinned for the duration of the call. The sink returns
+ * the bytes it consumed or -1; a short count ends the copy.
+ *
+ * Reads from *offset and updates it if offset != NULL, otherwise from
+ * and updating the fd's own offset. Returns the bytes moved (0 at EOF),
+ * or the sink's error (-1, or -EAGAIN for a non-blocking target) if
+ * nothing could be moved.
+ */
+typedef int32_t (*fd_splice_sink)(void *ctx, const struct iovec *iov,
+                                  int iovcnt);
+int32_t fd_splice_from(int in_fd, uint32_t *offset, uint32_t count,
+                       uint32_t chunk, fd_splice_sink sink, void *ctx);
+
+/* sendfile: copy up to count bytes of in_fd (a VFS file) to out_fd
+   (pipe, console or another file) without a user-space buffer */
+int32_t fd_sendfile(int out_fd, int in_fd, uint32_t *offset, uint32_t count);
+
+/* fcntl commands (values match Linux) */
+#define F_GETFL       3      /* open-file flags */
+#define F_SETFL       4      /* change O_APPEND / O_NONBLOCK */
+#define F_SETPIPE_SZ  1031   /* resize a pipe; returns the new size */
+#define F_GETPIPE_SZ  1032   /* current pipe capacity */
+
+/* OR'd into cmd: 'fd' is a UDP socket index (F_GETFL/F_SETFL only) */
+#define F_SOCK        0x10000
+
+/* Flags F_SETFL may change */
+#define FD_SETFL_MASK (O_APPEND | O_NONBLOCK)
+
+/* File control. Returns a command-specific value, or -1. */
+int32_t fd_fcntl(int fd, int cmd, uint32_t arg);
+
 /* Seek whence values */
 #define SEEK_SET  0
 #define SEEK_CUR  1
 #define SEEK_END  2
 
 /* Initialize fd table for a new process (sets up stdin/stdout/stderr) */
-void fd_init_process(int *fd_table);
+void fd_init_process(fd_table_t *t);
 
-/* Close all fds in a process's fd table */
-void fd_close_all(int *fd_table);
+/* Close all fds in a process's fd table and shrink it back to inline */
+void fd_close_all(fd_table_t *t);
 
 #endif
@@ -86,6 +86,15 @@ void *kcalloc(size_t nmemb, size_t size);
  */
 void *krealloc(void *ptr, size_t new_size);
 
+/*
+ * Memory-pressure callback. When a request can't be met even after
+ * growing the heap to HEAP_MAX_SIZE, kmalloc calls the reclaim hook
+ * once (interrupts enabled, never recursively) asking it to kfree about
+ * 'bytes' of cached data, then retries. Returns bytes actually freed.
+ */
+typedef uint32_t (*heap_reclaim_fn)(uint32_t bytes);
+void  heap_set_reclaim(heap_reclaim_fn fn);
+
 /*
  * Print a dump of all heap blocks (address, size, free/used status)
  * to the terminal via printf. Useful for debugging and the 'meminfo'
@@ -4,11 +4,14 @@
 #include <kernel/io.h>
 #include <kernel/isr.h>
 #include <kernel/key_event.h>
+#include <kernel/wait.h>
 #include <stdio.h>
 
 void keyboard_init(void);
 key_event_t keyboard_get_event(void);
 key_event_t keyboard_get_event_blocking(void);
+int keyboard_has_event(void);
+wait_queue_t *keyboard_wait_queue(void);   /* for poll */
 int keyboard_shift_held(void);
 
 #endif
\ No newline at end of file
@@ -58,13 +58,35 @@ typedef struct __attribute__((packed)) {
     uint32_t tpa;       /* Target protocol address */
 } arp_header_t;
 
-#define ARP_CACHE_SIZE 16
-
-typedef struct {
+/* Neighbour table: ARP_TABLE_SIZE entries in ARP_HASH_SIZE chains */
+#define ARP_TABLE_SIZE  256
+#define ARP_HASH_SIZE   64
+
+#define ARP_QUEUE_MAX   48     /* packets held per unresolved neighbour:
+                                  a 64 KB datagram's fragments */
+#define ARP_RETRIES     3      /* requests before giving up, 1 s apart */
+#define ARP_RETRY_TICKS   100
+#define ARP_REACHABLE_TICKS 6000   /* 60 s: then refreshed on next use */
+#define ARP_EXPIRE_TICKS  60000    /* 10 min unconfirmed: forgotten */
+
+/* arp_entry_t.state */
+#define ARP_FREE        0
+#define ARP_INCOMPLETE  1      /* request sent, packets queued */
+#define ARP_REACHABLE   2      /* confirmed recently */
+#define ARP_STALE       3      /* still used, refreshed on next use */
+
+struct sk_buff;
+
+typedef struct arp_entry {
     uint32_t ip;
     uint8_t  mac[6];
-    uint32_t timestamp;  /* timer ticks when added */
-    int      valid;
+    uint8_t  state;      /* ARP_* */
+    uint8_t  probes;     /* requests sent since last confirmed */
+    uint32_t confirmed;  /* timer ticks of the last reply from it */
+    uint32_t requested;  /* timer ticks of the last request for it */
+    struct sk_buff *queue, *queue_tail;  /* waiting for the MAC */
+    uint32_t queue_len;
+    struct arp_entry *hnext;             /* hash chain / free list */
 } arp_entry_t;
 
 /* ================================================================== */
@@ -72,6 +94,7 @@ typedef struct {
 /* ================================================================== */
 
 #define IP_PROTO_ICMP  1
+#define IP_PROTO_TCP   6
 #define IP_PROTO_UDP   17
 
 typedef struct __attribute__((packed)) {
@@ -87,13 +110,77 @@ typedef struct __attribute__((packed)) {
     uint32_t dst_ip;
 } ip_header_t;
 
+/* flags_frag (host order) */
+#define IP_DF       0x4000   /* don't fragment */
+#define IP_MF       0x2000   /* more fragments follow */
+#define IP_OFFMASK  0x1FFF   /* fragment offset, in 8-byte units */
+
+/* Largest IP payload: what a 16-bit total_len leaves after the header */
+#define IP_MAX_PAYLOAD  (65535 - 20)
+
+/* Reassembly (ipfrag.c). Fragments are held as they arrived, chained
+   in order; a datagram not complete in IPFRAG_TIMEOUT ticks, or the
+   oldest one when a limit is hit, is dropped. */
+#define IPFRAG_SLOTS     8      /* datagrams being reassembled at once */
+#define IPFRAG_MAX_BUFS  64     /* packet buffers they may hold in all */
+#define IPFRAG_TIMEOUT   3000   /* 30 seconds */
+
+/* Path MTU (RFC 1191): the MTU an ICMP "fragmentation needed" reported
+   for a destination, kept for PMTU_EXPIRE_TICKS; otherwise ETH_MTU.
+   Reports below IP_MIN_MTU are taken as IP_MIN_MTU. */
+#define PMTU_CACHE_SIZE    16
+#define PMTU_EXPIRE_TICKS  60000   /* 10 minutes */
+#define IP_MIN_MTU         576
+
+/* 127.0.0.0/8, and the address loopback traffic comes from */
+#define IP_LOOPBACK_NET   0x0000007Fu    /* 127.0.0.0, network order */
+#define IP_LOOPBACK_MASK  0x000000FFu    /* 255.0.0.0 */
+#define IP_LOOPBACK_ADDR  0x0100007Fu    /* 127.0.0.1 */
+
+static inline int ip_is_loopback(uint32_t ip) {
+    return (ip & IP_LOOPBACK_MASK) == IP_LOOPBACK_NET;
+}
+
+/* ================================================================== */
+/*  Routing                                                           */
+/* ================================================================== */
+
+/*
+ * Longest prefix match over two sets of routes: the ones the interface
+ * configuration implies (127/8 and our own address to the loopback,
+ * our subnet on the wire, the default gateway), worked out from
+ * net_cfg at each lookup so they follow DHCP, and up to
+ * ROUTE_TABLE_SIZE static ones from `route add`. Of two routes with
+ * the same prefix length, a static one wins.
+ */
+#define ROUTE_TABLE_SIZE  16
+
+/* route_t.flags */
+#define ROUTE_F_GATEWAY  0x01   /* via gateway, not on-link */
+#define ROUTE_F_LOCAL    0x02   /* to this host: out the loopback */
+#define ROUTE_F_IFACE    0x04   /* from the interface config */
+
+struct nic;
+
+typedef struct {
+    uint32_t dest;       /* network (network byte order) */
+    uint32_t mask;
+    uint32_t gateway;    /* with ROUTE_F_GATEWAY */
+    uint32_t src;        /* source address for packets sent on it */
+    uint32_t flags;      /* ROUTE_F_* */
+    struct nic *dev;     /* lookup: the NIC it goes out of */
+} route_t;
+
 /* ================================================================== */
 /*  ICMP                                                              */
 /* ================================================================== */
 
 #define ICMP_ECHO_REPLY    0
+#define ICMP_DEST_UNREACH  3
 #define ICMP_ECHO_REQUEST  8
 
+#define ICMP_FRAG_NEEDED   4   /* DEST_UNREACH code: DF set, MTU in seq */
+
 typedef struct __attribute__((packed)) {
     uint8_t  type;
     uint8_t  code;
@@ -113,6 +200,38 @@ typedef struct __attribute__((packed)) {
     uint16_t checksum;   /* 0 = no checksum (valid for UDP/IPv4) */
 } udp_header_t;
 
+/* Largest datagram payload that fits one Ethernet frame */
+#define UDP_MAX_PAYLOAD (ETH_MTU - 20 - sizeof(udp_header_t))
+
+/* Largest datagram payload at all; anything over the path MTU is sent
+   in IP fragments */
+#define UDP_MAX_DGRAM   (IP_MAX_PAYLOAD - sizeof(udp_header_t))
+
+/* ================================================================== */
+/*  TCP                                                               */
+/* ================================================================== */
+
+typedef struct __attribute__((packed)) {
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t  off;        /* header length in 32-bit words, high nibble */
+    uint8_t  flags;      /* TCP_FIN .. TCP_ACK */
+    uint16_t window;
+    uint16_t checksum;   /* over a pseudo-header + segment, required */
+    uint16_t urgent;
+} tcp_header_t;
+
+#define TCP_FIN  0x01
+#define TCP_SYN  0x02
+#define TCP_RST  0x04
+#define TCP_PSH  0x08
+#define TCP_ACK  0x10
+
+/* Largest segment payload that fits one Ethernet frame */
+#define TCP_MSS  (ETH_MTU - 20 - sizeof(tcp_header_t))
+
 /* ================================================================== */
 /*  DHCP                                                              */
 /* ================================================================== */
@@ -158,18 +277,97 @@ typedef struct {
 
 extern net_config_t net_cfg;
 
+/* Packet counters. A copy is one memcpy of a packet's payload from one
+   buffer to another, including to and from user memory (NIC DMA is
+   not counted), so copies / packets is the per-packet copy cost. */
+typedef struct {
+    uint32_t rx_packets;   /* frames handed up by the NIC */
+    uint32_t tx_packets;   /* frames handed to the NIC */
+    uint32_t rx_bytes;
+    uint32_t tx_bytes;
+    uint32_t tx_doorbells; /* times the NIC was told of new TX frames */
+    uint32_t tx_ring_full; /* frames refused: no free TX descriptor */
+    uint32_t rx_copies;
+    uint32_t tx_copies;
+    uint32_t rx_nobuf;     /* frames dropped: no free packet buffer */
+    uint32_t rx_csum_errors; /* frames dropped: the NIC found a bad checksum */
+    uint32_t rx_missed;    /* NIC: frames lost, no room on the card (MPC) */
+    uint32_t rx_no_desc;   /* NIC: frames that found the RX ring full (RNBC) */
+    uint32_t rx_crc_errors; /* NIC: frames with a bad Ethernet CRC */
+    uint32_t rx_overruns;  /* NIC: receiver overrun interrupts */
+    uint32_t rx_irqs;      /* RX interrupts that scheduled a poll */
+    uint32_t rx_polls;     /* nic->poll() rounds */
+    uint32_t rx_full_polls; /* rounds that used the whole budget */
+    uint32_t arp_queued;   /* packets held for an ARP reply */
+    uint32_t arp_drops;    /* ... dropped: no reply, or queue full */
+    uint32_t arp_conflicts; /* ARP from another host claiming our IP */
+    uint32_t ip_frags_out; /* IP fragments sent */
+    uint32_t ip_frags_in;  /* ... received */
+    uint32_t ip_reasm_ok;  /* datagrams reassembled */
+    uint32_t ip_reasm_fails; /* ... given up: timeout, limits, overlaps */
+    uint32_t ip_no_route;  /* packets dropped: no route to the destination */
+    uint32_t ip_martians;  /* ... received: 127/8 from outside the loopback */
+    uint32_t lo_packets;   /* packets sent through the loopback */
+    uint32_t lo_drops;     /* ... dropped: its queue was full */
+    uint32_t tcp_retrans;  /* TCP segments resent on a timeout */
+    uint32_t tcp_fast_retrans; /* ... on three duplicate ACKs */
+} net_stats_t;
+
+extern net_stats_t net_stats;
+
 /* ================================================================== */
 /*  API — net.c                                                       */
 /* ================================================================== */
 
+struct sk_buff;
+
+/* Frames passed up per nic->poll() round before the RX thread checks
+   for more; other threads get the CPU between rounds */
+#define NET_RX_BUDGET  16
+
 void net_init(void);
-void net_rx_callback(const void *data, uint16_t len);
+
+/* Called by a NIC's IRQ handler after masking its RX interrupts: the
+   RX thread will call nic->poll() until the ring is empty. Before the
+   thread runs, polls right away. */
+void net_rx_schedule(void);
+
+/* Wake the RX thread to drain the loopback queue */
+void net_rx_kick(void);
+
+/* Hand a received frame up the stack. Takes over the caller's
+   reference to skb. Called from nic->poll(). */
+void net_rx(struct sk_buff *skb);
+
+/* Prepend the Ethernet header to skb in place and transmit it on the
+   NIC (eth_xmit: on dev). The skb is consumed whether or not it is
+   sent. */
+int  eth_send_skb(const uint8_t *dst_mac, uint16_t type,
+                  struct sk_buff *skb);
+int  eth_xmit(struct nic *dev, const uint8_t *dst_mac, uint16_t type,
+              struct sk_buff *skb);
+
+/* Same, for a payload in a flat buffer (copied into a packet buffer) */
 int  eth_send(const uint8_t *dst_mac, uint16_t type,
               const void *payload, uint16_t payload_len);
 
+/* Send bursts. Between net_tx_hold() and net_tx_release() the NIC
+   queues this thread's frames without being told of each one; the
+   release (or a full ring) tells it of them all at once. Holds nest.
+   A burst shouldn't sleep, as its frames wait for it. */
+void net_tx_hold(void);
+void net_tx_release(void);
+int  net_tx_held(void);       /* for drivers: in the current thread's burst */
+void net_tx_flush(void);      /* tell the NIC of queued frames now */
+
+/* Fill in a TCP/UDP checksum left to the NIC (SKB_CSUM_L4), for a NIC
+   without NIC_F_TX_CSUM or a segment looped back to the stack */
+void net_csum_complete(struct sk_buff *skb);
+
 /* IP address parse/format helpers */
 uint32_t ip_parse(const char *str);
 const char *ip_fmt(uint32_t ip);
+const char *mac_fmt(const uint8_t *mac);   /* aa:bb:cc:dd:ee:ff */
 
 /* ================================================================== */
 /*  API — arp.c                                                       */
@@ -178,17 +376,132 @@ const char *ip_fmt(uint32_t ip);
 void arp_init(void);
 void arp_handle(const void *data, uint16_t len);
 void arp_request(uint32_t target_ip);
-int  arp_resolve(uint32_t ip, uint8_t *mac_out);
+
+/* Send an IPv4 packet to next_hop on the LAN. Without its MAC yet,
+   the packet waits on the neighbour's queue for the ARP reply (and is
+   dropped if none comes), so the caller never blocks. Consumes skb.
+   Returns 0 if sent or queued, -1 if dropped. */
+int  arp_output(uint32_t next_hop, struct sk_buff *skb);
+
+/* Non-blocking: copy ip's MAC out if it's known. Returns 0 or -1. */
+int  arp_lookup(uint32_t ip, uint8_t *mac_out);
+
+/* Gratuitous ARP for our own address, e.g. once DHCP has assigned it */
+void arp_announce(void);
+
+/* Copy up to max in-use entries (queues left out) for display.
+   Returns how many. */
+int  arp_list(arp_entry_t *out, int max);
+
+/* Forget every entry, dropping queued packets */
+void arp_flush(void);
 
 /* ================================================================== */
 /*  API — ip.c                                                        */
 /* ================================================================== */
 
-void     ip_handle(const void *data, uint16_t len);
+void     ip_init(void);
+void     ip_handle(struct sk_buff *skb);
+
+/* Prepend an IP header to skb (its data is the IP payload) and route
+   it out. Consumes skb. A payload over the path MTU must come as a
+   chain (frag_next) whose pieces, all but the last a multiple of 8
+   bytes, each fit ip_frag_size(); every piece goes out as a fragment
+   with its own header. TCP segments go with DF set. */
+int      ip_send_skb(uint32_t dst_ip, uint8_t protocol,
+                     struct sk_buff *skb);
 int      ip_send(uint32_t dst_ip, uint8_t protocol,
                  const void *payload, uint16_t payload_len);
 uint16_t ip_checksum(const void *data, uint16_t len);
 
+/* Source address for a packet to dst_ip: the one its route gives, or
+   ours if there is no route */
+uint32_t ip_route_src(uint32_t dst_ip);
+
+/* Path MTU towards dst_ip, and the most payload one fragment to it can
+   carry (a multiple of 8) */
+uint16_t ip_path_mtu(uint32_t dst_ip);
+uint16_t ip_frag_size(uint32_t dst_ip);
+
+/* Record an ICMP "fragmentation needed" report: the path to dst_ip
+   takes at most mtu */
+void     ip_pmtu_update(uint32_t dst_ip, uint16_t mtu);
+
+/* Internet checksum in pieces: ip_csum_add() sums len bytes onto sum
+   (pieces before the last must be of even length), ip_csum_fold()
+   gives the final, complemented value. ip_pseudo_sum() starts a
+   TCP/UDP sum with the IPv4 pseudo-header (len: L4 header plus
+   payload). */
+uint32_t ip_csum_add(uint32_t sum, const void *data, uint32_t len);
+uint16_t ip_csum_fold(uint32_t sum);
+uint32_t ip_pseudo_sum(uint32_t src_ip, uint32_t dst_ip, uint8_t protocol,
+                       uint16_t len);
+
+/* ip_csum_add() over the first len bytes of an skb chain */
+uint32_t ip_csum_chain(uint32_t sum, const struct sk_buff *skb, uint32_t len);
+
+/* ================================================================== */
+/*  API — ipfrag.c                                                    */
+/* ================================================================== */
+
+void ip_frag_init(void);
+
+/* Take a fragment (skb->data at its payload; ip is its header, still
+   in the buffer) into reassembly, with a reference of its own. Returns
+   the whole datagram once this completes it, as a chain the caller
+   holds a reference to, or NULL. */
+struct sk_buff *ip_frag_input(struct sk_buff *skb, const ip_header_t *ip);
+
+/* Drop everything being reassembled */
+void ip_frag_flush(void);
+
+/* ================================================================== */
+/*  API — route.c                                                     */
+/* ================================================================== */
+
+void route_init(void);
+
+/* Best route to dst_ip, copied to *out if out isn't NULL. Returns 0,
+   or -1 if there is none. */
+int  route_lookup(uint32_t dst_ip, route_t *out);
+
+/* Add a static route to dest/mask, via gateway (0: on-link). Returns
+   0, or -1 if the mask isn't a prefix, the route exists or the table
+   is full. */
+int  route_add(uint32_t dest, uint32_t mask, uint32_t gateway);
+
+/* Remove the static route to dest/mask. Returns 0 or -1. */
+int  route_del(uint32_t dest, uint32_t mask);
+
+/* Copy up to max routes out, interface ones first. Returns how many. */
+int  route_list(route_t *out, int max);
+
+/* Remove every static route */
+void route_flush(void);
+
+/* Prefix length of a network-byte-order mask */
+int  route_prefix_len(uint32_t mask);
+
+/* ================================================================== */
+/*  API — loopback.c                                                  */
+/* ================================================================== */
+
+/*
+ * The loopback is a nic_t of its own. Frames sent on it are queued,
+ * up to LOOPBACK_QUEUE_MAX, and handed back to net_rx() by the RX
+ * thread, so a sender never re-enters the stack. Checksums are left
+ * out on send and taken as verified on receive, as nothing can corrupt
+ * them in memory.
+ */
+#define LOOPBACK_QUEUE_MAX  128   /* a 64 KB datagram's fragments and more */
+
+extern struct nic loopback_nic;
+
+void loopback_init(void);
+
+/* Pass up to budget queued frames to net_rx(). Returns how many. */
+int  loopback_poll(int budget);
+
 /* ================================================================== */
 /*  API — icmp.c                                                      */
 /* ================================================================== */
@@ -202,7 +515,11 @@ int  net_ping(uint32_t dst_ip);
 /* ================================================================== */
 
 void udp_init(void);
-void udp_handle(const void *data, uint16_t len, uint32_t src_ip);
+
+/* Deliver a datagram (skb->data at the UDP header, skb->src_ip set;
+   a reassembled one is a chain). The socket queues the buffer itself,
+   taking its own reference. */
+void udp_handle(struct sk_buff *skb);
 int  udp_send(uint32_t dst_ip, uint16_t src_port, uint16_t dst_port,
               const void *data, uint16_t data_len);
 int  udp_sendto(int sock, uint32_t dst_ip, uint16_t dst_port,
@@ -212,6 +529,123 @@ void udp_unbind(int sock);
 int  udp_recv(int sock, void *buf, uint16_t max_len,
               uint32_t *from_ip, uint16_t *from_port);
 
+/* Gather/scatter variants (struct iovec from fd.h): one datagram built
+   from, or spread across, iovcnt buffers */
+struct iovec;
+int  udp_sendv(int sock, uint32_t dst_ip, uint16_t dst_port,
+               const struct iovec *iov, int iovcnt);
+int  udp_recvv(int sock, const struct iovec *iov, int iovcnt,
+               uint32_t *from_ip, uint16_t *from_port);
+
+/* Receive queue size per socket (SO_RCVBUF, bytes). Each queued
+   datagram costs 8 bytes of header plus its payload rounded up to 4. */
+#define UDP_RCVBUF_DEFAULT 8192
+#define UDP_RCVBUF_MIN     2048
+#define UDP_RCVBUF_MAX     65536
+
+/* Socket options */
+#define SO_RCVBUF    1   /* get/set: receive queue size in bytes */
+#define SO_RCVDROPS  2   /* get: datagrams dropped on a full queue */
+#define SO_RCVQLEN   3   /* get: datagrams queued now */
+
+int     udp_setsockopt(int sock, int opt, uint32_t val);
+int32_t udp_getsockopt(int sock, int opt);
+
+/* One message of a batched send or receive */
+struct udp_msg {
+    const struct iovec *iov;
+    int       iovcnt;
+    uint32_t  ip;          /* send: destination; recv: filled in, source */
+    uint16_t  port;
+    uint16_t  len;         /* recv: filled in, bytes stored */
+};
+
+#define UDP_MMSG_MAX 16    /* most messages per udp_recvmmsg / udp_sendmmsg */
+
+/* Wait for a datagram like udp_recvv, then take as many queued ones
+   as fit in msgs[vlen] without waiting again. Returns the number
+   received, -EAGAIN (non-blocking, nothing queued) or -1. */
+int  udp_recvmmsg(int sock, struct udp_msg *msgs, int vlen);
+
+/* Send vlen datagrams as one burst (net_tx_hold), the NIC told of
+   them once. Returns the number sent (stopping at the first that
+   fails), or -1 if none was. */
+int  udp_sendmmsg(int sock, const struct udp_msg *msgs, int vlen);
+
+/* F_GETFL / F_SETFL for a socket (only O_NONBLOCK is kept). A
+   non-blocking socket's recv returns -EAGAIN when nothing is queued. */
+int32_t udp_fcntl(int sock, int cmd, uint32_t arg);
+
+/* Readiness for poll: 1 if a datagram is waiting, 0 if not, -1 if
+   sock isn't bound. *wq is the queue woken when one arrives. */
+struct wait_queue;
+int  udp_poll(int sock, struct wait_queue **wq);
+
+/* Stream a VFS file out as datagrams of up to UDP_MAX_PAYLOAD bytes,
+   copied straight from the page cache into each frame (see
+   fd_splice_from for offset/count). Returns bytes sent or -1. */
+int32_t udp_sendfile(int sock, uint32_t dst_ip, uint16_t dst_port,
+                     int in_fd, uint32_t *offset, uint32_t count);
+
+/* ================================================================== */
+/*  API — tcp.c                                                       */
+/* ================================================================== */
+
+/*
+ * TCP connections are fds (FD_TYPE_TCP): read/write/poll/close and
+ * O_NONBLOCK work on them as on pipes. A listening socket's fd hands
+ * out a new fd per connection from tcp_accept.
+ */
+
+#define TCP_SNDBUF   32768   /* bytes buffered for sending, per connection */
+#define TCP_RCVBUF   32768   /* receive buffer; the largest window offered */
+#define TCP_BACKLOG_MAX 16   /* most pending connections per listener */
+#define TCP_MAX_SOCKETS 64   /* sockets of any state, system-wide */
+
+/* Socket options (tcp_setsockopt / tcp_getsockopt take an fd) */
+#define TCP_NODELAY  16   /* get/set: 1 = send small segments at once (no Nagle) */
+#define TCP_RETRANS  17   /* get: segments this connection has resent */
+
+struct tcp_sock;
+
+void tcp_init(void);
+
+/* Deliver a segment (skb->data at the TCP header, src_ip/dst_ip set) */
+void tcp_handle(struct sk_buff *skb);
+
+/* New unconnected socket behind a new fd; flags may hold O_NONBLOCK.
+   Returns the fd or -1. */
+int  tcp_open(uint32_t flags);
+
+/* Listen on a local port for up to backlog pending connections */
+int  tcp_listen(int fd, uint16_t port, int backlog);
+
+/* Take the next established connection off a listener as a new fd,
+   filling in the peer's address. Blocks unless O_NONBLOCK (-EAGAIN). */
+int  tcp_accept(int fd, uint32_t *ip, uint16_t *port);
+
+/* Connect to ip:port. Blocks until established; a non-blocking socket
+   returns -EINPROGRESS and becomes writable once connected. */
+int  tcp_connect(int fd, uint32_t ip, uint16_t port);
+
+int     tcp_setsockopt(int fd, int opt, uint32_t val);
+int32_t tcp_getsockopt(int fd, int opt);
+
+/* fd-layer hooks (fd.c, poll.c) */
+int32_t  tcp_read(struct tcp_sock *s, void *buf, uint32_t count, int nonblock);
+int32_t  tcp_write(struct tcp_sock *s, const void *buf, uint32_t count,
+                   int nonblock);
+uint16_t tcp_poll(struct tcp_sock *s, struct wait_queue *wq[2]);
+void     tcp_release(struct tcp_sock *s);
+
+/* Send segments through fn instead of ip_send_skb (NULL restores it).
+   Lets tests loop a connection back to itself. */
+void tcp_set_output(int (*fn)(uint32_t dst_ip, uint8_t protocol,
+                              struct sk_buff *skb));
+
+/* Sockets in use (for netinfo) */
+uint32_t tcp_socket_count(void);
+
 /* ================================================================== */
 /*  API — dhcp.c                                                      */
 /* ================================================================== */
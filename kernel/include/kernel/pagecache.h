@@ -0,0 +1,63 @@
+#ifndef _PAGECACHE_H
+#define _PAGECACHE_H
+
+#include <stdint.h>
+
+/*
+ * Page cache — per-inode radix tree of 4 KiB file pages.
+ *
+ * Each file keeps its data in whole physical frames indexed by page
+ * number (file offset / 4096). The tree is built from 64-slot nodes,
+ * six index bits per level; a tree of height h covers pages
+ * 0 .. 64^h - 1, so four levels reach past the 4 GiB file size limit.
+ * Interior slots hold child node pointers, leaf slots hold frame
+ * physical addresses (0 = no page; frame 0 is never handed out).
+ *
+ * The cache owns one reference on every frame it holds (see
+ * frame_get/free_frame). A frame mapped into a process by mmap carries
+ * an extra reference, so dropping a page from the cache never pulls it
+ * out from under a live mapping.
+ *
+ * Frames are reached through the physmap (phys_to_virt), so copying
+ * to and from the cache needs no temp_map window.
+ */
+
+#define PCACHE_SHIFT      6
+#define PCACHE_SLOTS      (1u << PCACHE_SHIFT)   /* 64 per node */
+#define PCACHE_MAX_HEIGHT 4
+
+/* Pages to ask the reclaim hook for when the frame allocator runs dry */
+#define PCACHE_RECLAIM_PAGES 16
+
+typedef struct pcache_node {
+    uint32_t slots[PCACHE_SLOTS];   /* child node pointer or frame phys */
+} pcache_node_t;
+
+typedef struct pcache {
+    pcache_node_t *root;
+    uint8_t        height;          /* 0 = empty tree */
+    uint32_t       nr_pages;
+} pcache_t;
+
+/* Frame holding page 'index', or 0 if the page isn't cached. */
+uint32_t pcache_lookup(const pcache_t *pc, uint32_t index);
+
+/* Frame holding page 'index', allocating a zeroed one if absent.
+   Returns 0 when no frame or tree node can be allocated. */
+uint32_t pcache_get_page(pcache_t *pc, uint32_t index);
+
+/* Drop every page at index >= first (first = 0 empties the tree). */
+void     pcache_truncate(pcache_t *pc, uint32_t first);
+
+/*
+ * Memory-pressure callback. When alloc_frame() fails, pcache_get_page
+ * calls the hook once (never recursively) asking it to release about
+ * 'bytes' of clean cached data, then retries. Returns bytes freed.
+ */
+typedef uint32_t (*pcache_reclaim_fn)(uint32_t bytes);
+void     pcache_set_reclaim(pcache_reclaim_fn fn);
+
+/* Frames held by all page caches (for 'vfsstat') */
+uint32_t pcache_total_pages(void);
+
+#endif
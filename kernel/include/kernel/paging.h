@@ -79,6 +79,21 @@ uint32_t virt_to_phys(uint32_t virt);
 void *temp_map(uint32_t phys_frame);
 void  temp_unmap(void);
 
+/*
+    Physmap — all of RAM the frame allocator manages (MAX_FRAMES) mapped
+    at a fixed kernel VA, PDEs 960-975. Built by physmap_init() before
+    the first process exists, so every page directory inherits it.
+    Lets the kernel touch any frame without going through temp_map.
+*/
+#define PHYSMAP_VADDR     0xF0000000u
+#define PHYSMAP_PDE_START (PHYSMAP_VADDR >> 22)  /* 960 */
+
+void physmap_init(void);
+
+static inline void *phys_to_virt(uint32_t phys) {
+    return (void *)(PHYSMAP_VADDR + phys);
+}
+
 /*
     Sentinel value for alloc_frame() failure (out of memory).
     Distinct from physical address 0x0 (which is a valid reserved frame).
@@ -100,6 +115,14 @@ int test_frame(uint32_t frame);
 
 uint32_t alloc_frame(void);
 
+/*
+    Frames are reference counted. alloc_frame() returns a frame holding
+    one reference; frame_get() takes another (e.g. a page-cache frame
+    mapped into a process) and free_frame() drops one, releasing the
+    frame when the last reference goes.
+*/
+void frame_get(uint32_t phys);
+
 void free_frame(uint32_t phys);
 
 /*
@@ -118,7 +141,7 @@ int map_page(uint32_t virt, uint32_t phys, uint32_t flags);
 
 /*
     Map a device MMIO region into kernel virtual address space.
-    Automatically selects a free PDE slot (starting from PDE[773]),
+    Automatically selects a free PDE slot (PDE[773] up to the physmap),
     maps 'size' bytes from 'phys_base' with PAGE_CACHE_DISABLE.
     On success, writes the kernel virtual address to *virt_out and returns 0.
     On failure (no free PDE or map_page failed), returns -1.
@@ -134,6 +157,9 @@ uint32_t pgdir_create(void);
 void     pgdir_destroy(uint32_t pd_phys);
 int      pgdir_map_user_page(uint32_t pd_phys, uint32_t virt, uint32_t phys, uint32_t flags);
 
+/* PTE for 'virt' in a per-process page directory, or 0 if unmapped */
+uint32_t pgdir_get_pte(uint32_t pd_phys, uint32_t virt);
+
 /*
     Page fault handler (ISR 14)
     Called from isr_common_handler. Returns 0 if handled, -1 to kill/halt.
@@ -11,13 +11,23 @@
  * Reading from an empty pipe blocks. Writing to a full pipe blocks.
  * When all write-end fds are closed, reading returns 0 (EOF).
  * When all read-end fds are closed, writing returns -1 (broken pipe).
+ *
+ * The ring lives in physically contiguous frames reached through the
+ * physmap, so a transfer is at most two memcpy calls (before and after
+ * the wrap). Its size is a power-of-two number of pages, one page by
+ * default and up to PIPE_MAX_SIZE via pipe_set_size (F_SETPIPE_SZ).
+ * Readers only sleep on an empty pipe and writers on a full one, so
+ * each side wakes the other only on those transitions.
  */
 
-#define PIPE_BUF_SIZE 512
-#define MAX_PIPES     16
+#define PIPE_DEFAULT_SIZE 4096     /* one page */
+#define PIPE_MAX_SIZE     65536    /* 16 pages */
+#define MAX_PIPES         16
 
 typedef struct pipe {
-    uint8_t      buf[PIPE_BUF_SIZE];
+    uint8_t     *buf;         /* ring, 'size' bytes (physmap address) */
+    uint32_t     phys;        /* first frame of the ring */
+    uint32_t     size;        /* capacity in bytes, power of two */
     uint32_t     read_pos;    /* next byte to read */
     uint32_t     write_pos;   /* next byte to write */
     uint32_t     count;       /* bytes currently in buffer */
@@ -35,11 +45,19 @@ void pipe_init(void);
    Returns -1 on failure. Operates on current_process->fds. */
 int pipe_create(int *read_fd, int *write_fd);
 
-/* Read from a pipe. Blocks if empty, returns 0 on EOF. */
-int32_t pipe_read(pipe_t *p, void *buf, uint32_t count);
+/* Read from a pipe. Blocks if empty, returns 0 on EOF. With nonblock
+   set it returns what is buffered instead, or -EAGAIN if nothing is. */
+int32_t pipe_read(pipe_t *p, void *buf, uint32_t count, int nonblock);
+
+/* Write to a pipe. Blocks if full, returns -1 on broken pipe. With
+   nonblock set it writes what fits, or returns -EAGAIN if nothing does. */
+int32_t pipe_write(pipe_t *p, const void *buf, uint32_t count, int nonblock);
 
-/* Write to a pipe. Blocks if full, returns -1 on broken pipe. */
-int32_t pipe_write(pipe_t *p, const void *buf, uint32_t count);
+/* Resize the ring (rounded up to a power-of-two number of pages).
+   Fails if 'size' exceeds PIPE_MAX_SIZE, is smaller than the data
+   currently buffered, or no frames are free. Returns the new size or
+   -1. */
+int32_t pipe_set_size(pipe_t *p, uint32_t size);
 
 /* Called when an fd pointing to a pipe is closed */
 void pipe_close_reader(pipe_t *p);
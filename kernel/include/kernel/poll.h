@@ -0,0 +1,77 @@
+#ifndef _POLL_H
+#define _POLL_H
+
+#include <stdint.h>
+
+/*
+ * poll and epoll — wait for any of several fds to become ready.
+ *
+ * Nothing here owns a wait queue. Readiness is probed from the objects
+ * themselves (pipe ring, keyboard buffer, UDP and TCP sockets), and waiting is
+ * done by hanging watcher entries (see wait.h) on the queues their
+ * blocking readers and writers already sleep on.
+ *
+ * UDP sockets are not fds; set POLLSOCK in 'events' to name a socket
+ * index instead. Both interfaces are level-triggered.
+ */
+
+#define POLLIN    0x0001   /* data to read (or EOF) */
+#define POLLOUT   0x0004   /* room to write */
+#define POLLERR   0x0008   /* write end of a pipe with no readers */
+#define POLLHUP   0x0010   /* read end of a pipe with no writers */
+#define POLLNVAL  0x0020   /* not an open fd / bound socket */
+#define POLLSOCK  0x1000   /* 'fd' is a UDP socket index */
+
+struct pollfd {
+    int32_t  fd;
+    uint16_t events;       /* POLLIN | POLLOUT [| POLLSOCK] */
+    uint16_t revents;      /* filled in */
+};
+
+#define POLL_MAX_FDS     32
+#define POLL_TICK_MS     10   /* timer runs at 100 Hz */
+
+/* Fill in revents for each entry. timeout_ms < 0 waits forever, 0 only
+   checks. Returns the number of entries with revents set, 0 on
+   timeout, or -1. */
+int32_t poll_fds(struct pollfd *fds, uint32_t nfds, int32_t timeout_ms);
+
+/* ------------------------------------------------------------------ */
+/*  epoll                                                             */
+/* ------------------------------------------------------------------ */
+
+#define EPOLL_CTL_ADD    1
+#define EPOLL_CTL_DEL    2
+#define EPOLL_CTL_MOD    3
+
+#define EPOLL_MAX_WATCH  32   /* fds/sockets per epoll instance */
+
+struct epoll_event {
+    uint32_t events;       /* POLL* bits (POLLSOCK as in pollfd) */
+    uint32_t data;         /* returned untouched by epoll_wait */
+};
+
+struct epoll;
+struct open_file;
+
+/* Create an epoll instance behind a new fd. Returns the fd or -1. */
+int     epoll_create(void);
+
+/* Add, change or remove a watched fd (or socket, with POLLSOCK set in
+   ev->events; for DEL ev only needs that bit). Returns 0 or -1. */
+int     epoll_ctl(int epfd, int op, int fd, const struct epoll_event *ev);
+
+/* Wait for watched fds to become ready; fills up to maxevents entries
+   with the ready bits and the registered data. Returns the count, 0 on
+   timeout, or -1. */
+int32_t epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+                   int32_t timeout_ms);
+
+/* Drop an instance when its last fd is closed (called by fd.c) */
+void    epoll_release(struct epoll *ep);
+
+/* Remove every watch on an open file whose last fd is being closed,
+   from whichever instances hold them (called by fd.c) */
+void    epoll_forget_file(struct open_file *of);
+
+#endif
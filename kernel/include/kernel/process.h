@@ -15,6 +15,8 @@ typedef struct {
     uint32_t length;        /* byte length (page-aligned) */
     uint32_t prot;          /* PROT_READ | PROT_WRITE | PROT_EXEC */
     uint32_t flags;         /* MAP_ANONYMOUS | MAP_PRIVATE | MAP_SHARED */
+    uint32_t ino;           /* file mappings: VFS inode */
+    uint32_t offset;        /* file mappings: file offset of 'base' */
 } vma_t;
 
 struct trapframe;   // forward declaration
@@ -44,8 +46,8 @@ struct process {
     uint32_t cr3;               // physical address of page directory
                                 // 0 = use kernel's page directory
 
-    /* File descriptor table (indexes into open_file_table, -1 = free) */
-    int fds[MAX_FDS];
+    /* File descriptor table (open file indices, -1 = free) */
+    fd_table_t fds;
 
     /* Process hierarchy */
     uint32_t parent_pid;        /* PID of parent (0 = no parent / init) */
@@ -0,0 +1,107 @@
+#ifndef _SKB_H
+#define _SKB_H
+
+#include <stdint.h>
+
+/*
+ * Packet buffers (sk_buff-style).
+ *
+ * A fixed pool of SKB_BUF_SIZE buffers, two per page frame, so each one
+ * is physically contiguous and can be handed to a NIC for DMA as is.
+ * The valid bytes are [data, data + len); the space in front of data
+ * is headroom that skb_push() grows headers into, so TX builds the
+ * payload once and each layer prepends its header in place. RX goes
+ * the other way: the NIC fills a buffer, which is swapped out of the
+ * descriptor ring and passed up the stack, each layer skb_pull()ing
+ * its header off.
+ *
+ * Buffers are reference counted; skb_free() drops one reference and
+ * returns the buffer to the pool with the last. All calls are
+ * interrupt-safe.
+ *
+ * A datagram too big for one buffer (an IP datagram sent or received
+ * in fragments) is a chain of them linked by frag_next, each holding
+ * the next one: freeing the first buffer for the last time frees the
+ * rest of the chain with it.
+ */
+
+#define SKB_BUF_SIZE   2048   /* matches the e1000's 2 KB RX buffers */
+#define SKB_POOL_SIZE  256    /* buffers skb_init() makes (128 frames) */
+#define SKB_HEADROOM   128    /* room for Ethernet + IP + transport */
+
+typedef struct sk_buff {
+    struct sk_buff *next;     /* free list / queue link */
+    uint8_t  *head;           /* start of the buffer */
+    uint8_t  *data;           /* first valid byte */
+    uint16_t  len;            /* valid bytes from data */
+    int       refcount;
+    uint32_t  phys;           /* physical address of head */
+    uint32_t  src_ip;         /* RX: set by ip_handle */
+    uint32_t  dst_ip;         /* RX: set by ip_handle */
+    uint16_t  src_port;       /* RX: set by the transport layer */
+    uint8_t   csum;           /* SKB_CSUM_* */
+    uint16_t  csum_start;     /* TX: L4 header, as an offset from head */
+    uint16_t  csum_offset;    /* TX: its checksum field, from csum_start */
+    struct sk_buff *frag_next; /* rest of the datagram, in order */
+    uint16_t  frag_off;       /* RX: where this piece goes, in reassembly */
+    uint8_t   looped;         /* RX: came in through the loopback */
+} sk_buff_t;
+
+/*
+ * Checksum offload. On TX a flag means the checksum is left for the
+ * NIC to fill in: the IPv4 header's (the IP header follows the
+ * Ethernet header), or the TCP/UDP one at csum_start + csum_offset,
+ * which holds the pseudo-header sum. ip_send_skb() leaves the former
+ * only to a NIC with NIC_F_TX_IP_CSUM, and eth_send_skb() finishes the
+ * latter in software for a NIC without NIC_F_TX_CSUM. On RX a flag
+ * means the NIC has already verified that checksum.
+ */
+#define SKB_CSUM_IP  0x01
+#define SKB_CSUM_L4  0x02
+
+/* Carve the pool out of page frames. Returns 0 or -1. */
+int skb_init(void);
+
+/* Add count more buffers to the pool, for a driver whose RX ring will
+   hold that many. Returns 0, or -1 if memory ran out (whatever was
+   added stays). */
+int skb_grow(uint32_t count);
+
+/* Take a buffer with 'headroom' bytes in front of data and len 0, or
+   NULL if the pool is empty. */
+sk_buff_t *skb_alloc(uint16_t headroom);
+
+/* Take / drop a reference */
+void skb_get(sk_buff_t *skb);
+void skb_free(sk_buff_t *skb);
+
+/* Grow the data by n bytes at the front (header) or the end; returns
+   the new bytes, or NULL if there is no room. */
+uint8_t *skb_push(sk_buff_t *skb, uint16_t n);
+uint8_t *skb_put(sk_buff_t *skb, uint16_t n);
+
+/* Strip n bytes from the front, returning the new data, or NULL if
+   there are fewer than n. */
+uint8_t *skb_pull(sk_buff_t *skb, uint16_t n);
+
+/* Cut the data to len bytes (no-op if it is already shorter) */
+void skb_trim(sk_buff_t *skb, uint16_t len);
+
+/* Bytes in the whole chain starting at skb */
+static inline uint32_t skb_chain_len(const sk_buff_t *skb) {
+    uint32_t len = 0;
+    for (; skb; skb = skb->frag_next)
+        len += skb->len;
+    return len;
+}
+
+/* Physical address of skb->data, for DMA */
+static inline uint32_t skb_data_phys(const sk_buff_t *skb) {
+    return skb->phys + (uint32_t)(skb->data - skb->head);
+}
+
+/* Buffers currently in the pool, and in existence */
+uint32_t skb_pool_free(void);
+uint32_t skb_pool_size(void);
+
+#endif
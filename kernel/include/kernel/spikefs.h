@@ -8,9 +8,10 @@
 /* ------------------------------------------------------------------ */
 
 #define SPIKEFS_MAGIC       0x534B4653  /* "SKFS" */
-#define SPIKEFS_VERSION     3           /* v3: inode chunks (btrfs/XFS-style) */
+#define SPIKEFS_VERSION     4           /* v4: extent-mapped inodes */
+#define SPIKEFS_VERSION_V3  3           /* v3: direct + single indirect */
 
-#define SPIKEFS_DIRECT_BLOCKS 12
+#define SPIKEFS_DIRECT_BLOCKS 12        /* v3 only */
 #define SPIKEFS_NAME_MAX      60
 
 /* Inode chunk: 8 inodes (64 bytes each) per 512-byte block */
@@ -19,14 +20,30 @@
 /* Inode map: 127 chunk entries per block + 1 "next" pointer */
 #define SPIKEFS_IMAP_ENTRIES  127
 
+/* Extents stored directly in the inode before spilling to a tree */
+#define SPIKEFS_INLINE_EXTENTS 6
+
+/* Extent tree node: 8-byte header + 42 twelve-byte entries */
+#define SPIKEFS_XT_MAGIC      0x5854    /* "XT" */
+#define SPIKEFS_XT_ENTRIES    42
+#define SPIKEFS_XT_MAX_DEPTH  4
+
+/* Metadata journal (see spikefs_jheader_t) */
+#define SPIKEFS_JOURNAL_MAGIC 0x4C4E4A53  /* "SJNL" */
+#define SPIKEFS_JDESC_MAGIC   0x43534544  /* "DESC" */
+#define SPIKEFS_JCOMMIT_MAGIC 0x54494D43  /* "CMIT" */
+#define SPIKEFS_JDESC_ENTRIES 125
+#define SPIKEFS_JOURNAL_MIN   16          /* smaller disks run unjournaled */
+#define SPIKEFS_JOURNAL_MAX   2048        /* 1 MiB */
+
 /* ------------------------------------------------------------------ */
 /*  On-disk structures                                                */
 /* ------------------------------------------------------------------ */
 
 /*
- * Superblock (v3) — 512 bytes.
+ * Superblock — 512 bytes.
  *
- * v3 eliminates the fixed inode table region. Inodes are stored in
+ * Since v3 there is no fixed inode table region. Inodes are stored in
  * "inode chunk" blocks allocated from the unified data pool (like
  * btrfs/XFS). The inode map block tracks chunk locations.
  *
@@ -34,6 +51,12 @@
  *   Sector 0:            Superblock
  *   Sectors 1..B:        Block bitmap
  *   Sectors B+1..end:    Data pool (inode chunks + file data)
+ *
+ * v4 keeps the same layout but maps file data with extents, and
+ * reserves data block 0 so a block number of 0 always means "none".
+ * It also carries a metadata journal: a contiguous run of data-pool
+ * blocks (journal_block, journal_blocks). v4 disks written before the
+ * journal existed have both fields zero and get one on mount.
  */
 typedef struct spikefs_super {
     uint32_t magic;
@@ -43,11 +66,40 @@ typedef struct spikefs_super {
     uint32_t data_start;      /* first sector of data pool */
     uint32_t imap_block;      /* block# of first inode map (in data pool) */
     uint32_t num_ichunks;     /* number of active inode chunks */
-    uint8_t  pad[484];
+    uint32_t journal_block;   /* first journal block (in data pool) */
+    uint32_t journal_blocks;  /* journal length (0 = no journal) */
+    uint8_t  pad[476];
 } __attribute__((packed)) spikefs_super_t;
 
-/* 64 bytes — 8 per block (one "inode chunk") */
+/* A run of consecutive data blocks */
+typedef struct spikefs_extent {
+    uint32_t start;             /* first block (0 = unused slot) */
+    uint32_t length;            /* blocks */
+} __attribute__((packed)) spikefs_extent_t;
+
+/*
+ * v4 inode — 64 bytes, 8 per block (one "inode chunk").
+ *
+ * File data is a list of extents in logical order. Up to six live in
+ * the inode itself; a file with more keeps all of them in an extent
+ * tree rooted at 'xtree' and leaves the inline slots empty.
+ *
+ * A directory's data is its dirents ('size' bytes), optionally followed
+ * by its VFS name index ('dir_index' bytes of uint32 hash slots), so a
+ * large directory needn't be rehashed at mount.
+ */
 typedef struct spikefs_inode {
+    uint8_t  type;              /* 0=free, 1=file, 2=dir */
+    uint8_t  pad;
+    uint16_t link_count;
+    uint32_t size;              /* bytes of data */
+    spikefs_extent_t extents[SPIKEFS_INLINE_EXTENTS];
+    uint32_t xtree;             /* extent tree root block (0=none) */
+    uint32_t dir_index;         /* dir: name index bytes after the data */
+} __attribute__((packed)) spikefs_inode_t;
+
+/* v3 inode — read only, for upgrading old disks */
+typedef struct spikefs_inode_v3 {
     uint8_t  type;              /* 0=free, 1=file, 2=dir */
     uint8_t  pad;
     uint16_t link_count;
@@ -55,7 +107,28 @@ typedef struct spikefs_inode {
     uint32_t direct[SPIKEFS_DIRECT_BLOCKS];  /* 12 direct block numbers */
     uint32_t indirect;          /* single indirect block number (0=none) */
     uint32_t reserved;
-} __attribute__((packed)) spikefs_inode_t;
+} __attribute__((packed)) spikefs_inode_v3_t;
+
+/*
+ * Extent tree entry. In a leaf (depth 0) it maps 'length' blocks at
+ * file block 'logical' to disk block 'start'. In an index node it
+ * points at a child node ('start') covering 'length' blocks from
+ * 'logical' onward.
+ */
+typedef struct spikefs_xentry {
+    uint32_t logical;
+    uint32_t start;
+    uint32_t length;
+} __attribute__((packed)) spikefs_xentry_t;
+
+/* Extent tree node — one 512-byte block */
+typedef struct spikefs_xnode {
+    uint16_t magic;             /* SPIKEFS_XT_MAGIC */
+    uint16_t depth;             /* 0 = leaf */
+    uint16_t count;             /* entries in use */
+    uint16_t pad;
+    spikefs_xentry_t entries[SPIKEFS_XT_ENTRIES];
+} __attribute__((packed)) spikefs_xnode_t;
 
 /* 64 bytes — 8 per block, matches vfs_dirent_t layout */
 typedef struct spikefs_dirent {
@@ -63,23 +136,81 @@ typedef struct spikefs_dirent {
     uint32_t inode;
 } __attribute__((packed)) spikefs_dirent_t;
 
+/*
+ * Metadata journal.
+ *
+ * Every sync is one transaction. File data and extent tree nodes go
+ * straight to freshly allocated blocks; the metadata sectors that
+ * point at them (inode chunks, inode map, bitmap, superblock) are
+ * first logged to the journal:
+ *
+ *   block 0:   header (sequence number of the next transaction)
+ *   block 1..: descriptor, up to 125 logged sectors, descriptor, ...
+ *              commit record
+ *
+ * Once the commit record is on disk the logged sectors are copied to
+ * their real locations (checkpoint) and the header's sequence is
+ * bumped. At mount, a transaction whose descriptors carry the header's
+ * sequence and whose commit CRC matches is replayed; anything less is
+ * an interrupted sync and is ignored.
+ */
+typedef struct spikefs_jheader {
+    uint32_t magic;             /* SPIKEFS_JOURNAL_MAGIC */
+    uint32_t seq;
+    uint8_t  pad[504];
+} __attribute__((packed)) spikefs_jheader_t;
+
+typedef struct spikefs_jdesc {
+    uint32_t magic;             /* SPIKEFS_JDESC_MAGIC */
+    uint32_t seq;
+    uint32_t count;             /* logged sectors following this block */
+    uint32_t targets[SPIKEFS_JDESC_ENTRIES];   /* their home LBAs */
+} __attribute__((packed)) spikefs_jdesc_t;
+
+typedef struct spikefs_jcommit {
+    uint32_t magic;             /* SPIKEFS_JCOMMIT_MAGIC */
+    uint32_t seq;
+    uint32_t blocks;            /* descriptor + logged blocks before it */
+    uint32_t crc;               /* CRC-32 of those blocks, in order */
+    uint8_t  pad[496];
+} __attribute__((packed)) spikefs_jcommit_t;
+
 /* ------------------------------------------------------------------ */
 /*  Public API                                                        */
 /* ------------------------------------------------------------------ */
 
-/* Called at boot after ata_init() + vfs_init().
-   Reads superblock: if valid, loads filesystem from disk.
-   If blank disk, formats and syncs current VFS to disk.
+struct blk_device;
+
+/* Called at boot after ata_init() + vfs_init(). Mounts ata0.
    Returns 0 on success, -1 if no disk. */
 int spikefs_init(void);
 
+/* Reads the superblock: if valid, replays the journal and loads the
+   filesystem from disk. A v3 disk is loaded and rewritten as v4
+   (crash-safe: the v3 blocks are left alone until the v4 superblock
+   is committed). If blank disk, formats and syncs current VFS to disk.
+   Returns 0 on success, -1 on error. */
+int spikefs_mount(struct blk_device *dev);
+
 /* Write empty filesystem to disk. Layout calculated from disk size. */
 int spikefs_format(void);
 
-/* Serialize current in-memory VFS to disk. Clears dirty flag on success. */
+/* Serialize current in-memory VFS to disk as one journaled transaction.
+   Clears dirty flag on success. */
 int spikefs_sync(void);
 
 /* Deserialize disk filesystem into in-memory VFS. */
 int spikefs_load(void);
 
+/* Cross-check the on-disk bitmap against every block the mounted
+   filesystem references (inodes, extent trees, inode map, journal).
+   Run it right after a mount or a successful sync. Returns the number
+   of problems found (0 = consistent), or -1 if nothing is mounted. */
+int spikefs_check(void);
+
+/* Testing: allocate file data in runs of at most 'blocks' blocks, kept
+   apart by a free block, so small files still need extent trees.
+   0 restores normal allocation. */
+void spikefs_set_frag(uint32_t blocks);
+
 #endif
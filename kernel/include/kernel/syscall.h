@@ -44,8 +44,28 @@ struct trapframe;
 #define SYS_GPU_CREATE_CTX  26
 #define SYS_GPU_SUBMIT      27
 #define SYS_GPU_DESTROY_CTX 28
+#define SYS_READV     29
+#define SYS_WRITEV    30
+#define SYS_PREAD     31
+#define SYS_PWRITE    32
+#define SYS_SENDMSG   33
+#define SYS_RECVMSG   34
+#define SYS_SENDFILE  35
+#define SYS_SENDFILE_UDP 36
+#define SYS_FCNTL     37
+#define SYS_POLL      38
+#define SYS_EPOLL_CREATE 39
+#define SYS_EPOLL_CTL    40
+#define SYS_EPOLL_WAIT   41
+#define SYS_SETSOCKOPT   42
+#define SYS_GETSOCKOPT   43
+#define SYS_RECVMMSG     44
+#define SYS_LISTEN       45
+#define SYS_ACCEPT       46
+#define SYS_CONNECT      47
+#define SYS_SENDMMSG     48
 
-#define NUM_SYSCALLS  29
+#define NUM_SYSCALLS  49
 
 /* Argument struct for SYS_GPU_SUBMIT */
 struct gpu_submit_args {
@@ -79,8 +99,16 @@ struct mmap_args {
     uint32_t offset;    /* offset into file (must be page-aligned) */
 };
 
-/* Socket type for SYS_SOCKET */
+/* Socket types for SYS_SOCKET / SYS_BIND */
 #define SOCK_UDP  1
+#define SOCK_TCP  2                /* SYS_SOCKET returns an fd */
+#define SOCK_NONBLOCK O_NONBLOCK   /* OR'd into the SYS_BIND / SYS_SOCKET type */
+
+/* Peer address filled in by SYS_ACCEPT (pointer may be NULL) */
+struct accept_args {
+    uint32_t ip;
+    uint16_t port;
+};
 
 /* Argument structs passed by pointer for SYS_SENDTO / SYS_RECVFROM */
 struct sendto_args {
@@ -98,6 +126,62 @@ struct recvfrom_args {
     uint16_t  received;    /* filled by kernel */
 };
 
+/* Argument struct for SYS_PREAD / SYS_PWRITE (4 params > 3 registers) */
+struct prw_args {
+    int32_t   fd;
+    void     *buf;
+    uint32_t  len;
+    uint32_t  offset;   /* file position; the fd's offset is untouched */
+};
+
+/* Argument structs for SYS_SENDMSG / SYS_RECVMSG: one datagram
+   gathered from / scattered over an array of struct iovec (fd.h).
+   SYS_SENDMMSG / SYS_RECVMMSG take an array of them, one per
+   datagram. */
+struct sendmsg_args {
+    uint32_t      dst_ip;     /* network byte order */
+    uint16_t      dst_port;   /* host byte order */
+    const struct iovec *iov;
+    uint32_t      iovcnt;
+};
+
+struct recvmsg_args {
+    const struct iovec *iov;
+    uint32_t      iovcnt;
+    uint32_t      from_ip;    /* filled by kernel, network byte order */
+    uint16_t      from_port;  /* filled by kernel, host byte order */
+    uint16_t      received;   /* filled by kernel */
+};
+
+/* Argument structs for SYS_EPOLL_CTL / SYS_EPOLL_WAIT (struct
+   epoll_event is in poll.h) */
+struct epoll_ctl_args {
+    int32_t       epfd;
+    int32_t       op;         /* EPOLL_CTL_* */
+    int32_t       fd;         /* fd, or socket with POLLSOCK in events */
+    uint32_t      events;
+    uint32_t      data;
+};
+
+struct epoll_wait_args {
+    int32_t       epfd;
+    void         *events;     /* struct epoll_event[maxevents] */
+    int32_t       maxevents;
+    int32_t       timeout_ms; /* < 0 = forever */
+};
+
+/* Argument struct for SYS_SENDFILE / SYS_SENDFILE_UDP. in_fd must be a
+   VFS file; offset = NULL reads from (and advances) in_fd's offset,
+   otherwise *offset is used and updated instead. dst_* are only used
+   by SYS_SENDFILE_UDP. */
+struct sendfile_args {
+    int32_t       in_fd;
+    uint32_t     *offset;
+    uint32_t      count;
+    uint32_t      dst_ip;     /* network byte order */
+    uint16_t      dst_port;   /* host byte order */
+};
+
 /*
  * Stat struct — returned by SYS_STAT.
  * Passed as a pointer in ECX.
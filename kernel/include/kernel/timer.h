@@ -8,4 +8,14 @@
 void timer_init(uint32_t hz);
 uint32_t timer_ticks(void);
 
+/* Microseconds since timer_init(), interpolated from the PIT counter.
+   Wraps after ~71 minutes; compare with unsigned subtraction. */
+uint32_t timer_usecs(void);
+
+/* Raw CPU timestamp counter. Works before timer_init(), so early boot
+   code can time itself: timer_cycles_to_us(timer_cycles() - start).
+   The first conversion calibrates against the PIT (~10 ms). */
+uint64_t timer_cycles(void);
+uint32_t timer_cycles_to_us(uint64_t cycles);
+
 #endif
\ No newline at end of file
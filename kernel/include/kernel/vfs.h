@@ -3,32 +3,91 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <kernel/pagecache.h>
 
-#define VFS_MAX_INODES_CAP 8192   /* hard ceiling for inode count */
+#define VFS_MAX_INODES_CAP 262144 /* hard ceiling for inode count */
 #define VFS_MAX_NAME       59
 
+/*
+ * The inode table is sparse: a fixed 64-entry top level points at
+ * blocks of 64 chunk pointers, each chunk holding VFS_ICHUNK_INODES
+ * inodes. A chunk is allocated when an inode in it is first needed and
+ * freed once all its inodes are free and synced, so memory follows the
+ * number of live inodes, not the highest inode number. Inodes never
+ * move: a vfs_get_inode() pointer stays valid while the inode is in use.
+ */
+#define VFS_ICHUNK_INODES  64
+
 #define VFS_TYPE_FREE   0
 #define VFS_TYPE_FILE   1
 #define VFS_TYPE_DIR    2
 
+/* Inode flags */
+#define VFS_INODE_DIRTY    0x01   /* changed since the last sync */
+#define VFS_INODE_UNLOADED 0x02   /* file data is only on the backing store */
+
+/* Don't evict file data touched within this many timer ticks */
+#define VFS_EVICT_MIN_TICKS 200
+
+/* File data lives in the page cache in pages of this size */
+#define VFS_PAGE_SIZE      4096
+
+/*
+ * Directories with at least this many entries get a name index: an
+ * open-addressed hash table (linear probing, power-of-two size, at
+ * most half full) whose slots hold dirent position + 1, 0 = empty.
+ * Smaller directories are scanned linearly. The table is rebuilt on
+ * demand if missing, so a backing store may persist it or not.
+ */
+#define VFS_DIR_INDEX_MIN  16
+
+/*
+ * Dentry cache: (parent inode, name) -> child inode for recent path
+ * lookups, including misses (negative entries). Bounded LRU; an entry
+ * is dropped when its name is added to or removed from the parent, and
+ * everything naming an inode is dropped when the inode is freed.
+ */
+#define VFS_DCACHE_SIZE    256
+
 typedef struct vfs_inode {
     uint8_t   type;         /* VFS_TYPE_FREE / FILE / DIR */
+    uint8_t   flags;        /* VFS_INODE_* */
     uint32_t  size;         /* bytes (file) or entry count (dir) */
-    void     *data;         /* kmalloc'd: byte buffer (file) or dirent array (dir) */
-    uint32_t  capacity;     /* allocated bytes (file) or dirent slots (dir) */
+    void     *data;         /* dir: kmalloc'd dirent array (unused for files) */
+    uint32_t  capacity;     /* dir: allocated dirent slots */
+    uint32_t *index;        /* dir: name hash table (NULL = none yet) */
+    uint32_t  index_cap;    /* dir: hash table slots */
+    pcache_t  pages;        /* file: cached data pages */
     uint16_t  link_count;   /* directory entries pointing to this inode */
+    uint16_t  mmap_count;   /* live user mappings (pins the pages) */
+    uint32_t  atime;        /* timer tick of last data access (eviction LRU) */
+    uint32_t  dirty_seq;    /* changes so far, VFS-wide, at the last one */
 } vfs_inode_t;
 
+/*
+ * Backing store for file data. A mounted filesystem may leave file
+ * inodes VFS_INODE_UNLOADED (size known, no pages cached); the VFS
+ * calls fill() the first time the data is needed.
+ */
+typedef struct vfs_backing_ops {
+    /* Read the 'size' bytes of ino's data into pages[], one
+       VFS_PAGE_SIZE buffer per file page, already zeroed. Returns 0
+       on success. */
+    int (*fill)(uint32_t ino, uint32_t size, uint8_t *const *pages);
+} vfs_backing_ops_t;
+
 typedef struct vfs_dirent {
     char     name[VFS_MAX_NAME + 1]; /* NUL-terminated filename */
     uint32_t inode;                  /* index into inode table */
 } vfs_dirent_t;
 
-/* Initialization (initial_capacity = starting inode slots, grows on demand) */
+/* Initialization (initial_capacity = inode slots to allocate up front;
+   more chunks are added on demand) */
 void    vfs_init(uint32_t initial_capacity);
 void    vfs_import_initrd(void);
 
-/* Grow the inode table to at least min_inodes slots (krealloc). Returns 0 on success. */
+/* Check that inode numbers below min_inodes fit the table (chunks are
+   allocated on use). Returns 0 on success. */
 int     vfs_ensure_capacity(uint32_t min_inodes);
 
 /* Path resolution: resolve path to inode number (-1 if not found).
@@ -43,9 +102,25 @@ int     vfs_remove(const char *path);
 int     vfs_remove_recursive(const char *path);
 int32_t vfs_read(uint32_t ino, void *buf, uint32_t offset, uint32_t count);
 int32_t vfs_write(uint32_t ino, const void *buf, uint32_t offset, uint32_t count);
+int     vfs_truncate(uint32_t ino, uint32_t size);
 int     vfs_rename(const char *old_path, const char *new_path);
 int32_t vfs_copy(const char *src_path, const char *dst_path);
 
+/* Hash of a directory entry name, as used by the name index */
+uint32_t vfs_name_hash(const char *name);
+
+/* Install a name index read from the backing store for a directory
+   whose entries are already in place. The VFS takes ownership; an
+   index that doesn't fit the entries is dropped and rebuilt later. */
+void    vfs_dir_set_index(uint32_t dir_ino, uint32_t *index, uint32_t cap);
+
+/* Use (1) or bypass (0) name indexes for lookups. Indexes are kept up
+   to date either way; bypassing is only for benchmarking. */
+void    vfs_dir_index_enable(int on);
+
+/* Dentry cache hit/miss counters since boot */
+void    vfs_dcache_stats(uint32_t *hits, uint32_t *misses);
+
 /* Directory listing (prints to terminal) */
 int     vfs_list(uint32_t dir_ino);
 
@@ -57,14 +132,68 @@ const char *vfs_get_cwd_path(void);
 /* Access inode by number (for shell to inspect type/size) */
 vfs_inode_t *vfs_get_inode(uint32_t ino);
 
+/* Claim inode 'ino' with the given type for a backing store loading a
+   saved tree after vfs_reset(), growing the table as needed. Returns
+   the inode, or NULL if it can't be allocated. */
+vfs_inode_t *vfs_install_inode(uint32_t ino, uint8_t type);
+
 /* Reset: free all inodes and data, re-init empty root (used by spikefs_load) */
 void vfs_reset(void);
 
-/* Runtime inode capacity (determined at init from disk size) */
+/* Upper bound on inode numbers in use: every live inode is below it */
 uint32_t vfs_get_max_inodes(void);
 
-/* Dirty tracking (Linux-style write-back support) */
+/* Next inode >= from that is in use or has a change to sync (freed but
+   still VFS_INODE_DIRTY), or -1. Skips unallocated chunks, so walking
+   the table costs about the number of live inodes:
+     for (i = vfs_next_inode(0); i >= 0; i = vfs_next_inode(i + 1)) */
+int32_t  vfs_next_inode(uint32_t from);
+
+/* Live inodes and allocated inode chunks */
+void     vfs_inode_stats(uint32_t *live, uint32_t *chunks);
+
+/* Dirty tracking (Linux-style write-back support). The global flag says
+   "something changed"; VFS_INODE_DIRTY says which inodes. */
 int  vfs_is_dirty(void);
 void vfs_mark_clean(void);
+void vfs_mark_all_dirty(void);
+
+/* Write-back that may sleep: note an inode's dirty_seq before reading
+   it, and once it is safely stored clear its DIRTY only if the seq is
+   unchanged, so a change made meanwhile is kept for the next sync.
+   vfs_mark_synced() then drops empty chunks and clears the global flag
+   if no inode is left dirty. */
+void vfs_clear_dirty(uint32_t ino, uint32_t seq);
+void vfs_mark_synced(void);
+
+/* Lazy file data. vfs_read/vfs_write/vfs_copy/vfs_get_page load on
+   demand; vfs_load_data() brings a whole file in explicitly. */
+void     vfs_set_backing(const vfs_backing_ops_t *ops);
+int      vfs_load_data(uint32_t ino);
+
+/* Page-cache access. vfs_page_addr() returns the kernel address of a
+   cached page, or NULL for a hole or unloaded data (never loads).
+   vfs_get_page() loads the file if needed and returns the frame of
+   page 'index', allocating a zeroed one for a hole; 0 on failure. */
+void    *vfs_page_addr(uint32_t ino, uint32_t index);
+uint32_t vfs_get_page(uint32_t ino, uint32_t index);
+
+/* Frame of a cached page with an extra reference held, so it survives
+   eviction or truncation while the caller copies out of it; 0 for a
+   hole or unloaded data (never loads). Drop it with free_frame(). */
+uint32_t vfs_pin_page(uint32_t ino, uint32_t index);
+
+/* User mappings of a file (mmap). Mapped files are never evicted. A
+   shared writable mapping can change the pages at any time, so it marks
+   the file dirty when it is set up and again when it goes away. */
+void     vfs_map_file(uint32_t ino, int shared_write);
+void     vfs_unmap_file(uint32_t ino, int shared_write);
+
+/* Drop cached pages of clean, idle, unmapped files (least recently used
+   first) until 'bytes' have been freed. Returns bytes freed. */
+uint32_t vfs_evict_clean(uint32_t bytes);
+
+/* Residency counters for the 'vfsstat' shell command */
+void     vfs_print_stats(void);
 
 #endif
@@ -2,6 +2,7 @@
 #define _VIRTIO_H
 
 #include <stdint.h>
+#include <kernel/pci.h>
 
 /*
  * VirtIO PCI transport definitions (legacy + modern).
@@ -14,6 +15,7 @@
 /* VirtIO PCI device IDs (transitional: 0x1000-0x103F) */
 #define VIRTIO_PCI_DEV_NET      0x1000
 #define VIRTIO_PCI_DEV_BLK      0x1001
+#define VIRTIO_PCI_DEV_NET_MODERN 0x1041 /* non-transitional net */
 #define VIRTIO_PCI_DEV_GPU      0x1050   /* non-transitional GPU */
 
 /* VirtIO PCI capability types (found via PCI capability list, cap ID = 0x09) */
@@ -41,6 +43,14 @@ typedef struct {
 #define VIRTIO_STATUS_FEATURES_OK    8
 #define VIRTIO_STATUS_FAILED         128
 
+/* Device-independent feature bits */
+#define VIRTIO_F_RING_EVENT_IDX      29  /* used_event / avail_event */
+#define VIRTIO_F_VERSION_1           32  /* modern device (feature word 1) */
+
+/* ISR status bits (reading the ISR register clears them) */
+#define VIRTIO_ISR_QUEUE             0x01
+#define VIRTIO_ISR_CONFIG            0x02
+
 /* ------------------------------------------------------------------ */
 /*  VirtIO common configuration (mapped via VIRTIO_PCI_CAP_COMMON_CFG)*/
 /* ------------------------------------------------------------------ */
@@ -66,6 +76,8 @@ typedef struct {
 #define VIRTIO_COMMON_Q_USED_LO      0x30  /* uint32: used ring addr low */
 #define VIRTIO_COMMON_Q_USED_HI      0x34  /* uint32: used ring addr high */
 
+#define VIRTIO_MSI_NO_VECTOR         0xFFFF
+
 /* ------------------------------------------------------------------ */
 /*  Virtqueue structures (in guest physical memory)                   */
 /* ------------------------------------------------------------------ */
@@ -74,6 +86,12 @@ typedef struct {
 #define VIRTQ_DESC_F_NEXT      1   /* descriptor is chained (has next) */
 #define VIRTQ_DESC_F_WRITE     2   /* device writes to this descriptor (response) */
 
+/* Available ring flags */
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  1   /* ignored with VIRTIO_F_RING_EVENT_IDX */
+
+/* Used ring flags */
+#define VIRTQ_USED_F_NO_NOTIFY      1   /* ignored with VIRTIO_F_RING_EVENT_IDX */
+
 /* Virtqueue descriptor (16 bytes) */
 typedef struct {
     uint64_t addr;     /* guest-physical address of buffer */
@@ -120,6 +138,39 @@ typedef struct {
     uint16_t notify_off;   /* notification offset for this queue */
 } virtq_t;
 
+/*
+ * Event index (VIRTIO_F_RING_EVENT_IDX). The driver puts used_event
+ * after the available ring: interrupt me once the used index passes
+ * it. The device puts avail_event after the used ring: notify me once
+ * the available index passes it. virtq_init() leaves room for both.
+ */
+static inline volatile uint16_t *virtq_used_event(virtq_t *vq) {
+    return (volatile uint16_t *)((uint8_t *)vq->avail + 4 + 2 * vq->size);
+}
+
+static inline volatile uint16_t *virtq_avail_event(virtq_t *vq) {
+    return (volatile uint16_t *)((uint8_t *)vq->used + 4 + 8 * vq->size);
+}
+
+/* Whether moving an index from old to new_idx crossed event */
+static inline int virtq_need_event(uint16_t event, uint16_t new_idx,
+                                   uint16_t old) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Modern PCI transport                                              */
+/* ------------------------------------------------------------------ */
+
+/* A device's capability structures, mapped into kernel VA */
+typedef struct {
+    volatile uint8_t *common;   /* VIRTIO_PCI_CAP_COMMON_CFG */
+    volatile uint8_t *notify;   /* VIRTIO_PCI_CAP_NOTIFY_CFG */
+    volatile uint8_t *isr;      /* VIRTIO_PCI_CAP_ISR_CFG */
+    volatile uint8_t *device;   /* VIRTIO_PCI_CAP_DEVICE_CFG (may be NULL) */
+    uint32_t notify_off_multiplier;
+} virtio_pci_t;
+
 /* ------------------------------------------------------------------ */
 /*  VirtIO transport API                                              */
 /* ------------------------------------------------------------------ */
@@ -164,4 +215,15 @@ int virtq_has_used(virtq_t *vq);
  */
 uint16_t virtq_pop_used(virtq_t *vq, uint32_t *len_out);
 
+/*
+ * Find and map a device's VirtIO capabilities.
+ * Returns 0, or -1 if the common, notify or ISR structure is missing.
+ */
+int virtio_pci_map_caps(pci_device_t *dev, virtio_pci_t *vp);
+
+/*
+ * Tell the device queue 'index' has new available buffers.
+ */
+void virtio_pci_notify(virtio_pci_t *vp, virtq_t *vq, uint16_t index);
+
 #endif
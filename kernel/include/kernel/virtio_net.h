@@ -0,0 +1,61 @@
+#ifndef _VIRTIO_NET_H
+#define _VIRTIO_NET_H
+
+#include <stdint.h>
+
+/*
+ * VirtIO network device definitions.
+ * Based on VirtIO 1.1 specification, section 5.1 (Network Device).
+ */
+
+/* Virtqueues */
+#define VIRTIO_NET_RXQ  0
+#define VIRTIO_NET_TXQ  1
+
+/* Feature bits */
+#define VIRTIO_NET_F_CSUM        0    /* device takes partial checksums */
+#define VIRTIO_NET_F_GUEST_CSUM  1    /* driver takes partial / validated */
+#define VIRTIO_NET_F_MAC         5    /* device config has the MAC */
+#define VIRTIO_NET_F_MRG_RXBUF   15   /* frames may span RX buffers */
+#define VIRTIO_NET_F_STATUS      16   /* device config has link status */
+
+/* Device configuration (VIRTIO_PCI_CAP_DEVICE_CFG) */
+#define VIRTIO_NET_CFG_MAC       0x00  /* uint8[6] */
+#define VIRTIO_NET_CFG_STATUS    0x06  /* uint16 */
+#define VIRTIO_NET_S_LINK_UP     1
+
+/* virtio_net_hdr_t.flags */
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM  1  /* checksum from csum_start is partial */
+#define VIRTIO_NET_HDR_F_DATA_VALID  2  /* RX: checksum already verified */
+
+#define VIRTIO_NET_HDR_GSO_NONE  0
+
+/*
+ * Header in front of every frame, in the same buffer. With
+ * VIRTIO_F_VERSION_1 it always has num_buffers (12 bytes).
+ */
+typedef struct {
+    uint8_t  flags;
+    uint8_t  gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;     /* from the start of the frame */
+    uint16_t csum_offset;    /* from csum_start */
+    uint16_t num_buffers;    /* RX: buffers the frame used */
+} __attribute__((packed)) virtio_net_hdr_t;
+
+/* Queue sizes are the device's, capped at this */
+#define VIRTIO_NET_QUEUE_MAX  256
+
+/* Initialize a virtio-net NIC. Returns 0 on success, -1 if not found. */
+int virtio_net_init(void);
+
+struct sk_buff;
+
+/* nic_t operations */
+int  virtio_net_send(const void *data, uint16_t len);
+int  virtio_net_send_skb(struct sk_buff *skb);
+void virtio_net_tx_flush(void);
+int  virtio_net_poll(int budget);
+
+#endif
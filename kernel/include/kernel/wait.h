@@ -11,13 +11,23 @@
  *   sleep_on(&wq);        // blocks current process
  *   wake_up_one(&wq);     // wakes one waiter
  *   wake_up_all(&wq);     // wakes all waiters
+ *
+ * An entry with a 'func' hook is a watcher rather than a sleeper (poll,
+ * epoll). Every wake_up_one/all calls its hook, with interrupts off,
+ * and leaves it queued until wait_queue_remove(); it is never counted
+ * as the one process wake_up_one wakes.
  */
 
 struct process;
+struct wait_queue_entry;
+
+typedef void (*wait_func_t)(struct wait_queue_entry *entry);
 
 typedef struct wait_queue_entry {
     struct process           *proc;
     struct wait_queue_entry  *next;
+    wait_func_t               func;   /* NULL = plain sleeper */
+    void                     *data;   /* for func */
 } wait_queue_entry_t;
 
 typedef struct wait_queue {
@@ -37,4 +47,9 @@ int wake_up_one(wait_queue_t *wq);
 /* Wake all waiting processes. Returns number of processes woken. */
 int wake_up_all(wait_queue_t *wq);
 
+/* Queue / dequeue a watcher entry (func set). Removing an entry that
+   is not on the queue is a no-op. */
+void wait_queue_add(wait_queue_t *wq, wait_queue_entry_t *entry);
+void wait_queue_remove(wait_queue_t *wq, wait_queue_entry_t *entry);
+
 #endif
@@ -29,6 +29,10 @@ static uint32_t heap_end = HEAP_START;
 /* Head of the doubly-linked free list. */
 static heap_block_t *free_list = NULL;
 
+/* Memory-pressure hook (see heap_set_reclaim). */
+static heap_reclaim_fn reclaim_hook = NULL;
+static int reclaiming = 0;
+
 /* Round sz up to the next multiple of HEAP_ALIGN (16). */
 static inline uint32_t align_up(uint32_t sz) {
     return (sz + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
@@ -149,10 +153,15 @@ void *kmalloc(size_t size) {
     uint32_t req = align_up((uint32_t)size);
     if (req < HEAP_ALIGN) req = HEAP_ALIGN;
 
-    uint32_t irqflags = hal_irq_save();
+    int reclaimed = 0;
+    uint32_t irqflags;
+    heap_block_t *blk;
+
+retry:
+    irqflags = hal_irq_save();
 
     /* First-fit search: walk the free list for a large enough block. */
-    heap_block_t *blk = free_list;
+    blk = free_list;
     while (blk != NULL) {
         if (blk->size >= req) goto found;
         blk = blk->next;
@@ -164,8 +173,19 @@ void *kmalloc(size_t size) {
         if (pages_needed < HEAP_GROW_PAGES) pages_needed = HEAP_GROW_PAGES;
 
         if (heap_grow(pages_needed) != 0) {
-            printf("[heap] kmalloc(%u): out of memory\n", (unsigned)size);
             hal_irq_restore(irqflags);
+
+            /* At the ceiling: ask caches to give memory back, once */
+            if (reclaim_hook && !reclaiming && !reclaimed) {
+                reclaiming = 1;
+                uint32_t freed = reclaim_hook(req + sizeof(heap_block_t));
+                reclaiming = 0;
+                reclaimed = 1;
+                if (freed > 0)
+                    goto retry;
+            }
+
+            printf("[heap] kmalloc(%u): out of memory\n", (unsigned)size);
             return NULL;
         }
     }
@@ -204,6 +224,10 @@ found:
     return (void *)(blk + 1);
 }
 
+void heap_set_reclaim(heap_reclaim_fn fn) {
+    reclaim_hook = fn;
+}
+
 void kfree(void *ptr) {
     if (ptr == NULL) return;
 
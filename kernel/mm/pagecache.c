@@ -0,0 +1,140 @@
+/*
+ * Page cache radix tree.
+ *
+ * See kernel/include/kernel/pagecache.h for the layout. The tree only
+ * grows upward: a new root adopts the old one as slot 0 when an index
+ * beyond the current height is inserted. Truncation prunes empty nodes
+ * but leaves the height alone.
+ */
+
+#include <kernel/pagecache.h>
+#include <kernel/paging.h>
+#include <kernel/heap.h>
+#include <string.h>
+#include <stdio.h>
+
+static pcache_reclaim_fn reclaim_hook = NULL;
+static int reclaiming = 0;
+static uint32_t total_pages = 0;
+
+/* Pages addressable by a tree of the given height (<= 64^4) */
+static uint32_t height_span(uint32_t height) {
+    return 1u << (height * PCACHE_SHIFT);
+}
+
+uint32_t pcache_lookup(const pcache_t *pc, uint32_t index) {
+    if (!pc->root) return 0;
+
+    if (index >= height_span(pc->height)) return 0;
+
+    pcache_node_t *node = pc->root;
+    for (uint32_t h = pc->height; h > 1; h--) {
+        uint32_t slot = (index >> ((h - 1) * PCACHE_SHIFT)) & (PCACHE_SLOTS - 1);
+        node = (pcache_node_t *)node->slots[slot];
+        if (!node) return 0;
+    }
+    return node->slots[index & (PCACHE_SLOTS - 1)];
+}
+
+static uint32_t alloc_page_frame(void) {
+    uint32_t frame = alloc_frame();
+
+    if (frame == FRAME_ALLOC_FAIL && reclaim_hook && !reclaiming) {
+        reclaiming = 1;
+        reclaim_hook(PCACHE_RECLAIM_PAGES * PAGE_SIZE);
+        reclaiming = 0;
+        frame = alloc_frame();
+    }
+    return frame == FRAME_ALLOC_FAIL ? 0 : frame;
+}
+
+uint32_t pcache_get_page(pcache_t *pc, uint32_t index) {
+    /* Grow until the tree covers index */
+    while (!pc->root || index >= height_span(pc->height)) {
+        if (pc->height >= PCACHE_MAX_HEIGHT) return 0;
+        pcache_node_t *n = (pcache_node_t *)kcalloc(1, sizeof(pcache_node_t));
+        if (!n) return 0;
+        if (pc->root)
+            n->slots[0] = (uint32_t)pc->root;
+        pc->root = n;
+        pc->height++;
+    }
+
+    pcache_node_t *node = pc->root;
+    for (uint32_t h = pc->height; h > 1; h--) {
+        uint32_t slot = (index >> ((h - 1) * PCACHE_SHIFT)) & (PCACHE_SLOTS - 1);
+        if (!node->slots[slot]) {
+            pcache_node_t *n = (pcache_node_t *)kcalloc(1, sizeof(pcache_node_t));
+            if (!n) return 0;
+            node->slots[slot] = (uint32_t)n;
+        }
+        node = (pcache_node_t *)node->slots[slot];
+    }
+
+    uint32_t *leaf = &node->slots[index & (PCACHE_SLOTS - 1)];
+    if (*leaf) return *leaf;
+
+    uint32_t frame = alloc_page_frame();
+    if (!frame) return 0;
+    memset(phys_to_virt(frame), 0, PAGE_SIZE);
+
+    *leaf = frame;
+    pc->nr_pages++;
+    total_pages++;
+    return frame;
+}
+
+/* Drop pages >= first below 'node' (covering pages from 'base').
+   Returns 1 if the node ended up empty. */
+static int truncate_node(pcache_t *pc, pcache_node_t *node, uint32_t height,
+                         uint32_t base, uint32_t first) {
+    uint32_t shift = (height - 1) * PCACHE_SHIFT;
+    int empty = 1;
+
+    for (uint32_t i = 0; i < PCACHE_SLOTS; i++) {
+        if (!node->slots[i]) continue;
+
+        uint32_t start = base + (i << shift);
+        uint32_t end = start + (1u << shift);
+
+        if (end <= first) {
+            empty = 0;          /* wholly below the cut */
+            continue;
+        }
+
+        if (height == 1) {
+            free_frame(node->slots[i]);
+            node->slots[i] = 0;
+            pc->nr_pages--;
+            total_pages--;
+            continue;
+        }
+
+        pcache_node_t *child = (pcache_node_t *)node->slots[i];
+        if (truncate_node(pc, child, height - 1, start, first)) {
+            kfree(child);
+            node->slots[i] = 0;
+        } else {
+            empty = 0;
+        }
+    }
+    return empty;
+}
+
+void pcache_truncate(pcache_t *pc, uint32_t first) {
+    if (!pc->root) return;
+
+    if (truncate_node(pc, pc->root, pc->height, 0, first)) {
+        kfree(pc->root);
+        pc->root = NULL;
+        pc->height = 0;
+    }
+}
+
+void pcache_set_reclaim(pcache_reclaim_fn fn) {
+    reclaim_hook = fn;
+}
+
+uint32_t pcache_total_pages(void) {
+    return total_pages;
+}
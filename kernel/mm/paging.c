@@ -3,6 +3,7 @@
 #include <kernel/isr.h>
 #include <kernel/hal.h>
 #include <kernel/signal.h>
+#include <kernel/syscall.h>
 #include <stdint.h>
 
 uint32_t page_directory[PAGE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
@@ -11,11 +12,13 @@ uint32_t second_page_table[PAGE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
 uint32_t third_page_table[PAGE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
 
 static uint32_t frame_bitmap[MAX_FRAMES / 32];
+static uint16_t frame_refs[MAX_FRAMES];    /* references per allocated frame */
 
 void frame_init() {
     for (uint32_t i = 0; i < MAX_FRAMES / 32; i++) {
         frame_bitmap[i] = 0;
     }
+    memset(frame_refs, 0, sizeof(frame_refs));
 }
 
 void reserve_region(uint32_t start, uint32_t end) {
@@ -111,20 +114,44 @@ int test_frame(uint32_t frame) {
 }
 
 uint32_t alloc_frame() {
+    uint32_t flags = hal_irq_save();
+
     for (int i = 0; i < MAX_FRAMES; i++) {
         if (!test_frame(i)) {
             set_frame(i);
+            frame_refs[i] = 1;
+            hal_irq_restore(flags);
 
             return i * FRAME_SIZE;
         }
     }
 
+    hal_irq_restore(flags);
     return FRAME_ALLOC_FAIL;
 }
 
+void frame_get(uint32_t phys) {
+    uint32_t frame = phys / FRAME_SIZE;
+    if (frame >= MAX_FRAMES) return;
+
+    uint32_t flags = hal_irq_save();
+    frame_refs[frame]++;
+    hal_irq_restore(flags);
+}
+
 void free_frame(uint32_t phys) {
     uint32_t frame = phys / FRAME_SIZE;
-    clear_frame(frame);
+    if (frame >= MAX_FRAMES) return;
+
+    uint32_t flags = hal_irq_save();
+    /* Reserved frames were never counted; treat them as singly owned */
+    if (frame_refs[frame] > 1) {
+        frame_refs[frame]--;
+    } else {
+        frame_refs[frame] = 0;
+        clear_frame(frame);
+    }
+    hal_irq_restore(flags);
 }
 
 uint32_t alloc_frames_contiguous(uint32_t count, uint32_t align_frames) {
@@ -148,8 +175,10 @@ uint32_t alloc_frames_contiguous(uint32_t count, uint32_t align_frames) {
 
         if (run == count) {
             /* Found a contiguous run — mark all frames as used */
-            for (uint32_t i = 0; i < count; i++)
+            for (uint32_t i = 0; i < count; i++) {
                 set_frame(start + i);
+                frame_refs[start + i] = 1;
+            }
             hal_irq_restore(flags);
             return start * FRAME_SIZE;
         }
@@ -165,8 +194,10 @@ uint32_t alloc_frames_contiguous(uint32_t count, uint32_t align_frames) {
 void free_frames_contiguous(uint32_t phys, uint32_t count) {
     uint32_t frame = phys / FRAME_SIZE;
     uint32_t flags = hal_irq_save();
-    for (uint32_t i = 0; i < count; i++)
+    for (uint32_t i = 0; i < count; i++) {
+        frame_refs[frame + i] = 0;
         clear_frame(frame + i);
+    }
     hal_irq_restore(flags);
 }
 
@@ -196,6 +227,33 @@ void temp_unmap(void) {
     hal_irq_restore(temp_map_irq_flags);
 }
 
+/*
+ * Physmap: one page table per 4 MiB of managed RAM, filled linearly.
+ * Must run before process_init() — pgdir_create() copies the kernel's
+ * PDEs, and PDEs added later would not reach existing processes.
+ */
+void physmap_init(void) {
+    uint32_t tables = (MAX_FRAMES + PAGE_ENTRIES - 1) / PAGE_ENTRIES;
+
+    for (uint32_t t = 0; t < tables; t++) {
+        uint32_t pt_phys = alloc_frame();
+        if (pt_phys == FRAME_ALLOC_FAIL) {
+            printf("[paging] physmap: out of frames\n");
+            return;
+        }
+
+        uint32_t *pt = (uint32_t *)temp_map(pt_phys);
+        for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+            uint32_t phys = (t * PAGE_ENTRIES + i) * FRAME_SIZE;
+            pt[i] = phys | PAGE_PRESENT | PAGE_WRITABLE;
+        }
+        temp_unmap();
+
+        page_directory[PHYSMAP_PDE_START + t] =
+            pt_phys | PAGE_PRESENT | PAGE_WRITABLE;
+    }
+}
+
 /*
  * Allocate a new page directory that clones the kernel's PDEs.
  * Returns the physical address, or 0 on failure.
@@ -216,13 +274,15 @@ uint32_t pgdir_create(void) {
  * Frees user page tables (PDEs 1-767) and their mapped frames,
  * then frees the PD frame itself. Skips shared kernel page tables.
  */
+/* Does this PDE still point at the kernel's own page table? */
+static int is_kernel_pt(int pd_index, uint32_t pt_phys) {
+    uint32_t kpde = page_directory[pd_index];
+    return (kpde & PAGE_PRESENT) && (kpde & 0xFFFFF000) == pt_phys;
+}
+
 void pgdir_destroy(uint32_t pd_phys) {
     if (pd_phys == 0) return;
 
-    uint32_t fpt_phys = (uint32_t)first_page_table - KERNEL_VMA_OFFSET;
-    uint32_t spt_phys = (uint32_t)second_page_table - KERNEL_VMA_OFFSET;
-    uint32_t tpt_phys = (uint32_t)third_page_table - KERNEL_VMA_OFFSET;
-
     for (int i = 1; i < 768; i++) {
         /* Temp-map PD, read one PDE, temp-unmap */
         uint32_t *pd = (uint32_t *)temp_map(pd_phys);
@@ -234,9 +294,9 @@ void pgdir_destroy(uint32_t pd_phys) {
         uint32_t pt_phys = pde & 0xFFFFF000;
 
         /* Skip shared kernel page tables */
-        if (pt_phys == fpt_phys || pt_phys == spt_phys || pt_phys == tpt_phys) continue;
+        if (is_kernel_pt(i, pt_phys)) continue;
 
-        /* Free all frames referenced by this page table */
+        /* Drop this process's reference on every mapped frame */
         for (int j = 0; j < PAGE_ENTRIES; j++) {
             uint32_t *pt = (uint32_t *)temp_map(pt_phys);
             uint32_t pte = pt[j];
@@ -261,8 +321,9 @@ void pgdir_destroy(uint32_t pd_phys) {
 
         uint32_t pt_phys = pde & 0xFFFFF000;
 
-        /* Only free if it's NOT a shared kernel page table */
-        if (pt_phys != fpt_phys && pt_phys != spt_phys && pt_phys != tpt_phys) {
+        /* Only free if it's NOT a shared kernel page table (the heap,
+           physmap and MMIO tables live here too) */
+        if (!is_kernel_pt(i, pt_phys)) {
             /* This is a cloned kernel PT — free the clone but NOT the frames
                (they're kernel frames, still in use by the kernel's PD) */
             free_frame(pt_phys);
@@ -283,10 +344,6 @@ int pgdir_map_user_page(uint32_t pd_phys, uint32_t virt, uint32_t phys,
     uint32_t pd_index = virt >> 22;
     uint32_t pt_index = (virt >> 12) & 0x3FF;
 
-    uint32_t fpt_phys = (uint32_t)first_page_table - KERNEL_VMA_OFFSET;
-    uint32_t spt_phys = (uint32_t)second_page_table - KERNEL_VMA_OFFSET;
-    uint32_t tpt_phys = (uint32_t)third_page_table - KERNEL_VMA_OFFSET;
-
     /* Read the PDE */
     uint32_t *pd = (uint32_t *)temp_map(pd_phys);
     uint32_t pde = pd[pd_index];
@@ -310,8 +367,7 @@ int pgdir_map_user_page(uint32_t pd_phys, uint32_t virt, uint32_t phys,
     uint32_t pt_phys = pde & 0xFFFFF000;
 
     /* If PDE points to a shared kernel PT and we need PAGE_USER, clone it */
-    if ((flags & PAGE_USER) &&
-        (pt_phys == fpt_phys || pt_phys == spt_phys || pt_phys == tpt_phys)) {
+    if ((flags & PAGE_USER) && is_kernel_pt((int)pd_index, pt_phys)) {
         uint32_t new_pt_phys = alloc_frame();
         if (new_pt_phys == FRAME_ALLOC_FAIL) { temp_unmap(); return -1; }
 
@@ -319,10 +375,8 @@ int pgdir_map_user_page(uint32_t pd_phys, uint32_t virt, uint32_t phys,
         pd[pd_index] = new_pt_phys | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
         temp_unmap();
 
-        /* Copy from the original kernel PT (accessible via identity map) */
-        uint32_t *orig_pt = (pt_phys == fpt_phys) ? first_page_table
-                          : (pt_phys == spt_phys)  ? second_page_table
-                                                   : third_page_table;
+        /* Copy from the original kernel PT through the physmap */
+        uint32_t *orig_pt = (uint32_t *)phys_to_virt(pt_phys);
 
         uint32_t *new_pt = (uint32_t *)temp_map(new_pt_phys);
         memcpy(new_pt, orig_pt, PAGE_SIZE);
@@ -340,6 +394,15 @@ int pgdir_map_user_page(uint32_t pd_phys, uint32_t virt, uint32_t phys,
     return 0;
 }
 
+uint32_t pgdir_get_pte(uint32_t pd_phys, uint32_t virt) {
+    uint32_t *pd = (uint32_t *)phys_to_virt(pd_phys);
+    uint32_t pde = pd[virt >> 22];
+    if (!(pde & PAGE_PRESENT)) return 0;
+
+    uint32_t *pt = (uint32_t *)phys_to_virt(pde & 0xFFFFF000);
+    return pt[(virt >> 12) & 0x3FF];
+}
+
 int map_page(uint32_t virt, uint32_t phys, uint32_t flags) {
     uint32_t pd_index = virt >> 22;
     uint32_t pt_index = (virt >> 12) & 0x3FF;
@@ -384,8 +447,8 @@ int map_mmio_region(uint32_t phys_base, uint32_t size, uint32_t *virt_out) {
     uint32_t num_pages = (total_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
     uint32_t num_pdes  = (num_pages + PAGE_ENTRIES - 1) / PAGE_ENTRIES;
 
-    /* Check we have enough PDE slots */
-    if (mmio_next_pde + (int)num_pdes > PAGE_ENTRIES) return -1;
+    /* Check we have enough PDE slots (the physmap sits above them) */
+    if (mmio_next_pde + (int)num_pdes > (int)PHYSMAP_PDE_START) return -1;
 
     uint32_t virt_base = (uint32_t)mmio_next_pde << 22;
 
@@ -408,6 +471,48 @@ int map_mmio_region(uint32_t phys_base, uint32_t size, uint32_t *virt_out) {
     return 0;
 }
 
+/*
+ * Write to a read-only page of a private writable file mapping: give
+ * the process its own copy of the page-cache frame. With CR0.WP set,
+ * kernel writes into such a page (read() into a mapping) land here too.
+ * Returns 0 if the fault was resolved.
+ */
+static int cow_fault(uint32_t addr) {
+    struct process *p = current_process;
+    if (!p || p->cr3 == 0 || addr >= KERNEL_VMA_OFFSET) return -1;
+
+    vma_t *vma = NULL;
+    for (uint32_t i = 0; i < p->vma_count; i++) {
+        vma_t *v = &p->vmas[i];
+        if (addr >= v->base && addr < v->base + v->length) {
+            vma = v;
+            break;
+        }
+    }
+    if (!vma || (vma->flags & (MAP_ANONYMOUS | MAP_PRIVATE)) != MAP_PRIVATE
+        || !(vma->prot & PROT_WRITE))
+        return -1;
+
+    uint32_t va = addr & ~0xFFFu;
+    uint32_t pte = pgdir_get_pte(p->cr3, va);
+    if (!(pte & PAGE_PRESENT) || (pte & PAGE_WRITABLE)) return -1;
+
+    uint32_t old = pte & 0xFFFFF000;
+    uint32_t frame = alloc_frame();
+    if (frame == FRAME_ALLOC_FAIL) return -1;
+
+    memcpy(phys_to_virt(frame), phys_to_virt(old), PAGE_SIZE);
+    if (pgdir_map_user_page(p->cr3, va, frame,
+                            PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER) != 0) {
+        free_frame(frame);
+        return -1;
+    }
+    hal_tlb_invalidate(va);
+
+    free_frame(old);    /* drop the mapping's page-cache reference */
+    return 0;
+}
+
 /*
  * Page fault handler (ISR 14).
  *
@@ -425,6 +530,16 @@ void page_fault_handler(trapframe *tf) {
     int write    = tf->err_code & 0x2;
     int user     = tf->err_code & 0x4;
 
+    /* Copy-on-write of a private file mapping */
+    if (present && write && cow_fault(fault_addr) == 0)
+        return;
+
+    /* A syscall writing into a read-only user page is the caller's
+       fault, not the kernel's (only possible now that WP is set) */
+    if (!user && present && write && fault_addr < KERNEL_VMA_OFFSET
+        && current_process && current_process->cr3 != 0)
+        user = 1;
+
     if (user) {
         /* User-mode page fault: send SIGSEGV */
         printf("\n[PAGE FAULT] PID %d: %s %s at 0x%x (EIP=0x%x)\n",
@@ -1,110 +1,278 @@
 /*
  * ARP (Address Resolution Protocol) for SpikeOS.
  *
- * Maintains a 16-entry cache, sends requests, replies to queries
- * for our IP, and provides blocking resolution with timeout.
+ * Keeps a neighbour table of ARP_TABLE_SIZE entries found by a hash of
+ * the IP address, sends requests, replies to queries for our IP, and
+ * announces our address with a gratuitous ARP once it is configured.
+ *
+ * Resolution never blocks the sender: a packet for a neighbour whose
+ * MAC isn't known yet waits on that neighbour's queue (up to
+ * ARP_QUEUE_MAX) and goes out when the reply arrives. A timer thread
+ * re-sends unanswered requests once a second, drops the queue after
+ * ARP_RETRIES, and ages entries: a neighbour not heard from for
+ * ARP_REACHABLE_TICKS is stale, still used but asked again on the next
+ * packet, and forgotten if it doesn't answer or after ARP_EXPIRE_TICKS.
+ *
+ * Senders are learned as RFC 826 says: an entry we already have is
+ * updated from any ARP packet (so gratuitous ARPs move it to a new
+ * MAC), but a new one is only made for a host that is talking to us.
  */
 
 #include <kernel/net.h>
 #include <kernel/e1000.h>
+#include <kernel/skb.h>
 #include <kernel/hal.h>
 #include <kernel/timer.h>
 #include <kernel/wait.h>
+#include <kernel/process.h>
 #include <stdio.h>
 #include <string.h>
 
-static arp_entry_t arp_cache[ARP_CACHE_SIZE];
-static wait_queue_t arp_wq = WAIT_QUEUE_INIT;
+static arp_entry_t  arp_table[ARP_TABLE_SIZE];
+static arp_entry_t *arp_hash[ARP_HASH_SIZE];
+static arp_entry_t *arp_free_list;
+static uint32_t     arp_count;          /* entries in use */
+
+static struct process *arp_thread;
+static wait_queue_t arp_timer_wq = WAIT_QUEUE_INIT;
 
 static const uint8_t broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 static const uint8_t zero_mac[6]      = {0, 0, 0, 0, 0, 0};
 
+static void arp_timer_worker(void);
+
 /* ------------------------------------------------------------------ */
-/*  Cache management                                                  */
+/*  Table management (interrupts off)                                 */
 /* ------------------------------------------------------------------ */
 
-void arp_init(void) {
-    memset(arp_cache, 0, sizeof(arp_cache));
+static uint32_t arp_hashfn(uint32_t ip) {
+    uint32_t h = ip ^ (ip >> 16);
+    return (h ^ (h >> 8)) & (ARP_HASH_SIZE - 1);
 }
 
-static void arp_cache_add(uint32_t ip, const uint8_t *mac) {
-    uint32_t flags = hal_irq_save();
+static arp_entry_t *arp_find(uint32_t ip) {
+    for (arp_entry_t *e = arp_hash[arp_hashfn(ip)]; e; e = e->hnext)
+        if (e->ip == ip)
+            return e;
+    return (arp_entry_t *)0;
+}
 
-    /* Update existing entry */
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (arp_cache[i].valid && arp_cache[i].ip == ip) {
-            memcpy(arp_cache[i].mac, mac, 6);
-            arp_cache[i].timestamp = timer_ticks();
-            hal_irq_restore(flags);
-            wake_up_all(&arp_wq);
-            return;
-        }
-    }
+/* Drop an entry and the packets waiting on it */
+static void arp_release(arp_entry_t *e) {
+    arp_entry_t **pp = &arp_hash[arp_hashfn(e->ip)];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
 
-    /* Use first free slot */
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (!arp_cache[i].valid) {
-            arp_cache[i].ip = ip;
-            memcpy(arp_cache[i].mac, mac, 6);
-            arp_cache[i].timestamp = timer_ticks();
-            arp_cache[i].valid = 1;
-            hal_irq_restore(flags);
-            wake_up_all(&arp_wq);
-            return;
-        }
+    while (e->queue) {
+        sk_buff_t *skb = e->queue;
+        e->queue = skb->next;
+        skb->next = (sk_buff_t *)0;
+        skb_free(skb);
+        net_stats.arp_drops++;
     }
+    memset(e, 0, sizeof(*e));
+    e->hnext = arp_free_list;
+    arp_free_list = e;
+    arp_count--;
+}
 
-    /* Cache full — overwrite oldest entry */
-    int oldest = 0;
-    uint32_t oldest_time = arp_cache[0].timestamp;
-    for (int i = 1; i < ARP_CACHE_SIZE; i++) {
-        if (arp_cache[i].timestamp < oldest_time) {
-            oldest_time = arp_cache[i].timestamp;
-            oldest = i;
+/* A fresh entry for ip. With the table full, the neighbour heard from
+   longest ago makes way; one still being resolved is never evicted. */
+static arp_entry_t *arp_new(uint32_t ip) {
+    if (!arp_free_list) {
+        uint32_t now = timer_ticks();
+        arp_entry_t *victim = (arp_entry_t *)0;
+        for (int i = 0; i < ARP_TABLE_SIZE; i++) {
+            arp_entry_t *e = &arp_table[i];
+            if (e->state == ARP_INCOMPLETE) continue;
+            if (!victim || now - e->confirmed > now - victim->confirmed)
+                victim = e;
         }
+        if (!victim) return (arp_entry_t *)0;
+        arp_release(victim);
     }
-    arp_cache[oldest].ip = ip;
-    memcpy(arp_cache[oldest].mac, mac, 6);
-    arp_cache[oldest].timestamp = timer_ticks();
-    arp_cache[oldest].valid = 1;
 
-    hal_irq_restore(flags);
-    wake_up_all(&arp_wq);
+    arp_entry_t *e = arp_free_list;
+    arp_free_list = e->hnext;
+
+    uint32_t h = arp_hashfn(ip);
+    e->ip = ip;
+    e->hnext = arp_hash[h];
+    arp_hash[h] = e;
+
+    /* The timer thread sleeps while the table is empty */
+    if (arp_count++ == 0)
+        wake_up_one(&arp_timer_wq);
+    return e;
 }
 
-static int arp_cache_lookup(uint32_t ip, uint8_t *mac_out) {
-    uint32_t flags = hal_irq_save();
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (arp_cache[i].valid && arp_cache[i].ip == ip) {
-            memcpy(mac_out, arp_cache[i].mac, 6);
-            hal_irq_restore(flags);
-            return 0;
-        }
+void arp_init(void) {
+    memset(arp_table, 0, sizeof(arp_table));
+    memset(arp_hash, 0, sizeof(arp_hash));
+    arp_free_list = (arp_entry_t *)0;
+    for (int i = ARP_TABLE_SIZE - 1; i >= 0; i--) {
+        arp_table[i].hnext = arp_free_list;
+        arp_free_list = &arp_table[i];
+    }
+    arp_count = 0;
+
+    if (!arp_thread) {
+        arp_thread = proc_create_kernel_thread(arp_timer_worker);
+        if (!arp_thread)
+            printf("[arp] failed to start timer thread\n");
     }
-    hal_irq_restore(flags);
-    return -1;
 }
 
 /* ------------------------------------------------------------------ */
-/*  ARP request                                                       */
+/*  Sending ARP packets                                               */
 /* ------------------------------------------------------------------ */
 
-void arp_request(uint32_t target_ip) {
-    if (!nic) return;
-
+static void arp_send(uint16_t oper, const uint8_t *dst_mac,
+                     const uint8_t *tha, uint32_t tpa) {
     arp_header_t arp;
     arp.htype = htons(ARP_HW_ETHER);
     arp.ptype = htons(ETH_TYPE_IP);
     arp.hlen  = 6;
     arp.plen  = 4;
-    arp.oper  = htons(ARP_OP_REQUEST);
+    arp.oper  = htons(oper);
 
     memcpy(arp.sha, nic->mac, 6);
     arp.spa = net_cfg.ip;
-    memcpy(arp.tha, zero_mac, 6);
-    arp.tpa = target_ip;
+    memcpy(arp.tha, tha, 6);
+    arp.tpa = tpa;
+
+    eth_send(dst_mac, ETH_TYPE_ARP, &arp, sizeof(arp));
+}
+
+void arp_request(uint32_t target_ip) {
+    if (!nic) return;
+
+    arp_send(ARP_OP_REQUEST, broadcast_mac, zero_mac, target_ip);
+
+    /* Resolving inside a send burst: the request mustn't wait for it */
+    if (net_tx_held())
+        net_tx_flush();
+}
+
+void arp_announce(void) {
+    if (!nic || !net_cfg.configured) return;
+
+    /* A request for our own address: others update any entry they
+       have for it, and a host already using it will answer */
+    arp_send(ARP_OP_REQUEST, broadcast_mac, zero_mac, net_cfg.ip);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Resolution                                                        */
+/* ------------------------------------------------------------------ */
+
+int arp_output(uint32_t next_hop, sk_buff_t *skb) {
+    uint32_t now = timer_ticks();
+    int request = 0;
+
+    uint32_t flags = hal_irq_save();
+    arp_entry_t *e = arp_find(next_hop);
+
+    if (e && e->state != ARP_INCOMPLETE) {
+        uint8_t mac[6];
+        memcpy(mac, e->mac, 6);
 
-    eth_send(broadcast_mac, ETH_TYPE_ARP, &arp, sizeof(arp));
+        /* Stale: keep using it, but make sure it's still there */
+        if (e->state == ARP_STALE && e->probes < ARP_RETRIES &&
+            now - e->requested >= ARP_RETRY_TICKS) {
+            e->probes++;
+            e->requested = now;
+            request = 1;
+        }
+        hal_irq_restore(flags);
+
+        if (request)
+            arp_request(next_hop);
+        return eth_send_skb(mac, ETH_TYPE_IP, skb);
+    }
+
+    if (!e) {
+        e = arp_new(next_hop);
+        if (!e) {
+            hal_irq_restore(flags);
+            net_stats.arp_drops++;
+            skb_free(skb);
+            return -1;
+        }
+        e->state     = ARP_INCOMPLETE;
+        e->probes    = 1;
+        e->requested = now;
+        request = 1;
+    }
+
+    /* Queue behind the reply; a full queue loses its oldest packet */
+    if (e->queue_len >= ARP_QUEUE_MAX) {
+        sk_buff_t *old = e->queue;
+        e->queue = old->next;
+        e->queue_len--;
+        old->next = (sk_buff_t *)0;
+        skb_free(old);
+        net_stats.arp_drops++;
+    }
+    skb->next = (sk_buff_t *)0;
+    if (e->queue)
+        e->queue_tail->next = skb;
+    else
+        e->queue = skb;
+    e->queue_tail = skb;
+    e->queue_len++;
+    net_stats.arp_queued++;
+    hal_irq_restore(flags);
+
+    if (request)
+        arp_request(next_hop);
+    return 0;
+}
+
+int arp_lookup(uint32_t ip, uint8_t *mac_out) {
+    uint32_t flags = hal_irq_save();
+    arp_entry_t *e = arp_find(ip);
+    int found = e && e->state != ARP_INCOMPLETE;
+    if (found)
+        memcpy(mac_out, e->mac, 6);
+    hal_irq_restore(flags);
+    return found ? 0 : -1;
+}
+
+/* Heard from ip at mac: refresh its entry (making one if create), and
+   send whatever was waiting for it */
+static void arp_update(uint32_t ip, const uint8_t *mac, int create) {
+    uint32_t flags = hal_irq_save();
+    arp_entry_t *e = arp_find(ip);
+    if (!e && create)
+        e = arp_new(ip);
+    if (!e) {
+        hal_irq_restore(flags);
+        return;
+    }
+
+    memcpy(e->mac, mac, 6);
+    e->state     = ARP_REACHABLE;
+    e->confirmed = timer_ticks();
+    e->probes    = 0;
+
+    sk_buff_t *q = e->queue;
+    e->queue = e->queue_tail = (sk_buff_t *)0;
+    e->queue_len = 0;
+    hal_irq_restore(flags);
+
+    /* One doorbell for the lot */
+    if (q) {
+        net_tx_hold();
+        while (q) {
+            sk_buff_t *next = q->next;
+            q->next = (sk_buff_t *)0;
+            eth_send_skb(mac, ETH_TYPE_IP, q);
+            q = next;
+        }
+        net_tx_release();
+    }
 }
 
 /* ------------------------------------------------------------------ */
@@ -120,50 +288,105 @@ void arp_handle(const void *data, uint16_t len) {
     if (ntohs(arp->htype) != ARP_HW_ETHER) return;
     if (ntohs(arp->ptype) != ETH_TYPE_IP)   return;
 
-    /* Always cache the sender's IP→MAC mapping */
-    arp_cache_add(arp->spa, arp->sha);
+    /* Another host claiming our address: don't learn it */
+    if (net_cfg.configured && arp->spa == net_cfg.ip) {
+        if (nic && memcmp(arp->sha, nic->mac, 6) != 0)
+            net_stats.arp_conflicts++;
+        return;
+    }
+
+    /* A probe (sender 0.0.0.0) has nothing to learn. Otherwise update
+       the sender's entry, and make one if it's talking to us. */
+    int for_us = net_cfg.configured && arp->tpa == net_cfg.ip;
+    if (arp->spa != 0)
+        arp_update(arp->spa, arp->sha, for_us);
 
     /* If this is a request for our IP, send a reply */
-    if (ntohs(arp->oper) == ARP_OP_REQUEST &&
-        net_cfg.configured && arp->tpa == net_cfg.ip) {
-
-        arp_header_t reply;
-        reply.htype = htons(ARP_HW_ETHER);
-        reply.ptype = htons(ETH_TYPE_IP);
-        reply.hlen  = 6;
-        reply.plen  = 4;
-        reply.oper  = htons(ARP_OP_REPLY);
-
-        memcpy(reply.sha, nic->mac, 6);
-        reply.spa = net_cfg.ip;
-        memcpy(reply.tha, arp->sha, 6);
-        reply.tpa = arp->spa;
-
-        eth_send(arp->sha, ETH_TYPE_ARP, &reply, sizeof(reply));
-    }
+    if (ntohs(arp->oper) == ARP_OP_REQUEST && for_us)
+        arp_send(ARP_OP_REPLY, arp->sha, arp->sha, arp->spa);
 }
 
 /* ------------------------------------------------------------------ */
-/*  Blocking ARP resolve                                              */
+/*  Timers                                                            */
 /* ------------------------------------------------------------------ */
 
-int arp_resolve(uint32_t ip, uint8_t *mac_out) {
-    /* Check cache first */
-    if (arp_cache_lookup(ip, mac_out) == 0)
-        return 0;
+/* Retry and age the table, an entry at a time with interrupts off */
+static void arp_timers(void) {
+    for (int i = 0; i < ARP_TABLE_SIZE; i++) {
+        arp_entry_t *e = &arp_table[i];
+        uint32_t ip = 0;
+
+        uint32_t flags = hal_irq_save();
+        uint32_t now = timer_ticks();
+        switch (e->state) {
+        case ARP_INCOMPLETE:
+            if (now - e->requested < ARP_RETRY_TICKS)
+                break;
+            if (e->probes >= ARP_RETRIES) {
+                arp_release(e);     /* no answer: drop what waited */
+            } else {
+                e->probes++;
+                e->requested = now;
+                ip = e->ip;
+            }
+            break;
+        case ARP_REACHABLE:
+            if (now - e->confirmed >= ARP_REACHABLE_TICKS)
+                e->state = ARP_STALE;
+            break;
+        case ARP_STALE:
+            if (now - e->confirmed >= ARP_EXPIRE_TICKS ||
+                (e->probes >= ARP_RETRIES &&
+                 now - e->requested >= ARP_RETRY_TICKS))
+                arp_release(e);
+            break;
+        }
+        hal_irq_restore(flags);
+
+        if (ip)
+            arp_request(ip);
+    }
+}
+
+/* Once a second while the table has entries, like the TCP timers */
+static void arp_timer_worker(void) {
+    for (;;) {
+        uint32_t irq = hal_irq_save();
+        if (!arp_count)
+            sleep_on(&arp_timer_wq);
+        hal_irq_restore(irq);
 
-    /* Send ARP request and busy-wait up to 3 seconds */
-    arp_request(ip);
+        uint32_t next = timer_ticks() + ARP_RETRY_TICKS;
+        while ((int32_t)(timer_ticks() - next) < 0) {
+            hal_irq_enable();
+            hal_halt();
+        }
+        arp_timers();
+    }
+}
 
-    uint32_t deadline = timer_ticks() + 300;  /* 3 seconds at 100Hz */
-    while (timer_ticks() < deadline) {
-        if (arp_cache_lookup(ip, mac_out) == 0)
-            return 0;
+/* ------------------------------------------------------------------ */
+/*  Listing                                                           */
+/* ------------------------------------------------------------------ */
 
-        /* Wait a bit then retry */
-        hal_irq_enable();
-        hal_halt();
+int arp_list(arp_entry_t *out, int max) {
+    int n = 0;
+    uint32_t flags = hal_irq_save();
+    for (int i = 0; i < ARP_TABLE_SIZE && n < max; i++) {
+        if (arp_table[i].state == ARP_FREE) continue;
+        out[n] = arp_table[i];
+        out[n].queue = out[n].queue_tail = (sk_buff_t *)0;
+        out[n].hnext = (arp_entry_t *)0;
+        n++;
     }
+    hal_irq_restore(flags);
+    return n;
+}
 
-    return -1;  /* timeout */
+void arp_flush(void) {
+    uint32_t flags = hal_irq_save();
+    for (int i = 0; i < ARP_TABLE_SIZE; i++)
+        if (arp_table[i].state != ARP_FREE)
+            arp_release(&arp_table[i]);
+    hal_irq_restore(flags);
 }
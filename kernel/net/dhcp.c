@@ -211,5 +211,8 @@ void dhcp_handle(const void *data, uint16_t len) {
         printf("[net] DHCP: IP=%s", ip_fmt(net_cfg.ip));
         printf(" GW=%s", ip_fmt(net_cfg.gateway));
         printf(" DNS=%s\n", ip_fmt(net_cfg.dns));
+
+        /* Let the LAN know (and update caches holding an old MAC) */
+        arp_announce();
     }
 }
@@ -2,7 +2,8 @@
  * ICMP echo request/reply for SpikeOS.
  *
  * Handles incoming echo requests (sends reply) and echo replies
- * (wakes up net_ping waiter). Provides net_ping() for the shell.
+ * (wakes up net_ping waiter), and passes "fragmentation needed"
+ * reports on to the path MTU cache. Provides net_ping() for the shell.
  */
 
 #include <kernel/net.h>
@@ -44,6 +45,16 @@ void icmp_handle(const void *data, uint16_t len, uint32_t src_ip) {
         ping_received = 1;
         wake_up_all(&ping_wq);
     }
+    else if (icmp->type == ICMP_DEST_UNREACH &&
+             icmp->code == ICMP_FRAG_NEEDED &&
+             len >= sizeof(icmp_header_t) + sizeof(ip_header_t)) {
+        /* The header of the packet of ours that was too big follows;
+           the next-hop MTU is where an echo's seq would be (RFC 1191).
+           A router too old to say gets the minimum. */
+        const ip_header_t *orig = (const ip_header_t *)(icmp + 1);
+        if (orig->src_ip == net_cfg.ip)
+            ip_pmtu_update(orig->dst_ip, ntohs(icmp->seq));
+    }
 }
 
 /* ------------------------------------------------------------------ */
@@ -76,8 +87,8 @@ int icmp_send_echo(uint32_t dst_ip, uint16_t id, uint16_t seq) {
 /* ------------------------------------------------------------------ */
 
 int net_ping(uint32_t dst_ip) {
-    if (!nic || !net_cfg.configured) {
-        printf("Network not configured\n");
+    if (route_lookup(dst_ip, NULL) < 0) {
+        printf("No route to %s\n", ip_fmt(dst_ip));
         return -1;
     }
 
@@ -1,117 +1,348 @@
 /*
  * IPv4 send/receive for SpikeOS.
+ *
+ * Each packet goes where route_lookup() says: out the loopback, to a
+ * neighbour on the wire, or to a gateway. A datagram over the path MTU
+ * is sent as fragments, one per buffer of the chain the transport
+ * layer built it in; received fragments go to ipfrag.c. The path MTU
+ * to a destination is ETH_MTU unless an ICMP "fragmentation needed"
+ * said otherwise (TCP sends with DF set, so its segments are the ones
+ * that find out).
  */
 
 #include <kernel/net.h>
 #include <kernel/e1000.h>
 #include <kernel/hal.h>
+#include <kernel/skb.h>
+#include <kernel/timer.h>
 #include <stdio.h>
 #include <string.h>
 
 static uint16_t ip_id_counter = 1;
 
+typedef struct {
+    uint32_t dst_ip;     /* 0 = unused */
+    uint16_t mtu;
+    uint32_t expires;    /* timer ticks */
+} pmtu_entry_t;
+
+static pmtu_entry_t pmtu_cache[PMTU_CACHE_SIZE];
+
+void ip_init(void) {
+    memset(pmtu_cache, 0, sizeof(pmtu_cache));
+    ip_frag_init();
+}
+
 /* ------------------------------------------------------------------ */
 /*  IP checksum (RFC 1071)                                            */
 /* ------------------------------------------------------------------ */
 
-uint16_t ip_checksum(const void *data, uint16_t len) {
-    const uint16_t *words = (const uint16_t *)data;
-    uint32_t sum = 0;
+/*
+ * Sums 32 bits at a time into a 64-bit accumulator, which collects the
+ * carries for the end: folding the 32-bit halves gives the same 16-bit
+ * one's-complement sum as adding 16-bit words, in half the loads.
+ */
+uint32_t ip_csum_add(uint32_t sum, const void *data, uint32_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t acc = sum;
 
-    while (len > 1) {
-        sum += *words++;
-        len -= 2;
+    for (; len >= 16; p += 16, len -= 16) {
+        acc += *(const uint32_t *)(p + 0);
+        acc += *(const uint32_t *)(p + 4);
+        acc += *(const uint32_t *)(p + 8);
+        acc += *(const uint32_t *)(p + 12);
     }
-    if (len == 1) {
-        sum += *(const uint8_t *)words;
+    for (; len >= 4; p += 4, len -= 4)
+        acc += *(const uint32_t *)p;
+    if (len >= 2) {
+        acc += *(const uint16_t *)p;
+        p += 2;
+        len -= 2;
     }
+    if (len)
+        acc += *p;
 
+    acc = (acc & 0xFFFFFFFFu) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFFu) + (acc >> 32);
+    uint32_t s = (uint32_t)acc;
+    s = (s & 0xFFFF) + (s >> 16);
+    s = (s & 0xFFFF) + (s >> 16);
+    return s;
+}
+
+uint16_t ip_csum_fold(uint32_t sum) {
     while (sum >> 16)
         sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
 
-    return (uint16_t)(~sum);
+uint32_t ip_pseudo_sum(uint32_t src_ip, uint32_t dst_ip, uint8_t protocol,
+                       uint16_t len) {
+    uint32_t sum = (src_ip & 0xFFFF) + (src_ip >> 16) +
+                   (dst_ip & 0xFFFF) + (dst_ip >> 16) +
+                   htons(protocol) + htons(len);
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return sum;
+}
+
+uint16_t ip_checksum(const void *data, uint16_t len) {
+    return ip_csum_fold(ip_csum_add(0, data, len));
+}
+
+uint32_t ip_csum_chain(uint32_t sum, const sk_buff_t *skb, uint32_t len) {
+    for (; skb && len; skb = skb->frag_next) {
+        uint32_t n = skb->len < len ? skb->len : len;
+        sum = ip_csum_add(sum, skb->data, n);
+        len -= n;
+    }
+    return sum;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Path MTU                                                          */
+/* ------------------------------------------------------------------ */
+
+uint16_t ip_path_mtu(uint32_t dst_ip) {
+    uint16_t mtu = ETH_MTU;
+    uint32_t flags = hal_irq_save();
+    uint32_t now = timer_ticks();
+    for (int i = 0; i < PMTU_CACHE_SIZE; i++) {
+        pmtu_entry_t *e = &pmtu_cache[i];
+        if (e->dst_ip != dst_ip) continue;
+        if ((int32_t)(now - e->expires) >= 0)
+            e->dst_ip = 0;              /* try the full MTU again */
+        else
+            mtu = e->mtu;
+        break;
+    }
+    hal_irq_restore(flags);
+    return mtu;
+}
+
+uint16_t ip_frag_size(uint32_t dst_ip) {
+    return (uint16_t)((ip_path_mtu(dst_ip) - 20) & ~7u);
+}
+
+void ip_pmtu_update(uint32_t dst_ip, uint16_t mtu) {
+    if (mtu < IP_MIN_MTU) mtu = IP_MIN_MTU;
+    if (mtu >= ETH_MTU || !dst_ip) return;
+
+    uint32_t flags = hal_irq_save();
+    uint32_t now = timer_ticks();
+
+    /* Its own entry, or a free one, or the one nearest expiry */
+    pmtu_entry_t *slot = &pmtu_cache[0];
+    for (int i = 0; i < PMTU_CACHE_SIZE; i++) {
+        pmtu_entry_t *e = &pmtu_cache[i];
+        if (e->dst_ip == dst_ip) {
+            slot = e;
+            break;
+        }
+        if (slot->dst_ip &&
+            (!e->dst_ip || (int32_t)(e->expires - slot->expires) < 0))
+            slot = e;
+    }
+
+    /* A report can only lower a live estimate; expiry raises it */
+    if (slot->dst_ip != dst_ip || (int32_t)(now - slot->expires) >= 0 ||
+        mtu < slot->mtu) {
+        slot->dst_ip  = dst_ip;
+        slot->mtu     = mtu;
+        slot->expires = now + PMTU_EXPIRE_TICKS;
+    }
+    hal_irq_restore(flags);
 }
 
 /* ------------------------------------------------------------------ */
 /*  IPv4 receive                                                      */
 /* ------------------------------------------------------------------ */
 
-void ip_handle(const void *data, uint16_t len) {
-    if (len < sizeof(ip_header_t)) return;
+static void ip_deliver(sk_buff_t *skb, uint8_t protocol) {
+    /* Only UDP takes a datagram spread over several buffers */
+    if (skb->frag_next && protocol != IP_PROTO_UDP)
+        return;
+
+    switch (protocol) {
+    case IP_PROTO_ICMP:
+        icmp_handle(skb->data, skb->len, skb->src_ip);
+        break;
+    case IP_PROTO_UDP:
+        udp_handle(skb);
+        break;
+    case IP_PROTO_TCP:
+        tcp_handle(skb);
+        break;
+    }
+}
+
+void ip_handle(sk_buff_t *skb) {
+    if (skb->len < sizeof(ip_header_t)) return;
 
-    const ip_header_t *ip = (const ip_header_t *)data;
+    const ip_header_t *ip = (const ip_header_t *)skb->data;
 
     /* Validate: must be IPv4 */
     if ((ip->ver_ihl >> 4) != 4) return;
 
-    /* Validate checksum */
+    /* Validate checksum, unless the NIC has */
     uint16_t ihl = (ip->ver_ihl & 0x0F) * 4;
-    if (ihl < 20 || ihl > len) return;
-    if (ip_checksum(ip, ihl) != 0) return;
+    uint16_t total_len = ntohs(ip->total_len);
+    if (ihl < 20 || ihl > total_len || total_len > skb->len) return;
+    if (!(skb->csum & SKB_CSUM_IP) && ip_checksum(ip, ihl) != 0) return;
+
+    /* 127/8 never leaves the host, so from the wire it is spoofed */
+    if (!skb->looped
+        && (ip_is_loopback(ip->dst_ip) || ip_is_loopback(ip->src_ip))) {
+        net_stats.ip_martians++;
+        return;
+    }
 
-    /* Accept packets for our IP, or broadcast (for DHCP before config) */
+    /* Accept packets for our IP, loopback, or broadcast (for DHCP
+       before config) */
     if (net_cfg.configured && ip->dst_ip != net_cfg.ip &&
-        ip->dst_ip != 0xFFFFFFFFu) return;
+        ip->dst_ip != 0xFFFFFFFFu && !ip_is_loopback(ip->dst_ip)) return;
 
-    uint16_t payload_len = ntohs(ip->total_len) - ihl;
-    const void *payload = (const uint8_t *)data + ihl;
-    uint32_t src_ip = ip->src_ip;
+    uint8_t protocol = ip->protocol;
+    skb->src_ip = ip->src_ip;
+    skb->dst_ip = ip->dst_ip;
 
-    switch (ip->protocol) {
-    case IP_PROTO_ICMP:
-        icmp_handle(payload, payload_len, src_ip);
-        break;
-    case IP_PROTO_UDP:
-        udp_handle(payload, payload_len, src_ip);
-        break;
+    /* Drop Ethernet padding, then the header */
+    skb_trim(skb, total_len);
+    skb_pull(skb, ihl);
+
+    /* A fragment waits for the rest; the one that completes the
+       datagram delivers it all */
+    if (ntohs(ip->flags_frag) & (IP_MF | IP_OFFMASK)) {
+        sk_buff_t *dgram = ip_frag_input(skb, ip);
+        if (dgram) {
+            ip_deliver(dgram, protocol);
+            skb_free(dgram);
+        }
+        return;
     }
+
+    ip_deliver(skb, protocol);
 }
 
 /* ------------------------------------------------------------------ */
 /*  IPv4 send                                                         */
 /* ------------------------------------------------------------------ */
 
-int ip_send(uint32_t dst_ip, uint8_t protocol,
-            const void *payload, uint16_t payload_len) {
-    if (!nic || !net_cfg.configured) return -1;
+uint32_t ip_route_src(uint32_t dst_ip) {
+    route_t rt;
+    if (route_lookup(dst_ip, &rt) < 0)
+        return net_cfg.ip;
+    return rt.src;
+}
 
-    uint16_t total_len = 20 + payload_len;
-    uint8_t packet[ETH_MTU];
-    if (total_len > ETH_MTU) return -1;
+/* Push the header on one packet (or fragment) and route it out */
+static int ip_output(uint32_t dst_ip, uint8_t protocol, sk_buff_t *skb,
+                     uint16_t id, uint16_t flags_frag) {
+    static const uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    route_t rt;
 
-    ip_header_t *ip = (ip_header_t *)packet;
+    /* Broadcast is always direct, out the NIC */
+    if (dst_ip == 0xFFFFFFFFu) {
+        memset(&rt, 0, sizeof(rt));
+        rt.src = net_cfg.ip;
+        rt.dev = nic;
+    } else if (route_lookup(dst_ip, &rt) < 0) {
+        net_stats.ip_no_route++;
+        skb_free(skb);
+        return -1;
+    }
+
+    /* Only the loopback works before the interface is configured */
+    if (!rt.dev || (!(rt.flags & ROUTE_F_LOCAL) && !net_cfg.configured)) {
+        skb_free(skb);
+        return -1;
+    }
+
+    ip_header_t *ip = (ip_header_t *)skb_push(skb, 20);
+    if (!ip) {
+        skb_free(skb);
+        return -1;
+    }
     ip->ver_ihl    = 0x45;  /* IPv4, IHL=5 (20 bytes) */
     ip->tos        = 0;
-    ip->total_len  = htons(total_len);
-    ip->id         = htons(ip_id_counter++);
-    ip->flags_frag = 0;
+    ip->total_len  = htons(skb->len);
+    ip->id         = htons(id);
+    ip->flags_frag = htons(flags_frag);
     ip->ttl        = 64;
     ip->protocol   = protocol;
     ip->checksum   = 0;
-    ip->src_ip     = net_cfg.ip;
+    ip->src_ip     = rt.src;
     ip->dst_ip     = dst_ip;
 
-    ip->checksum = ip_checksum(ip, 20);
+    /* The NIC fills in the header checksum if it can */
+    if (rt.dev->features & NIC_F_TX_IP_CSUM)
+        skb->csum |= SKB_CSUM_IP;
+    else
+        ip->checksum = ip_checksum(ip, 20);
+
+    if (rt.flags & ROUTE_F_LOCAL)
+        return eth_xmit(rt.dev, rt.dev->mac, ETH_TYPE_IP, skb);
+    if (dst_ip == 0xFFFFFFFFu)
+        return eth_xmit(rt.dev, bcast, ETH_TYPE_IP, skb);
 
-    memcpy(packet + 20, payload, payload_len);
+    /* Out to the next hop's MAC, or queued until ARP finds it */
+    uint32_t next_hop = (rt.flags & ROUTE_F_GATEWAY) ? rt.gateway : dst_ip;
+    return arp_output(next_hop, skb);
+}
 
-    /* Determine next-hop: same subnet → direct, else gateway */
-    uint32_t next_hop = dst_ip;
-    if (net_cfg.subnet != 0 &&
-        (dst_ip & net_cfg.subnet) != (net_cfg.ip & net_cfg.subnet)) {
-        next_hop = net_cfg.gateway;
+/* One fragment per buffer of the chain, all sharing an ID */
+static int ip_send_frags(uint32_t dst_ip, uint8_t protocol, sk_buff_t *skb) {
+    uint32_t total = 0;
+    for (sk_buff_t *p = skb; p; p = p->frag_next) {
+        total += p->len;
+        if (p->len > ETH_MTU - 20 || (p->frag_next && (p->len & 7)) ||
+            total > IP_MAX_PAYLOAD) {
+            skb_free(skb);
+            return -1;
+        }
     }
-    /* Broadcast is always direct */
-    if (dst_ip == 0xFFFFFFFFu) {
-        static const uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-        return eth_send(bcast, ETH_TYPE_IP, packet, total_len);
+
+    uint16_t id = ip_id_counter++;
+    uint32_t off = 0;
+    int ret = 0;
+    net_tx_hold();
+    while (skb) {
+        /* Unlinked, each piece is ours to send (and the rest with it) */
+        sk_buff_t *rest = skb->frag_next;
+        skb->frag_next = (sk_buff_t *)0;
+
+        uint16_t ff = (uint16_t)(off / 8) | (rest ? IP_MF : 0);
+        off += skb->len;
+        net_stats.ip_frags_out++;
+        if (ip_output(dst_ip, protocol, skb, id, ff) < 0)
+            ret = -1;
+        skb = rest;
     }
+    net_tx_release();
+    return ret;
+}
 
-    /* ARP resolve the next-hop */
-    uint8_t dst_mac[6];
-    if (arp_resolve(next_hop, dst_mac) != 0) {
-        return -1;  /* ARP timeout */
+int ip_send_skb(uint32_t dst_ip, uint8_t protocol, sk_buff_t *skb) {
+    if (skb->frag_next)
+        return ip_send_frags(dst_ip, protocol, skb);
+    if (skb->len > ETH_MTU - 20) {
+        skb_free(skb);
+        return -1;
     }
 
-    return eth_send(dst_mac, ETH_TYPE_IP, packet, total_len);
+    /* TCP keeps to the path MTU, and DF gets it told when that drops */
+    return ip_output(dst_ip, protocol, skb, ip_id_counter++,
+                     protocol == IP_PROTO_TCP ? IP_DF : 0);
+}
+
+int ip_send(uint32_t dst_ip, uint8_t protocol,
+            const void *payload, uint16_t payload_len) {
+    if (payload_len > ETH_MTU - 20) return -1;
+
+    sk_buff_t *skb = skb_alloc(SKB_HEADROOM);
+    if (!skb) return -1;
+    memcpy(skb_put(skb, payload_len), payload, payload_len);
+    net_stats.tx_copies++;
+
+    return ip_send_skb(dst_ip, protocol, skb);
 }
@@ -0,0 +1,185 @@
+/*
+ * IPv4 fragment reassembly for SpikeOS.
+ *
+ * Up to IPFRAG_SLOTS datagrams at once, each found by (source,
+ * destination, ID, protocol). A fragment's buffer is kept as it came
+ * off the NIC, with the IP header pulled off, and linked into its
+ * datagram's chain in offset order, so the finished datagram is the
+ * chain itself and nothing is copied. Fragments that overlap another
+ * (other than an exact repeat) give the datagram up rather than being
+ * trimmed. There is no timer: expired datagrams are cleared out when
+ * the next fragment arrives, and IPFRAG_MAX_BUFS bounds what they can
+ * hold until then.
+ */
+
+#include <kernel/net.h>
+#include <kernel/hal.h>
+#include <kernel/skb.h>
+#include <kernel/timer.h>
+#include <string.h>
+
+typedef struct {
+    int        in_use;
+    uint32_t   src_ip, dst_ip;
+    uint16_t   id;
+    uint8_t    protocol;
+    uint32_t   total;      /* payload length, once the last piece is in */
+    uint32_t   received;   /* payload bytes held */
+    uint32_t   bufs;       /* buffers held */
+    uint32_t   started;    /* timer ticks of the first fragment */
+    sk_buff_t *frags;      /* in offset order, via frag_next */
+} ipfrag_t;
+
+static ipfrag_t ipfrags[IPFRAG_SLOTS];
+static uint32_t ipfrag_bufs;       /* held by all slots */
+
+/* Give a datagram up, freeing its fragments */
+static void ipfrag_drop(ipfrag_t *q) {
+    skb_free(q->frags);
+    ipfrag_bufs -= q->bufs;
+    memset(q, 0, sizeof(*q));
+    net_stats.ip_reasm_fails++;
+}
+
+static void ipfrag_expire(uint32_t now) {
+    for (int i = 0; i < IPFRAG_SLOTS; i++)
+        if (ipfrags[i].in_use &&
+            now - ipfrags[i].started >= IPFRAG_TIMEOUT)
+            ipfrag_drop(&ipfrags[i]);
+}
+
+/* The in-use datagram started longest ago, other than keep */
+static ipfrag_t *ipfrag_oldest(ipfrag_t *keep, uint32_t now) {
+    ipfrag_t *victim = (ipfrag_t *)0;
+    for (int i = 0; i < IPFRAG_SLOTS; i++) {
+        ipfrag_t *q = &ipfrags[i];
+        if (!q->in_use || q == keep) continue;
+        if (!victim || now - q->started > now - victim->started)
+            victim = q;
+    }
+    return victim;
+}
+
+static ipfrag_t *ipfrag_find(const ip_header_t *ip, uint32_t now) {
+    ipfrag_t *free_slot = (ipfrag_t *)0;
+    for (int i = 0; i < IPFRAG_SLOTS; i++) {
+        ipfrag_t *q = &ipfrags[i];
+        if (!q->in_use) {
+            if (!free_slot) free_slot = q;
+            continue;
+        }
+        if (q->src_ip == ip->src_ip && q->dst_ip == ip->dst_ip &&
+            q->id == ip->id && q->protocol == ip->protocol)
+            return q;
+    }
+
+    /* A new datagram; with every slot taken, the oldest makes way */
+    if (!free_slot) {
+        free_slot = ipfrag_oldest((ipfrag_t *)0, now);
+        ipfrag_drop(free_slot);
+    }
+    free_slot->in_use   = 1;
+    free_slot->src_ip   = ip->src_ip;
+    free_slot->dst_ip   = ip->dst_ip;
+    free_slot->id       = ip->id;
+    free_slot->protocol = ip->protocol;
+    free_slot->started  = now;
+    return free_slot;
+}
+
+void ip_frag_init(void) {
+    memset(ipfrags, 0, sizeof(ipfrags));
+    ipfrag_bufs = 0;
+}
+
+sk_buff_t *ip_frag_input(sk_buff_t *skb, const ip_header_t *ip) {
+    uint16_t ff   = ntohs(ip->flags_frag);
+    uint32_t off  = (uint32_t)(ff & IP_OFFMASK) * 8;
+    uint32_t end  = off + skb->len;
+    int      more = (ff & IP_MF) != 0;
+
+    net_stats.ip_frags_in++;
+
+    /* Every piece but the last carries a multiple of 8 bytes */
+    if (end > IP_MAX_PAYLOAD || (more && (!skb->len || (skb->len & 7))))
+        return (sk_buff_t *)0;
+
+    uint32_t flags = hal_irq_save();
+    uint32_t now = timer_ticks();
+    ipfrag_expire(now);
+    ipfrag_t *q = ipfrag_find(ip, now);
+
+    /* The last piece fixes the length; nothing may go past it */
+    if ((!more && q->total && q->total != end) ||
+        (q->total && end > q->total)) {
+        ipfrag_drop(q);
+        hal_irq_restore(flags);
+        return (sk_buff_t *)0;
+    }
+
+    /* Find its place, after every piece that starts before it */
+    sk_buff_t *prev = (sk_buff_t *)0;
+    sk_buff_t **pp = &q->frags;
+    while (*pp && (*pp)->frag_off < off) {
+        prev = *pp;
+        pp = &(*pp)->frag_next;
+    }
+    sk_buff_t *next = *pp;
+
+    if (next && next->frag_off == off && next->len == skb->len) {
+        hal_irq_restore(flags);             /* a repeat: already have it */
+        return (sk_buff_t *)0;
+    }
+    if ((prev && prev->frag_off + prev->len > off) ||
+        (next && end > next->frag_off)) {
+        ipfrag_drop(q);
+        hal_irq_restore(flags);
+        return (sk_buff_t *)0;
+    }
+
+    /* Room for one more buffer, at older datagrams' expense */
+    while (ipfrag_bufs >= IPFRAG_MAX_BUFS) {
+        ipfrag_t *victim = ipfrag_oldest(q, now);
+        if (!victim) {
+            ipfrag_drop(q);                 /* it alone fills the limit */
+            hal_irq_restore(flags);
+            return (sk_buff_t *)0;
+        }
+        ipfrag_drop(victim);
+    }
+
+    skb_get(skb);
+    skb->frag_off  = (uint16_t)off;
+    skb->frag_next = next;
+    *pp = skb;
+    q->bufs++;
+    ipfrag_bufs++;
+    q->received += skb->len;
+    if (!more)
+        q->total = end;
+
+    if (!q->total || q->received != q->total) {
+        hal_irq_restore(flags);
+        return (sk_buff_t *)0;
+    }
+
+    /* Complete: no gaps, since nothing overlaps and the bytes add up.
+       The chain and our references on it go to the caller. */
+    sk_buff_t *head = q->frags;
+    ipfrag_bufs -= q->bufs;
+    memset(q, 0, sizeof(*q));
+    net_stats.ip_reasm_ok++;
+    hal_irq_restore(flags);
+
+    /* A NIC's checksum verdict was on one fragment, not the datagram */
+    head->csum &= ~SKB_CSUM_L4;
+    return head;
+}
+
+void ip_frag_flush(void) {
+    uint32_t flags = hal_irq_save();
+    for (int i = 0; i < IPFRAG_SLOTS; i++)
+        if (ipfrags[i].in_use)
+            ipfrag_drop(&ipfrags[i]);
+    hal_irq_restore(flags);
+}
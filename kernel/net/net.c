@@ -5,10 +5,76 @@
 #include <kernel/net.h>
 #include <kernel/e1000.h>
 #include <kernel/hal.h>
+#include <kernel/skb.h>
+#include <kernel/process.h>
+#include <kernel/wait.h>
 #include <stdio.h>
 #include <string.h>
 
 net_config_t net_cfg;
+net_stats_t  net_stats;
+
+static struct process *rx_thread = NULL;
+static wait_queue_t rx_wq = WAIT_QUEUE_INIT;
+static volatile int rx_pending;
+
+static struct process *tx_holder;   /* thread in a send burst */
+static int tx_hold_depth;
+
+/* ------------------------------------------------------------------ */
+/*  Deferred RX (NAPI-style)                                          */
+/* ------------------------------------------------------------------ */
+
+/*
+ * The NIC's IRQ handler only masks its RX interrupts and wakes this
+ * thread, which drains the ring in rounds of NET_RX_BUDGET frames.
+ * Between frames interrupts are on and the timer can preempt it, so a
+ * flood of packets no longer starves the timer, keyboard and mouse.
+ * Once a round comes up short the driver has unmasked RX interrupts
+ * and the thread sleeps until the next one. Frames sent on the
+ * loopback are drained here too, a budget's worth per round.
+ */
+static void net_rx_worker(void) {
+    for (;;) {
+        uint32_t flags = hal_irq_save();
+        if (!rx_pending)
+            sleep_on(&rx_wq);
+        hal_irq_disable();
+        rx_pending = 0;
+        hal_irq_restore(flags);
+
+        if (loopback_poll(NET_RX_BUDGET) >= NET_RX_BUDGET)
+            rx_pending = 1;
+
+        if (!nic || !nic->poll)
+            continue;
+
+        net_stats.rx_polls++;
+        if (nic->poll(NET_RX_BUDGET) >= NET_RX_BUDGET) {
+            net_stats.rx_full_polls++;
+            rx_pending = 1;     /* more in the ring: go round again */
+        }
+    }
+}
+
+void net_rx_schedule(void) {
+    net_stats.rx_irqs++;
+
+    if (!rx_thread) {
+        /* No thread yet: drain the ring here, as before */
+        if (nic && nic->poll)
+            while (nic->poll(NET_RX_BUDGET) >= NET_RX_BUDGET)
+                ;
+        return;
+    }
+
+    net_rx_kick();
+}
+
+void net_rx_kick(void) {
+    rx_pending = 1;
+    wake_up_one(&rx_wq);
+}
 
 /* ------------------------------------------------------------------ */
 /*  Initialization                                                    */
@@ -16,58 +82,157 @@ net_config_t net_cfg;
 
 void net_init(void) {
     memset(&net_cfg, 0, sizeof(net_cfg));
+    memset(&net_stats, 0, sizeof(net_stats));
     arp_init();
+    ip_init();
+    route_init();
+    loopback_init();
     udp_init();
+    tcp_init();
+
+    /* Started even without a NIC, for the loopback */
+    if (!rx_thread) {
+        rx_thread = proc_create_kernel_thread(net_rx_worker);
+        if (!rx_thread)
+            printf("[net] failed to start RX thread\n");
+        else
+            rx_pending = 1;     /* first round picks up anything queued */
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Send bursts                                                       */
+/* ------------------------------------------------------------------ */
+
+/*
+ * The burst belongs to the thread that started it: if it sleeps or is
+ * preempted, another thread's frames go out as usual (and tell the NIC
+ * of the holder's too), so only the holder's own frames ever wait.
+ */
+void net_tx_hold(void) {
+    uint32_t flags = hal_irq_save();
+    if (tx_hold_depth == 0 || tx_holder == current_process) {
+        tx_holder = current_process;
+        tx_hold_depth++;
+    }
+    hal_irq_restore(flags);
+}
+
+void net_tx_release(void) {
+    uint32_t flags = hal_irq_save();
+    int flush = 0;
+    if (tx_hold_depth > 0 && tx_holder == current_process &&
+        --tx_hold_depth == 0) {
+        tx_holder = NULL;
+        flush = 1;
+    }
+    hal_irq_restore(flags);
+    if (flush)
+        net_tx_flush();
+}
+
+int net_tx_held(void) {
+    return tx_hold_depth > 0 && tx_holder == current_process;
+}
+
+void net_tx_flush(void) {
+    if (nic && nic->tx_flush)
+        nic->tx_flush();
+}
+
+void net_csum_complete(sk_buff_t *skb) {
+    if (!(skb->csum & SKB_CSUM_L4)) return;
+
+    uint8_t *l4 = skb->head + skb->csum_start;
+    uint32_t len = (uint32_t)(skb->data + skb->len - l4);
+    uint16_t sum = ip_csum_fold(ip_csum_add(0, l4, len));
+
+    /* 0 means "no checksum" to UDP; 0xFFFF is the same sum */
+    *(uint16_t *)(l4 + skb->csum_offset) = sum ? sum : 0xFFFF;
+    skb->csum &= ~SKB_CSUM_L4;
 }
 
 /* ------------------------------------------------------------------ */
 /*  Ethernet TX                                                       */
 /* ------------------------------------------------------------------ */
 
-int eth_send(const uint8_t *dst_mac, uint16_t type,
-             const void *payload, uint16_t payload_len) {
-    if (!nic || payload_len > ETH_MTU) return -1;
+int eth_send_skb(const uint8_t *dst_mac, uint16_t type, sk_buff_t *skb) {
+    return eth_xmit(nic, dst_mac, type, skb);
+}
+
+int eth_xmit(nic_t *dev, const uint8_t *dst_mac, uint16_t type,
+             sk_buff_t *skb) {
+    if (!dev || skb->len > ETH_MTU) {
+        skb_free(skb);
+        return -1;
+    }
 
-    uint8_t frame[ETH_FRAME_MAX];
-    eth_header_t *eth = (eth_header_t *)frame;
+    /* Checksums the NIC can't do (before the padding goes on) */
+    if (!(dev->features & NIC_F_TX_CSUM))
+        net_csum_complete(skb);
 
+    eth_header_t *eth = (eth_header_t *)skb_push(skb, ETH_HDR_LEN);
+    if (!eth) {
+        skb_free(skb);
+        return -1;
+    }
     memcpy(eth->dst, dst_mac, ETH_ADDR_LEN);
-    memcpy(eth->src, nic->mac, ETH_ADDR_LEN);
+    memcpy(eth->src, dev->mac, ETH_ADDR_LEN);
     eth->type = htons(type);
 
-    memcpy(frame + ETH_HDR_LEN, payload, payload_len);
-
-    uint16_t total = ETH_HDR_LEN + payload_len;
     /* Pad to minimum Ethernet frame size (64 bytes including CRC,
        but CRC is added by hardware, so pad to 60) */
-    if (total < 60) {
-        memset(frame + total, 0, 60 - total);
-        total = 60;
+    if (skb->len < 60) {
+        uint16_t pad = 60 - skb->len;
+        memset(skb_put(skb, pad), 0, pad);
     }
 
-    return nic->send(frame, total);
+    return dev->send_skb(skb);
+}
+
+int eth_send(const uint8_t *dst_mac, uint16_t type,
+             const void *payload, uint16_t payload_len) {
+    if (!nic || payload_len > ETH_MTU) return -1;
+
+    sk_buff_t *skb = skb_alloc(SKB_HEADROOM);
+    if (!skb) return -1;
+    memcpy(skb_put(skb, payload_len), payload, payload_len);
+    net_stats.tx_copies++;
+
+    return eth_send_skb(dst_mac, type, skb);
 }
 
 /* ------------------------------------------------------------------ */
-/*  Ethernet RX dispatch (called from e1000 IRQ handler)              */
+/*  Ethernet RX dispatch (called from nic->poll)                      */
 /* ------------------------------------------------------------------ */
 
-void net_rx_callback(const void *data, uint16_t len) {
-    if (len < ETH_HDR_LEN) return;
+void net_rx(sk_buff_t *skb) {
+    /* One frame at a time with interrupts off: the protocol handlers
+       were written for IRQ context and must not be preempted by a
+       sender halfway through (ARP cache, socket queues, DHCP state) */
+    uint32_t flags = hal_irq_save();
+    net_stats.rx_packets++;
+    net_stats.rx_bytes += skb->len;
 
-    const eth_header_t *eth = (const eth_header_t *)data;
-    uint16_t type = ntohs(eth->type);
-    const void *payload = (const uint8_t *)data + ETH_HDR_LEN;
-    uint16_t payload_len = len - ETH_HDR_LEN;
+    const eth_header_t *eth = (const eth_header_t *)skb->data;
+    if (!skb_pull(skb, ETH_HDR_LEN)) {
+        skb_free(skb);
+        hal_irq_restore(flags);
+        return;
+    }
 
-    switch (type) {
+    switch (ntohs(eth->type)) {
     case ETH_TYPE_ARP:
-        arp_handle(payload, payload_len);
+        arp_handle(skb->data, skb->len);
         break;
     case ETH_TYPE_IP:
-        ip_handle(payload, payload_len);
+        ip_handle(skb);
         break;
     }
+
+    /* Layers that keep the buffer took their own reference */
+    skb_free(skb);
+    hal_irq_restore(flags);
 }
 
 /* ------------------------------------------------------------------ */
@@ -139,3 +304,15 @@ const char *ip_fmt(uint32_t ip) {
 
     return buf;
 }
+
+const char *mac_fmt(const uint8_t *mac) {
+    static char buf[18];
+    static const char hex[] = "0123456789abcdef";
+
+    for (int i = 0; i < 6; i++) {
+        buf[i * 3]     = hex[mac[i] >> 4];
+        buf[i * 3 + 1] = hex[mac[i] & 0xF];
+        buf[i * 3 + 2] = i < 5 ? ':' : '\0';
+    }
+    return buf;
+}
@@ -0,0 +1,167 @@
+/*
+ * IPv4 routing table for SpikeOS.
+ *
+ * Static routes live in a small array; the interface routes are made
+ * up from net_cfg on every lookup, so there is nothing to keep in step
+ * when DHCP (or a test) changes the address. Both sets are searched
+ * linearly for the longest matching prefix, which at this size beats
+ * anything cleverer.
+ */
+
+#include <kernel/net.h>
+#include <kernel/e1000.h>
+#include <kernel/hal.h>
+#include <string.h>
+
+static route_t route_table[ROUTE_TABLE_SIZE];
+static int     route_count;
+
+/* Routes implied by the interface config, at most 4 */
+static int route_iface(route_t *out) {
+    int n = 0;
+
+    memset(out, 0, 4 * sizeof(route_t));
+    out[n].dest  = IP_LOOPBACK_NET;
+    out[n].mask  = IP_LOOPBACK_MASK;
+    out[n].src   = IP_LOOPBACK_ADDR;
+    out[n].flags = ROUTE_F_LOCAL | ROUTE_F_IFACE;
+    n++;
+
+    if (!nic || !net_cfg.configured)
+        return n;
+
+    out[n].dest  = net_cfg.ip;
+    out[n].mask  = 0xFFFFFFFFu;
+    out[n].src   = net_cfg.ip;
+    out[n].flags = ROUTE_F_LOCAL | ROUTE_F_IFACE;
+    n++;
+
+    /* With no mask, everything is on-link (as before routing) */
+    out[n].dest  = net_cfg.ip & net_cfg.subnet;
+    out[n].mask  = net_cfg.subnet;
+    out[n].src   = net_cfg.ip;
+    out[n].flags = ROUTE_F_IFACE;
+    n++;
+
+    if (net_cfg.gateway && net_cfg.subnet) {
+        out[n].gateway = net_cfg.gateway;
+        out[n].src     = net_cfg.ip;
+        out[n].flags   = ROUTE_F_GATEWAY | ROUTE_F_IFACE;
+        n++;
+    }
+    return n;
+}
+
+int route_prefix_len(uint32_t mask) {
+    uint32_t m = ntohl(mask);
+    int len = 0;
+    while (m & 0x80000000u) {
+        len++;
+        m <<= 1;
+    }
+    return len;
+}
+
+static int route_is_prefix(uint32_t mask) {
+    uint32_t inv = ~ntohl(mask);
+    return (inv & (inv + 1)) == 0;
+}
+
+void route_init(void) {
+    uint32_t flags = hal_irq_save();
+    memset(route_table, 0, sizeof(route_table));
+    route_count = 0;
+    hal_irq_restore(flags);
+}
+
+int route_lookup(uint32_t dst_ip, route_t *out) {
+    route_t iface[4];
+    const route_t *best = (const route_t *)0;
+    int best_len = -1;
+
+    uint32_t flags = hal_irq_save();
+    int n = route_iface(iface);
+
+    /* Static routes first, so they win ties */
+    for (int i = 0; i < route_count + n; i++) {
+        const route_t *r = i < route_count ? &route_table[i]
+                                           : &iface[i - route_count];
+        if ((dst_ip & r->mask) != r->dest) continue;
+        int len = route_prefix_len(r->mask);
+        if (len > best_len) {
+            best = r;
+            best_len = len;
+        }
+    }
+
+    if (best && out) {
+        *out = *best;
+        if (!(best->flags & ROUTE_F_IFACE))
+            out->src = net_cfg.ip;
+        out->dev = (best->flags & ROUTE_F_LOCAL) ? &loopback_nic : nic;
+    }
+    hal_irq_restore(flags);
+    return best ? 0 : -1;
+}
+
+int route_add(uint32_t dest, uint32_t mask, uint32_t gateway) {
+    if (!route_is_prefix(mask)) return -1;
+    dest &= mask;
+
+    uint32_t flags = hal_irq_save();
+    for (int i = 0; i < route_count; i++) {
+        if (route_table[i].dest == dest && route_table[i].mask == mask) {
+            hal_irq_restore(flags);
+            return -1;
+        }
+    }
+    if (route_count >= ROUTE_TABLE_SIZE) {
+        hal_irq_restore(flags);
+        return -1;
+    }
+
+    route_t *r = &route_table[route_count++];
+    memset(r, 0, sizeof(*r));
+    r->dest    = dest;
+    r->mask    = mask;
+    r->gateway = gateway;
+    r->flags   = gateway ? ROUTE_F_GATEWAY : 0;
+    hal_irq_restore(flags);
+    return 0;
+}
+
+int route_del(uint32_t dest, uint32_t mask) {
+    uint32_t flags = hal_irq_save();
+    for (int i = 0; i < route_count; i++) {
+        if (route_table[i].dest == (dest & mask) &&
+            route_table[i].mask == mask) {
+            route_table[i] = route_table[--route_count];
+            hal_irq_restore(flags);
+            return 0;
+        }
+    }
+    hal_irq_restore(flags);
+    return -1;
+}
+
+int route_list(route_t *out, int max) {
+    route_t iface[4];
+
+    uint32_t flags = hal_irq_save();
+    int n = route_iface(iface);
+    int count = 0;
+    for (int i = 0; i < n + route_count && count < max; i++) {
+        out[count] = i < n ? iface[i] : route_table[i - n];
+        if (!(out[count].flags & ROUTE_F_IFACE))
+            out[count].src = net_cfg.ip;
+        out[count].dev = (out[count].flags & ROUTE_F_LOCAL) ? &loopback_nic
+                                                            : nic;
+        count++;
+    }
+    hal_irq_restore(flags);
+    return count;
+}
+
+void route_flush(void) {
+    route_init();
+}
@@ -0,0 +1,150 @@
+/*
+ * Packet buffer pool for SpikeOS.
+ *
+ * SKB_POOL_SIZE buffer descriptors on a free list, backed by page
+ * frames reached through the physmap (two 2 KB buffers per frame).
+ * Drivers with large RX rings add to it with skb_grow().
+ */
+
+#include <kernel/skb.h>
+#include <kernel/paging.h>
+#include <kernel/hal.h>
+#include <kernel/heap.h>
+#include <string.h>
+
+#define SKBS_PER_FRAME (PAGE_SIZE / SKB_BUF_SIZE)
+
+static sk_buff_t  skb_pool[SKB_POOL_SIZE];
+static sk_buff_t *skb_free_list;
+static uint32_t   skb_nfree;
+static uint32_t   skb_total;
+
+/* ------------------------------------------------------------------ */
+/*  Init                                                              */
+/* ------------------------------------------------------------------ */
+
+/* Back count descriptors with frames and put them on the free list */
+static int skb_add(sk_buff_t *skbs, uint32_t count) {
+    for (uint32_t i = 0; i < count; i += SKBS_PER_FRAME) {
+        uint32_t frame = alloc_frame();
+        if (frame == FRAME_ALLOC_FAIL) return -1;
+
+        for (uint32_t j = 0; j < SKBS_PER_FRAME && i + j < count; j++) {
+            sk_buff_t *skb = &skbs[i + j];
+            skb->phys = frame + j * SKB_BUF_SIZE;
+            skb->head = (uint8_t *)phys_to_virt(skb->phys);
+
+            uint32_t flags = hal_irq_save();
+            skb->next = skb_free_list;
+            skb_free_list = skb;
+            skb_nfree++;
+            skb_total++;
+            hal_irq_restore(flags);
+        }
+    }
+    return 0;
+}
+
+int skb_init(void) {
+    memset(skb_pool, 0, sizeof(skb_pool));
+    skb_free_list = (sk_buff_t *)0;
+    skb_nfree = 0;
+    skb_total = 0;
+    return skb_add(skb_pool, SKB_POOL_SIZE);
+}
+
+int skb_grow(uint32_t count) {
+    sk_buff_t *skbs = (sk_buff_t *)kcalloc(count, sizeof(sk_buff_t));
+    if (!skbs) return -1;
+    return skb_add(skbs, count);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Alloc / free                                                      */
+/* ------------------------------------------------------------------ */
+
+sk_buff_t *skb_alloc(uint16_t headroom) {
+    if (headroom > SKB_BUF_SIZE) return (sk_buff_t *)0;
+
+    uint32_t flags = hal_irq_save();
+    sk_buff_t *skb = skb_free_list;
+    if (skb) {
+        skb_free_list = skb->next;
+        skb_nfree--;
+    }
+    hal_irq_restore(flags);
+    if (!skb) return (sk_buff_t *)0;
+
+    skb->next     = (sk_buff_t *)0;
+    skb->data     = skb->head + headroom;
+    skb->len      = 0;
+    skb->refcount = 1;
+    skb->src_ip   = 0;
+    skb->dst_ip   = 0;
+    skb->src_port = 0;
+    skb->csum     = 0;
+    skb->frag_next = (sk_buff_t *)0;
+    skb->frag_off = 0;
+    skb->looped   = 0;
+    return skb;
+}
+
+void skb_get(sk_buff_t *skb) {
+    uint32_t flags = hal_irq_save();
+    skb->refcount++;
+    hal_irq_restore(flags);
+}
+
+void skb_free(sk_buff_t *skb) {
+    uint32_t flags = hal_irq_save();
+    /* The last reference to a buffer was also the one to the rest of
+       its chain */
+    while (skb && skb->refcount > 0 && --skb->refcount == 0) {
+        sk_buff_t *rest = skb->frag_next;
+        skb->frag_next = (sk_buff_t *)0;
+        skb->next = skb_free_list;
+        skb_free_list = skb;
+        skb_nfree++;
+        skb = rest;
+    }
+    hal_irq_restore(flags);
+}
+
+uint32_t skb_pool_free(void) {
+    return skb_nfree;
+}
+
+uint32_t skb_pool_size(void) {
+    return skb_total;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Data area                                                         */
+/* ------------------------------------------------------------------ */
+
+uint8_t *skb_push(sk_buff_t *skb, uint16_t n) {
+    if ((uint32_t)(skb->data - skb->head) < n) return (uint8_t *)0;
+    skb->data -= n;
+    skb->len  += n;
+    return skb->data;
+}
+
+uint8_t *skb_put(sk_buff_t *skb, uint16_t n) {
+    uint32_t end = (uint32_t)(skb->data - skb->head) + skb->len;
+    if (end + n > SKB_BUF_SIZE) return (uint8_t *)0;
+    uint8_t *tail = skb->data + skb->len;
+    skb->len += n;
+    return tail;
+}
+
+uint8_t *skb_pull(sk_buff_t *skb, uint16_t n) {
+    if (skb->len < n) return (uint8_t *)0;
+    skb->data += n;
+    skb->len  -= n;
+    return skb->data;
+}
+
+void skb_trim(sk_buff_t *skb, uint16_t len) {
+    if (skb->len > len)
+        skb->len = len;
+}
@@ -0,0 +1,1438 @@
+/*
+ * TCP for SpikeOS.
+ *
+ * Sockets come from a fixed table. Connections are found through a
+ * hash of (remote IP, remote port, local port); listeners sit on a
+ * list of their own. Each connection has a send ring, holding the bytes
+ * not yet acknowledged plus the ones not yet sent, and a receive ring
+ * whose free space is the window it offers.
+ *
+ * Sending follows Reno with the NewReno partial-ACK fix:
+ *   - slow start, then congestion avoidance on cwnd
+ *   - fast retransmit and recovery after three duplicate ACKs
+ *   - a retransmit timer from the smoothed RTT (Jacobson/Karels, Karn's
+ *     rule), backing off exponentially
+ * Small writes are coalesced (Nagle) unless TCP_NODELAY is set. ACKs
+ * for in-order data go out every second segment, or after
+ * TCP_DELACK_TICKS. A segment past a hole is dropped and answered with
+ * an immediate duplicate ACK, which is what triggers the sender's fast
+ * retransmit. There is no window scaling, SACK or timestamps; the only
+ * option sent or parsed is MSS.
+ *
+ * Every state change happens with interrupts off. Three contexts touch
+ * a socket:
+ *   - segments arrive on the net RX thread (net_rx)
+ *   - timers run on a kernel thread started with the first socket
+ *   - reads and writes come from process context
+ * Neither thread may call into the heap, which is not interrupt-safe.
+ * So connection buffers are allocated in process context
+ * (listen/accept/connect) and recycled through a free list.
+ */
+
+#include <kernel/net.h>
+#include <kernel/skb.h>
+#include <kernel/fd.h>
+#include <kernel/poll.h>
+#include <kernel/process.h>
+#include <kernel/timer.h>
+#include <kernel/heap.h>
+#include <kernel/hal.h>
+#include <kernel/wait.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TCP_HASH_SIZE      64     /* connection hash buckets (power of 2) */
+#define TCP_BUFS_SIZE      (TCP_SNDBUF + TCP_RCVBUF)
+#define TCP_DEFAULT_MSS    536    /* if the peer sends no MSS option */
+#define TCP_EPHEMERAL_LO   49152  /* first port tcp_connect picks */
+
+/* Timers, in ticks of the 100 Hz timer */
+#define TCP_RTO_INIT       100    /* 1 s, until the first RTT sample */
+#define TCP_RTO_MIN        20
+#define TCP_RTO_MAX        6000
+#define TCP_DELACK_TICKS   4      /* 40 ms */
+#define TCP_TIME_WAIT_TICKS 200   /* a short 2*MSL: frees slots sooner */
+#define TCP_FIN_WAIT_TICKS 6000   /* orphaned FIN_WAIT_2 gives up */
+#define TCP_MAX_RETRIES    8      /* timeouts in a row before a reset */
+
+enum {
+    TCP_CLOSED, TCP_LISTEN, TCP_SYN_SENT, TCP_SYN_RCVD, TCP_ESTABLISHED,
+    TCP_FIN_WAIT_1, TCP_FIN_WAIT_2, TCP_CLOSE_WAIT, TCP_CLOSING,
+    TCP_LAST_ACK, TCP_TIME_WAIT
+};
+
+typedef struct tcp_sock {
+    int       in_use;
+    int       state;
+    int       has_fd;        /* an open file refers to it */
+    int       hashed;        /* on the connection hash */
+    int       error;         /* reset, refused or timed out */
+    int       nodelay;       /* TCP_NODELAY */
+    uint32_t  local_ip;
+    uint32_t  remote_ip;
+    uint16_t  local_port;
+    uint16_t  remote_port;
+    uint16_t  mss;           /* largest segment the peer takes */
+    struct tcp_sock *hash_next;   /* hash chain, or listener list */
+
+    /* Listener: established connections not yet accepted */
+    struct tcp_sock *aq_head, *aq_tail;
+    int       backlog;
+    int       pending;       /* children in SYN_RCVD or queued */
+    /* Child: the listener it arrived on, until accepted */
+    struct tcp_sock *parent;
+    struct tcp_sock *aq_next;
+
+    uint8_t  *bufs;          /* send ring, then receive ring */
+
+    /* Send side */
+    uint32_t  iss, snd_una, snd_nxt, snd_max;
+    uint32_t  snd_wnd, snd_wl1, snd_wl2;
+    uint32_t  sb_seq;        /* sequence number of the oldest buffered byte */
+    uint32_t  sb_head;       /* its index in the ring */
+    uint32_t  sb_len;        /* bytes buffered: unacked + unsent */
+    int       fin_queued;    /* FIN goes after the buffered bytes */
+    uint32_t  cwnd, ssthresh;
+    uint32_t  recover;       /* snd_max when recovery started */
+    int       dupacks, in_recovery;
+
+    /* Receive side */
+    uint32_t  rcv_nxt;
+    uint32_t  rcv_adv;       /* right edge of the window last offered */
+    uint32_t  rb_head, rb_len;
+    int       fin_rcvd;
+    int       acks_owed;     /* segments taken since we last ACKed */
+
+    /* Timers: tick deadlines, 0 = off */
+    uint32_t  rto_at, delack_at, close_at;
+    int       persist;       /* rto_at is the zero-window probe */
+    uint32_t  rto;
+    uint32_t  srtt, rttvar;  /* scaled by 8 and 4; srtt 0 = no sample */
+    int       rtt_timing;
+    uint32_t  rtt_seq, rtt_start;
+    int       retries;
+    uint32_t  retrans;       /* TCP_RETRANS */
+
+    wait_queue_t rwq;        /* readers, accept */
+    wait_queue_t wwq;        /* writers, connect */
+} tcp_sock_t;
+
+static tcp_sock_t  tcp_socks[TCP_MAX_SOCKETS];
+static tcp_sock_t *tcp_hash[TCP_HASH_SIZE];
+static tcp_sock_t *tcp_listeners;
+static uint32_t    tcp_nsocks;
+
+static uint8_t    *bufs_free;      /* first word links to the next */
+static uint32_t    bufs_nfree;
+
+static uint16_t    next_ephemeral = TCP_EPHEMERAL_LO;
+static uint32_t    iss_counter;
+
+static struct process *timer_thread;
+static wait_queue_t    timer_wq = WAIT_QUEUE_INIT;
+
+static int (*tcp_out)(uint32_t, uint8_t, sk_buff_t *) = ip_send_skb;
+
+static void tcp_output(tcp_sock_t *s);
+
+/* ------------------------------------------------------------------ */
+/*  Helpers                                                           */
+/* ------------------------------------------------------------------ */
+
+/* Sequence number comparisons, modulo 2^32 */
+static inline int seq_lt(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+static inline int seq_le(uint32_t a, uint32_t b) { return (int32_t)(a - b) <= 0; }
+static inline int seq_gt(uint32_t a, uint32_t b) { return seq_lt(b, a); }
+static inline int seq_ge(uint32_t a, uint32_t b) { return seq_le(b, a); }
+
+static uint32_t ticks_from_now(uint32_t n) {
+    uint32_t t = timer_ticks() + n;
+    return t ? t : 1;
+}
+
+static int expired(uint32_t at, uint32_t now) {
+    return at && (int32_t)(now - at) >= 0;
+}
+
+static uint32_t min_u32(uint32_t a, uint32_t b) { return a < b ? a : b; }
+static uint32_t max_u32(uint32_t a, uint32_t b) { return a > b ? a : b; }
+
+static uint8_t *snd_ring(tcp_sock_t *s) { return s->bufs; }
+static uint8_t *rcv_ring(tcp_sock_t *s) { return s->bufs + TCP_SNDBUF; }
+
+static void ring_put(uint8_t *ring, uint32_t size, uint32_t pos,
+                     const uint8_t *src, uint32_t n) {
+    uint32_t first = min_u32(size - pos, n);
+    memcpy(ring + pos, src, first);
+    memcpy(ring, src + first, n - first);
+}
+
+static void ring_get(const uint8_t *ring, uint32_t size, uint32_t pos,
+                     uint8_t *dst, uint32_t n) {
+    uint32_t first = min_u32(size - pos, n);
+    memcpy(dst, ring + pos, first);
+    memcpy(dst + first, ring, n - first);
+}
+
+static uint32_t new_iss(void) {
+    iss_counter += 64000;
+    return (timer_usecs() << 2) ^ iss_counter;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Connection buffers                                                */
+/* ------------------------------------------------------------------ */
+
+static void bufs_put(uint8_t *b) {
+    *(uint8_t **)b = bufs_free;
+    bufs_free = b;
+    bufs_nfree++;
+}
+
+static uint8_t *bufs_get(void) {
+    uint8_t *b = bufs_free;
+    if (b) {
+        bufs_free = *(uint8_t **)b;
+        bufs_nfree--;
+    }
+    return b;
+}
+
+/* Top the free list up to n buffer sets (process context only) */
+static void bufs_reserve(uint32_t n) {
+    for (;;) {
+        uint32_t flags = hal_irq_save();
+        int enough = bufs_nfree >= n;
+        hal_irq_restore(flags);
+        if (enough) return;
+
+        uint8_t *b = (uint8_t *)kmalloc(TCP_BUFS_SIZE);
+        if (!b) return;
+        flags = hal_irq_save();
+        bufs_put(b);
+        hal_irq_restore(flags);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Socket table (interrupts off)                                     */
+/* ------------------------------------------------------------------ */
+
+static uint32_t tcp_hashfn(uint32_t ip, uint16_t rport, uint16_t lport) {
+    uint32_t h = ip ^ ((uint32_t)rport << 16) ^ lport;
+    h ^= h >> 16;
+    h ^= h >> 8;
+    return h & (TCP_HASH_SIZE - 1);
+}
+
+static void hash_add(tcp_sock_t *s) {
+    uint32_t b = tcp_hashfn(s->remote_ip, s->remote_port, s->local_port);
+    s->hash_next = tcp_hash[b];
+    tcp_hash[b] = s;
+    s->hashed = 1;
+}
+
+static void hash_del(tcp_sock_t *s) {
+    if (!s->hashed) return;
+    uint32_t b = tcp_hashfn(s->remote_ip, s->remote_port, s->local_port);
+    tcp_sock_t **pp = &tcp_hash[b];
+    while (*pp && *pp != s)
+        pp = &(*pp)->hash_next;
+    if (*pp)
+        *pp = s->hash_next;
+    s->hashed = 0;
+}
+
+static tcp_sock_t *hash_find(uint32_t ip, uint16_t rport, uint16_t lport) {
+    tcp_sock_t *s = tcp_hash[tcp_hashfn(ip, rport, lport)];
+    for (; s; s = s->hash_next) {
+        if (s->remote_ip == ip && s->remote_port == rport &&
+            s->local_port == lport)
+            return s;
+    }
+    return NULL;
+}
+
+static tcp_sock_t *listener_find(uint16_t port) {
+    for (tcp_sock_t *l = tcp_listeners; l; l = l->hash_next) {
+        if (l->local_port == port) return l;
+    }
+    return NULL;
+}
+
+static void listener_del(tcp_sock_t *l) {
+    tcp_sock_t **pp = &tcp_listeners;
+    while (*pp && *pp != l)
+        pp = &(*pp)->hash_next;
+    if (*pp)
+        *pp = l->hash_next;
+}
+
+static int port_in_use(uint16_t port) {
+    for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
+        if (tcp_socks[i].in_use && tcp_socks[i].local_port == port)
+            return 1;
+    }
+    return 0;
+}
+
+static uint16_t ephemeral_port(void) {
+    for (uint32_t tries = 0; tries < 65536 - TCP_EPHEMERAL_LO; tries++) {
+        uint16_t p = next_ephemeral++;
+        if (next_ephemeral == 0)
+            next_ephemeral = TCP_EPHEMERAL_LO;
+        if (!port_in_use(p)) return p;
+    }
+    return 0;
+}
+
+static tcp_sock_t *sock_alloc(void) {
+    for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
+        tcp_sock_t *s = &tcp_socks[i];
+        if (s->in_use) continue;
+
+        memset(s, 0, sizeof(*s));
+        s->in_use   = 1;
+        s->state    = TCP_CLOSED;
+        s->mss      = TCP_DEFAULT_MSS;
+        s->rto      = TCP_RTO_INIT;
+        s->ssthresh = 65535;
+        if (tcp_nsocks++ == 0)
+            wake_up_one(&timer_wq);
+        return s;
+    }
+    return NULL;
+}
+
+/* A child leaves its listener: accepted, reset or timed out */
+static void child_detach(tcp_sock_t *s) {
+    tcp_sock_t *l = s->parent;
+    if (!l) return;
+
+    tcp_sock_t **pp = &l->aq_head;
+    tcp_sock_t *prev = NULL;
+    while (*pp && *pp != s) {
+        prev = *pp;
+        pp = &(*pp)->aq_next;
+    }
+    if (*pp) {
+        *pp = s->aq_next;
+        if (l->aq_tail == s)
+            l->aq_tail = prev;
+    }
+    s->aq_next = NULL;
+    s->parent = NULL;
+    l->pending--;
+}
+
+static void sock_free(tcp_sock_t *s) {
+    hash_del(s);
+    child_detach(s);
+    if (s->bufs)
+        bufs_put(s->bufs);
+    s->bufs = NULL;
+    s->in_use = 0;
+    tcp_nsocks--;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Segment output (interrupts off)                                   */
+/* ------------------------------------------------------------------ */
+
+static uint16_t tcp_checksum(uint32_t src, uint32_t dst,
+                             const void *seg, uint32_t len) {
+    return ip_csum_fold(ip_csum_add(ip_pseudo_sum(src, dst, IP_PROTO_TCP,
+                                                  (uint16_t)len),
+                                    seg, len));
+}
+
+/* Window to offer: the free receive space, but never a sliver smaller
+   than a segment (receiver-side SWS avoidance), and never pulling back
+   the right edge already offered */
+static uint32_t rcv_window(tcp_sock_t *s) {
+    uint32_t w = TCP_RCVBUF - s->rb_len;
+    if (w < s->mss && w < TCP_RCVBUF / 4)
+        w = 0;
+    if (seq_gt(s->rcv_adv, s->rcv_nxt))
+        w = max_u32(w, s->rcv_adv - s->rcv_nxt);
+    return min_u32(w, 65535);
+}
+
+/* Build and send one segment carrying 'len' buffered bytes starting at
+   sequence number 'seq'. Returns 0 or -1. */
+static int tcp_xmit(tcp_sock_t *s, uint32_t seq, uint32_t len, uint8_t flags) {
+    sk_buff_t *skb = skb_alloc(SKB_HEADROOM);
+    if (!skb) return -1;
+
+    if (len) {
+        uint32_t pos = (s->sb_head + (seq - s->sb_seq)) % TCP_SNDBUF;
+        ring_get(snd_ring(s), TCP_SNDBUF, pos, skb_put(skb, (uint16_t)len), len);
+        net_stats.tx_copies++;
+    }
+
+    uint16_t hlen = sizeof(tcp_header_t) + ((flags & TCP_SYN) ? 4 : 0);
+    tcp_header_t *th = (tcp_header_t *)skb_push(skb, hlen);
+    uint32_t wnd = rcv_window(s);
+    th->src_port = htons(s->local_port);
+    th->dst_port = htons(s->remote_port);
+    th->seq      = htonl(seq);
+    th->ack      = (flags & TCP_ACK) ? htonl(s->rcv_nxt) : 0;
+    th->off      = (uint8_t)((hlen / 4) << 4);
+    th->flags    = flags;
+    th->window   = htons((uint16_t)wnd);
+    th->checksum = 0;
+    th->urgent   = 0;
+    if (flags & TCP_SYN) {
+        uint8_t *opt = (uint8_t *)(th + 1);
+        opt[0] = 2;                     /* MSS */
+        opt[1] = 4;
+        opt[2] = (uint8_t)(TCP_MSS >> 8);
+        opt[3] = (uint8_t)(TCP_MSS & 0xFF);
+    }
+
+    /* Seeded with the pseudo-header; the NIC (or eth_send_skb) sums
+       the rest */
+    th->checksum = (uint16_t)ip_pseudo_sum(s->local_ip, s->remote_ip,
+                                           IP_PROTO_TCP, skb->len);
+    skb->csum        = SKB_CSUM_L4;
+    skb->csum_start  = (uint16_t)(skb->data - skb->head);
+    skb->csum_offset = 16;
+
+    if (flags & TCP_ACK) {
+        s->rcv_adv   = s->rcv_nxt + wnd;
+        s->acks_owed = 0;
+        s->delack_at = 0;
+    }
+
+    /* ARP may briefly enable interrupts; put them back as they were */
+    uint32_t irq = hal_irq_save();
+    int ret = tcp_out(s->remote_ip, IP_PROTO_TCP, skb);
+    hal_irq_restore(irq);
+    return ret;
+}
+
+static void tcp_ack_now(tcp_sock_t *s) {
+    tcp_xmit(s, s->snd_nxt, 0, TCP_ACK);
+}
+
+/* Reset in answer to a segment that has no connection to go to */
+static void tcp_reply_rst(uint32_t local_ip, uint32_t remote_ip,
+                          uint16_t lport, uint16_t rport,
+                          uint32_t seq, uint32_t ack, uint8_t flags,
+                          uint32_t seg_len) {
+    if (flags & TCP_RST) return;
+
+    tcp_sock_t tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.local_ip    = local_ip;
+    tmp.remote_ip   = remote_ip;
+    tmp.local_port  = lport;
+    tmp.remote_port = rport;
+    tmp.mss         = TCP_DEFAULT_MSS;
+    tmp.rb_len      = TCP_RCVBUF;        /* offer a zero window */
+
+    if (flags & TCP_ACK) {
+        tcp_xmit(&tmp, ack, 0, TCP_RST);
+    } else {
+        tmp.rcv_nxt = seq + seg_len;
+        tmp.rcv_adv = tmp.rcv_nxt;
+        tcp_xmit(&tmp, 0, 0, TCP_RST | TCP_ACK);
+    }
+}
+
+static void rto_arm(tcp_sock_t *s) {
+    s->rto_at  = ticks_from_now(s->rto);
+    s->persist = 0;
+}
+
+/* Initial window, RFC 3390 */
+static void cwnd_init(tcp_sock_t *s) {
+    s->cwnd = min_u32(4u * s->mss, max_u32(2u * s->mss, 4380));
+}
+
+/* The MSS, or less if the path MTU has been found to be smaller */
+static uint32_t tcp_seg_max(tcp_sock_t *s) {
+    return min_u32(s->mss, ip_path_mtu(s->remote_ip) - 20 -
+                           sizeof(tcp_header_t));
+}
+
+/*
+ * Send whatever the windows allow: new data from snd_nxt, then the FIN
+ * once everything before it has gone. A segment smaller than the MSS
+ * waits while anything is unacknowledged, unless TCP_NODELAY is set or
+ * it ends a write (Nagle); it also waits if only the window is holding
+ * it back, so a slowly opening window isn't filled with slivers.
+ */
+static void tcp_output(tcp_sock_t *s) {
+    switch (s->state) {
+    case TCP_ESTABLISHED: case TCP_CLOSE_WAIT:
+    case TCP_FIN_WAIT_1:  case TCP_CLOSING: case TCP_LAST_ACK:
+        break;
+    default:
+        return;
+    }
+
+    /* Every segment the window allows, then one doorbell */
+    uint32_t mss = tcp_seg_max(s);
+    net_tx_hold();
+    for (;;) {
+        uint32_t data_end = s->sb_seq + s->sb_len;
+        uint32_t unsent = seq_lt(s->snd_nxt, data_end) ? data_end - s->snd_nxt : 0;
+        uint32_t wnd    = min_u32(s->snd_wnd, s->cwnd);
+        uint32_t flight = s->snd_nxt - s->snd_una;
+        uint32_t usable = wnd > flight ? wnd - flight : 0;
+        uint32_t len    = min_u32(min_u32(unsent, mss), usable);
+
+        int fin = s->fin_queued && len == unsent && seq_le(s->snd_nxt, data_end);
+        if (!len && !fin) break;
+        if (!fin && len < mss && flight) {
+            if (len < unsent) break;            /* window-limited sliver */
+            if (!s->nodelay) break;             /* Nagle */
+        }
+
+        uint8_t flags = TCP_ACK;
+        if (fin) flags |= TCP_FIN;
+        if (len && len == unsent) flags |= TCP_PSH;
+        if (tcp_xmit(s, s->snd_nxt, len, flags) < 0) {
+            if (!s->rto_at) rto_arm(s);         /* try again on the timer */
+            break;
+        }
+
+        /* Time one segment per round trip, never a resent one (Karn) */
+        if (!s->rtt_timing && len && s->snd_nxt == s->snd_max) {
+            s->rtt_timing = 1;
+            s->rtt_seq    = s->snd_nxt + len;
+            s->rtt_start  = timer_ticks();
+        }
+        s->snd_nxt += len + (fin ? 1 : 0);
+        if (seq_gt(s->snd_nxt, s->snd_max))
+            s->snd_max = s->snd_nxt;
+        if (!s->rto_at || s->persist)
+            rto_arm(s);
+        if (fin) break;
+    }
+    net_tx_release();
+
+    /* Data waiting, nothing in flight and a zero window: probe it */
+    if (s->snd_nxt == s->snd_una && !s->snd_wnd && !s->rto_at &&
+        seq_lt(s->snd_nxt, s->sb_seq + s->sb_len)) {
+        s->rto_at  = ticks_from_now(s->rto);
+        s->persist = 1;
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Connection teardown (interrupts off)                              */
+/* ------------------------------------------------------------------ */
+
+/* The connection is over: wake everyone, and free it unless an fd
+   still refers to it (reads then see EOF, or an error if 'err') */
+static void tcp_drop(tcp_sock_t *s, int err) {
+    if (err) s->error = 1;
+    s->state = TCP_CLOSED;
+    s->rto_at = s->delack_at = s->close_at = 0;
+    hash_del(s);
+    child_detach(s);
+    wake_up_all(&s->rwq);
+    wake_up_all(&s->wwq);
+    if (!s->has_fd)
+        sock_free(s);
+}
+
+static void tcp_abort(tcp_sock_t *s) {
+    if (s->state >= TCP_SYN_RCVD && s->state != TCP_TIME_WAIT)
+        tcp_xmit(s, s->snd_nxt, 0, TCP_RST | TCP_ACK);
+    tcp_drop(s, 1);
+}
+
+/* Our FIN has been sent and acknowledged */
+static int fin_acked(tcp_sock_t *s) {
+    return s->fin_queued && s->snd_una == s->sb_seq + s->sb_len + 1;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Input (interrupts off)                                            */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    uint32_t local_ip, remote_ip;
+    uint16_t lport, rport;
+    uint32_t seq, ack;
+    uint16_t wnd;
+    uint16_t mss;
+    uint8_t  flags;
+} tcp_seg_t;
+
+static uint16_t parse_mss(const tcp_header_t *th, uint32_t hlen) {
+    const uint8_t *o   = (const uint8_t *)(th + 1);
+    const uint8_t *end = (const uint8_t *)th + hlen;
+
+    while (o < end) {
+        if (o[0] == 0) break;                   /* end of options */
+        if (o[0] == 1) { o++; continue; }       /* NOP */
+        if (o + 1 >= end || o[1] < 2 || o + o[1] > end) break;
+        if (o[0] == 2 && o[1] == 4) {
+            uint32_t mss = ((uint32_t)o[2] << 8) | o[3];
+            if (mss > TCP_MSS) mss = TCP_MSS;
+            if (mss < 64) mss = 64;
+            return (uint16_t)mss;
+        }
+        o += o[1];
+    }
+    return TCP_DEFAULT_MSS;
+}
+
+static void rtt_sample(tcp_sock_t *s, uint32_t m) {
+    if (!s->srtt) {
+        s->srtt   = max_u32(m, 1) << 3;
+        s->rttvar = m << 1;
+    } else {
+        int32_t err = (int32_t)m - (int32_t)(s->srtt >> 3);
+        s->srtt += err;
+        if ((int32_t)s->srtt <= 0) s->srtt = 1;
+        if (err < 0) err = -err;
+        s->rttvar += err - (s->rttvar >> 2);
+    }
+}
+
+static void rto_update(tcp_sock_t *s) {
+    if (!s->srtt) return;
+    uint32_t rto = (s->srtt >> 3) + s->rttvar;
+    s->rto = min_u32(max_u32(rto, TCP_RTO_MIN), TCP_RTO_MAX);
+}
+
+/* Resend one segment from snd_una (fast retransmit, partial ACK) */
+static void retransmit_head(tcp_sock_t *s) {
+    uint32_t data_end = s->sb_seq + s->sb_len;
+    uint32_t len = seq_lt(s->snd_una, data_end) ? data_end - s->snd_una : 0;
+    len = min_u32(len, tcp_seg_max(s));
+    int fin = s->fin_queued && s->snd_una + len == data_end &&
+              seq_gt(s->snd_max, data_end);
+
+    if (len || fin)
+        tcp_xmit(s, s->snd_una, len, TCP_ACK | (fin ? TCP_FIN : 0));
+    s->rtt_timing = 0;
+    s->retrans++;
+    rto_arm(s);
+}
+
+/* Process the ACK field and window. Returns -1 if the segment
+   acknowledges something never sent (it is then dropped). */
+static int tcp_ack(tcp_sock_t *s, tcp_seg_t *g, uint32_t seg_len) {
+    uint32_t ack = g->ack;
+    if (seq_gt(ack, s->snd_max)) {
+        tcp_ack_now(s);
+        return -1;
+    }
+
+    uint32_t old_wnd = s->snd_wnd;
+    if (seq_lt(s->snd_wl1, g->seq) ||
+        (s->snd_wl1 == g->seq && seq_le(s->snd_wl2, ack))) {
+        s->snd_wnd = g->wnd;
+        s->snd_wl1 = g->seq;
+        s->snd_wl2 = ack;
+        if (s->persist && s->snd_wnd) {
+            s->persist = 0;
+            s->rto_at  = 0;
+        }
+    }
+
+    if (seq_le(ack, s->snd_una)) {
+        /* Duplicate: the peer got something past a hole */
+        if (ack == s->snd_una && !seg_len && g->wnd == old_wnd &&
+            s->snd_max != s->snd_una) {
+            s->dupacks++;
+            if (s->dupacks == 3 && !s->in_recovery) {
+                uint32_t flight = s->snd_max - s->snd_una;
+                s->ssthresh = max_u32(flight / 2, 2u * s->mss);
+                s->recover  = s->snd_max;
+                s->in_recovery = 1;
+                retransmit_head(s);
+                s->cwnd = s->ssthresh + 3u * s->mss;
+                net_stats.tcp_fast_retrans++;
+            } else if (s->in_recovery) {
+                s->cwnd += s->mss;              /* one more left the network */
+            }
+        }
+        return 0;
+    }
+
+    /* New data acknowledged */
+    uint32_t acked = ack - s->snd_una;
+    if (s->rtt_timing && seq_ge(ack, s->rtt_seq)) {
+        rtt_sample(s, timer_ticks() - s->rtt_start);
+        s->rtt_timing = 0;
+    }
+    rto_update(s);
+
+    uint32_t data_end = s->sb_seq + s->sb_len;
+    uint32_t upto = seq_lt(ack, data_end) ? ack : data_end;
+    if (seq_gt(upto, s->sb_seq)) {
+        uint32_t n = upto - s->sb_seq;
+        s->sb_head = (s->sb_head + n) % TCP_SNDBUF;
+        s->sb_len -= n;
+        s->sb_seq  = upto;
+        wake_up_all(&s->wwq);
+    }
+    s->snd_una = ack;
+    if (seq_lt(s->snd_nxt, s->snd_una))
+        s->snd_nxt = s->snd_una;
+    s->retries = 0;
+
+    if (s->in_recovery) {
+        if (seq_ge(ack, s->recover)) {
+            s->in_recovery = 0;
+            s->cwnd = s->ssthresh;
+        } else {
+            /* Partial ACK: the next hole is lost too */
+            retransmit_head(s);
+            s->cwnd -= min_u32(acked, s->cwnd);
+            s->cwnd += s->mss;
+        }
+    } else if (s->cwnd < s->ssthresh) {
+        s->cwnd += min_u32(acked, s->mss);
+    } else {
+        s->cwnd += max_u32(s->mss * s->mss / s->cwnd, 1);
+    }
+    s->dupacks = 0;
+
+    if (s->snd_una == s->snd_max)
+        s->rto_at = 0;
+    else if (!s->persist)
+        rto_arm(s);
+    return 0;
+}
+
+/* Take in-order payload and a FIN; out-of-order data is dropped and
+   answered with a duplicate ACK */
+static void tcp_data(tcp_sock_t *s, tcp_seg_t *g, sk_buff_t *skb) {
+    uint32_t seq = g->seq;
+    uint32_t len = skb->len;
+    int fin = (g->flags & TCP_FIN) != 0;
+
+    if (seq_lt(seq, s->rcv_nxt)) {              /* trim what we have */
+        uint32_t dup = s->rcv_nxt - seq;
+        if (dup > len) dup = len;
+        skb_pull(skb, (uint16_t)dup);
+        seq += dup;
+        len -= dup;
+    }
+    if (seq != s->rcv_nxt) {
+        tcp_ack_now(s);
+        return;
+    }
+
+    if (len) {
+        uint32_t n = min_u32(len, TCP_RCVBUF - s->rb_len);
+        ring_put(rcv_ring(s), TCP_RCVBUF, (s->rb_head + s->rb_len) % TCP_RCVBUF,
+                 skb->data, n);
+        net_stats.rx_copies++;
+        s->rb_len  += n;
+        s->rcv_nxt += n;
+        if (n < len) fin = 0;                   /* FIN is past what we took */
+        wake_up_all(&s->rwq);
+
+        if (++s->acks_owed >= 2 || n < len)
+            tcp_ack_now(s);
+        else if (!s->delack_at)
+            s->delack_at = ticks_from_now(TCP_DELACK_TICKS);
+    }
+
+    if (!fin) return;
+
+    s->rcv_nxt++;
+    s->fin_rcvd = 1;
+    wake_up_all(&s->rwq);
+    tcp_ack_now(s);
+
+    switch (s->state) {
+    case TCP_ESTABLISHED:
+        s->state = TCP_CLOSE_WAIT;
+        break;
+    case TCP_FIN_WAIT_1:
+        s->state = TCP_CLOSING;
+        break;
+    case TCP_FIN_WAIT_2:
+        s->state = TCP_TIME_WAIT;
+        s->close_at = ticks_from_now(TCP_TIME_WAIT_TICKS);
+        break;
+    }
+}
+
+/* Segment for our SYN */
+static void tcp_syn_sent_input(tcp_sock_t *s, tcp_seg_t *g, uint32_t seg_len) {
+    uint8_t flags = g->flags;
+
+    if ((flags & TCP_ACK) &&
+        (seq_le(g->ack, s->iss) || seq_gt(g->ack, s->snd_max))) {
+        tcp_reply_rst(g->local_ip, g->remote_ip, g->lport, g->rport,
+                      g->seq, g->ack, flags, seg_len);
+        return;
+    }
+    if (flags & TCP_RST) {
+        if (flags & TCP_ACK)
+            tcp_drop(s, 1);                     /* connection refused */
+        return;
+    }
+    if (!(flags & TCP_SYN)) return;
+
+    s->rcv_nxt = g->seq + 1;
+    s->rcv_adv = s->rcv_nxt;
+    s->mss     = g->mss;
+    s->snd_wnd = g->wnd;
+    s->snd_wl1 = g->seq;
+
+    if (!(flags & TCP_ACK)) {
+        /* Simultaneous open */
+        s->state = TCP_SYN_RCVD;
+        tcp_xmit(s, s->iss, 0, TCP_SYN | TCP_ACK);
+        rto_arm(s);
+        return;
+    }
+
+    if (s->rtt_timing && s->retries == 0)
+        rtt_sample(s, timer_ticks() - s->rtt_start);
+    s->rtt_timing = 0;
+    rto_update(s);
+
+    s->snd_una = g->ack;
+    s->snd_wl2 = g->ack;
+    s->state   = TCP_ESTABLISHED;
+    s->rto_at  = 0;
+    s->retries = 0;
+    cwnd_init(s);
+    tcp_ack_now(s);
+    wake_up_all(&s->wwq);
+    wake_up_all(&s->rwq);
+    tcp_output(s);
+}
+
+/* SYN for a listener: start a child in SYN_RCVD */
+static void tcp_listen_input(tcp_sock_t *l, tcp_seg_t *g, uint32_t seg_len) {
+    if (g->flags & TCP_RST) return;
+    if (g->flags & TCP_ACK) {
+        tcp_reply_rst(g->local_ip, g->remote_ip, g->lport, g->rport,
+                      g->seq, g->ack, g->flags, seg_len);
+        return;
+    }
+    if (!(g->flags & TCP_SYN)) return;
+    if (l->pending >= l->backlog) return;       /* the peer resends its SYN */
+
+    tcp_sock_t *c = sock_alloc();
+    if (!c) return;
+    c->bufs = bufs_get();
+    if (!c->bufs) {
+        sock_free(c);
+        return;
+    }
+
+    c->local_ip    = g->local_ip;
+    c->remote_ip   = g->remote_ip;
+    c->local_port  = g->lport;
+    c->remote_port = g->rport;
+    c->mss         = g->mss;
+    c->nodelay     = l->nodelay;
+    c->rcv_nxt     = g->seq + 1;
+    c->rcv_adv     = c->rcv_nxt;
+    c->iss         = new_iss();
+    c->snd_una     = c->iss;
+    c->snd_nxt     = c->iss + 1;
+    c->snd_max     = c->snd_nxt;
+    c->sb_seq      = c->iss + 1;
+    c->snd_wnd     = g->wnd;
+    c->snd_wl1     = g->seq;
+    c->snd_wl2     = c->iss;
+    c->state       = TCP_SYN_RCVD;
+    c->parent      = l;
+    l->pending++;
+    hash_add(c);
+
+    tcp_xmit(c, c->iss, 0, TCP_SYN | TCP_ACK);
+    c->rtt_timing = 1;
+    c->rtt_seq    = c->iss + 1;
+    c->rtt_start  = timer_ticks();
+    rto_arm(c);
+}
+
+/* Handshake done on a child: queue it for accept */
+static void tcp_child_established(tcp_sock_t *s) {
+    tcp_sock_t *l = s->parent;
+    cwnd_init(s);
+    if (!l) return;
+
+    s->aq_next = NULL;
+    if (l->aq_tail)
+        l->aq_tail->aq_next = s;
+    else
+        l->aq_head = s;
+    l->aq_tail = s;
+    wake_up_all(&l->rwq);
+}
+
+static void tcp_input(tcp_sock_t *s, tcp_seg_t *g, sk_buff_t *skb) {
+    uint8_t  flags   = g->flags;
+    uint32_t seg_len = skb->len + ((flags & TCP_FIN) ? 1 : 0);
+
+    if (s->state == TCP_SYN_SENT) {
+        tcp_syn_sent_input(s, g, seg_len);
+        return;
+    }
+
+    /* Our SYN-ACK was lost and the peer resent its SYN */
+    if (s->state == TCP_SYN_RCVD && (flags & TCP_SYN) &&
+        g->seq == s->rcv_nxt - 1) {
+        tcp_xmit(s, s->iss, 0, TCP_SYN | TCP_ACK);
+        return;
+    }
+
+    /* Is any of it inside the receive window? */
+    uint32_t wnd = TCP_RCVBUF - s->rb_len;
+    int ok;
+    if (seg_len == 0)
+        ok = g->seq == s->rcv_nxt ||
+             (seq_gt(g->seq, s->rcv_nxt) && seq_lt(g->seq, s->rcv_nxt + wnd));
+    else
+        ok = seq_gt(g->seq + seg_len, s->rcv_nxt) &&
+             seq_lt(g->seq, s->rcv_nxt + (wnd ? wnd : 1));
+    if (!ok) {
+        if (!(flags & TCP_RST)) tcp_ack_now(s);
+        return;
+    }
+
+    /* Resets and SYNs only count exactly at rcv_nxt; anything else in
+       the window just gets an ACK (RFC 5961) */
+    if (flags & TCP_RST) {
+        if (g->seq == s->rcv_nxt)
+            tcp_drop(s, s->state != TCP_TIME_WAIT);
+        else
+            tcp_ack_now(s);
+        return;
+    }
+    if (flags & TCP_SYN) {
+        tcp_ack_now(s);
+        return;
+    }
+    if (!(flags & TCP_ACK)) return;
+
+    if (s->state == TCP_SYN_RCVD) {
+        if (seq_le(g->ack, s->snd_una) || seq_gt(g->ack, s->snd_max)) {
+            tcp_reply_rst(g->local_ip, g->remote_ip, g->lport, g->rport,
+                          g->seq, g->ack, flags, seg_len);
+            return;
+        }
+        s->state   = TCP_ESTABLISHED;
+        s->snd_wnd = g->wnd;
+        s->snd_wl1 = g->seq;
+        s->snd_wl2 = g->ack;
+        tcp_child_established(s);
+        wake_up_all(&s->wwq);
+    }
+
+    if (tcp_ack(s, g, skb->len) < 0) return;
+
+    if (fin_acked(s)) {
+        switch (s->state) {
+        case TCP_FIN_WAIT_1:
+            s->state = TCP_FIN_WAIT_2;
+            s->close_at = ticks_from_now(TCP_FIN_WAIT_TICKS);
+            break;
+        case TCP_CLOSING:
+            s->state = TCP_TIME_WAIT;
+            s->close_at = ticks_from_now(TCP_TIME_WAIT_TICKS);
+            break;
+        case TCP_LAST_ACK:
+            tcp_drop(s, 0);
+            return;
+        }
+    }
+
+    switch (s->state) {
+    case TCP_ESTABLISHED: case TCP_FIN_WAIT_1: case TCP_FIN_WAIT_2:
+        if (skb->len || (flags & TCP_FIN))
+            tcp_data(s, g, skb);
+        break;
+    }
+
+    tcp_output(s);
+}
+
+void tcp_handle(sk_buff_t *skb) {
+    if (skb->len < sizeof(tcp_header_t)) return;
+
+    tcp_header_t *th = (tcp_header_t *)skb->data;
+    uint32_t hlen = (uint32_t)(th->off >> 4) * 4;
+    if (hlen < sizeof(tcp_header_t) || hlen > skb->len) return;
+    if (!(skb->csum & SKB_CSUM_L4) &&
+        tcp_checksum(skb->src_ip, skb->dst_ip, th, skb->len) != 0) return;
+
+    tcp_seg_t g;
+    g.local_ip  = skb->dst_ip;
+    g.remote_ip = skb->src_ip;
+    g.lport     = ntohs(th->dst_port);
+    g.rport     = ntohs(th->src_port);
+    g.seq       = ntohl(th->seq);
+    g.ack       = ntohl(th->ack);
+    g.wnd       = ntohs(th->window);
+    g.flags     = th->flags;
+    g.mss       = parse_mss(th, hlen);
+    skb->src_port = g.rport;
+    skb_pull(skb, (uint16_t)hlen);
+
+    uint32_t irq = hal_irq_save();
+    tcp_sock_t *s = hash_find(g.remote_ip, g.rport, g.lport);
+    if (s) {
+        tcp_input(s, &g, skb);
+    } else {
+        tcp_sock_t *l = listener_find(g.lport);
+        uint32_t seg_len = skb->len + ((g.flags & TCP_SYN) ? 1 : 0) +
+                           ((g.flags & TCP_FIN) ? 1 : 0);
+        if (l)
+            tcp_listen_input(l, &g, seg_len);
+        else
+            tcp_reply_rst(g.local_ip, g.remote_ip, g.lport, g.rport,
+                          g.seq, g.ack, g.flags, seg_len);
+    }
+    hal_irq_restore(irq);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Timers                                                            */
+/* ------------------------------------------------------------------ */
+
+static void tcp_timeout(tcp_sock_t *s) {
+    s->rto_at = 0;
+
+    if (s->persist) {
+        /* Window probe: a byte-old ACK makes the peer restate its window.
+           Probes go on for as long as the window stays shut. */
+        tcp_xmit(s, s->snd_una - 1, 0, TCP_ACK);
+        s->rto = min_u32(s->rto * 2, TCP_RTO_MAX);
+        s->rto_at  = ticks_from_now(s->rto);
+        s->persist = 1;
+        return;
+    }
+
+    if (++s->retries > TCP_MAX_RETRIES) {
+        tcp_abort(s);
+        return;
+    }
+    s->rto = min_u32(s->rto * 2, TCP_RTO_MAX);
+    s->rtt_timing = 0;
+    s->retrans++;
+    net_stats.tcp_retrans++;
+
+    if (s->state == TCP_SYN_SENT || s->state == TCP_SYN_RCVD) {
+        uint8_t flags = TCP_SYN | (s->state == TCP_SYN_RCVD ? TCP_ACK : 0);
+        tcp_xmit(s, s->iss, 0, flags);
+        rto_arm(s);
+        return;
+    }
+
+    /* Go back to the oldest unacknowledged byte with one segment's
+       worth of window, and slow-start from there */
+    uint32_t flight = s->snd_max - s->snd_una;
+    s->ssthresh = max_u32(flight / 2, 2u * s->mss);
+    s->cwnd = s->mss;
+    s->in_recovery = 0;
+    s->dupacks = 0;
+    s->snd_nxt = s->snd_una;
+    tcp_output(s);
+    if (!s->rto_at && s->snd_una != s->snd_max)
+        rto_arm(s);
+}
+
+static void tcp_timers(void) {
+    uint32_t irq = hal_irq_save();
+    uint32_t now = timer_ticks();
+    net_tx_hold();
+
+    for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
+        tcp_sock_t *s = &tcp_socks[i];
+        if (!s->in_use) continue;
+
+        if (expired(s->delack_at, now)) {
+            s->delack_at = 0;
+            if (s->acks_owed) tcp_ack_now(s);
+        }
+        if (expired(s->rto_at, now))
+            tcp_timeout(s);
+        if (s->in_use && expired(s->close_at, now)) {
+            s->close_at = 0;
+            if (s->state == TCP_TIME_WAIT || s->state == TCP_FIN_WAIT_2)
+                tcp_drop(s, 0);
+        }
+    }
+    net_tx_release();
+    hal_irq_restore(irq);
+}
+
+/* Run the timers once a tick while any socket exists. Like sys_sleep
+   it idles on HLT between ticks. */
+static void tcp_timer_worker(void) {
+    for (;;) {
+        uint32_t irq = hal_irq_save();
+        if (!tcp_nsocks)
+            sleep_on(&timer_wq);
+        hal_irq_restore(irq);
+
+        uint32_t next = timer_ticks() + 1;
+        while ((int32_t)(timer_ticks() - next) < 0) {
+            hal_irq_enable();
+            hal_halt();
+        }
+        tcp_timers();
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Socket API                                                        */
+/* ------------------------------------------------------------------ */
+
+void tcp_init(void) {
+    memset(tcp_socks, 0, sizeof(tcp_socks));
+    memset(tcp_hash, 0, sizeof(tcp_hash));
+    tcp_listeners = NULL;
+    tcp_nsocks = 0;
+    tcp_out = ip_send_skb;
+}
+
+void tcp_set_output(int (*fn)(uint32_t, uint8_t, sk_buff_t *)) {
+    tcp_out = fn ? fn : ip_send_skb;
+}
+
+uint32_t tcp_socket_count(void) {
+    return tcp_nsocks;
+}
+
+static tcp_sock_t *tcp_from_fd(int fd, open_file_t **ofp) {
+    open_file_t *of = fd_file(fd);
+    if (!of || of->type != FD_TYPE_TCP || !of->tcp) return NULL;
+    if (ofp) *ofp = of;
+    return of->tcp;
+}
+
+/* Put a socket behind a new fd. On failure the socket is released. */
+static int tcp_new_fd(tcp_sock_t *s, uint32_t flags) {
+    int ofi = alloc_open_file();
+    if (ofi < 0) {
+        tcp_release(s);
+        return -1;
+    }
+    open_file_t *of = open_file_get(ofi);
+    of->type  = FD_TYPE_TCP;
+    of->flags = O_RDWR | (flags & O_NONBLOCK);
+    of->tcp   = s;
+
+    int fd = fd_install(&current_process->fds, ofi);
+    if (fd < 0) {
+        release_open_file(ofi);     /* releases s */
+        return -1;
+    }
+    return fd;
+}
+
+int tcp_open(uint32_t flags) {
+    if (!timer_thread) {
+        timer_thread = proc_create_kernel_thread(tcp_timer_worker);
+        if (!timer_thread) {
+            printf("[tcp] failed to start timer thread\n");
+            return -1;
+        }
+    }
+
+    uint32_t irq = hal_irq_save();
+    tcp_sock_t *s = sock_alloc();
+    if (s) s->has_fd = 1;
+    hal_irq_restore(irq);
+    if (!s) return -1;
+
+    return tcp_new_fd(s, flags);
+}
+
+int tcp_listen(int fd, uint16_t port, int backlog) {
+    tcp_sock_t *s = tcp_from_fd(fd, NULL);
+    if (!s || port == 0) return -1;
+    if (backlog < 1) backlog = 1;
+    if (backlog > TCP_BACKLOG_MAX) backlog = TCP_BACKLOG_MAX;
+
+    bufs_reserve((uint32_t)backlog);
+
+    uint32_t irq = hal_irq_save();
+    if (s->state != TCP_CLOSED || s->error || listener_find(port)) {
+        hal_irq_restore(irq);
+        return -1;
+    }
+    s->local_ip   = net_cfg.ip;
+    s->local_port = port;
+    s->backlog    = backlog;
+    s->state      = TCP_LISTEN;
+    s->hash_next  = tcp_listeners;
+    tcp_listeners = s;
+    hal_irq_restore(irq);
+    return 0;
+}
+
+int tcp_accept(int fd, uint32_t *ip, uint16_t *port) {
+    open_file_t *of;
+    tcp_sock_t *s = tcp_from_fd(fd, &of);
+    if (!s) return -1;
+
+    uint32_t irq = hal_irq_save();
+    if (s->state != TCP_LISTEN) {
+        hal_irq_restore(irq);
+        return -1;
+    }
+    while (!s->aq_head) {
+        if (of->flags & O_NONBLOCK) {
+            hal_irq_restore(irq);
+            return -EAGAIN;
+        }
+        sleep_on(&s->rwq);
+        hal_irq_disable();
+        if (s->state != TCP_LISTEN) {
+            hal_irq_restore(irq);
+            return -1;
+        }
+    }
+
+    tcp_sock_t *c = s->aq_head;
+    child_detach(c);
+    c->has_fd = 1;
+    if (ip)   *ip   = c->remote_ip;
+    if (port) *port = c->remote_port;
+    hal_irq_restore(irq);
+
+    /* Refill for the connections still to come */
+    bufs_reserve((uint32_t)s->backlog);
+    return tcp_new_fd(c, 0);
+}
+
+int tcp_connect(int fd, uint32_t ip, uint16_t port) {
+    open_file_t *of;
+    tcp_sock_t *s = tcp_from_fd(fd, &of);
+    if (!s || port == 0) return -1;
+
+    bufs_reserve(1);
+
+    uint32_t irq = hal_irq_save();
+    if (!s->bufs)
+        s->bufs = bufs_get();
+    if (s->state != TCP_CLOSED || s->error || !s->bufs) {
+        hal_irq_restore(irq);
+        return -1;
+    }
+    s->local_port = ephemeral_port();
+    if (!s->local_port) {
+        hal_irq_restore(irq);
+        return -1;
+    }
+    s->local_ip    = ip_route_src(ip);
+    s->remote_ip   = ip;
+    s->remote_port = port;
+    s->iss         = new_iss();
+    s->snd_una     = s->iss;
+    s->snd_nxt     = s->iss + 1;
+    s->snd_max     = s->snd_nxt;
+    s->sb_seq      = s->iss + 1;
+    s->state       = TCP_SYN_SENT;
+    hash_add(s);
+
+    s->rtt_timing = 1;
+    s->rtt_seq    = s->iss + 1;
+    s->rtt_start  = timer_ticks();
+    if (tcp_xmit(s, s->iss, 0, TCP_SYN) < 0) {
+        /* No route / ARP failure: fail now rather than after retries */
+        hash_del(s);
+        s->state = TCP_CLOSED;
+        s->error = 1;
+        hal_irq_restore(irq);
+        return -1;
+    }
+    rto_arm(s);
+
+    if (of->flags & O_NONBLOCK) {
+        hal_irq_restore(irq);
+        return -EINPROGRESS;
+    }
+    while (s->state == TCP_SYN_SENT || s->state == TCP_SYN_RCVD) {
+        sleep_on(&s->wwq);
+        hal_irq_disable();
+    }
+    int ret = s->error ? -1 : 0;
+    hal_irq_restore(irq);
+    return ret;
+}
+
+int tcp_setsockopt(int fd, int opt, uint32_t val) {
+    tcp_sock_t *s = tcp_from_fd(fd, NULL);
+    if (!s) return -1;
+
+    uint32_t irq = hal_irq_save();
+    int ret = 0;
+    switch (opt) {
+    case TCP_NODELAY:
+        s->nodelay = val != 0;
+        if (s->nodelay)
+            tcp_output(s);          /* flush anything Nagle held */
+        break;
+    default:
+        ret = -1;
+        break;
+    }
+    hal_irq_restore(irq);
+    return ret;
+}
+
+int32_t tcp_getsockopt(int fd, int opt) {
+    tcp_sock_t *s = tcp_from_fd(fd, NULL);
+    if (!s) return -1;
+
+    switch (opt) {
+    case TCP_NODELAY: return s->nodelay;
+    case TCP_RETRANS: return (int32_t)s->retrans;
+    default:          return -1;
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  fd-layer hooks                                                    */
+/* ------------------------------------------------------------------ */
+
+int32_t tcp_read(tcp_sock_t *s, void *buf, uint32_t count, int nonblock) {
+    if (count == 0) return 0;
+
+    uint32_t irq = hal_irq_save();
+    while (!s->rb_len) {
+        if (s->error || s->state == TCP_LISTEN ||
+            (s->state == TCP_CLOSED && !s->bufs)) {
+            hal_irq_restore(irq);
+            return -1;
+        }
+        if (s->fin_rcvd || s->state == TCP_CLOSED) {
+            hal_irq_restore(irq);
+            return 0;                           /* EOF */
+        }
+        if (nonblock) {
+            hal_irq_restore(irq);
+            return -EAGAIN;
+        }
+        sleep_on(&s->rwq);
+        hal_irq_disable();
+    }
+
+    uint32_t n = min_u32(count, s->rb_len);
+    ring_get(rcv_ring(s), TCP_RCVBUF, s->rb_head, (uint8_t *)buf, n);
+    s->rb_head = (s->rb_head + n) % TCP_RCVBUF;
+    s->rb_len -= n;
+
+    /* Tell the peer once the window has opened by a useful amount */
+    if (s->state == TCP_ESTABLISHED || s->state == TCP_FIN_WAIT_1 ||
+        s->state == TCP_FIN_WAIT_2) {
+        uint32_t offered = seq_gt(s->rcv_adv, s->rcv_nxt) ?
+                           s->rcv_adv - s->rcv_nxt : 0;
+        uint32_t wnd = rcv_window(s);
+        if (wnd >= offered + 2u * s->mss || wnd >= offered + TCP_RCVBUF / 2)
+            tcp_ack_now(s);
+    }
+    hal_irq_restore(irq);
+    return (int32_t)n;
+}
+
+int32_t tcp_write(tcp_sock_t *s, const void *buf, uint32_t count, int nonblock) {
+    const uint8_t *src = (const uint8_t *)buf;
+    uint32_t done = 0;
+    if (count == 0) return 0;
+
+    uint32_t irq = hal_irq_save();
+    while (done < count) {
+        int connecting = s->state == TCP_SYN_SENT || s->state == TCP_SYN_RCVD;
+        if (s->error || s->fin_queued ||
+            (!connecting && s->state != TCP_ESTABLISHED &&
+             s->state != TCP_CLOSE_WAIT))
+            break;
+
+        if (connecting || s->sb_len == TCP_SNDBUF) {
+            if (nonblock) {
+                hal_irq_restore(irq);
+                return done ? (int32_t)done : -EAGAIN;
+            }
+            sleep_on(&s->wwq);
+            hal_irq_disable();
+            continue;
+        }
+
+        uint32_t n = min_u32(count - done, TCP_SNDBUF - s->sb_len);
+        ring_put(snd_ring(s), TCP_SNDBUF, (s->sb_head + s->sb_len) % TCP_SNDBUF,
+                 src + done, n);
+        s->sb_len += n;
+        done += n;
+        tcp_output(s);
+    }
+    hal_irq_restore(irq);
+    return done ? (int32_t)done : -1;
+}
+
+uint16_t tcp_poll(tcp_sock_t *s, wait_queue_t *wq[2]) {
+    wq[0] = &s->rwq;
+    wq[1] = &s->wwq;
+
+    if (s->state == TCP_LISTEN)
+        return s->aq_head ? POLLIN : 0;
+
+    uint16_t ready = 0;
+    if (s->rb_len || s->fin_rcvd)
+        ready |= POLLIN;
+    if ((s->state == TCP_ESTABLISHED || s->state == TCP_CLOSE_WAIT) &&
+        !s->fin_queued && s->sb_len < TCP_SNDBUF)
+        ready |= POLLOUT;
+    if (s->error)
+        ready |= POLLIN | POLLERR | POLLHUP;
+    else if (s->state == TCP_CLOSED && s->bufs)
+        ready |= POLLIN | POLLHUP;
+    return ready;
+}
+
+/* The last fd is closed. Connections send their FIN and finish closing
+   on their own; unread data makes it a reset instead (RFC 2525). */
+void tcp_release(tcp_sock_t *s) {
+    if (!s) return;
+
+    uint32_t irq = hal_irq_save();
+    s->has_fd = 0;
+
+    switch (s->state) {
+    case TCP_LISTEN:
+        for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
+            tcp_sock_t *c = &tcp_socks[i];
+            if (c->in_use && c->parent == s)
+                tcp_abort(c);
+        }
+        listener_del(s);
+        sock_free(s);
+        break;
+
+    case TCP_ESTABLISHED:
+    case TCP_CLOSE_WAIT:
+        if (s->rb_len) {
+            tcp_abort(s);
+            break;
+        }
+        s->fin_queued = 1;
+        s->state = s->state == TCP_ESTABLISHED ? TCP_FIN_WAIT_1 : TCP_LAST_ACK;
+        tcp_output(s);
+        break;
+
+    case TCP_SYN_RCVD:
+        tcp_abort(s);
+        break;
+
+    case TCP_CLOSED:
+    case TCP_SYN_SENT:
+        sock_free(s);
+        break;
+
+    default:
+        break;
+    }
+    hal_irq_restore(irq);
+}
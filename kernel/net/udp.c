@@ -1,33 +1,130 @@
 /*
  * UDP datagram send/receive for SpikeOS.
  *
- * Simple 8-slot socket table with per-socket receive buffer
- * and blocking recv via wait queues.
+ * Simple 8-slot socket table. Each socket queues the packet buffers
+ * of arriving datagrams as they came off the NIC (up to SO_RCVBUF
+ * bytes), counts the ones dropped because the queue was full, and has
+ * blocking recv via wait queues. The payload is copied once, straight
+ * into the reader's buffers. Sending builds the datagram in a packet
+ * buffer that the lower layers prepend their headers to. A datagram
+ * over the path MTU (up to UDP_MAX_DGRAM) is built as a chain of
+ * buffers, one per IP fragment, and received as the chain reassembly
+ * made of its fragments.
  */
 
 #include <kernel/net.h>
 #include <kernel/e1000.h>
 #include <kernel/hal.h>
 #include <kernel/wait.h>
+#include <kernel/fd.h>
+#include <kernel/skb.h>
 #include <stdio.h>
 #include <string.h>
 
 #define MAX_UDP_SOCKETS 8
-#define UDP_RECV_BUF    2048
+
+/* Bytes a queued datagram counts against SO_RCVBUF: its payload plus
+   a fixed per-datagram overhead, rounded to 4 */
+#define UDP_DGRAM_COST(len) (8 + (((uint32_t)(len) + 3) & ~3u))
+
+/* Buffers kept free for the NIC's RX refill: sockets stop queueing
+   (and drop) once the pool gets this low */
+#define UDP_SKB_RESERVE 64
 
 typedef struct {
     int          in_use;
     uint16_t     local_port;
-    uint8_t      recv_buf[UDP_RECV_BUF];
-    uint16_t     recv_len;
-    uint32_t     from_ip;
-    uint16_t     from_port;
-    int          has_data;
+    sk_buff_t   *rq_head;     /* oldest queued datagram */
+    sk_buff_t   *rq_tail;
+    uint32_t     rq_size;     /* SO_RCVBUF */
+    uint32_t     rq_used;     /* UDP_DGRAM_COST of everything queued */
+    uint32_t     rq_count;    /* datagrams queued */
+    uint32_t     drops;       /* datagrams dropped: queue full */
+    uint32_t     flags;       /* O_NONBLOCK */
     wait_queue_t wq;
 } udp_socket_t;
 
 static udp_socket_t udp_sockets[MAX_UDP_SOCKETS];
 
+static udp_socket_t *udp_sock(int sock) {
+    if (sock < 0 || sock >= MAX_UDP_SOCKETS) return NULL;
+    if (!udp_sockets[sock].in_use) return NULL;
+    return &udp_sockets[sock];
+}
+
+/* ------------------------------------------------------------------ */
+/*  Receive queue (interrupts off)                                    */
+/* ------------------------------------------------------------------ */
+
+/* Queue a datagram (skb->data at the payload), taking a reference.
+   Returns 0, or -1 (counted as a drop) if there is no room. */
+static int rq_put(udp_socket_t *s, sk_buff_t *skb) {
+    uint32_t cost = UDP_DGRAM_COST(skb_chain_len(skb));
+    if (s->rq_used + cost > s->rq_size ||
+        skb_pool_free() < UDP_SKB_RESERVE) {
+        s->drops++;
+        return -1;
+    }
+
+    skb_get(skb);
+    skb->next = NULL;
+    if (s->rq_tail)
+        s->rq_tail->next = skb;
+    else
+        s->rq_head = skb;
+    s->rq_tail = skb;
+    s->rq_used += cost;
+    s->rq_count++;
+    return 0;
+}
+
+/* Unlink the oldest datagram; the caller owns its reference */
+static sk_buff_t *rq_pop(udp_socket_t *s) {
+    sk_buff_t *skb = s->rq_head;
+    if (!skb) return NULL;
+
+    s->rq_head = skb->next;
+    if (!s->rq_head) s->rq_tail = NULL;
+    skb->next = NULL;
+    s->rq_used -= UDP_DGRAM_COST(skb_chain_len(skb));
+    s->rq_count--;
+    return skb;
+}
+
+/* Copy the oldest datagram out over the iovecs and dequeue it; what
+   doesn't fit is lost. Returns the bytes stored, or -EAGAIN. */
+static int rq_take(udp_socket_t *s, const struct iovec *iov, int iovcnt,
+                   uint32_t *from_ip, uint16_t *from_port) {
+    sk_buff_t *skb = rq_pop(s);
+    if (!skb) return -EAGAIN;
+
+    /* Buffer by buffer of the chain, iovec by iovec */
+    uint32_t copy = 0;
+    const sk_buff_t *p = skb;
+    uint32_t p_off = 0;
+    for (int i = 0; i < iovcnt && p; i++) {
+        uint32_t done = 0;
+        while (p && done < iov[i].iov_len) {
+            uint32_t n = p->len - p_off;
+            if (n > iov[i].iov_len - done) n = iov[i].iov_len - done;
+            memcpy((uint8_t *)iov[i].iov_base + done, p->data + p_off, n);
+            done  += n;
+            p_off += n;
+            if (p_off == p->len) {
+                p = p->frag_next;
+                p_off = 0;
+            }
+        }
+        copy += done;
+    }
+    net_stats.rx_copies++;
+    if (from_ip)   *from_ip   = skb->src_ip;
+    if (from_port) *from_port = skb->src_port;
+
+    skb_free(skb);
+    return (int)copy;
+}
+
 /* ------------------------------------------------------------------ */
 /*  Init                                                              */
 /* ------------------------------------------------------------------ */
@@ -44,11 +141,12 @@ int udp_bind(uint16_t port) {
     uint32_t flags = hal_irq_save();
     for (int i = 0; i < MAX_UDP_SOCKETS; i++) {
         if (!udp_sockets[i].in_use) {
-            udp_sockets[i].in_use = 1;
-            udp_sockets[i].local_port = port;
-            udp_sockets[i].has_data = 0;
-            udp_sockets[i].recv_len = 0;
-            udp_sockets[i].wq = (wait_queue_t)WAIT_QUEUE_INIT;
+            udp_socket_t *s = &udp_sockets[i];
+            memset(s, 0, sizeof(*s));
+            s->in_use = 1;
+            s->local_port = port;
+            s->rq_size = UDP_RCVBUF_DEFAULT;
+            s->wq = (wait_queue_t)WAIT_QUEUE_INIT;
             hal_irq_restore(flags);
             return i;
         }
@@ -60,31 +158,147 @@ int udp_bind(uint16_t port) {
 void udp_unbind(int sock) {
     if (sock < 0 || sock >= MAX_UDP_SOCKETS) return;
     uint32_t flags = hal_irq_save();
-    udp_sockets[sock].in_use = 0;
-    wake_up_all(&udp_sockets[sock].wq);
+    udp_socket_t *s = &udp_sockets[sock];
+    sk_buff_t *skb;
+    while ((skb = rq_pop(s)) != NULL)
+        skb_free(skb);
+    s->in_use = 0;
+    wake_up_all(&s->wq);
+    hal_irq_restore(flags);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Socket options                                                    */
+/* ------------------------------------------------------------------ */
+
+/* Resize the queue. Queued datagrams stay; if they are over the new
+   size, new ones are dropped until enough have been read. */
+static int udp_set_rcvbuf(int sock, uint32_t size) {
+    if (size < UDP_RCVBUF_MIN || size > UDP_RCVBUF_MAX) return -1;
+
+    uint32_t flags = hal_irq_save();
+    udp_socket_t *s = udp_sock(sock);
+    if (s) s->rq_size = size & ~3u;
     hal_irq_restore(flags);
+    return s ? 0 : -1;
+}
+
+int udp_setsockopt(int sock, int opt, uint32_t val) {
+    switch (opt) {
+    case SO_RCVBUF:
+        return udp_set_rcvbuf(sock, val);
+    default:
+        return -1;
+    }
+}
+
+int32_t udp_getsockopt(int sock, int opt) {
+    udp_socket_t *s = udp_sock(sock);
+    if (!s) return -1;
+
+    switch (opt) {
+    case SO_RCVBUF:   return (int32_t)s->rq_size;
+    case SO_RCVDROPS: return (int32_t)s->drops;
+    case SO_RCVQLEN:  return (int32_t)s->rq_count;
+    default:          return -1;
+    }
 }
 
 /* ------------------------------------------------------------------ */
 /*  UDP send                                                          */
 /* ------------------------------------------------------------------ */
 
-int udp_send(uint32_t dst_ip, uint16_t src_port, uint16_t dst_port,
-             const void *data, uint16_t data_len) {
-    uint16_t udp_total = sizeof(udp_header_t) + data_len;
-    uint8_t buf[1500];
+/* Copy the iovecs into a chain of buffers of at most piece bytes each,
+   the first starting piece - first bytes in (the UDP header's room).
+   Returns the chain, or NULL if the pool ran out. */
+static sk_buff_t *udp_build_chain(const struct iovec *iov, int iovcnt,
+                                  uint32_t len, uint32_t piece,
+                                  uint32_t first) {
+    sk_buff_t *head = (sk_buff_t *)0, **tail = &head;
+    uint32_t room = 0;
+    sk_buff_t *cur = (sk_buff_t *)0;
+    int i = 0;
+    uint32_t i_off = 0;
 
-    if (udp_total > sizeof(buf)) return -1;
+    while (len) {
+        if (!room) {
+            cur = skb_alloc(SKB_HEADROOM);
+            if (!cur) {
+                skb_free(head);
+                return (sk_buff_t *)0;
+            }
+            *tail = cur;
+            tail = &cur->frag_next;
+            room = head == cur ? first : piece;
+        }
+        while (i < iovcnt && i_off == iov[i].iov_len) {
+            i++;
+            i_off = 0;
+        }
+        uint32_t n = iov[i].iov_len - i_off;
+        if (n > room) n = room;
+        if (n > len) n = len;
+        memcpy(skb_put(cur, (uint16_t)n),
+               (const uint8_t *)iov[i].iov_base + i_off, n);
+        i_off += n;
+        room  -= n;
+        len   -= n;
+    }
+    if (!head)
+        head = skb_alloc(SKB_HEADROOM);     /* an empty datagram */
+    return head;
+}
+
+/* Build one datagram from the iovecs, copying each straight into a
+   packet buffer; the UDP, IP and Ethernet headers go in front of it in
+   place. Over the path MTU, it is built in fragment-sized buffers and
+   its checksum done here, as no NIC sees the whole datagram. */
+static int udp_send_iov(uint32_t dst_ip, uint16_t src_port, uint16_t dst_port,
+                        const struct iovec *iov, int iovcnt) {
+    uint32_t data_len = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        data_len += iov[i].iov_len;
+        if (data_len > UDP_MAX_DGRAM) return -1;
+    }
+
+    uint32_t src_ip = ip_route_src(dst_ip);
+    uint32_t piece = ip_frag_size(dst_ip);
+    uint32_t udp_len = data_len + sizeof(udp_header_t);
+    sk_buff_t *skb = udp_build_chain(iov, iovcnt, data_len, piece,
+                                     piece - sizeof(udp_header_t));
+    if (!skb) return -1;
+    net_stats.tx_copies++;
 
-    udp_header_t *udp = (udp_header_t *)buf;
+    udp_header_t *udp = (udp_header_t *)skb_push(skb, sizeof(udp_header_t));
     udp->src_port = htons(src_port);
     udp->dst_port = htons(dst_port);
-    udp->length   = htons(udp_total);
-    udp->checksum  = 0;  /* checksum optional for UDP/IPv4 */
+    udp->length   = htons((uint16_t)udp_len);
+
+    if (skb->frag_next) {
+        udp->checksum = 0;
+        uint16_t sum = ip_csum_fold(ip_csum_chain(
+            ip_pseudo_sum(src_ip, dst_ip, IP_PROTO_UDP, (uint16_t)udp_len),
+            skb, udp_len));
+        udp->checksum = sum ? sum : 0xFFFF;
+        return ip_send_skb(dst_ip, IP_PROTO_UDP, skb);
+    }
 
-    memcpy(buf + sizeof(udp_header_t), data, data_len);
+    /* Seeded with the pseudo-header; the NIC (or eth_send_skb) sums
+       the rest */
+    udp->checksum = (uint16_t)ip_pseudo_sum(src_ip, dst_ip, IP_PROTO_UDP,
+                                            skb->len);
+    skb->csum        = SKB_CSUM_L4;
+    skb->csum_start  = (uint16_t)(skb->data - skb->head);
+    skb->csum_offset = 6;
 
-    return ip_send(dst_ip, IP_PROTO_UDP, buf, udp_total);
+    return ip_send_skb(dst_ip, IP_PROTO_UDP, skb);
+}
+
+int udp_send(uint32_t dst_ip, uint16_t src_port, uint16_t dst_port,
+             const void *data, uint16_t data_len) {
+    struct iovec iov = { (void *)data, data_len };
+    return udp_send_iov(dst_ip, src_port, dst_port, &iov, 1);
 }
 
 /* ------------------------------------------------------------------ */
@@ -99,54 +313,193 @@ int udp_sendto(int sock, uint32_t dst_ip, uint16_t dst_port,
                     data, data_len);
 }
 
+int udp_sendv(int sock, uint32_t dst_ip, uint16_t dst_port,
+              const struct iovec *iov, int iovcnt) {
+    if (sock < 0 || sock >= MAX_UDP_SOCKETS) return -1;
+    if (!udp_sockets[sock].in_use || iovcnt < 0 || iovcnt > IOV_MAX) return -1;
+    return udp_send_iov(dst_ip, udp_sockets[sock].local_port, dst_port,
+                        iov, iovcnt);
+}
+
+/* Destination of a udp_sendfile */
+struct udp_splice {
+    int      sock;
+    uint32_t dst_ip;
+    uint16_t dst_port;
+};
+
+/* One datagram per chunk handed over by fd_splice_from */
+static int32_t udp_splice_sink(void *ctx, const struct iovec *iov, int iovcnt) {
+    struct udp_splice *u = (struct udp_splice *)ctx;
+    uint32_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    if (udp_sendv(u->sock, u->dst_ip, u->dst_port, iov, iovcnt) < 0)
+        return -1;
+    return (int32_t)len;
+}
+
+int32_t udp_sendfile(int sock, uint32_t dst_ip, uint16_t dst_port,
+                     int in_fd, uint32_t *offset, uint32_t count) {
+    if (sock < 0 || sock >= MAX_UDP_SOCKETS) return -1;
+    if (!udp_sockets[sock].in_use) return -1;
+
+    struct udp_splice u = { sock, dst_ip, dst_port };
+    net_tx_hold();
+    int32_t ret = fd_splice_from(in_fd, offset, count, UDP_MAX_PAYLOAD,
+                                 udp_splice_sink, &u);
+    net_tx_release();
+    return ret;
+}
+
+int udp_sendmmsg(int sock, const struct udp_msg *msgs, int vlen) {
+    if (sock < 0 || sock >= MAX_UDP_SOCKETS) return -1;
+    if (!udp_sockets[sock].in_use || vlen <= 0) return -1;
+
+    int n = 0;
+    net_tx_hold();
+    while (n < vlen && udp_sendv(sock, msgs[n].ip, msgs[n].port,
+                                 msgs[n].iov, msgs[n].iovcnt) >= 0)
+        n++;
+    net_tx_release();
+    return n ? n : -1;
+}
+
 /* ------------------------------------------------------------------ */
 /*  UDP recv (blocking)                                               */
 /* ------------------------------------------------------------------ */
 
 int udp_recv(int sock, void *buf, uint16_t max_len,
              uint32_t *from_ip, uint16_t *from_port) {
-    if (sock < 0 || sock >= MAX_UDP_SOCKETS) return -1;
+    struct iovec iov = { buf, max_len };
+    return udp_recvv(sock, &iov, 1, from_ip, from_port);
+}
+
+/* Sleep until s has a datagram queued (or was closed), unless it is
+   non-blocking. Returns 0 with interrupts off (saved in *irq), or an
+   error with them restored. */
+static int udp_wait_data(int sock, uint32_t *irq) {
     udp_socket_t *s = &udp_sockets[sock];
-    if (!s->in_use) return -1;
 
-    /* Block until data arrives */
-    while (!s->has_data && s->in_use) {
+    *irq = hal_irq_save();
+    if (!s->in_use) {
+        hal_irq_restore(*irq);
+        return -1;
+    }
+    if (!s->rq_count && (s->flags & O_NONBLOCK)) {
+        hal_irq_restore(*irq);
+        return -EAGAIN;
+    }
+
+    /* Block until data arrives. sleep_on queues us before interrupts
+       come back on, so an arrival after the check still wakes us. */
+    while (!s->rq_count && s->in_use) {
         sleep_on(&s->wq);
+        hal_irq_disable();
+    }
+    if (!s->in_use) {           /* socket was closed while waiting */
+        hal_irq_restore(*irq);
+        return -1;
     }
-    if (!s->in_use) return -1;  /* socket was closed while waiting */
+    return 0;
+}
 
-    uint32_t flags = hal_irq_save();
-    uint16_t copy = s->recv_len;
-    if (copy > max_len) copy = max_len;
-    memcpy(buf, s->recv_buf, copy);
-    if (from_ip)   *from_ip   = s->from_ip;
-    if (from_port) *from_port = s->from_port;
-    s->has_data = 0;
+int udp_recvv(int sock, const struct iovec *iov, int iovcnt,
+              uint32_t *from_ip, uint16_t *from_port) {
+    if (sock < 0 || sock >= MAX_UDP_SOCKETS) return -1;
+    if (iovcnt < 0 || iovcnt > IOV_MAX) return -1;
+
+    uint32_t flags;
+    int ret = udp_wait_data(sock, &flags);
+    if (ret < 0) return ret;
+
+    ret = rq_take(&udp_sockets[sock], iov, iovcnt, from_ip, from_port);
+    hal_irq_restore(flags);
+    return ret;
+}
+
+int udp_recvmmsg(int sock, struct udp_msg *msgs, int vlen) {
+    if (sock < 0 || sock >= MAX_UDP_SOCKETS) return -1;
+    if (vlen <= 0) return -1;
+    for (int i = 0; i < vlen; i++) {
+        if (msgs[i].iovcnt < 0 || msgs[i].iovcnt > IOV_MAX) return -1;
+    }
+
+    uint32_t flags;
+    int ret = udp_wait_data(sock, &flags);
+    if (ret < 0) return ret;
+
+    /* Whatever is queued now, up to vlen, in one go */
+    udp_socket_t *s = &udp_sockets[sock];
+    int n = 0;
+    while (n < vlen) {
+        struct udp_msg *m = &msgs[n];
+        ret = rq_take(s, m->iov, m->iovcnt, &m->ip, &m->port);
+        if (ret < 0) break;
+        m->len = (uint16_t)ret;
+        n++;
+    }
     hal_irq_restore(flags);
+    return n;
+}
+
+int32_t udp_fcntl(int sock, int cmd, uint32_t arg) {
+    if (sock < 0 || sock >= MAX_UDP_SOCKETS) return -1;
+    if (!udp_sockets[sock].in_use) return -1;
 
-    return copy;
+    switch (cmd) {
+    case F_GETFL:
+        return (int32_t)udp_sockets[sock].flags;
+    case F_SETFL:
+        udp_sockets[sock].flags = arg & O_NONBLOCK;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+int udp_poll(int sock, struct wait_queue **wq) {
+    udp_socket_t *s = udp_sock(sock);
+    if (!s) return -1;
+
+    *wq = &s->wq;
+    return s->rq_count != 0;
 }
 
 /* ------------------------------------------------------------------ */
 /*  UDP RX handler (called from ip_handle)                            */
 /* ------------------------------------------------------------------ */
 
-void udp_handle(const void *data, uint16_t len, uint32_t src_ip) {
-    if (len < sizeof(udp_header_t)) return;
+void udp_handle(sk_buff_t *skb) {
+    if (skb->len < sizeof(udp_header_t)) return;
 
-    const udp_header_t *udp = (const udp_header_t *)data;
+    const udp_header_t *udp = (const udp_header_t *)skb->data;
     uint16_t dst_port = ntohs(udp->dst_port);
     uint16_t src_port = ntohs(udp->src_port);
     uint16_t udp_len  = ntohs(udp->length);
+    uint32_t len      = skb_chain_len(skb);
+
+    /* A reassembled datagram has no padding to trim */
+    if (udp_len < sizeof(udp_header_t) || udp_len > len ||
+        (skb->frag_next && udp_len != len)) return;
 
-    if (udp_len < sizeof(udp_header_t) || udp_len > len) return;
+    /* Checksum, if the sender used one and the NIC hasn't checked it */
+    if (udp->checksum && !(skb->csum & SKB_CSUM_L4) &&
+        ip_csum_fold(ip_csum_chain(ip_pseudo_sum(skb->src_ip, skb->dst_ip,
+                                                 IP_PROTO_UDP, udp_len),
+                                   skb, udp_len)) != 0)
+        return;
 
-    const void *payload = (const uint8_t *)data + sizeof(udp_header_t);
-    uint16_t payload_len = udp_len - sizeof(udp_header_t);
+    /* Leave just the payload */
+    skb_trim(skb, udp_len);
+    skb_pull(skb, sizeof(udp_header_t));
+    skb->src_port = src_port;
 
     /* Route DHCP replies to DHCP handler */
     if (dst_port == DHCP_CLIENT_PORT) {
-        dhcp_handle(payload, payload_len);
+        if (skb->frag_next) return;
+        dhcp_handle(skb->data, skb->len);
         return;
     }
 
@@ -156,16 +509,13 @@ void udp_handle(const void *data, uint16_t len, uint32_t src_ip) {
         if (udp_sockets[i].in_use &&
             udp_sockets[i].local_port == dst_port) {
 
-            uint16_t copy = payload_len;
-            if (copy > UDP_RECV_BUF) copy = UDP_RECV_BUF;
-            memcpy(udp_sockets[i].recv_buf, payload, copy);
-            udp_sockets[i].recv_len  = copy;
-            udp_sockets[i].from_ip   = src_ip;
-            udp_sockets[i].from_port = src_port;
-            udp_sockets[i].has_data  = 1;
+            /* Queue the buffer itself; a full queue drops the new
+               datagram */
+            int queued = rq_put(&udp_sockets[i], skb) == 0;
 
             hal_irq_restore(flags);
-            wake_up_one(&udp_sockets[i].wq);
+            if (queued)
+                wake_up_one(&udp_sockets[i].wq);
             return;
         }
     }
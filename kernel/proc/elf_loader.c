@@ -216,8 +216,9 @@ fail:
 
 /*
  * Load an ELF binary from the VFS and create a user process.
- * VFS file data (node->data) is already a contiguous heap buffer,
- * so we can parse ELF headers directly via pointer arithmetic.
+ * Headers are read into kernel buffers; segment contents are read from
+ * the page cache straight into the new process's frames through the
+ * physmap.
  */
 struct process *elf_load_from_vfs(const char *path) {
     int32_t ino = vfs_resolve(path, NULL, NULL);
@@ -227,40 +228,50 @@ struct process *elf_load_from_vfs(const char *path) {
     if (!node || node->type != VFS_TYPE_FILE || node->size == 0)
         return NULL;
 
-    uint8_t *file_data = (uint8_t *)node->data;
     uint32_t file_size = node->size;
 
     /* ---- 1. Validate ELF header ---- */
     if (file_size < sizeof(Elf32_Ehdr)) return NULL;
 
-    Elf32_Ehdr *ehdr = (Elf32_Ehdr *)file_data;
+    Elf32_Ehdr ehdr;
+    if (vfs_read((uint32_t)ino, &ehdr, 0, sizeof(ehdr)) != (int32_t)sizeof(ehdr))
+        return NULL;
 
-    if (ehdr->e_ident[EI_MAG0] != ELFMAG0 ||
-        ehdr->e_ident[EI_MAG1] != ELFMAG1 ||
-        ehdr->e_ident[EI_MAG2] != ELFMAG2 ||
-        ehdr->e_ident[EI_MAG3] != ELFMAG3)
+    if (ehdr.e_ident[EI_MAG0] != ELFMAG0 ||
+        ehdr.e_ident[EI_MAG1] != ELFMAG1 ||
+        ehdr.e_ident[EI_MAG2] != ELFMAG2 ||
+        ehdr.e_ident[EI_MAG3] != ELFMAG3)
         return NULL;
 
-    if (ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||
-        ehdr->e_ident[EI_DATA]  != ELFDATA2LSB ||
-        ehdr->e_type    != ET_EXEC ||
-        ehdr->e_machine != EM_386 ||
-        ehdr->e_phnum   == 0)
+    if (ehdr.e_ident[EI_CLASS] != ELFCLASS32 ||
+        ehdr.e_ident[EI_DATA]  != ELFDATA2LSB ||
+        ehdr.e_type    != ET_EXEC ||
+        ehdr.e_machine != EM_386 ||
+        ehdr.e_phnum   == 0 ||
+        ehdr.e_phentsize != sizeof(Elf32_Phdr))
         return NULL;
 
-    /* ---- 2. Locate program headers ---- */
-    uint32_t ph_off  = ehdr->e_phoff;
-    uint16_t ph_num  = ehdr->e_phnum;
-    uint16_t ph_entsz = ehdr->e_phentsize;
+    /* ---- 2. Read program headers ---- */
+    uint32_t ph_off  = ehdr.e_phoff;
+    uint16_t ph_num  = ehdr.e_phnum;
+    uint32_t ph_size = (uint32_t)ph_num * sizeof(Elf32_Phdr);
 
-    if (ph_off + ph_num * ph_entsz > file_size)
+    if (ph_off + ph_size > file_size)
         return NULL;
 
-    Elf32_Phdr *phdrs = (Elf32_Phdr *)(file_data + ph_off);
+    Elf32_Phdr *phdrs = (Elf32_Phdr *)kmalloc(ph_size);
+    if (!phdrs) return NULL;
+    if (vfs_read((uint32_t)ino, phdrs, ph_off, ph_size) != (int32_t)ph_size) {
+        kfree(phdrs);
+        return NULL;
+    }
 
     /* ---- 3. Create a new page directory ---- */
     uint32_t pd_phys = pgdir_create();
-    if (pd_phys == 0) return NULL;
+    if (pd_phys == 0) {
+        kfree(phdrs);
+        return NULL;
+    }
 
     /* ---- 4. Map each PT_LOAD segment ---- */
     uint32_t max_load_end = 0;  /* track highest PT_LOAD end for brk */
@@ -270,6 +281,7 @@ struct process *elf_load_from_vfs(const char *path) {
         if (ph->p_type != PT_LOAD || ph->p_memsz == 0) continue;
 
         if (ph->p_vaddr >= 0xC0000000u) goto fail;
+        if (ph->p_offset + ph->p_filesz > file_size) goto fail;
 
         uint32_t start_page = ph->p_vaddr & ~0xFFFu;
         uint32_t end_addr   = ph->p_vaddr + ph->p_memsz;
@@ -287,7 +299,8 @@ struct process *elf_load_from_vfs(const char *path) {
                 goto fail;
             }
 
-            memset(elf_staging, 0, PAGE_SIZE);
+            uint8_t *dest = (uint8_t *)phys_to_virt(frame);
+            memset(dest, 0, PAGE_SIZE);
 
             uint32_t seg_file_start = ph->p_vaddr;
             uint32_t seg_file_end   = ph->p_vaddr + ph->p_filesz;
@@ -299,15 +312,12 @@ struct process *elf_load_from_vfs(const char *path) {
             if (copy_start < copy_end) {
                 uint32_t off_in_page = copy_start - pv;
                 uint32_t off_in_file = copy_start - ph->p_vaddr;
+                uint32_t len = copy_end - copy_start;
 
-                memcpy(elf_staging + off_in_page,
-                       file_data + ph->p_offset + off_in_file,
-                       copy_end - copy_start);
+                if (vfs_read((uint32_t)ino, dest + off_in_page,
+                             ph->p_offset + off_in_file, len) != (int32_t)len)
+                    goto fail;
             }
-
-            uint8_t *dest = (uint8_t *)temp_map(frame);
-            memcpy(dest, elf_staging, PAGE_SIZE);
-            temp_unmap();
         }
     }
 
@@ -322,14 +332,13 @@ struct process *elf_load_from_vfs(const char *path) {
             goto fail;
         }
 
-        uint8_t *sp = (uint8_t *)temp_map(stack_frame);
-        memset(sp, 0, PAGE_SIZE);
-        temp_unmap();
+        memset(phys_to_virt(stack_frame), 0, PAGE_SIZE);
     }
 
     /* ---- 6. Create the user process ---- */
     {
-        struct process *p = proc_create_user_process(pd_phys, ehdr->e_entry,
+        kfree(phdrs);
+        struct process *p = proc_create_user_process(pd_phys, ehdr.e_entry,
                                                       USER_STACK_TOP);
         if (!p) {
             pgdir_destroy(pd_phys);
@@ -340,6 +349,7 @@ struct process *elf_load_from_vfs(const char *path) {
     }
 
 fail:
+    kfree(phdrs);
     pgdir_destroy(pd_phys);
     return NULL;
 }
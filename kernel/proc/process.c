@@ -3,6 +3,8 @@
 #include <kernel/isr.h>
 #include <kernel/signal.h>
 #include <kernel/hal.h>
+#include <kernel/vfs.h>
+#include <kernel/syscall.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -42,8 +44,7 @@ void process_init(void) {
         proc_table[i].pending_signals = 0;
         proc_table[i].brk = 0;
         proc_table[i].vma_count = 0;
-        for (int j = 0; j < MAX_FDS; j++)
-            proc_table[i].fds[j] = -1;
+        fd_table_init(&proc_table[i].fds);
     }
 
     // Initialize idle/kernel process (PID 0)
@@ -65,7 +66,7 @@ void process_init(void) {
     idle->pending_signals = 0;
 
     // Init fds for idle process (kernel shell runs here)
-    fd_init_process(idle->fds);
+    fd_init_process(&idle->fds);
 
     current_process = idle;
 }
@@ -82,7 +83,16 @@ void proc_kill(uint32_t pid) {
             proc_table[i].state = PROC_ZOMBIE;
 
             /* Close all open file descriptors */
-            fd_close_all(proc_table[i].fds);
+            fd_close_all(&proc_table[i].fds);
+
+            /* Release file mappings (pgdir_destroy drops their frames) */
+            for (uint32_t v = 0; v < proc_table[i].vma_count; v++) {
+                vma_t *vma = &proc_table[i].vmas[v];
+                if (!(vma->flags & MAP_ANONYMOUS))
+                    vfs_unmap_file(vma->ino, (vma->flags & MAP_SHARED)
+                                             && (vma->prot & PROT_WRITE));
+            }
+            proc_table[i].vma_count = 0;
 
             /* Free per-process page directory if this process has one */
             if (proc_table[i].cr3 != 0) {
@@ -148,8 +158,7 @@ static void reap_orphan_zombies(void) {
         proc_table[i].brk = 0;
         proc_table[i].vma_count = 0;
         proc_table[i].wait_children.head = NULL;
-        for (int j = 0; j < MAX_FDS; j++)
-            proc_table[i].fds[j] = -1;
+        fd_table_init(&proc_table[i].fds);
     }
 }
 
@@ -171,7 +180,7 @@ struct process *proc_create_kernel_thread(void (*entry)(void)) {
             p->vma_count = 0;
 
             /* Inherit parent's fds (kernel threads share console) */
-            fd_init_process(p->fds);
+            fd_init_process(&p->fds);
 
             // Assign a real kernel stack for this process
             p->kstack_top = (uint32_t)&kstacks[i][KSTACK_SIZE];
@@ -237,7 +246,7 @@ struct process *proc_create_user_process(uint32_t pd_phys,
             p->vma_count = 0;
 
             /* Give user process its own console fds */
-            fd_init_process(p->fds);
+            fd_init_process(&p->fds);
 
             /* Kernel stack for ring-3 → ring-0 traps */
             p->kstack_top = (uint32_t)&kstacks[i][KSTACK_SIZE];
@@ -11,7 +11,8 @@
  * picks another process and this one is eventually woken.
  *
  * Wake functions set the process back to PROC_READY and remove it
- * from the queue.
+ * from the queue. Watcher entries (func != NULL) get their hook called
+ * instead and stay queued.
  */
 
 #pragma GCC diagnostic push
@@ -27,6 +28,8 @@ void sleep_on(wait_queue_t *wq) {
     wait_queue_entry_t entry;
     entry.proc = current_process;
     entry.next = NULL;
+    entry.func = NULL;
+    entry.data = NULL;
 
     /* Save and disable interrupts while modifying the queue and process
        state.  Using hal_irq_save/restore preserves the caller's
@@ -56,36 +59,64 @@ void sleep_on(wait_queue_t *wq) {
 
 #pragma GCC diagnostic pop
 
+/* Call every watcher hook; unlink and ready up to 'max' sleepers.
+   Interrupts must be off. */
+static int wake_up(wait_queue_t *wq, int max) {
+    int count = 0;
+    wait_queue_entry_t **link = &wq->head;
+
+    while (*link) {
+        wait_queue_entry_t *entry = *link;
+        if (entry->func) {
+            entry->func(entry);
+            link = &entry->next;
+        } else if (count < max) {
+            *link = entry->next;
+            entry->proc->state = PROC_READY;
+            count++;
+        } else {
+            link = &entry->next;
+        }
+    }
+    return count;
+}
+
 int wake_up_one(wait_queue_t *wq) {
     if (!wq) return 0;
 
     uint32_t flags = hal_irq_save();
-
-    wait_queue_entry_t *entry = wq->head;
-    if (entry) {
-        wq->head = entry->next;
-        entry->proc->state = PROC_READY;
-        hal_irq_restore(flags);
-        return 1;
-    }
-
+    int count = wake_up(wq, 1);
     hal_irq_restore(flags);
-    return 0;
+    return count;
 }
 
 int wake_up_all(wait_queue_t *wq) {
     if (!wq) return 0;
 
     uint32_t flags = hal_irq_save();
+    int count = wake_up(wq, MAX_PROCS);
+    hal_irq_restore(flags);
+    return count;
+}
+
+void wait_queue_add(wait_queue_t *wq, wait_queue_entry_t *entry) {
+    if (!wq || !entry) return;
+
+    uint32_t flags = hal_irq_save();
+    entry->next = wq->head;
+    wq->head = entry;
+    hal_irq_restore(flags);
+}
 
-    int count = 0;
-    while (wq->head) {
-        wait_queue_entry_t *entry = wq->head;
-        wq->head = entry->next;
-        entry->proc->state = PROC_READY;
-        count++;
-    }
+void wait_queue_remove(wait_queue_t *wq, wait_queue_entry_t *entry) {
+    if (!wq || !entry) return;
 
+    uint32_t flags = hal_irq_save();
+    for (wait_queue_entry_t **link = &wq->head; *link; link = &(*link)->next) {
+        if (*link == entry) {
+            *link = entry->next;
+            break;
+        }
+    }
     hal_irq_restore(flags);
-    return count;
 }
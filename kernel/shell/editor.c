@@ -162,8 +162,19 @@ static void ed_load_file(const char *filename) {
         return;
     }
 
+    /* Copy the file out of the page cache */
     vfs_inode_t *node = vfs_get_inode((uint32_t)ino);
-    if (!node || node->type != VFS_TYPE_FILE || node->size == 0) {
+    char *data = NULL;
+    uint32_t size = 0;
+    if (node && node->type == VFS_TYPE_FILE && node->size > 0) {
+        size = node->size;
+        data = (char *)kmalloc(size);
+        if (data && vfs_read((uint32_t)ino, data, 0, size) != (int32_t)size) {
+            kfree(data);
+            data = NULL;
+        }
+    }
+    if (!data) {
         ed_lines[0] = line_alloc(ED_INIT_LINE_CAP);
         ed_len[0]   = 0;
         ed_cap[0]   = ED_INIT_LINE_CAP;
@@ -172,8 +183,6 @@ static void ed_load_file(const char *filename) {
     }
 
     /* Split file data on newlines */
-    const char *data = (const char *)node->data;
-    uint32_t size = node->size;
     uint32_t start = 0;
 
     for (uint32_t i = 0; i <= size && ed_nlines < ED_MAX_LINES; i++) {
@@ -192,6 +201,7 @@ static void ed_load_file(const char *filename) {
             start = i + 1;
         }
     }
+    kfree(data);
 
     /* If file ended with \n, we may have an extra empty trailing line.
        That's fine — it matches nano behavior. */
@@ -213,12 +223,8 @@ static int ed_save_file(void) {
     vfs_inode_t *node = vfs_get_inode((uint32_t)ino);
     if (!node || node->type != VFS_TYPE_FILE) return -1;
 
-    /* Calculate total size */
-    uint32_t total = 0;
-    for (int i = 0; i < ed_nlines; i++) {
-        total += (uint32_t)ed_len[i];
-        if (i < ed_nlines - 1) total++;  /* newline between lines */
-    }
+    /* Rewrite from scratch (no need to load the old contents) */
+    vfs_truncate((uint32_t)ino, 0);
 
     /* Write line by line */
     uint32_t off = 0;
@@ -232,8 +238,6 @@ static int ed_save_file(void) {
         }
     }
 
-    /* Truncate if file was previously longer */
-    node->size = total;
     ed_modified = 0;
     return 0;
 }
@@ -348,8 +348,19 @@ static void ge_load_file(gui_editor_t *ed) {
         return;
     }
 
+    /* Copy the file out of the page cache */
     vfs_inode_t *node = vfs_get_inode((uint32_t)ino);
-    if (!node || node->type != VFS_TYPE_FILE || node->size == 0) {
+    char *data = NULL;
+    uint32_t size = 0;
+    if (node && node->type == VFS_TYPE_FILE && node->size > 0) {
+        size = node->size;
+        data = (char *)kmalloc(size);
+        if (data && vfs_read((uint32_t)ino, data, 0, size) != (int32_t)size) {
+            kfree(data);
+            data = NULL;
+        }
+    }
+    if (!data) {
         ed->lines[0] = ge_line_alloc(GE_INIT_LINE_CAP);
         ed->line_len[0] = 0;
         ed->line_cap[0] = GE_INIT_LINE_CAP;
@@ -357,8 +368,6 @@ static void ge_load_file(gui_editor_t *ed) {
         return;
     }
 
-    const char *data = (const char *)node->data;
-    uint32_t size = node->size;
     uint32_t start = 0;
 
     for (uint32_t i = 0; i <= size && ed->nlines < GE_MAX_LINES; i++) {
@@ -377,6 +386,7 @@ static void ge_load_file(gui_editor_t *ed) {
             start = i + 1;
         }
     }
+    kfree(data);
 
     if (ed->nlines == 0) {
         ed->lines[0] = ge_line_alloc(GE_INIT_LINE_CAP);
@@ -567,11 +577,7 @@ static int ge_save_file(gui_editor_t *ed) {
     vfs_inode_t *node = vfs_get_inode((uint32_t)ino);
     if (!node || node->type != VFS_TYPE_FILE) return -1;
 
-    uint32_t total = 0;
-    for (int i = 0; i < ed->nlines; i++) {
-        total += (uint32_t)ed->line_len[i];
-        if (i < ed->nlines - 1) total++;
-    }
+    vfs_truncate((uint32_t)ino, 0);
 
     uint32_t off = 0;
     for (int i = 0; i < ed->nlines; i++) {
@@ -584,7 +590,6 @@ static int ge_save_file(gui_editor_t *ed) {
         }
     }
 
-    node->size = total;
     ed->modified = 0;
     strcpy(ed->status, "Saved");
     return 0;
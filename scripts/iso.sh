@@ -27,7 +27,7 @@ set timeout=3
 set default=0
 
 menuentry "myos" {
-	multiboot /boot/myos.kernel
+	multiboot /boot/myos.kernel ${SPIKEOS_CMDLINE:-}
 	module /boot/initrd.img
 }
 EOF
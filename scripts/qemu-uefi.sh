@@ -59,7 +59,7 @@ qemu-system-x86_64 \
     -vga std \
     -device virtio-gpu-pci \
     -serial file:.debug.log \
-    -netdev user,id=net0,hostfwd=udp::9999-:9999 \
+    -netdev user,id=net0,hostfwd=udp::9999-:9999,hostfwd=tcp::7777-:7777 \
     -device e1000,netdev=net0 \
     -no-reboot \
     -no-shutdown \
@@ -2,11 +2,15 @@
 set -e
 
 # Parse flags
+NIC_DEVICE=e1000
 for arg in "$@"; do
     case "$arg" in
         -v|--verbose)
             export KERNEL_CPPFLAGS="-DVERBOSE_BOOT"
             ;;
+        --virtio-net)
+            NIC_DEVICE=virtio-net-pci
+            ;;
     esac
 done
 
@@ -31,6 +35,6 @@ qemu-system-$(scripts/target-triplet-to-arch.sh $HOST) \
     -vga std \
     -device virtio-gpu-pci \
     -serial file:.debug.log \
-    -netdev user,id=net0,hostfwd=udp::9999-:9999 \
-    -device e1000,netdev=net0 \
+    -netdev user,id=net0,hostfwd=udp::9999-:9999,hostfwd=tcp::7777-:7777 \
+    -device $NIC_DEVICE,netdev=net0 \
     -no-reboot -no-shutdown
@@ -1,7 +1,8 @@
 /*
  * files_test.c — Exercise filesystem syscalls from userland.
  *
- * Tests: open, write, read, close, stat, lseek, mkdir, chdir, getcwd, unlink.
+ * Tests: open, write, read, close, stat, lseek, mkdir, chdir, getcwd, unlink,
+ *        readv, writev, pread, pwrite, sendfile.
  * Run with: exec files_test.elf
  */
 #include "libc/stdio.h"
@@ -123,6 +124,111 @@ int main(void) {
         check("unlink /testdir (empty dir)", r == 0);
     }
 
+    /* Test 7: readv/writev and pread/pwrite */
+    printf("\nTest 7: readv/writev/pread/pwrite\n");
+    {
+        int fd = open("/test_vec.txt", O_CREAT | O_RDWR);
+        check("open(/test_vec.txt) >= 0", fd >= 0);
+
+        if (fd >= 0) {
+            struct iovec out[3] = {
+                { "head:", 5 }, { "body", 4 }, { ":tail", 5 },
+            };
+            check("writev gathers 3 buffers", writev(fd, out, 3) == 14);
+
+            char a[5], b[9];
+            struct iovec in[2] = { { a, 5 }, { b, 9 } };
+            lseek(fd, 0, SEEK_SET);
+            check("readv scatters 14 bytes", readv(fd, in, 2) == 14);
+            check("readv contents", memcmp(a, "head:", 5) == 0
+                                    && memcmp(b, "body:tail", 9) == 0);
+
+            check("pwrite at offset 5", pwrite(fd, "BODY", 4, 5) == 4);
+            char c[4];
+            check("pread at offset 5", pread(fd, c, 4, 5) == 4
+                                       && memcmp(c, "BODY", 4) == 0);
+            check("fd offset untouched",
+                  lseek(fd, 0, SEEK_CUR) == 14);
+            close(fd);
+        }
+        unlink("/test_vec.txt");
+
+        /* The first buffer fills; the second must not wait for more */
+        int pfd[2];
+        if (spike_pipe(pfd) == 0) {
+            char d[1], e[4];
+            struct iovec pin[2] = { { d, 1 }, { e, 4 } };
+            write(pfd[1], "p", 1);
+            check("readv from a pipe returns what is there",
+                  readv(pfd[0], pin, 2) == 1 && d[0] == 'p');
+            close(pfd[0]);
+            close(pfd[1]);
+        }
+    }
+
+    /* Test 8: sendfile into a pipe */
+    printf("\nTest 8: sendfile\n");
+    {
+        int fd = open("/test_sendfile.txt", O_CREAT | O_RDWR);
+        check("open(/test_sendfile.txt) >= 0", fd >= 0);
+
+        int pfd[2];
+        if (fd >= 0 && spike_pipe(pfd) == 0) {
+            check("write 10 bytes", write(fd, "0123456789", 10) == 10);
+
+            unsigned int off = 2;
+            check("sendfile 5 bytes at offset 2",
+                  sendfile(pfd[1], fd, &off, 5) == 5);
+            check("offset advanced to 7", off == 7);
+            check("fd offset untouched", lseek(fd, 0, SEEK_CUR) == 10);
+
+            lseek(fd, 8, SEEK_SET);
+            check("sendfile stops at EOF",
+                  sendfile(pfd[1], fd, (unsigned int *)0, 100) == 2);
+            check("sendfile at EOF returns 0",
+                  sendfile(pfd[1], fd, (unsigned int *)0, 100) == 0);
+
+            char buf[8];
+            check("pipe holds 7 bytes", read(pfd[0], buf, 7) == 7);
+            check("pipe contents", memcmp(buf, "2345689", 7) == 0);
+
+            close(pfd[0]);
+            close(pfd[1]);
+        }
+        if (fd >= 0) close(fd);
+        unlink("/test_sendfile.txt");
+    }
+
+    /* Test 9: select on a pipe */
+    printf("\nTest 9: select\n");
+    {
+        int pfd[2];
+        if (spike_pipe(pfd) == 0) {
+            int nfds = (pfd[0] > pfd[1] ? pfd[0] : pfd[1]) + 1;
+            struct timeval zero = { 0, 0 };
+            fd_set rd, wr;
+
+            FD_ZERO(&rd); FD_SET(pfd[0], &rd);
+            FD_ZERO(&wr); FD_SET(pfd[1], &wr);
+            check("empty pipe: only write end ready",
+                  select(nfds, &rd, &wr, (fd_set *)0, &zero) == 1 &&
+                  !FD_ISSET(pfd[0], &rd) && FD_ISSET(pfd[1], &wr));
+
+            write(pfd[1], "x", 1);
+            FD_ZERO(&rd); FD_SET(pfd[0], &rd);
+            check("read end ready after write",
+                  select(nfds, &rd, (fd_set *)0, (fd_set *)0, &zero) == 1 &&
+                  FD_ISSET(pfd[0], &rd));
+
+            close(pfd[0]);
+            close(pfd[1]);
+            FD_ZERO(&rd); FD_SET(pfd[0], &rd);
+            check("closed fd is EBADF",
+                  select(nfds, &rd, (fd_set *)0, (fd_set *)0, &zero) < 0 &&
+                  errno == EBADF);
+        }
+    }
+
     printf("\n=== Results: %d passed, %d failed ===\n",
            tests_passed, tests_failed);
 
@@ -38,6 +38,7 @@ extern int errno;
 #define ENOSYS      38   /* Function not implemented */
 #define ENOTEMPTY   39   /* Directory not empty */
 #define ENAMETOOLONG 36  /* File name too long */
+#define EINPROGRESS 115  /* Operation now in progress */
 #define EWOULDBLOCK EAGAIN
 
 #endif
@@ -25,5 +25,6 @@ struct spike_stat {
 #define O_CREAT  0x100
 #define O_TRUNC  0x200
 #define O_APPEND 0x400
+#define O_NONBLOCK 0x800
 
 #endif
@@ -31,6 +31,26 @@
 #define SYS_GPU_CREATE_CTX  26
 #define SYS_GPU_SUBMIT      27
 #define SYS_GPU_DESTROY_CTX 28
+#define SYS_READV     29
+#define SYS_WRITEV    30
+#define SYS_PREAD     31
+#define SYS_PWRITE    32
+#define SYS_SENDMSG   33
+#define SYS_RECVMSG   34
+#define SYS_SENDFILE  35
+#define SYS_SENDFILE_UDP 36
+#define SYS_FCNTL     37
+#define SYS_POLL      38
+#define SYS_EPOLL_CREATE 39
+#define SYS_EPOLL_CTL    40
+#define SYS_EPOLL_WAIT   41
+#define SYS_SETSOCKOPT   42
+#define SYS_GETSOCKOPT   43
+#define SYS_RECVMMSG     44
+#define SYS_LISTEN       45
+#define SYS_ACCEPT       46
+#define SYS_CONNECT      47
+#define SYS_SENDMMSG     48
 
 static inline int syscall0(int num) {
     int ret;
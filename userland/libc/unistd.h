@@ -3,6 +3,16 @@
 
 #include "syscall.h"
 #include "stat.h"
+#include "errno.h"
+
+/* Calls that can fail with -EAGAIN (O_NONBLOCK) report it via errno */
+static inline int __nb_ret(int ret) {
+    if (ret == -EAGAIN) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return ret;
+}
 
 static inline void _exit(int status) {
     syscall1(SYS_EXIT, status);
@@ -10,11 +20,11 @@ static inline void _exit(int status) {
 }
 
 static inline int write(int fd, const void *buf, int len) {
-    return syscall3(SYS_WRITE, fd, (int)buf, len);
+    return __nb_ret(syscall3(SYS_WRITE, fd, (int)buf, len));
 }
 
 static inline int read(int fd, void *buf, int len) {
-    return syscall3(SYS_READ, fd, (int)buf, len);
+    return __nb_ret(syscall3(SYS_READ, fd, (int)buf, len));
 }
 
 static inline int open(const char *path, int flags) {
@@ -91,6 +101,210 @@ static inline int lseek(int fd, int offset, int whence) {
     return syscall3(SYS_SEEK, fd, offset, whence);
 }
 
+/* ------------------------------------------------------------------ */
+/*  Vectored and positional I/O                                       */
+/* ------------------------------------------------------------------ */
+
+#define IOV_MAX 16
+
+struct iovec {
+    void         *iov_base;
+    unsigned int  iov_len;
+};
+
+struct prw_args {
+    int           fd;
+    void         *buf;
+    unsigned int  len;
+    unsigned int  offset;
+};
+
+static inline int readv(int fd, const struct iovec *iov, int iovcnt) {
+    return __nb_ret(syscall3(SYS_READV, fd, (int)iov, iovcnt));
+}
+
+static inline int writev(int fd, const struct iovec *iov, int iovcnt) {
+    return __nb_ret(syscall3(SYS_WRITEV, fd, (int)iov, iovcnt));
+}
+
+static inline int pread(int fd, void *buf, int len, int offset) {
+    struct prw_args args = { fd, buf, (unsigned int)len, (unsigned int)offset };
+    return syscall1(SYS_PREAD, (int)&args);
+}
+
+static inline int pwrite(int fd, const void *buf, int len, int offset) {
+    struct prw_args args = { fd, (void *)buf, (unsigned int)len,
+                             (unsigned int)offset };
+    return syscall1(SYS_PWRITE, (int)&args);
+}
+
+/* sendfile: copy count bytes of in_fd to out_fd inside the kernel.
+   offset = NULL uses (and advances) in_fd's own offset. */
+struct sendfile_args {
+    int            in_fd;
+    unsigned int  *offset;
+    unsigned int   count;
+    unsigned int   dst_ip;     /* network byte order (UDP only) */
+    unsigned short dst_port;   /* host byte order (UDP only) */
+};
+
+static inline int sendfile(int out_fd, int in_fd, unsigned int *offset,
+                           int count) {
+    struct sendfile_args args = { in_fd, offset, (unsigned int)count, 0, 0 };
+    return __nb_ret(syscall2(SYS_SENDFILE, out_fd, (int)&args));
+}
+
+#define F_GETFL       3
+#define F_SETFL       4
+#define F_SETPIPE_SZ  1031
+#define F_GETPIPE_SZ  1032
+#define F_SOCK        0x10000   /* OR into cmd: fd is a UDP socket index */
+
+static inline int fcntl(int fd, int cmd, int arg) {
+    return syscall3(SYS_FCNTL, fd, cmd, arg);
+}
+
+/* poll / epoll. UDP sockets aren't fds: set POLLSOCK in events to
+   pass a socket index instead. */
+#define POLLIN    0x0001
+#define POLLOUT   0x0004
+#define POLLERR   0x0008
+#define POLLHUP   0x0010
+#define POLLNVAL  0x0020
+#define POLLSOCK  0x1000
+
+struct pollfd {
+    int            fd;
+    unsigned short events;
+    unsigned short revents;
+};
+
+static inline int poll(struct pollfd *fds, int nfds, int timeout_ms) {
+    return syscall3(SYS_POLL, (int)fds, nfds, timeout_ms);
+}
+
+/* select, built on poll. The kernel polls at most SELECT_MAX_FDS fds
+   per call; more fail with EINVAL. exceptfds is only cleared, as
+   there is no out-of-band data to report. */
+#define FD_SETSIZE      1024
+#define SELECT_MAX_FDS  32
+
+typedef struct {
+    unsigned int bits[FD_SETSIZE / 32];
+} fd_set;
+
+#define FD_ZERO(s)     do { for (int _i = 0; _i < FD_SETSIZE / 32; _i++) \
+                                (s)->bits[_i] = 0; } while (0)
+#define FD_SET(fd, s)   ((s)->bits[(fd) / 32] |= 1u << ((fd) % 32))
+#define FD_CLR(fd, s)   ((s)->bits[(fd) / 32] &= ~(1u << ((fd) % 32)))
+#define FD_ISSET(fd, s) (((s)->bits[(fd) / 32] >> ((fd) % 32)) & 1)
+
+struct timeval {
+    long tv_sec;
+    long tv_usec;
+};
+
+static inline int select(int nfds, fd_set *readfds, fd_set *writefds,
+                         fd_set *exceptfds, struct timeval *timeout) {
+    struct pollfd fds[SELECT_MAX_FDS];
+    int n = 0;
+
+    if (nfds < 0 || nfds > FD_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int fd = 0; fd < nfds; fd++) {
+        unsigned short ev = 0;
+        if (readfds && FD_ISSET(fd, readfds))   ev |= POLLIN;
+        if (writefds && FD_ISSET(fd, writefds)) ev |= POLLOUT;
+        if (!ev) continue;
+        if (n == SELECT_MAX_FDS) {
+            errno = EINVAL;
+            return -1;
+        }
+        fds[n].fd = fd;
+        fds[n].events = ev;
+        fds[n].revents = 0;
+        n++;
+    }
+
+    int timeout_ms = -1;
+    if (timeout)
+        timeout_ms = (int)(timeout->tv_sec * 1000
+                           + (timeout->tv_usec + 999) / 1000);
+
+    int r = poll(fds, n, timeout_ms);
+    if (r < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (fds[i].revents & POLLNVAL) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+
+    /* A hangup reads as EOF and an error fails the write, so both
+       count as ready, as on Linux */
+    if (readfds)   FD_ZERO(readfds);
+    if (writefds)  FD_ZERO(writefds);
+    if (exceptfds) FD_ZERO(exceptfds);
+    int ready = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned short re = fds[i].revents;
+        if ((fds[i].events & POLLIN) && (re & (POLLIN | POLLHUP | POLLERR))) {
+            FD_SET(fds[i].fd, readfds);
+            ready++;
+        }
+        if ((fds[i].events & POLLOUT) && (re & (POLLOUT | POLLERR))) {
+            FD_SET(fds[i].fd, writefds);
+            ready++;
+        }
+    }
+    return ready;
+}
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+struct epoll_event {
+    unsigned int events;
+    unsigned int data;
+};
+
+struct epoll_ctl_args {
+    int          epfd;
+    int          op;
+    int          fd;
+    unsigned int events;
+    unsigned int data;
+};
+
+struct epoll_wait_args {
+    int                 epfd;
+    struct epoll_event *events;
+    int                 maxevents;
+    int                 timeout_ms;
+};
+
+static inline int epoll_create(void) {
+    return syscall0(SYS_EPOLL_CREATE);
+}
+
+static inline int epoll_ctl(int epfd, int op, int fd, struct epoll_event *ev) {
+    struct epoll_ctl_args args = { epfd, op, fd, ev ? ev->events : 0,
+                                   ev ? ev->data : 0 };
+    return syscall1(SYS_EPOLL_CTL, (int)&args);
+}
+
+static inline int epoll_wait(int epfd, struct epoll_event *events,
+                             int maxevents, int timeout_ms) {
+    struct epoll_wait_args args = { epfd, events, maxevents, timeout_ms };
+    return syscall1(SYS_EPOLL_WAIT, (int)&args);
+}
+
 static inline char *getcwd(char *buf, int size) {
     int result = syscall2(SYS_GETCWD, (int)buf, size);
     if (result < 0) return (char *)0;
@@ -172,6 +386,8 @@ static inline int spike_gpu_destroy_ctx(unsigned int ctx_id) {
 /* ------------------------------------------------------------------ */
 
 #define SOCK_UDP  1
+#define SOCK_TCP  2                /* spike_socket returns an fd */
+#define SOCK_NONBLOCK O_NONBLOCK   /* OR into spike_bind / spike_socket's type */
 
 struct sendto_args {
     unsigned int    dst_ip;     /* network byte order */
@@ -201,11 +417,108 @@ static inline int spike_sendto(int sock, struct sendto_args *args) {
 }
 
 static inline int spike_recvfrom(int sock, struct recvfrom_args *args) {
-    return syscall2(SYS_RECVFROM, sock, (int)args);
+    return __nb_ret(syscall2(SYS_RECVFROM, sock, (int)args));
+}
+
+/* One datagram gathered from / scattered over several buffers */
+struct sendmsg_args {
+    unsigned int        dst_ip;     /* network byte order */
+    unsigned short      dst_port;   /* host byte order */
+    const struct iovec *iov;
+    unsigned int        iovcnt;
+};
+
+struct recvmsg_args {
+    const struct iovec *iov;
+    unsigned int        iovcnt;
+    unsigned int        from_ip;     /* filled by kernel */
+    unsigned short      from_port;   /* filled by kernel */
+    unsigned short      received;    /* filled by kernel */
+};
+
+static inline int spike_sendmsg(int sock, struct sendmsg_args *args) {
+    return syscall2(SYS_SENDMSG, sock, (int)args);
+}
+
+static inline int spike_recvmsg(int sock, struct recvmsg_args *args) {
+    return __nb_ret(syscall2(SYS_RECVMSG, sock, (int)args));
+}
+
+/* Receive up to vlen queued datagrams in one call (waits for the first
+   unless the socket is non-blocking). Returns the number received. */
+#define UDP_MMSG_MAX 16
+
+static inline int spike_recvmmsg(int sock, struct recvmsg_args *msgs,
+                                 int vlen) {
+    return __nb_ret(syscall3(SYS_RECVMMSG, sock, (int)msgs, vlen));
+}
+
+/* Send vlen datagrams in one call; the NIC is told of them once.
+   Returns the number sent. */
+static inline int spike_sendmmsg(int sock, struct sendmsg_args *msgs,
+                                 int vlen) {
+    return syscall3(SYS_SENDMMSG, sock, (int)msgs, vlen);
+}
+
+/* Socket options */
+#define SO_RCVBUF    1   /* get/set: receive queue size in bytes */
+#define SO_RCVDROPS  2   /* get: datagrams dropped on a full queue */
+#define SO_RCVQLEN   3   /* get: datagrams queued now */
+
+static inline int spike_setsockopt(int sock, int opt, unsigned int val) {
+    return syscall3(SYS_SETSOCKOPT, sock, opt, (int)val);
+}
+
+static inline int spike_getsockopt(int sock, int opt) {
+    return syscall2(SYS_GETSOCKOPT, sock, opt);
+}
+
+/* Stream a file to dst_ip:dst_port as datagrams, without a user buffer */
+static inline int spike_sendfile_udp(int sock, unsigned int dst_ip,
+                                     unsigned short dst_port, int in_fd,
+                                     unsigned int *offset, int count) {
+    struct sendfile_args args = { in_fd, offset, (unsigned int)count,
+                                  dst_ip, dst_port };
+    return syscall2(SYS_SENDFILE_UDP, sock, (int)&args);
 }
 
 static inline int spike_closesock(int sock) {
     return syscall1(SYS_CLOSESOCK, sock);
 }
 
+/* ------------------------------------------------------------------ */
+/*  TCP                                                               */
+/* ------------------------------------------------------------------ */
+
+/* A TCP socket is an fd from spike_socket(SOCK_TCP): read, write,
+   sendfile, poll, fcntl and close work on it directly. */
+
+#define TCP_NODELAY  16   /* get/set: 1 = no Nagle coalescing */
+#define TCP_RETRANS  17   /* get: segments resent on this connection */
+
+struct accept_args {
+    unsigned int    ip;     /* network byte order, filled by kernel */
+    unsigned short  port;   /* host byte order, filled by kernel */
+};
+
+static inline int spike_listen(int fd, int port, int backlog) {
+    return syscall3(SYS_LISTEN, fd, port, backlog);
+}
+
+/* peer may be NULL */
+static inline int spike_accept(int fd, struct accept_args *peer) {
+    return __nb_ret(syscall2(SYS_ACCEPT, fd, (int)peer));
+}
+
+/* A non-blocking socket fails with errno = EINPROGRESS and polls
+   writable once connected (POLLERR if it failed) */
+static inline int spike_connect(int fd, unsigned int ip, int port) {
+    int ret = syscall3(SYS_CONNECT, fd, (int)ip, port);
+    if (ret == -EINPROGRESS) {
+        errno = EINPROGRESS;
+        return -1;
+    }
+    return ret;
+}
+
 #endif
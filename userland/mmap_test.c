@@ -77,6 +77,48 @@ int main(void) {
     void *bad = spike_mmap(0, 0, PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
     check(bad == MAP_FAILED, "zero-length mmap fails");
 
+    /* Test 7: file-backed mappings */
+    printf("Test 7: file mmap\n");
+    int fd = open("/tmp_mmap_test", O_CREAT | O_RDWR);
+    check(fd >= 0, "create test file");
+    if (fd >= 0) {
+        write(fd, "hello, page cache", 17);
+
+        char *shared = (char *)spike_mmap(0, 4096, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED, fd, 0);
+        check(shared != MAP_FAILED, "MAP_SHARED file mmap");
+        if (shared != MAP_FAILED) {
+            check(memcmp(shared, "hello", 5) == 0, "mapping sees file data");
+            shared[0] = 'J';
+
+            char buf[8];
+            lseek(fd, 0, SEEK_SET);
+            read(fd, buf, 5);
+            check(memcmp(buf, "Jello", 5) == 0, "shared store reaches file");
+            spike_munmap(shared, 4096);
+        }
+
+        char *priv = (char *)spike_mmap(0, 4096, PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE, fd, 0);
+        check(priv != MAP_FAILED, "MAP_PRIVATE file mmap");
+        if (priv != MAP_FAILED) {
+            priv[0] = 'Y';
+            check(priv[0] == 'Y', "private store visible in mapping");
+
+            char buf[8];
+            lseek(fd, 0, SEEK_SET);
+            read(fd, buf, 1);
+            check(buf[0] == 'J', "private store leaves file alone");
+            spike_munmap(priv, 4096);
+        }
+
+        void *past = spike_mmap(0, 8192, PROT_READ, MAP_SHARED, fd, 4096);
+        check(past == MAP_FAILED, "mapping past EOF fails");
+
+        close(fd);
+        unlink("/tmp_mmap_test");
+    }
+
     printf("\n=== Results: %d/%d passed ===\n", pass_count, test_count);
     return (pass_count == test_count) ? 0 : 1;
 }
@@ -0,0 +1,65 @@
+/*
+ * tcp_test.c — userland TCP test for SpikeOS.
+ *
+ * Listens on port 7777 (forwarded from the host by scripts/qemu.sh),
+ * accepts one connection and echoes everything back until the peer
+ * closes, then reports the byte count and retransmits. From the host:
+ *
+ *     nc localhost 7777
+ */
+#include "libc/stdio.h"
+#include "libc/unistd.h"
+
+#define PORT 7777
+
+int main(void) {
+    printf("[tcp_test] PID %d\n", getpid());
+
+    int lfd = spike_socket(SOCK_TCP);
+    if (lfd < 0) {
+        printf("[tcp_test] socket failed\n");
+        return 1;
+    }
+    if (spike_listen(lfd, PORT, 4) < 0) {
+        printf("[tcp_test] listen on %d failed\n", PORT);
+        close(lfd);
+        return 1;
+    }
+    printf("[tcp_test] listening on port %d...\n", PORT);
+
+    struct accept_args peer;
+    int fd = spike_accept(lfd, &peer);
+    if (fd < 0) {
+        printf("[tcp_test] accept failed\n");
+        close(lfd);
+        return 1;
+    }
+    unsigned char *ip = (unsigned char *)&peer.ip;
+    printf("[tcp_test] connection from %d.%d.%d.%d:%d\n",
+           ip[0], ip[1], ip[2], ip[3], peer.port);
+
+    /* Echo until EOF */
+    static char buf[4096];
+    unsigned int total = 0;
+    for (;;) {
+        int n = read(fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (int off = 0; off < n; ) {
+            int w = write(fd, buf + off, n - off);
+            if (w <= 0) {
+                n = -1;
+                break;
+            }
+            off += w;
+        }
+        if (n < 0) break;
+        total += (unsigned int)n;
+    }
+
+    printf("[tcp_test] echoed %u bytes, %d retransmits\n",
+           total, spike_getsockopt(fd, TCP_RETRANS));
+    close(fd);
+    close(lfd);
+    printf("[tcp_test] done\n");
+    return 0;
+}
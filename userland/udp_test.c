@@ -1,8 +1,9 @@
 /*
  * udp_test.c — userland UDP networking test for SpikeOS.
  *
- * Creates a UDP socket, binds to port 9999, sends "hello" to
- * the gateway (10.0.2.2:12345), then waits for a reply.
+ * Creates a UDP socket, binds to port 9999, grows its receive queue,
+ * sends "hello" to the gateway (10.0.2.2:12345), then waits for a
+ * reply.
  */
 #include "libc/stdio.h"
 #include "libc/unistd.h"
@@ -31,6 +32,13 @@ int main(void) {
     }
     printf("[udp_test] bound socket %d to port 9999\n", sock);
 
+    /* Room for a burst of replies */
+    if (spike_setsockopt(sock, SO_RCVBUF, 16384) == 0 &&
+        spike_getsockopt(sock, SO_RCVBUF) == 16384)
+        printf("[udp_test] receive queue: 16384 bytes\n");
+    else
+        printf("[udp_test] setsockopt SO_RCVBUF failed\n");
+
     /* Send "hello" to gateway:12345 */
     unsigned int gw_ip = make_ip(10, 0, 2, 2);
     const char *msg = "hello from userland!";